@@ -15,11 +15,11 @@
 #define __BANCACHE_H
 
 /** Stores a cached ban entry.
- * Each ban has one of these hashed in a hash_map to make for faster removal
+ * Each ban has one of these in the BanCacheManager to make for faster removal
  * of already-banned users in the case that they try to reconnect. As no wildcard
  * matching is done on these IPs, the speed of the system is improved. These cache
- * entries expire every few hours, which is a reasonable expiry for any reasonable
- * sized network.
+ * entries expire after a day at most, or when the least recently used entry is
+ * evicted to make room for a new one.
  */
 class CoreExport BanCacheHit
 {
@@ -55,21 +55,41 @@ class CoreExport BanCacheHit
 	}
 };
 
+/** Cached entries, most recently used first */
+typedef std::list<BanCacheHit> BanCacheList;
+
 /* A container of ban cache items.
  * must be defined after class BanCacheHit.
  */
-#if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
-typedef nspace::hash_map<std::string, BanCacheHit*, nspace::hash_compare<std::string, std::less<std::string> > > BanCacheHash;
-#else
-typedef nspace::hash_map<std::string, BanCacheHit*, nspace::hash<std::string> > BanCacheHash;
-#endif
+typedef irc::hash_map<std::string, BanCacheList::iterator, irc::hash> BanCacheHash;
 
 /** A manager for ban cache, which allocates and deallocates and checks cached bans.
+ *
+ * The cache holds at most <bancache:size> entries; when it is full, the least
+ * recently used entry is evicted. Entries are also filed by address, so that
+ * adding or removing an X-line on an IP or CIDR range only invalidates the
+ * entries inside that range. If <bancache:file> is set, the negative entries
+ * are written there on shutdown and read back on startup.
  */
 class CoreExport BanCacheManager
 {
  private:
-	BanCacheHash* BanHash;
+	BanCacheList entries;
+	BanCacheHash BanHash;
+	/** Entries by IP address, for invalidating the entries in a range */
+	irc::sockets::cidr_tree<BanCacheList::iterator> byaddr;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long invalidations;
+
+	/** Remove an entry from all indexes */
+	void Erase(BanCacheList::iterator i);
+	/** Remove the least recently used entries until there are at most max */
+	void Trim(size_t max);
+	/** Check whether an entry is one RemoveEntries() was asked to remove */
+	static bool Selected(const BanCacheHit& b, const std::string& type, bool positive);
  public:
 
 	/** Creates and adds a Ban Cache item.
@@ -90,12 +110,31 @@ class CoreExport BanCacheManager
 	 */
 	unsigned int RemoveEntries(const std::string &type, bool positive);
 
-	BanCacheManager()
+	/** Removes the entries of a given type which an X-line mask may cover. Returns the number of hits removed.
+	 * If the mask is an IP address or a CIDR range, only the entries inside it are removed. Otherwise
+	 * the mask is matched against the IP of each entry if ipmask is true, or all entries are removed.
+	 * @param type The type of bancache entries to remove (e.g. 'G')
+	 * @param positive Remove either positive (true) or negative (false) hits.
+	 * @param mask The host or IP mask of the X-line
+	 * @param ipmask True if the mask is only ever matched against IPs (as for Z-lines)
+	 */
+	unsigned int RemoveEntries(const std::string &type, bool positive, const std::string &mask, bool ipmask);
+
+	BanCacheManager() : hits(0), misses(0), evictions(0), invalidations(0)
 	{
-		this->BanHash = new BanCacheHash();
 	}
-	~BanCacheManager();
+
+	/** Remove expired entries */
 	void RehashCache();
+
+	/** Write the negative entries to <bancache:file>, if set */
+	void Save();
+
+	/** Read the entries written by Save(), dropping any which a Z-line now matches */
+	void Load();
+
+	/** Get a line of statistics for /STATS z */
+	std::string GetStats();
 };
 
 #endif
@@ -20,6 +20,12 @@ class CoreExport BanItem
 	std::string mask;
 	std::string setter;
 	time_t time;
+	/** The nick!ident and host parts of mask, compiled by Channel::CheckBan on first use.
+	 * Anything changing mask after that must reset compiled.
+	 */
+	mutable irc::wildmask userpart, hostpart;
+	mutable bool compiled;
+	BanItem() : compiled(false) {}
 };
 
 enum ModeListType {
@@ -61,10 +67,17 @@ class CoreExport Channel : public Extensible
 	 */
 	Channel(const std::string &name, time_t ts);
 
+	/** Channels are allocated from a SlabPool */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
+
 	/** The channel's name.
 	 */
 	const std::string name;
 
+	/** The channel name folded for the current casemapping, as filed in InspIRCd::chanlist */
+	irc::namekey namekey;
+
 	/** Timestamp for the channel. To change, recreate the channel.
 	 */
 	const time_t age;
@@ -160,7 +173,7 @@ class CoreExport Channel : public Extensible
 	 * The resulting pointer to the vector should be considered
 	 * readonly and only modified via AddUser and DelUser.
 	 *
-	 * @return This function returns pointer to a map of User pointers (CUList*).
+	 * @return This function returns a pointer to the channel's membership list.
 	 */
 	const UserMembList* GetUsers();
 
@@ -335,6 +348,11 @@ class CoreExport Channel : public Extensible
 	 */
 	bool SetPrefix(User* user, char prefix, bool adding);
 
+	/** Recalculate the prefix rank cached for every member, for when a
+	 * prefix mode is added or removed
+	 */
+	void UpdateRanks();
+
 	/** Check if a user is banned on this channel
 	 * @param user A user to check against the banlist
 	 * @returns True if the user given is banned
@@ -345,6 +363,10 @@ class CoreExport Channel : public Extensible
 	 */
 	bool CheckBan(User* user, const std::string& banmask);
 
+	/** Check a single entry of the ban list for match, using its compiled masks
+	 */
+	bool CheckBan(User* user, const BanItem& ban);
+
 	/** Get the status of an "action" type extban
 	 */
 	ModResult GetExtBanStatus(User *u, char type);
@@ -357,6 +379,13 @@ class CoreExport Channel : public Extensible
 	 * This is used when a channel's TS is lowered.
 	 */
 	static Channel* Nuke(Channel* old, const std::string& channel, time_t newTS);
+
+	/** Move everyone on a channel whose name now means the same as this one's
+	 * into this channel, and delete it. This is used when the casemapping changes;
+	 * the other channel must already be unhooked from the channel list.
+	 * As in a netburst, members keep their status only if both channels have the same TS.
+	 */
+	void Absorb(Channel* old);
 };
 
 #endif
@@ -199,6 +199,7 @@ class CoreExport ServerConfig
   private:
 	void CrossCheckOperClassType();
 	void CrossCheckConnectBlocks(ServerConfig* current);
+	void IndexConnectBlocks();
 
  public:
 	ServerConfig(RehashReason);
@@ -328,7 +329,7 @@ class CoreExport ServerConfig
 	 */
 	std::string FixedPart;
 
-	/** The DNS server to use for DNS queries
+	/** The DNS servers to use for DNS queries, separated by spaces
 	 */
 	std::string DNSServer;
 
@@ -365,12 +366,55 @@ class CoreExport ServerConfig
 	 */
 	int dns_timeout;
 
+	/** The number of seconds the DNS subsystem waits for an answer
+	 * before sending a query again, to the next server.
+	 */
+	int dns_retry;
+
+	/** The port DNS queries are sent to
+	 */
+	int dns_port;
+
+	/** The maximum number of answers kept in the DNS cache
+	 */
+	unsigned long dns_cachesize;
+
 	/** The size of the read() buffer in the user
 	 * handling code, used to read data into a user's
 	 * recvQ.
 	 */
 	int NetBufferSize;
 
+	/** The number of threads performing socket I/O for client
+	 * connections, or 0 to do all I/O in the main thread.
+	 * Only read at startup.
+	 */
+	int IOThreads;
+
+	/** The size of the buffer between the main thread and the log writer thread,
+	 * or 0 to write logs from the main thread. Only read at startup.
+	 */
+	unsigned long LogBuffer;
+
+	/** True to wait for room in the log buffer when it is full, rather than
+	 * dropping the line. Only read at startup.
+	 */
+	bool LogOverflowWait;
+
+	/** The maximum number of entries in the ban cache
+	 */
+	unsigned int BanCacheSize;
+
+	/** The file the ban cache is kept in over a restart, or empty
+	 * to not keep it.
+	 */
+	std::string BanCacheFile;
+
+	/** The number of threads in each pool of the ThreadEngine, from the <threadpool> tags.
+	 * Pools which are not listed have one thread.
+	 */
+	std::map<std::string, unsigned int> ThreadPools;
+
 	/** The value to be used for listen() backlogs
 	 * as default.
 	 */
@@ -425,6 +469,18 @@ class CoreExport ServerConfig
 	 */
 	ClassVector Classes;
 
+	/** The CIDR ranges in the allow/deny masks of the connect classes, mapped
+	 * to the indexes in Classes of the classes which list them, so that all
+	 * classes whose host list holds a range matching an address can be found
+	 * with one lookup.
+	 */
+	irc::sockets::cidr_tree<std::vector<unsigned int> > ClassRanges;
+
+	/** The other allow/deny masks of each connect class, by index in Classes,
+	 * matched against both the IP and the host of a user.
+	 */
+	std::vector<std::vector<irc::wildmask> > ClassMasks;
+
 	/** The 005 tokens of this server (ISUPPORT)
 	 * populated/repopulated upon loading or unloading
 	 * modules.
@@ -70,18 +70,24 @@ typedef std::pair<unsigned char*, std::string> DNSInfo;
 class CoreExport CachedQuery
 {
  public:
-	/** The cached result data, an IP or hostname
+	/** The cached result data, an IP or hostname, or for a
+	 * negative result the error message
 	 */
 	std::string data;
 	/** The time when the item is due to expire
 	 */
 	time_t expires;
+	/** True if this caches the name not existing, or having no
+	 * records of the type asked for
+	 */
+	bool negative;
 
 	/** Build a cached query
-	 * @param res The result data, an IP or hostname
+	 * @param res The result data, an IP or hostname, or an error message
 	 * @param ttl The time-to-live value of the query result
+	 * @param neg True if this is a negative result
 	 */
-	CachedQuery(const std::string &res, unsigned int ttl);
+	CachedQuery(const std::string &res, unsigned int ttl, bool neg = false);
 
 	/** Returns the number of seconds remaining before this
 	 * cache item has expired and should be removed.
@@ -89,13 +95,13 @@ class CoreExport CachedQuery
 	int CalcTTLRemaining();
 };
 
+/** Cached queries, most recently used first, with the query type and name they are for
+ */
+typedef std::list<std::pair<irc::string, CachedQuery> > dnscachelist;
+
 /** DNS cache information. Holds IPs mapped to hostnames, and hostnames mapped to IPs.
  */
-#if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
-typedef nspace::hash_map<irc::string, CachedQuery, nspace::hash_compare<irc::string> > dnscache;
-#else
-typedef nspace::hash_map<irc::string, CachedQuery, nspace::hash<irc::string> > dnscache;
-#endif
+typedef irc::hash_map<irc::string, dnscachelist::iterator, irc::insensitive> dnscache;
 
 /**
  * Error types that class Resolver can emit to its error method.
@@ -191,6 +197,14 @@ class CoreExport Resolver
 	 */
 	int time_left;
 
+ private:
+	/**
+	 * The next Resolver waiting for the same request, if several asked
+	 * for the same thing while it was in flight
+	 */
+	Resolver* next;
+	friend class DNS;
+
  public:
 	/**
 	 * Initiate DNS lookup. Your class should not attempt to delete or free these
@@ -243,7 +257,8 @@ class CoreExport Resolver
 
 	/**
 	 * If an error occurs (such as NXDOMAIN, no domain name found) then this method
-	 * will be called.
+	 * will be called. Negative results are cached like positive ones, in which case
+	 * this is called from TriggerCachedResult().
 	 * @param e A ResolverError enum containing the error type which has occured.
 	 * @param errormessage The error text of the error that occured.
 	 */
@@ -266,8 +281,9 @@ class CoreExport Resolver
 
 	/**
 	 * If the result is a cached result, this triggers the objects
-	 * OnLookupComplete. This is done because it is not safe to call
-	 * the abstract virtual method from the constructor.
+	 * OnLookupComplete, or OnError for a cached negative result. This is
+	 * done because it is not safe to call the abstract virtual method
+	 * from the constructor.
 	 */
 	void TriggerCachedResult();
 };
@@ -276,6 +292,17 @@ class CoreExport Resolver
  * requests to the dns server, and route incoming dns replies
  * back to Resolver objects, based upon the request ID. You
  * should never use this class yourself.
+ *
+ * Any number of queries may be in flight at once. A Resolver which asks
+ * for something already being looked up waits for the same request rather
+ * than sending another. Unanswered queries are sent again, every
+ * <dns:retry> seconds until <dns:timeout>, to the next of the configured
+ * nameservers in turn; a server which answers SERVFAIL or REFUSED is also
+ * skipped. A truncated reply is asked for again over TCP.
+ *
+ * Answers are cached for their TTL, and NXDOMAIN and empty answers for the
+ * SOA minimum TTL given with them (RFC 2308). The cache holds at most
+ * <dns:cachesize> entries, and forgets the least recently used first.
  */
 class CoreExport DNS : public EventHandler
 {
@@ -293,9 +320,15 @@ class CoreExport DNS : public EventHandler
 	int currid;
 
 	/**
-	 * Currently cached items
+	 * Currently cached items, and the same in least recently used order
 	 */
-	dnscache* cache;
+	dnscache cache;
+	dnscachelist cachelist;
+
+	/**
+	 * Requests in flight by query type and name, for sharing them
+	 */
+	std::map<irc::string, int> inflight;
 
 	/** A timer which ticks every hour to remove expired
 	 * items from the DNS cache.
@@ -307,9 +340,43 @@ class CoreExport DNS : public EventHandler
 	 */
 	int MakePayload(const char* name, const QueryType rr, const unsigned short rr_class, unsigned char* payload);
 
+	/**
+	 * Build, add and send a query
+	 * @param name The name to look up
+	 * @param qt The type of record to ask for
+	 * @param original The IP or name the lookup was asked for with
+	 * @return The request id, or -1
+	 */
+	int SendQuery(const char* name, QueryType qt, const char* original);
+
+	/**
+	 * Add an answer to the cache, forgetting the least recently used entry if it is full
+	 */
+	void AddCache(const irc::string& key, const CachedQuery& item);
+
+	/**
+	 * Make the key of the cache and of the in flight requests
+	 */
+	static irc::string MakeKey(QueryType qt, const std::string& source);
+
  public:
 
-	irc::sockets::sockaddrs myserver;
+	/**
+	 * The nameservers, in the order they are tried
+	 */
+	std::vector<irc::sockets::sockaddrs> servers;
+
+	/**
+	 * The server new queries are sent to first. This moves on to
+	 * the next server when one fails to answer.
+	 */
+	unsigned int currserver;
+
+	/**
+	 * Counters shown in /STATS T
+	 */
+	unsigned long cachehits, negativehits, cachemisses, evictions;
+	unsigned long retries, tcpretries, shared;
 
 	/**
 	 * Currently active Resolver classes
@@ -322,8 +389,9 @@ class CoreExport DNS : public EventHandler
 	DNSRequest* requests[MAX_REQUEST_ID];
 
 	/**
-	 * The port number DNS requests are made on,
+	 * The default port number DNS requests are made on,
 	 * and replies have as a source-port number.
+	 * This can be changed with <dns:port>.
 	 */
 	static const int QUERY_PORT = 53;
 
@@ -370,6 +438,35 @@ class CoreExport DNS : public EventHandler
 	 */
 	DNSResult GetResult();
 
+	/**
+	 * Process a reply, which came over UDP or TCP. Answers are added to
+	 * the cache. A truncated reply, or one from a server which failed,
+	 * leads to the query being sent again, and to no result.
+	 * @param buffer The reply
+	 * @param length The length of the reply
+	 * @return The result, with an id of -1 if there is nothing to pass on
+	 */
+	DNSResult ProcessReply(const unsigned char* buffer, int length);
+
+	/**
+	 * Pass a result to the Resolvers waiting for it
+	 */
+	void DeliverResult(DNSResult& res);
+
+	/**
+	 * Fail a request, telling the Resolvers waiting for it
+	 * @param id The request id
+	 * @param e The error type
+	 * @param errormessage The error text
+	 */
+	void FailRequest(int id, ResolverError e, const std::string& errormessage);
+
+	/**
+	 * Find a request for the same thing which is in flight
+	 * @return The request id, or -1 if there is none
+	 */
+	int FindRequest(QueryType qt, const std::string& source);
+
 	/**
 	 * Handle a SocketEngine read event
 	 * Inherited from EventHandler
@@ -415,16 +512,18 @@ class CoreExport DNS : public EventHandler
 	void CleanResolvers(Module* module);
 
 	/** Return the cached value of an IP or hostname
+	 * @param qt The query type
 	 * @param source An IP or hostname to find in the cache.
 	 * @return A pointer to a CachedQuery if the item exists,
 	 * otherwise NULL.
 	 */
-	CachedQuery* GetCache(const std::string &source);
+	CachedQuery* GetCache(QueryType qt, const std::string &source);
 
 	/** Delete a cached item from the DNS cache.
+	 * @param qt The query type
 	 * @param source An IP or hostname to remove
 	 */
-	void DelCache(const std::string &source);
+	void DelCache(QueryType qt, const std::string &source);
 
 	/** Clear all items from the DNS cache immediately.
 	 */
@@ -435,6 +534,10 @@ class CoreExport DNS : public EventHandler
 	 * items in the hash which are still valid.
 	 */
 	int PruneCache();
+
+	/** Get the cache and query counters, for /STATS T
+	 */
+	std::string GetStats();
 };
 
 /** Derived from Resolver, and performs user forward/reverse lookups.
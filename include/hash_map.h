@@ -14,43 +14,339 @@
 #ifndef INSPIRCD_HASHMAP_H
 #define INSPIRCD_HASHMAP_H
 
-	/** Where hash_map is varies from compiler to compiler
-	 * as it is not standard unless we have tr1.
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <utility>
+
+namespace irc
+{
+	/** An open addressing hash table with the interface of hash_map/unordered_map.
+	 *
+	 * All entries live in one flat array of slots, next to an array of control
+	 * bytes: one byte per slot, which is either EMPTY, DELETED or the low seven
+	 * bits of the hash of the key in the slot. A lookup walks the control bytes
+	 * from the key's home slot (linear probing) and only compares keys whose
+	 * seven hash bits match, so a miss rarely touches a key at all.
+	 *
+	 * Differences to the node based containers it replaces:
+	 *  - Inserting may move every entry, which invalidates all iterators and
+	 *    pointers to entries (erasing does not; erasing the entry an iterator
+	 *    points to and then incrementing the iterator is fine, so the usual
+	 *    erase(i++) loops keep working).
+	 *  - Erased slots become tombstones, which are cleared the next time the
+	 *    table is rebuilt.
+	 *
+	 * The Hash functor does not need to mix its output well; the table does that itself.
 	 */
-	#ifndef WIN32
-		#ifdef HASHMAP_DEPRECATED
-			// GCC4+ has deprecated hash_map and uses tr1. But of course, uses a different include to MSVC. FOR FUCKS SAKE.
-			#include <tr1/unordered_map>
-			#define HAS_TR1_UNORDERED
-		#else
-			#include <ext/hash_map>
-			/** Oddball linux namespace for hash_map */
-			#define nspace __gnu_cxx
-			#define BEGIN_HASHMAP_NAMESPACE namespace nspace {
-			#define END_HASHMAP_NAMESPACE }
-		#endif
-	#else
-		#if _MSC_VER >= 1600
-			// New MSVC has tr1. Just to make things fucked up, though, MSVC and GCC use different includes! FFS.
-			#include <unordered_map>
-			#define HAS_TR1_UNORDERED
-			#define HASHMAP_DEPRECATED
-		#else
-			/** Oddball windows namespace for hash_map */
-			#include <hash_map>
-			#define nspace stdext
-			using stdext::hash_map;
-			#define BEGIN_HASHMAP_NAMESPACE namespace nspace {
-			#define END_HASHMAP_NAMESPACE }
-		#endif
-	#endif
-
-	// tr1: restoring sanity to our headers. now if only compiler vendors could agree on a FUCKING INCLUDE FILE.
-	#ifdef HAS_TR1_UNORDERED
-		#define hash_map unordered_map
-		#define nspace std::tr1
-		#define BEGIN_HASHMAP_NAMESPACE namespace std { namespace tr1 {
-		#define END_HASHMAP_NAMESPACE } }
-	#endif
+	template<typename K, typename V, typename Hash, typename Equal = std::equal_to<K> >
+	class hash_map
+	{
+	 public:
+		typedef K key_type;
+		typedef V mapped_type;
+		typedef std::pair<const K, V> value_type;
+		typedef size_t size_type;
+
+	 private:
+		enum
+		{
+			/** Control byte of a slot which has never been used */
+			CTRL_EMPTY = 0x80,
+			/** Control byte of a slot whose entry was erased */
+			CTRL_DELETED = 0xFE,
+			/** Control byte after the last slot, which stops iteration */
+			CTRL_END = 0xFF
+		};
+		static const size_t MIN_CAPACITY = 16;
+
+		unsigned char* ctrl;
+		value_type* slots;
+		/** Number of slots minus one; the number of slots is zero or a power of two */
+		size_t mask;
+		size_t capacity;
+		size_t entries;
+		size_t tombstones;
+		Hash hasher;
+		Equal equal;
+
+		inline size_t HashOf(const K& key) const
+		{
+			size_t h = hasher(key);
+			h ^= h >> 16;
+			h *= 0x45d9f3b;
+			h ^= h >> 16;
+			return h;
+		}
+
+		static inline unsigned char Tag(size_t h) { return h & 0x7F; }
+
+		/** Find the slot holding a key, or capacity if it is not present */
+		size_t Locate(const K& key) const
+		{
+			if (!entries)
+				return capacity;
+			size_t h = HashOf(key);
+			unsigned char tag = Tag(h);
+			for (size_t pos = (h >> 7) & mask; ; pos = (pos + 1) & mask)
+			{
+				unsigned char c = ctrl[pos];
+				if (c == tag && equal(slots[pos].first, key))
+					return pos;
+				if (c == CTRL_EMPTY)
+					return capacity;
+			}
+		}
+
+		/** Put an entry known not to be in the table into its first free slot, without growing */
+		size_t Place(size_t h, const value_type& value)
+		{
+			size_t pos = (h >> 7) & mask;
+			while (ctrl[pos] != CTRL_EMPTY && ctrl[pos] != CTRL_DELETED)
+				pos = (pos + 1) & mask;
+			if (ctrl[pos] == CTRL_DELETED)
+				tombstones--;
+			new (&slots[pos]) value_type(value);
+			ctrl[pos] = Tag(h);
+			entries++;
+			return pos;
+		}
+
+		/** Rebuild the table with the given number of slots, dropping all tombstones */
+		void Rebuild(size_t newcap)
+		{
+			unsigned char* oldctrl = ctrl;
+			value_type* oldslots = slots;
+			size_t oldcap = capacity;
+
+			ctrl = static_cast<unsigned char*>(::operator new(newcap + 1));
+			slots = static_cast<value_type*>(::operator new(newcap * sizeof(value_type)));
+			for (size_t i = 0; i < newcap; i++)
+				ctrl[i] = CTRL_EMPTY;
+			ctrl[newcap] = CTRL_END;
+			capacity = newcap;
+			mask = newcap - 1;
+			entries = tombstones = 0;
+
+			for (size_t i = 0; i < oldcap; i++)
+			{
+				if (oldctrl[i] & 0x80)
+					continue;
+				Place(HashOf(oldslots[i].first), oldslots[i]);
+				oldslots[i].~value_type();
+			}
+			::operator delete(oldctrl);
+			::operator delete(oldslots);
+		}
+
+		/** Make room for one more entry, keeping at least one slot in eight EMPTY */
+		inline void Reserve()
+		{
+			if ((entries + tombstones + 1) * 8 <= capacity * 7)
+				return;
+			if (!capacity)
+				Rebuild(MIN_CAPACITY);
+			else if (entries * 2 < capacity)
+				Rebuild(capacity); // mostly tombstones, clean them out
+			else
+				Rebuild(capacity * 2);
+		}
+
+		void Destroy()
+		{
+			for (size_t i = 0; i < capacity; i++)
+				if (!(ctrl[i] & 0x80))
+					slots[i].~value_type();
+			::operator delete(ctrl);
+			::operator delete(slots);
+			ctrl = NULL;
+			slots = NULL;
+			capacity = mask = entries = tombstones = 0;
+		}
+
+		template<typename Value>
+		class iter_base
+		{
+		 protected:
+			const unsigned char* c;
+			Value* s;
+			iter_base(const unsigned char* C, Value* S) : c(C), s(S) { }
+			inline void advance()
+			{
+				do
+				{
+					++c;
+					++s;
+				} while ((*c & 0x80) && *c != CTRL_END);
+			}
+		 public:
+			iter_base() : c(NULL), s(NULL) { }
+			inline Value& operator*() const { return *s; }
+			inline Value* operator->() const { return s; }
+			friend class hash_map;
+		};
+
+	 public:
+		class iterator : public iter_base<value_type>
+		{
+			iterator(const unsigned char* C, value_type* S) : iter_base<value_type>(C, S) { }
+			friend class hash_map;
+			friend class const_iterator;
+		 public:
+			iterator() { }
+			inline iterator& operator++() { this->advance(); return *this; }
+			inline iterator operator++(int) { iterator old(*this); this->advance(); return old; }
+			friend inline bool operator==(const iterator& a, const iterator& b) { return a.c == b.c; }
+			friend inline bool operator!=(const iterator& a, const iterator& b) { return a.c != b.c; }
+		};
+
+		class const_iterator : public iter_base<const value_type>
+		{
+			const_iterator(const unsigned char* C, const value_type* S) : iter_base<const value_type>(C, S) { }
+			friend class hash_map;
+		 public:
+			const_iterator() { }
+			const_iterator(const iterator& i) : iter_base<const value_type>(i.c, i.s) { }
+			inline const_iterator& operator++() { this->advance(); return *this; }
+			inline const_iterator operator++(int) { const_iterator old(*this); this->advance(); return old; }
+			// Non-members, so that an iterator on either side is converted
+			friend inline bool operator==(const const_iterator& a, const const_iterator& b) { return a.c == b.c; }
+			friend inline bool operator!=(const const_iterator& a, const const_iterator& b) { return a.c != b.c; }
+		};
+
+		hash_map() : ctrl(NULL), slots(NULL), mask(0), capacity(0), entries(0), tombstones(0) { }
+
+		hash_map(const hash_map& other) : ctrl(NULL), slots(NULL), mask(0), capacity(0), entries(0), tombstones(0),
+			hasher(other.hasher), equal(other.equal)
+		{
+			insert(other.begin(), other.end());
+		}
+
+		hash_map& operator=(const hash_map& other)
+		{
+			if (this != &other)
+			{
+				hash_map tmp(other);
+				swap(tmp);
+			}
+			return *this;
+		}
+
+		~hash_map()
+		{
+			Destroy();
+		}
+
+		void swap(hash_map& other)
+		{
+			std::swap(ctrl, other.ctrl);
+			std::swap(slots, other.slots);
+			std::swap(mask, other.mask);
+			std::swap(capacity, other.capacity);
+			std::swap(entries, other.entries);
+			std::swap(tombstones, other.tombstones);
+			std::swap(hasher, other.hasher);
+			std::swap(equal, other.equal);
+		}
+
+		inline size_t size() const { return entries; }
+		inline bool empty() const { return !entries; }
+		/** Number of slots in the table */
+		inline size_t bucket_count() const { return capacity; }
+
+		iterator begin()
+		{
+			if (!entries)
+				return end();
+			iterator i(ctrl, slots);
+			if (*ctrl & 0x80)
+				++i;
+			return i;
+		}
+		const_iterator begin() const { return const_cast<hash_map*>(this)->begin(); }
+		inline iterator end() { return iterator(ctrl + capacity, slots + capacity); }
+		inline const_iterator end() const { return const_iterator(ctrl + capacity, slots + capacity); }
+
+		iterator find(const K& key)
+		{
+			size_t pos = Locate(key);
+			return iterator(ctrl + pos, slots + pos);
+		}
+		const_iterator find(const K& key) const
+		{
+			size_t pos = Locate(key);
+			return const_iterator(ctrl + pos, slots + pos);
+		}
+		inline size_t count(const K& key) const { return Locate(key) != capacity; }
+
+		std::pair<iterator, bool> insert(const value_type& value)
+		{
+			size_t pos = Locate(value.first);
+			if (pos != capacity)
+				return std::make_pair(iterator(ctrl + pos, slots + pos), false);
+			Reserve();
+			pos = Place(HashOf(value.first), value);
+			return std::make_pair(iterator(ctrl + pos, slots + pos), true);
+		}
+
+		template<typename InputIterator>
+		void insert(InputIterator first, InputIterator last)
+		{
+			for (; first != last; ++first)
+				insert(*first);
+		}
+
+		V& operator[](const K& key)
+		{
+			size_t pos = Locate(key);
+			if (pos != capacity)
+				return slots[pos].second;
+			return insert(value_type(key, V())).first->second;
+		}
+
+		void erase(iterator i)
+		{
+			size_t pos = i.c - ctrl;
+			slots[pos].~value_type();
+			entries--;
+			// A slot followed by an empty one cannot be in the middle of a probe sequence
+			if (ctrl[(pos + 1) & mask] == CTRL_EMPTY)
+			{
+				ctrl[pos] = CTRL_EMPTY;
+			}
+			else
+			{
+				ctrl[pos] = CTRL_DELETED;
+				tombstones++;
+			}
+		}
+
+		size_t erase(const K& key)
+		{
+			size_t pos = Locate(key);
+			if (pos == capacity)
+				return 0;
+			erase(iterator(ctrl + pos, slots + pos));
+			return 1;
+		}
+
+		/** Remove all entries, freeing the table */
+		void clear()
+		{
+			Destroy();
+		}
+
+		/** Make sure the table can hold at least n entries without being rebuilt */
+		void reserve(size_t n)
+		{
+			size_t want = MIN_CAPACITY;
+			while (want * 7 < n * 8)
+				want *= 2;
+			if (want > capacity)
+				Rebuild(want);
+		}
+	};
+}
 
 #endif
@@ -44,6 +44,12 @@
  */
 CoreExport extern unsigned const char *national_case_insensitive_map;
 
+/** Incremented by InspIRCd::UpdateCaseMapping() every time the contents of
+ * national_case_insensitive_map change, so that anything precomputed from it
+ * (such as an irc::wildmask) can tell that it is stale.
+ */
+CoreExport extern unsigned int national_case_generation;
+
 /** A mapping of uppercase to lowercase, including scandinavian
  * 'oddities' as specified by RFC1459, e.g. { -> [, and | -> \
  */
@@ -192,6 +198,52 @@ namespace irc
 		}
 	};
 
+	/** Hashes a string using RFC1459 case sensitivity rules (under the current
+	 * national casemapping), without making a lowercased copy of it. Use with
+	 * StrHashComp or irc::string keys in an irc::hash_map.
+	 */
+	struct CoreExport insensitive
+	{
+		size_t operator()(const std::string& s) const;
+	};
+
+	/** Hashes a string case sensitively, for irc::hash_map */
+	struct CoreExport hash
+	{
+		size_t operator()(const std::string& s) const;
+	};
+
+	/** A nick or channel name, folded through national_case_insensitive_map
+	 * once, along with its hash. Comparing two keys is a plain memcmp and hashing
+	 * one is free, so users and channels keep theirs (User::nickkey,
+	 * Channel::namekey) and the nick and channel hashes are keyed on them.
+	 * A lookup by name folds the name once, when the key is built.
+	 *
+	 * Keys must be rebuilt if the casemapping changes; see InspIRCd::UpdateCaseMapping.
+	 */
+	class CoreExport namekey
+	{
+		std::string folded;
+		size_t hashval;
+		void Fold(const char* name, size_t len);
+	 public:
+		namekey() : hashval(0) { }
+		namekey(const std::string& name) { Fold(name.data(), name.length()); }
+		namekey(const char* name) { Fold(name, strlen(name)); }
+
+		/** Get the folded name */
+		inline const std::string& str() const { return folded; }
+		inline size_t hash() const { return hashval; }
+		inline bool operator==(const namekey& other) const { return hashval == other.hashval && folded == other.folded; }
+		inline bool operator!=(const namekey& other) const { return !(*this == other); }
+
+		/** Hash functor for irc::hash_map, which returns the stored hash */
+		struct hasher
+		{
+			inline size_t operator()(const namekey& key) const { return key.hash(); }
+		};
+	};
+
 	/** irc::stringjoiner joins string lists into a string, using
 	 * the given seperator string.
 	 * This class can join a vector of std::string, a deque of
@@ -254,27 +306,42 @@ namespace irc
 	{
 	 private:
 
-		/** Original string
+		/** Copy of the original string, if one was taken
 		 */
 		std::string tokens;
 
+		/** End of the data being tokenized
+		 */
+		const char* end;
+
 		/** Last position of a seperator token
 		 */
-		std::string::iterator last_starting_position;
+		const char* last_starting_position;
 
 		/** Current string position
 		 */
-		std::string::iterator n;
+		const char* n;
 
 		/** True if the last value was an ending value
 		 */
 		bool last_pushed;
+
+		/* Not copyable; the positions point into the source */
+		tokenstream(const tokenstream&);
+		void operator=(const tokenstream&);
 	 public:
 
 		/** Create a tokenstream and fill it with the provided data
 		 */
 		tokenstream(const std::string &source);
 
+		/** Create a tokenstream over existing data, without copying it.
+		 * The data must remain unchanged for the lifetime of the tokenstream.
+		 * @param source The data to tokenize
+		 * @param len The length of the data
+		 */
+		tokenstream(const char* source, size_t len);
+
 		/** Destructor
 		 */
 		~tokenstream();
@@ -484,80 +551,4 @@ inline std::string& trim(std::string &str)
 	return str;
 }
 
-/** Hashing stuff is totally different on vc++'s hash_map implementation, so to save a buttload of
- * #ifdefs we'll just do it all at once. Except, of course, with TR1, when it's the same as GCC.
- */
-BEGIN_HASHMAP_NAMESPACE
-
-	/** Hashing function to hash irc::string
-	 */
-#if defined(WINDOWS) && !defined(HAS_TR1_UNORDERED)
-	template<> class CoreExport hash_compare<irc::string, std::less<irc::string> >
-	{
-	public:
-		enum { bucket_size = 4, min_buckets = 8 }; /* Got these numbers from the CRT source, if anyone wants to change them feel free. */
-
-		/** Compare two irc::string values for hashing in hash_map
-		 */
-		bool operator()(const irc::string & s1, const irc::string & s2) const
-		{
-			if(s1.length() != s2.length()) return true;
-			return (irc::irc_char_traits::compare(s1.c_str(), s2.c_str(), (size_t)s1.length()) < 0);
-		}
-
-		/** Hash an irc::string value for hash_map
-		 */
-		size_t operator()(const irc::string & s) const;
-	};
-
-	template<> class CoreExport hash_compare<std::string, std::less<std::string> >
-	{
-	public:
-		enum { bucket_size = 4, min_buckets = 8 }; /* Again, from the CRT source */
-
-		/** Compare two std::string values for hashing in hash_map
-		 */
-		bool operator()(const std::string & s1, const std::string & s2) const
-		{
-			if(s1.length() != s2.length()) return true;
-			return (irc::irc_char_traits::compare(s1.c_str(), s2.c_str(), (size_t)s1.length()) < 0);
-		}
-
-		/** Hash a std::string using RFC1459 case sensitivity rules
-		* @param s A string to hash
-		* @return The hash value
-		*/
-		size_t operator()(const std::string & s) const;
-	};
-#else
-
-	template<> struct hash<irc::string>
-	{
-		/** Hash an irc::string using RFC1459 case sensitivity rules
-		 * @param s A string to hash
-		 * @return The hash value
-		 */
-		size_t CoreExport operator()(const irc::string &s) const;
-	};
-
-	/* XXX FIXME: Implement a hash function overriding std::string's that works with TR1! */
-
-#ifdef HASHMAP_DEPRECATED
-	struct insensitive
-#else
-	CoreExport template<> struct hash<std::string>
-#endif
-	{
-		size_t CoreExport operator()(const std::string &s) const;
-	};
-
-#endif
-
-	/** Convert a string to lower case respecting RFC1459
-	* @param n A string to lowercase
-	*/
-	void strlower(char *n);
-
-END_HASHMAP_NAMESPACE
-
 #endif
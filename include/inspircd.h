@@ -53,11 +53,14 @@
 #include <bitset>
 #include <set>
 #include <time.h>
+#include <stdint.h>
 #include "inspircd_config.h"
 #include "inspircd_version.h"
 #include "types.h"
 #include "hash_map.h"
 #include "hashcomp.h"
+#include "wildcard.h"
+#include "multisearch.h"
 #include "base.h"
 #include "typedefs.h"
 #include "caller.h"
@@ -212,6 +215,15 @@ class serverstats
 	/** Total bytes of data received
 	 */
 	unsigned long statsRecv;
+	/** Total bytes of data added to socket send queues
+	 */
+	unsigned long statsSendqQueued;
+	/** Total bytes of data written out of socket send queues
+	 */
+	unsigned long statsSendqWritten;
+	/** Number of write calls made to flush socket send queues
+	 */
+	unsigned long statsWriteCalls;
 	/** Cpu usage at last sample
 	 */
 	timeval LastCPU;
@@ -222,7 +234,8 @@ class serverstats
 	 */
 	serverstats()
 		: statsAccept(0), statsRefused(0), statsUnknown(0), statsCollisions(0), statsDns(0),
-		statsDnsGood(0), statsDnsBad(0), statsConnects(0), statsSent(0), statsRecv(0)
+		statsDnsGood(0), statsDnsBad(0), statsConnects(0), statsSent(0), statsRecv(0),
+		statsSendqQueued(0), statsSendqWritten(0), statsWriteCalls(0)
 	{
 	}
 };
@@ -263,10 +276,6 @@ class CoreExport InspIRCd
 	 */
 	void IncrementUID(int pos);
 
-	/** Perform background user events such as PING checks
-	 */
-	void DoBackgroundUserStuff();
-
 	/** The current time, updated in the mainloop
 	 */
 	struct timespec TIME;
@@ -353,6 +362,10 @@ class CoreExport InspIRCd
 	 */
 	ThreadEngine* Threads;
 
+	/** I/O threads, which do the socket I/O of client connections if enabled
+	 */
+	IOThreadPool* IOThreads;
+
 	/** The thread/class used to read config files in REHASH and on startup
 	 */
 	ConfigReaderThread* PendingRehash;
@@ -444,6 +457,8 @@ class CoreExport InspIRCd
 	inline time_t Time() const { return TIME.tv_sec; }
 	/** The fractional time at the start of this mainloop iteration (nanoseconds) */
 	inline long Time_ns() const { return TIME.tv_nsec; }
+	/** The time at the start of this mainloop iteration in milliseconds since the epoch */
+	inline uint64_t Time_ms() const { return (uint64_t)TIME.tv_sec * 1000 + TIME.tv_nsec / 1000000; }
 	/** Update the current time. Don't call this unless you have reason to do so. */
 	void UpdateTime();
 
@@ -642,6 +657,13 @@ class CoreExport InspIRCd
 	static bool Match(const std::string &str, const std::string &mask, unsigned const char *map = NULL);
 	static bool Match(const  char *str, const char *mask, unsigned const char *map = NULL);
 
+	/** Match a string against a compiled mask. Use this instead of the above
+	 * when the same mask is matched against many strings.
+	 * @param str The literal string to match against
+	 * @param mask The compiled glob pattern to match against.
+	 */
+	static bool Match(const std::string &str, const irc::wildmask &mask);
+
 	/** Match two strings using pattern matching, optionally, with a map
 	 * to check case against (may be NULL). If map is null, match will be case insensitive.
 	 * Supports CIDR patterns as well as globs.
@@ -651,6 +673,12 @@ class CoreExport InspIRCd
 	static bool MatchCIDR(const std::string &str, const std::string &mask, unsigned const char *map = NULL);
 	static bool MatchCIDR(const  char *str, const char *mask, unsigned const char *map = NULL);
 
+	/** Match a string against a compiled mask, which may also be a CIDR pattern.
+	 * @param str The literal string to match against
+	 * @param mask The compiled glob or CIDR pattern to match against.
+	 */
+	static bool MatchCIDR(const std::string &str, const irc::wildmask &mask);
+
 	/** Call the handler for a given command.
 	 * @param commandname The command whos handler you wish to call
 	 * @param parameters The mode parameters
@@ -796,6 +824,13 @@ class CoreExport InspIRCd
 	 */
 	void DoGarbageCollect();
 
+	/** Recompute the cached case-folded keys of all users and channels and
+	 * rebuild the nick, UUID and channel hashes. Must be called whenever
+	 * national_case_insensitive_map is changed. Users whose nicks now collide
+	 * are moved to their UUIDs, and channels whose names collide are merged.
+	 */
+	void UpdateCaseMapping();
+
 	/** Resets the cached max bans value on all channels.
 	 * Called by rehash.
 	 */
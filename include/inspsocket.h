@@ -56,6 +56,20 @@ enum BufferedSocketError
 
 /* Required forward declarations */
 class BufferedSocket;
+struct IOThreadConn;
+
+/** An immutable, reference counted piece of output data.
+ * Lines which are sent to many sockets (channel messages and the like) are
+ * formatted once into a SharedLine; the send queue of every target socket
+ * then holds a reference to it rather than its own copy of the text.
+ */
+class CoreExport SharedLine : public refcountbase
+{
+ public:
+	/** The data to send, including any line terminator */
+	const std::string data;
+	SharedLine(const std::string& text) : data(text) {}
+};
 
 /** Private data handler and function dispatch for I/O */
 class CoreExport IOHook : public classbase
@@ -89,6 +103,94 @@ class CoreExport IOHookProvider : public ServiceProvider
 	virtual void OnServerConnection(StreamSocket*, ListenSocket* from) = 0;
 };
 
+/** A socket send queue.
+ * Private data is copied into fixed-size blocks which are recycled through a
+ * free list shared by all sockets; shared data is held by reference. The
+ * queue itself is a ring of (pointer, length) chunks, so appending is
+ * amortized O(1) and a partial write only advances the read cursor of the
+ * first chunk, without copying anything that is still queued.
+ */
+class CoreExport SendQueue
+{
+ public:
+	/** Size of the data area of a pooled block */
+	static const size_t BLOCK_SIZE = 4096;
+	struct Block;
+
+	SendQueue() : ring(NULL), ring_size(0), head(0), count(0), bytes(0), last(NULL) {}
+	~SendQueue();
+
+	/** Copy data onto the end of the queue */
+	void push_back(const char* data, size_t len);
+	/** Queue a reference to shared data */
+	void push_back(SharedLine* line);
+
+	/** Number of bytes waiting in the queue */
+	inline size_t size() const { return bytes; }
+	inline bool empty() const { return !bytes; }
+
+	/** Number of separate chunks in the queue */
+	inline size_t chunks() const { return count; }
+	/** Get a chunk of data, for building an iovec array
+	 * @param index The chunk to get, 0 being the front of the queue
+	 * @param len Set to the length of the chunk
+	 * @return Pointer to the data in the chunk
+	 */
+	inline const char* chunk(size_t index, size_t& len) const
+	{
+		const Chunk& c = ring[(head + index) & (ring_size - 1)];
+		len = c.len;
+		return c.data;
+	}
+
+	/** Remove data from the front of the queue, once it has been written */
+	void consume(size_t len);
+	/** Copy the contents of the queue into a string, without removing them */
+	void flatten(std::string& out) const;
+	/** Remove everything from the queue */
+	void clear();
+	/** Exchange the contents of two queues, without copying any data */
+	void swap(SendQueue& other);
+
+	/** Get the number of pooled blocks holding queued data, and the number
+	 * kept on the free list for reuse
+	 */
+	static void GetBlockStats(size_t& inuse, size_t& spare);
+
+ private:
+	/** One contiguous piece of queued data */
+	struct Chunk
+	{
+		/** Start of the unwritten data */
+		const char* data;
+		/** Length of the unwritten data */
+		size_t len;
+		/** Block holding the data; NULL if it is shared */
+		Block* block;
+		/** Shared line holding the data; NULL if it is in a block */
+		reference<SharedLine> line;
+	};
+	/** The ring of chunks; ring_size is always a power of two */
+	Chunk* ring;
+	size_t ring_size;
+	/** Index of the first chunk in the ring */
+	size_t head;
+	/** Number of chunks in use */
+	size_t count;
+	/** Total length of all chunks */
+	size_t bytes;
+	/** Block that new private data is appended to, or NULL */
+	Block* last;
+
+	Chunk& tail() { return ring[(head + count - 1) & (ring_size - 1)]; }
+	Chunk& append();
+	void release(Chunk& c);
+
+	/* Not copyable */
+	SendQueue(const SendQueue&);
+	void operator=(const SendQueue&);
+};
+
 /**
  * StreamSocket is a class that wraps a TCP socket and handles send
  * and receive queues, including passing them to IO hooks
@@ -97,17 +199,30 @@ class CoreExport StreamSocket : public EventHandler
 {
 	/** Module that handles raw I/O for this socket, or NULL */
 	IOHook* hook;
-	/** Private send queue. Note that individual strings may be shared
+	/** Private send queue */
+	SendQueue sendq;
+	/** The front of sendq, as handed to the IOHook. The hook gets this same
+	 * buffer again until it has written all of it, as TLS requires a write
+	 * which would block to be retried with the same data.
 	 */
-	std::deque<std::string> sendq;
-	/** Length, in bytes, of the sendq */
-	size_t sendq_len;
+	std::string hookq;
+	/** The I/O thread doing reads and writes for this socket, or NULL if it is done by the main thread */
+	IOThreadConn* ioconn;
+	/** Bytes handed to the I/O thread which it has not yet written */
+	size_t io_pending;
+	friend class IOThreadPool;
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
  protected:
+	/** Data read from the socket. Everything before recvq_pos has already
+	 * been consumed; it is only removed on the next read, so that taking
+	 * many lines out of one read does not repeatedly shift the buffer.
+	 */
 	std::string recvq;
+	/** Offset of the first unconsumed byte of recvq */
+	std::string::size_type recvq_pos;
  public:
-	StreamSocket() : hook(NULL), sendq_len(0) {}
+	StreamSocket() : hook(NULL), ioconn(NULL), io_pending(0), recvq_pos(0) {}
 	inline IOHook* GetIOHook() { return hook; }
 	inline void SetIOHook(IOHook* h) { hook = h; }
 	/** Handle event from socket engine.
@@ -133,6 +248,10 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+	/** Queue a reference to shared data, to be sent either now or when writes unblock.
+	 * The data is not copied, so one SharedLine may be queued on any number of sockets.
+	 */
+	void WriteData(SharedLine* line);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
@@ -140,7 +259,9 @@ class CoreExport StreamSocket : public EventHandler
 	 */
 	bool GetNextLine(std::string& line, char delim = '\n');
 	/** Useful for implementing sendq exceeded */
-	inline size_t getSendQSize() const { return sendq_len; }
+	inline size_t getSendQSize() const { return sendq.size() + io_pending; }
+	/** Useful for implementing recvq exceeded */
+	inline size_t getRecvQSize() const { return recvq.length() - recvq_pos; }
 
 	/**
 	 * Close the socket, remove from socket engine, etc
@@ -234,6 +355,19 @@ class CoreExport UserIOHandler : public StreamSocket
 	 * @param data The data to add to the write buffer
 	 */
 	void AddWriteBuf(const std::string &data);
+
+	/** Adds a reference to shared data to the user's write buffer.
+	 * The same sendq limits apply as for AddWriteBuf(const std::string&).
+	 * @param line The data to add to the write buffer
+	 */
+	void AddWriteBuf(SharedLine* line);
+
+ private:
+	/** Check the sendq limits before adding data to the write buffer
+	 * @param len The number of bytes about to be added
+	 * @return True if the data should be added
+	 */
+	bool CheckSendQ(size_t len);
 };
 
 #endif
@@ -0,0 +1,101 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __IOTHREADS_H__
+#define __IOTHREADS_H__
+
+class IOThread;
+struct IOThreadConn;
+
+/** Counters kept by each I/O thread */
+struct IOThreadStats
+{
+	/** Number of sockets the thread is handling */
+	unsigned long sockets;
+	/** Number of times the thread woke up with work to do */
+	unsigned long wakeups;
+	/** Number of recv() calls made, and bytes read */
+	unsigned long reads, bytes_in;
+	/** Number of send() calls made, and bytes written */
+	unsigned long writes, bytes_out;
+	IOThreadStats() : sockets(0), wakeups(0), reads(0), bytes_in(0), writes(0), bytes_out(0) {}
+};
+
+/** Moves the socket I/O of client connections off the main thread.
+ *
+ * Each I/O thread has its own epoll set and a share of the client sockets.
+ * It reads from its sockets, and writes out data handed to it by the main
+ * thread. Everything else, including line splitting, command processing and
+ * the sendq limits, stays in the main thread; it sees the data read by an
+ * I/O thread as if it had been read by StreamSocket::DoRead.
+ *
+ * The threads and the main thread talk through single producer, single
+ * consumer queues which need no locking. Each side batches its wakeups, so
+ * there is at most one eventfd write per thread per main loop iteration.
+ *
+ * Sockets with an IOHook are never handed to a thread, as IOHooks call back
+ * into the socket engine and other parts of the core which are not thread safe.
+ */
+class CoreExport IOThreadPool
+{
+	/** The threads, if any are running */
+	std::vector<IOThread*> threads;
+	/** Sockets which are handled by a thread, indexed by file descriptor */
+	std::vector<StreamSocket*> sockets;
+	/** Identifies each socket handed to a thread, so that results for a
+	 * closed socket cannot be delivered to a later one with the same fd
+	 */
+	unsigned long serial;
+	/** The thread that the next socket will be given to */
+	size_t next;
+	/** Wakes the main thread when threads have results */
+	EventHandler* signal;
+ public:
+	IOThreadPool();
+	~IOThreadPool();
+
+	/** Start the I/O threads
+	 * @param count The number of threads; if 0, no threads are started
+	 */
+	void Start(unsigned int count);
+
+	/** Check if I/O threads are in use */
+	inline bool Enabled() const { return !threads.empty(); }
+
+	/** Hand a socket over to an I/O thread.
+	 * The socket must not have an IOHook.
+	 * @param sock The socket
+	 * @return True if the socket's I/O is now done by a thread
+	 */
+	bool Attach(StreamSocket* sock);
+
+	/** Take a socket away from its I/O thread, which will write out what
+	 * it can of the data it holds and then close the file descriptor.
+	 * @param sock The socket, which is being closed
+	 */
+	void Detach(StreamSocket* sock);
+
+	/** Hand the contents of a socket's sendq to its I/O thread */
+	void Write(StreamSocket* sock);
+
+	/** Wake up any threads which have been given work since the last call */
+	void Flush();
+
+	/** Deliver the results from the I/O threads to their sockets */
+	void Process();
+
+	/** Get the counters of each I/O thread */
+	void GetStats(std::vector<IOThreadStats>& out) const;
+};
+
+#endif
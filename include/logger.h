@@ -20,11 +20,10 @@
  * periods of time (e.g. if the system is busy and/or swapping
  * a lot). If we just use a blocking fprintf() call, this could
  * block for undesirable amounts of time (half of a second through
- * to whole seconds). We DO NOT want this, so we make our logfile
- * nonblocking and hook it into the SocketEngine.
- * NB: If the operating system does not support nonblocking file
- * I/O (linux seems to, as does freebsd) this will default to
- * blocking behaviour.
+ * to whole seconds). We DO NOT want this, so once the server has
+ * started, log lines are handed to the LogManager's writer thread,
+ * which does the actual writes. Before then, and if the writer is
+ * disabled with <performance:logbuffer>, lines are written directly.
  */
 class CoreExport FileWriter
 {
@@ -53,6 +52,7 @@ class CoreExport FileWriter
 	void WriteLogLine(const std::string &line);
 
 	/** Close the log file and cancel any events.
+	 * Lines still waiting for the writer thread are written first.
 	 */
 	virtual ~FileWriter();
 };
@@ -105,6 +105,20 @@ class CoreExport LogStream : public classbase
 
 typedef std::map<FileWriter*, int> FileLogMap;
 
+class LogWriter;
+
+/** Counters kept by the log writer thread */
+struct LogWriterStats
+{
+	/** Number of records and bytes written */
+	unsigned long records, bytes;
+	/** Number of writev() calls made */
+	unsigned long writes;
+	/** Number of records dropped because the buffer was full, or because writing them failed */
+	unsigned long dropped, failed;
+	LogWriterStats() : records(0), bytes(0), writes(0), dropped(0), failed(0) {}
+};
+
 class CoreExport LogManager
 {
  private:
@@ -129,6 +143,10 @@ class CoreExport LogManager
 	 */
 	FileLogMap FileLogs;
 
+	/** The thread which writes to the log files, or NULL if they are written directly
+	 */
+	LogWriter* Writer;
+
  public:
 
 	LogManager();
@@ -167,6 +185,37 @@ class CoreExport LogManager
 	 */
 	void OpenFileLogs();
 
+	/** Start the writer thread, as configured by <performance:logbuffer> and
+	 * <performance:logoverflow>. This must be done after forking.
+	 */
+	void StartWriter();
+
+	/** Stop the writer thread, after it has written everything given to it
+	 */
+	void StopWriter();
+
+	/** Hand a line to the writer thread
+	 * @param fd The file to write to
+	 * @param line The line
+	 * @return False if there is no writer thread, and the caller must write the line itself
+	 */
+	bool QueueWrite(int fd, const std::string& line);
+
+	/** Wait until the writer thread has written everything given to it so far
+	 */
+	void WaitForWriter();
+
+	/** Wake the writer thread if there is anything for it to write.
+	 * Called at the end of each main loop iteration, so that the lines
+	 * logged in one iteration are written together.
+	 */
+	void Flush();
+
+	/** Get the counters of the writer thread
+	 * @return False if there is no writer thread
+	 */
+	bool GetWriterStats(LogWriterStats& out) const;
+
 	/** Removes all LogStreams, meaning they have to be readded for logging to continue.
 	 * Only LogStreams that were listed in AllLogStreams are actually closed.
 	 */
@@ -24,6 +24,9 @@ class CoreExport Membership : public Extensible
 	// mode list, sorted by prefix rank, higest first
 	std::string modes;
 	Membership(User* u, Channel* c) : Extensible(EXTENSIBLE_MEMBERSHIP), u_prev(NULL), u_next(NULL), user(u), chan(c) {}
+	/** Memberships are allocated from a SlabPool, as there is one for every join */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
 	inline bool hasMode(char m) const
 	{
 		return modes.find(m) != std::string::npos;
@@ -36,6 +39,88 @@ class CoreExport Membership : public Extensible
 	friend class UserChanList;
 };
 
+/** An entry in the membership list of a channel.
+ * The user and membership are reachable as first and second, as they were when
+ * the list was a std::map; the rest caches what the fan-out loops need so
+ * that they do not have to look at the user or membership at all.
+ */
+struct UserMembEntry : public std::pair<User*, Membership*>
+{
+	/** The user, if they are local to this server, or NULL */
+	LocalUser* local;
+	/** Prefix rank of the member's highest status mode, as returned by Membership::GetAccessRank.
+	 * Kept up to date by Channel::SetPrefix, and by Channel::UpdateRanks when prefix modes come and go.
+	 */
+	unsigned int rank;
+
+	UserMembEntry(User* u, Membership* m, LocalUser* lu)
+		: std::pair<User*, Membership*>(u, m), local(lu), rank(0) {}
+};
+
+/** Membership list of a channel.
+ * Members are kept in a contiguous array so that sending to a channel is a
+ * linear scan. Small channels are searched by walking the array; once a channel
+ * has more than INDEX_MIN members, an open addressing hash table (with linear
+ * probing) maps users to their position in the array.
+ *
+ * Removing a member moves the last member into its place, so the order of the
+ * list is not stable and a list may not be modified while it is being iterated;
+ * collect the users first if members might be kicked or part during the loop.
+ */
+class CoreExport UserMembList
+{
+ public:
+	typedef std::vector<UserMembEntry>::iterator iterator;
+	typedef std::vector<UserMembEntry>::const_iterator const_iterator;
+
+ private:
+	/** Channels with at most this many members are not indexed */
+	static const size_t INDEX_MIN = 8;
+
+	/** The members */
+	std::vector<UserMembEntry> entries;
+	/** Hash table of positions in entries, plus one; zero marks an empty slot.
+	 * Empty if the list is too small to be indexed, otherwise a power of two in size.
+	 */
+	std::vector<unsigned int> index;
+
+	static inline size_t Hash(User* user)
+	{
+		// Users are allocated from a slab, so the low bits of the address carry nothing
+		return (reinterpret_cast<size_t>(user) >> 4) * 2654435761U;
+	}
+	/** Find the index slot of a user, which may be empty */
+	size_t FindSlot(User* user) const;
+	/** Rebuild the index for the current number of members */
+	void Reindex();
+	void IndexErase(size_t slot);
+
+ public:
+	inline iterator begin() { return entries.begin(); }
+	inline iterator end() { return entries.end(); }
+	inline const_iterator begin() const { return entries.begin(); }
+	inline const_iterator end() const { return entries.end(); }
+	inline size_t size() const { return entries.size(); }
+	inline bool empty() const { return entries.empty(); }
+
+	/** Find the entry of a user
+	 * @return The entry, or end() if the user is not on the list
+	 */
+	iterator find(User* user);
+	const_iterator find(User* user) const;
+
+	/** Add a member; the user must not already be on the list */
+	void insert(User* user, Membership* memb);
+	/** Remove an entry, moving the last entry into its place */
+	void erase(iterator i);
+	void clear();
+};
+
+/** Iterator of UserMembList */
+typedef UserMembList::iterator UserMembIter;
+/** const Iterator of UserMembList */
+typedef UserMembList::const_iterator UserMembCIter;
+
 class CoreExport UCListIter
 {
 	Membership* curr;
@@ -552,6 +552,11 @@ class CoreExport ModeParser
 	 */
 	bool DelMode(ModeHandler* mh);
 
+	/** Recalculate the prefix rank cached for every member of every channel,
+	 * as a prefix mode was added or removed
+	 */
+	void UpdateRanks();
+
 	/** Add a mode watcher.
 	 * A mode watcher is triggered before and after a mode handler is
 	 * triggered. See the documentation of class ModeWatcher for more
@@ -0,0 +1,103 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef INSPIRCD_MULTISEARCH_H
+#define INSPIRCD_MULTISEARCH_H
+
+namespace irc
+{
+	/** Finds every occurrence of any of a set of words in a text in one pass.
+	 *
+	 * The words are compiled into an Aho-Corasick automaton, so searching costs
+	 * one table lookup per character of the text (plus one per occurrence found)
+	 * however many words there are. The automaton only has columns for the
+	 * characters which appear in the words, which keeps it small for large
+	 * word lists.
+	 *
+	 * Words are compared through a case mapping. A set using the default
+	 * (national) case mapping is recompiled automatically when that mapping
+	 * changes.
+	 */
+	class CoreExport multisearch
+	{
+	 public:
+		/** An occurrence of a word: the offset just past its end, and its index */
+		typedef std::pair<size_t, unsigned int> hit;
+
+	 private:
+		/** The words, as given */
+		std::vector<std::string> words;
+		/** True if no case mapping was given and the national one is used */
+		bool national;
+		/** The mapping the words are compiled with */
+		mutable const unsigned char* map;
+		/** Value of national_case_generation when the set was compiled */
+		mutable unsigned int generation;
+		/** True if words were added since the set was compiled */
+		mutable bool dirty;
+		/** Column of the automaton for each raw character; 0 for characters in no word */
+		mutable unsigned int column[256];
+		/** Number of columns */
+		mutable unsigned int columns;
+		/** The next state for each state and column */
+		mutable std::vector<unsigned int> next;
+		/** For each state, the first word ending there, or -1 */
+		mutable std::vector<int> output;
+		/** For each state, the nearest state (itself or along its failure links) where a word ends, or -1 */
+		mutable std::vector<int> report;
+		/** For each state, the next state after it along its failure links where a word ends, or -1 */
+		mutable std::vector<int> more;
+		/** For each word, the next word ending at the same state, or -1 */
+		mutable std::vector<int> sameend;
+
+		void Compile() const;
+
+	 public:
+		/** Create an empty set
+		 * @param Map The case mapping to compare with, or NULL for national_case_insensitive_map
+		 */
+		explicit multisearch(const unsigned char* Map = NULL);
+
+		/** Add a word to the set. Empty words are never found.
+		 * @param word The word to add
+		 * @return The index of the word, as given in hits
+		 */
+		unsigned int add(const std::string& word);
+
+		/** Remove all words */
+		void clear();
+
+		/** Get the number of words */
+		inline size_t size() const { return words.size(); }
+
+		/** Get a word by index */
+		inline const std::string& operator[](unsigned int index) const { return words[index]; }
+
+		/** Find every occurrence of every word in a text, overlapping ones included.
+		 * Occurrences are appended in the order they end; ones ending at the
+		 * same place are longest first.
+		 * @param text The text to search
+		 * @param len The length of the text
+		 * @param hits Vector to append the occurrences to
+		 */
+		void Search(const char* text, size_t len, std::vector<hit>& hits) const;
+
+		/** Find every occurrence of every word in a text, see above */
+		inline void Search(const std::string& text, std::vector<hit>& hits) const
+		{
+			Search(text.data(), text.length(), hits);
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+/** A pool of fixed size blocks for the objects of one class.
+ *
+ * Blocks are carved out of large slabs which are mapped straight from the
+ * operating system, so that connect/quit and join/part churn does not
+ * fragment the general heap. A slab whose objects have all been freed is
+ * handed back to the operating system by ReleaseEmpty, which CullList::Apply
+ * calls once it has deleted the objects it culled; one empty slab per pool is
+ * kept back so that the next burst of allocations does not have to map it again.
+ *
+ * A class uses a pool by defining its own operator new and operator delete
+ * which call Allocate and Deallocate. Objects bigger than the block size (for
+ * example, of a derived class which adds a lot of members) come from the
+ * normal heap instead.
+ */
+class CoreExport SlabPool
+{
+	struct Slab;
+	struct Block;
+
+	/** The name of the pool, shown in /STATS */
+	const char* const name;
+	/** The largest object that fits in a block */
+	const size_t objsize;
+	/** Distance between two blocks, including the block header */
+	const size_t stride;
+	/** Number of blocks in each slab */
+	const size_t perslab;
+	/** Slabs which have at least one free block */
+	Slab* partial;
+	/** Slabs with no objects in them */
+	std::vector<Slab*> empty;
+	/** Counters */
+	size_t live;
+	size_t slabs;
+	size_t heapobjs;
+
+	Slab* NewSlab();
+	void Unlink(Slab* slab);
+	static std::vector<SlabPool*>& AllPools();
+
+	SlabPool(const SlabPool&);
+	void operator=(const SlabPool&);
+ public:
+	/** Create a pool
+	 * @param Name The name of the pool, which must be a string literal
+	 * @param size The largest object the pool will hold
+	 */
+	SlabPool(const char* Name, size_t size);
+
+	/** Allocate memory for an object
+	 * @param size The size of the object
+	 */
+	void* Allocate(size_t size);
+
+	/** Free the memory of an object
+	 * @param ptr The object, returned by Allocate
+	 * @param size The size of the object, as passed to Allocate
+	 */
+	void Deallocate(void* ptr, size_t size);
+
+	/** Unmap the empty slabs of this pool
+	 * @param keep The number of empty slabs to keep for later allocations
+	 */
+	void Release(size_t keep);
+
+	inline const char* GetName() const { return name; }
+	/** Get the number of objects in the pool */
+	inline size_t GetLive() const { return live; }
+	/** Get the number of unused blocks in the pool's slabs */
+	inline size_t GetFree() const { return slabs * perslab - live; }
+	/** Get the number of slabs the pool has mapped */
+	inline size_t GetSlabs() const { return slabs; }
+	/** Get the size of each slab, in bytes */
+	size_t GetSlabSize() const;
+	/** Get the number of objects which were too big for a block and live on the heap */
+	inline size_t GetHeapObjects() const { return heapobjs; }
+
+	/** Release the empty slabs of all pools, keeping one spare slab in each */
+	static void ReleaseEmpty();
+
+	/** Get all pools, in the order they were created */
+	static const std::vector<SlabPool*>& GetPools();
+};
+
+#endif
@@ -110,6 +110,156 @@ namespace irc
 		 * @return true if the conversion was successful, false if not.
 		 */
 		CoreExport bool aptosa(const std::string& addr, int port, irc::sockets::sockaddrs& sa);
+
+		/** A node of a cidr_tree, covering all addresses which begin with its first length bits */
+		struct cidr_node
+		{
+			unsigned char bits[16];
+			unsigned char length;
+			cidr_node* child[2];
+			/** The value stored for exactly this range, or NULL */
+			void* value;
+			/** The count stored for exactly this range */
+			unsigned long count;
+			/** Sum of the counts of this node and all nodes below it */
+			unsigned long total;
+		};
+
+		/** A binary radix (patricia) tree of IPv4 and IPv6 ranges. Finding all the
+		 * ranges which contain an address, or the range for a mask, takes time
+		 * proportional to the length of the address rather than the number of ranges.
+		 *
+		 * Each range can hold a value (see cidr_tree, which wraps this class) and
+		 * a count. Counts are summed up the tree, so the number of everything counted
+		 * within any range can be read without visiting the ranges inside it; this is
+		 * used to count clones by address and read them at any prefix length.
+		 */
+		class CoreExport cidr_tree_base
+		{
+			cidr_tree_base(const cidr_tree_base&);
+			cidr_tree_base& operator=(const cidr_tree_base&);
+
+		 protected:
+			/** Trees for IPv4 and IPv6 */
+			cidr_node* roots[2];
+			/** Number of nodes holding a value */
+			size_t values;
+
+			/** Find the node for a range, or NULL */
+			cidr_node* Find(const cidr_mask& range) const;
+			/** Find the node for a range, creating it if needed
+			 * @param add Amount to add to the totals of the node and all nodes above it
+			 */
+			cidr_node* Insert(const cidr_mask& range, unsigned long add = 0);
+			/** Remove the node for a range if it no longer holds a value or count */
+			void Prune(const cidr_mask& range);
+			/** Get the values of every range containing an address, shortest range first
+			 * @param out Array of at least 129 entries
+			 * @return The number of values stored to out
+			 */
+			unsigned int Lookup(const sockaddrs& addr, void** out) const;
+			/** Get every node with a value */
+			void GetValues(std::vector<cidr_node*>& out) const;
+			/** Get every node with a value for a range within the given range */
+			void GetValues(const cidr_mask& range, std::vector<cidr_node*>& out) const;
+			/** Delete all nodes; values must have been freed already */
+			void Clear();
+
+		 public:
+			cidr_tree_base();
+			~cidr_tree_base();
+
+			/** Add to (or with a negative delta, subtract from) the count of a range */
+			void AddCount(const cidr_mask& range, long delta);
+
+			/** Get the sum of the counts of all ranges within a range */
+			unsigned long GetCount(const cidr_mask& range) const;
+
+			/** Get the totals of all ranges of a given length which have a non-zero count
+			 * within them, e.g. the number of clones in each /24 with any clones at all.
+			 * @param type AF_INET or AF_INET6
+			 * @param length The prefix length
+			 * @param out Vector to append the ranges and totals to
+			 */
+			void GetCounts(unsigned char type, unsigned char length, std::vector<std::pair<cidr_mask, unsigned long> >& out) const;
+		};
+
+		/** A cidr_tree_base mapping ranges to values of type T */
+		template<typename T>
+		class cidr_tree : public cidr_tree_base
+		{
+		 public:
+			~cidr_tree() { clear(); }
+
+			/** Get the value for a range, creating it if needed */
+			T& operator[](const cidr_mask& range)
+			{
+				cidr_node* n = Insert(range);
+				if (!n->value)
+				{
+					n->value = new T();
+					values++;
+				}
+				return *static_cast<T*>(n->value);
+			}
+
+			/** Get the value for a range, or NULL */
+			T* find(const cidr_mask& range) const
+			{
+				cidr_node* n = Find(range);
+				return n ? static_cast<T*>(n->value) : NULL;
+			}
+
+			/** Remove the value for a range */
+			void erase(const cidr_mask& range)
+			{
+				cidr_node* n = Find(range);
+				if (!n || !n->value)
+					return;
+				delete static_cast<T*>(n->value);
+				n->value = NULL;
+				values--;
+				Prune(range);
+			}
+
+			/** Get the values of every range containing an address, shortest range first
+			 * @param addr The address
+			 * @param out Array of at least 129 entries
+			 * @return The number of values stored to out
+			 */
+			unsigned int match(const sockaddrs& addr, T** out) const
+			{
+				void* found[129];
+				unsigned int count = Lookup(addr, found);
+				for (unsigned int i = 0; i < count; i++)
+					out[i] = static_cast<T*>(found[i]);
+				return count;
+			}
+
+			/** Get the values of every range within a range, e.g. of every address in a /24
+			 * @param range The range
+			 * @param out Vector to append the values to
+			 */
+			void within(const cidr_mask& range, std::vector<T*>& out) const
+			{
+				std::vector<cidr_node*> nodes;
+				GetValues(range, nodes);
+				for (std::vector<cidr_node*>::iterator i = nodes.begin(); i != nodes.end(); ++i)
+					out.push_back(static_cast<T*>((*i)->value));
+			}
+
+			/** Number of ranges with a value */
+			inline size_t size() const { return values; }
+
+			void clear()
+			{
+				std::vector<cidr_node*> nodes;
+				GetValues(nodes);
+				for (std::vector<cidr_node*>::iterator i = nodes.begin(); i != nodes.end(); ++i)
+					delete static_cast<T*>((*i)->value);
+				Clear();
+			}
+		};
 	}
 }
 
@@ -320,9 +470,11 @@ class CoreExport SocketEngine
 	/** Reference table, contains all current handlers
 	 */
 	EventHandler** ref;
-	/** List of handlers that want a trial read/write
+	/** The dirty list: fds of handlers that want a trial read/write.
+	 * A handler is only added when it gains its first trial flag, so each fd
+	 * is in the list once however many times it is written to.
 	 */
-	std::set<int> trials;
+	std::vector<int> trials;
 
 	int MAX_DESCRIPTORS;
 
@@ -340,6 +492,18 @@ public:
 	unsigned long ReadEvents;
 	unsigned long WriteEvents;
 	unsigned long ErrorEvents;
+	/** Number of system calls made by the engine to wait for events
+	 * and to change the events it waits for
+	 */
+	unsigned long Syscalls;
+	/** Number of times DispatchTrialWrites has run */
+	unsigned long FlushPasses;
+	/** Number of handlers given a trial write, in total, in the last pass,
+	 * and in the busiest pass
+	 */
+	unsigned long FlushedSockets;
+	unsigned long LastFlushSockets;
+	unsigned long MaxFlushSockets;
 
 	/** Constructor.
 	 * The constructor transparently initializes
@@ -424,10 +588,20 @@ public:
 	virtual int DispatchEvents() = 0;
 
 	/** Dispatch trial reads and writes. This causes the actual socket I/O
-	 * to happen when writes have been pre-buffered.
+	 * to happen when writes have been pre-buffered. It is called once at the
+	 * end of each main loop iteration, so each handler gets at most one write
+	 * event however many times it was written to during the iteration. Trial
+	 * reads run first, so that the writes they cause go out in the same pass.
 	 */
 	virtual void DispatchTrialWrites();
 
+	/** Get the longest time that DispatchEvents may wait for events.
+	 * @return The timeout in milliseconds: 0 if there are trial reads or
+	 * writes which have not been dispatched yet, otherwise the time until
+	 * the next timer is due (at most a second)
+	 */
+	int GetMaxWait() const;
+
 	/** Returns the socket engines name.  This returns the name of the
 	 * engine for use in /VERSION responses.
 	 * @return The socket engine name
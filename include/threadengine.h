@@ -24,10 +24,18 @@ class CoreExport Job : public classbase
 {
  public:
 	ModuleRef owner;
+	/** The name of the thread pool this job runs in, see ThreadEngine */
+	const std::string pool;
  private:
-	bool cancelled;
+	volatile bool cancelled;
+	/** When the job was submitted, started running and finished running
+	 * (monotonic clock, microseconds); set by the ThreadEngine
+	 */
+	uint64_t submit_time, start_time, end_time;
+	friend class ThreadEngine;
  public:
-	Job(Module* Creator) : owner(Creator), cancelled(false) {}
+	Job(Module* Creator, const std::string& Pool = "default")
+		: owner(Creator), pool(Pool), cancelled(false), submit_time(0), start_time(0), end_time(0) {}
 	virtual ~Job() {}
 	/** Run in thread context.
 	 */
@@ -54,7 +62,7 @@ class CoreExport ConfigReaderThread : public Job
  public:
 	const std::string TheUserUID;
 	ConfigReaderThread(const std::string &useruid)
-		: Job(NULL), Config(new ServerConfig(REHASH_NEWCONF)), TheUserUID(useruid)
+		: Job(NULL, "config"), Config(new ServerConfig(REHASH_NEWCONF)), TheUserUID(useruid)
 	{
 	}
 
@@ -91,41 +91,76 @@ class CoreExport pthread_cond_var
 	}
 };
 
+/** Runs Jobs in pools of background threads.
+ *
+ * Each job names the pool it runs in (see Job::pool), and each pool has its
+ * own threads, so that slow jobs of one kind (such as SQL queries) do not
+ * hold up the others. The number of threads in a pool is set with the
+ * <threadpool> tag, and is one by default.
+ *
+ * Jobs are handed to the threads, and results back to the main thread,
+ * through bounded queues which need no locking. A pool's threads only take
+ * a lock to go to sleep when there is nothing to do. The threads wake the
+ * main thread through one eventfd, which is written at most once until the
+ * main thread has collected the results.
+ */
 class CoreExport ThreadEngine
 {
  public:
+	/** Counters kept for each pool */
+	struct PoolStats
+	{
+		std::string name;
+		/** Number of threads in the pool */
+		unsigned int threads;
+		/** Number of jobs submitted and finished */
+		unsigned long submitted, finished;
+		/** Number of jobs waiting for a thread, now and at most */
+		unsigned long queued, max_queued;
+		/** Time jobs spent waiting for a thread, and running, in microseconds */
+		uint64_t wait_total, wait_max, run_total, run_max;
+	};
+
 	ThreadEngine();
 	~ThreadEngine();
 	void Submit(Job*);
 	/** Wait for all jobs that rely on this module */
 	void BlockForUnload(Module* going);
 
+	/** Get the counters of each pool */
+	void GetStats(std::vector<PoolStats>& out) const;
+
  private:
+	class Pool;
+
 	class Runner : public classbase
 	{
 	 public:
 		pthread_t id;
-		ThreadEngine* const te;
-		Job* current;
+		Pool* const pool;
+		/** Set by the thread just before it exits */
+		volatile bool done;
 		static void* entry_point(void* parameter);
 		void main_loop();
-		Runner(ThreadEngine* t);
+		Runner(Pool* p);
 		~Runner();
 	};
 
 	void result_loop();
 
-	Mutex job_lock;
+	/** Wake the main thread, unless it has been woken already */
+	void Notify();
 
-	std::list<Job*> submit_q;
-	pthread_cond_var submit_s;
-	
-	std::vector<Runner*> threads;
-	
-	std::list<Job*> result_q;
-	pthread_cond_var result_sc;
+	/** Pools by name */
+	std::map<std::string, Pool*> pools;
+
+	/** Jobs which have been submitted and not finished yet */
+	std::set<Job*> pending;
+
+	/** Non-zero if the threads have written to result_ss since the main thread last collected results */
+	volatile int signalled;
 	ThreadSignalSocket* result_ss;
-	
+
 	friend class ThreadSignalSocket;
 };
 
@@ -14,40 +14,43 @@
 #ifndef INSPIRCD_TIMER_H
 #define INSPIRCD_TIMER_H
 
-/** Timer class for one-second resolution timers
+/** Timer class for millisecond resolution timers
  * Timer provides a facility which allows module
  * developers to create one-shot timers. The timer
- * can be made to trigger at any time up to a one-second
- * resolution. To use Timer, inherit a class from
- * Timer, then insert your inherited class into the
- * queue using Server::AddTimer(). The Tick() method of
- * your object (which you should override) will be called
- * at the given time.
+ * is given in seconds, and triggers that many seconds
+ * after it was created, to the millisecond. To use Timer,
+ * inherit a class from Timer, then insert your inherited
+ * class into the queue using TimerManager::AddTimer(). The
+ * Tick() method of your object (which you should override)
+ * will be called at the given time.
  */
 class CoreExport Timer
 {
  private:
-	/** The triggering time
+	/** The triggering time, in milliseconds since the epoch
 	 */
-	time_t trigger;
-	/** Number of seconds between triggers
+	uint64_t trigger;
+	/** Number of milliseconds between triggers
 	 */
-	long secs;
+	unsigned long interval;
 	/** True if this is a repeating timer
 	 */
 	bool repeat;
+	/** Next timer in the same slot of the TimerManager
+	 */
+	Timer* next;
+	/** The pointer to this timer in its slot, or NULL if it is not in the TimerManager
+	 */
+	Timer** prev;
+
+	friend class TimerManager;
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
 	 * @param now The time now
 	 * @param repeating Repeat this timer every secs_from_now seconds if set to true
 	 */
-	Timer(long secs_from_now, time_t now, bool repeating = false)
-	{
-		trigger = now + secs_from_now;
-		secs = secs_from_now;
-		repeat = repeating;
-	}
+	Timer(long secs_from_now, time_t now, bool repeating = false);
 
 	/** Default destructor, does nothing.
 	 */
@@ -57,19 +60,22 @@ class CoreExport Timer
 	 */
 	virtual time_t GetTimer()
 	{
-		return trigger;
+		return trigger / 1000;
 	}
 
-	/** Sets the trigger timeout to a new value
+	/** Sets the trigger timeout to a new value.
+	 * This must not be called while the timer is added to the TimerManager.
 	 */
 	virtual void SetTimer(time_t t)
 	{
-		trigger = t;
+		trigger = (uint64_t)t * 1000;
 	}
 
 	/** Called when the timer ticks.
 	 * You should override this method with some useful code to
-	 * handle the tick event.
+	 * handle the tick event. A timer which sets a new trigger time
+	 * and adds itself to the TimerManager again from here is kept,
+	 * rather than repeated or deleted.
 	 */
 	virtual void Tick(time_t TIME) = 0;
 
@@ -85,7 +91,25 @@ class CoreExport Timer
 	 */
 	long GetSecs() const
 	{
-		return secs;
+		return interval / 1000;
+	}
+
+	/** Returns the interval of this timer object in milliseconds
+	 */
+	unsigned long GetInterval() const
+	{
+		return interval;
+	}
+
+	/** Changes the interval of this timer, moving the first trigger time with it.
+	 * Use this for timers which need to trigger more often than once a second.
+	 * This must not be called while the timer is added to the TimerManager.
+	 * @param ms The new interval in milliseconds
+	 */
+	void SetInterval(unsigned long ms)
+	{
+		trigger = trigger - interval + ms;
+		interval = ms;
 	}
 
 	/** Cancels the repeat state of a repeating timer.
@@ -108,12 +132,46 @@ class CoreExport Timer
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel: level 0 has one slot for
+ * each of the next 64 milliseconds, and each level above has 64 slots which
+ * are each as wide as all of the level below. A timer goes into the lowest
+ * level whose range reaches its trigger time, so adding and deleting a timer
+ * only links or unlinks it from a slot. When the wheel's time enters a slot
+ * on a higher level, the timers in it are moved down ("cascaded"); timers
+ * further away than the top level can reach wait on a separate list.
  */
 class CoreExport TimerManager
 {
-	/** Pending timers
+	static const unsigned int LEVEL_BITS = 6;
+	static const unsigned int SLOTS = 1 << LEVEL_BITS;
+	static const unsigned int LEVELS = 6;
+
+	/** Timer lists, by level and slot
+	 */
+	Timer* wheel[LEVELS][SLOTS];
+	/** For each level, a bit for every slot which holds at least one timer
+	 */
+	uint64_t occupied[LEVELS];
+	/** Timers which are beyond the range of the top level
 	 */
-	std::multimap<time_t, Timer*> Timers;
+	Timer* overflow;
+	/** The time the wheel has been advanced to, in milliseconds; every
+	 * timer due at or before this time has been triggered
+	 */
+	uint64_t current;
+
+	/** Link a timer into the slot for its trigger time
+	 * @param T The timer to add
+	 * @param earliest The earliest time to trigger it, if its trigger time has already passed
+	 */
+	void Schedule(Timer* T, uint64_t earliest);
+	/** Unlink a timer from whatever slot it is in */
+	void Unlink(Timer* T);
+	/** Move all timers in a list back into the slots for their trigger times */
+	void Reschedule(Timer*& list);
+	/** Get the next time after current at which a slot has to be cascaded or triggered */
+	uint64_t NextEvent() const;
 
  public:
 	/** Constructor
@@ -122,17 +180,18 @@ class CoreExport TimerManager
 	~TimerManager();
 
 	/** Tick all pending Timers
-	 * @param TIME the current system time
+	 * @param now The current system time in milliseconds, see InspIRCd::Time_ms()
+	 */
+	void TickTimers(uint64_t now);
+
+	/** Get the number of milliseconds until the timers next need to be ticked.
+	 * This is at most the time until the next second starts, so that the
+	 * main loop still runs its once a second work on time.
 	 */
-	void TickTimers(time_t TIME);
+	int GetMaxWait() const;
 
 	/** Add an Timer
 	 * @param T an Timer derived class to add
-	 * @param secs_from_now You may set this to the number of seconds
-	 * from the current time when the timer will tick, or you may just
-	 * leave this unset and the values set by the Timers constructor
-	 * will be used. This is used internally for re-triggering repeating
-	 * timers.
 	 */
 	void AddTimer(Timer *T);
 
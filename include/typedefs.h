@@ -14,18 +14,10 @@
 #ifndef __TYPEDEF_H__
 #define __TYPEDEF_H__
 
-#if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
-	typedef nspace::hash_map<std::string, User*, nspace::hash_compare<std::string, std::less<std::string> > > user_hash;
-	typedef nspace::hash_map<std::string, Channel*, nspace::hash_compare<std::string, std::less<std::string> > > chan_hash;
-#else
-	#ifdef HASHMAP_DEPRECATED
-		typedef nspace::hash_map<std::string, User*, nspace::insensitive, irc::StrHashComp> user_hash;
-		typedef nspace::hash_map<std::string, Channel*, nspace::insensitive, irc::StrHashComp> chan_hash;
-	#else
-		typedef nspace::hash_map<std::string, User*, nspace::hash<std::string>, irc::StrHashComp> user_hash;
-		typedef nspace::hash_map<std::string, Channel*, nspace::hash<std::string>, irc::StrHashComp> chan_hash;
-	#endif
-#endif
+/** Users by nick or UUID, case insensitive */
+typedef irc::hash_map<irc::namekey, User*, irc::namekey::hasher> user_hash;
+/** Channels by name, case insensitive */
+typedef irc::hash_map<irc::namekey, Channel*, irc::namekey::hasher> chan_hash;
 
 /** A list of failed port bindings, used for informational purposes on startup */
 typedef std::vector<std::pair<std::string, std::string> > FailedPortList;
@@ -69,14 +61,7 @@ typedef std::map<std::string, file_cache> ConfigFileCache;
 
 /** A hash of commands used by the core
  */
-typedef nspace::hash_map<std::string,Command*> Commandtable;
-
-/** Membership list of a channel */
-typedef std::map<User*, Membership*> UserMembList;
-/** Iterator of UserMembList */
-typedef UserMembList::iterator UserMembIter;
-/** const Iterator of UserMembList */
-typedef UserMembList::const_iterator UserMembCIter;
+typedef irc::hash_map<std::string, Command*, irc::hash> Commandtable;
 
 /** Generic user list, used for exceptions */
 typedef std::set<User*> CUList;
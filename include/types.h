@@ -32,6 +32,7 @@ class DNSRequest;
 class Extensible;
 class FakeUser;
 class InspIRCd;
+class IOThreadPool;
 class Job;
 class LocalUser;
 class Membership;
@@ -44,6 +45,7 @@ class ProtocolInterface;
 class Resolver;
 class ServerConfig;
 class ServerLimits;
+class SharedLine;
 class SocketTimeout;
 class StreamSocket;
 class SyncTarget;
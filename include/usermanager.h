@@ -16,8 +16,11 @@
 
 #include <list>
 
-/** A list of ip addresses cross referenced against clone counts */
-typedef std::map<irc::sockets::cidr_mask, unsigned int> clonemap;
+/** Clone counts by ip address. Users are counted at their full address, so
+ * the count for the configured CIDR range can be read at any time, even if
+ * the range changed on rehash since the user connected.
+ */
+typedef irc::sockets::cidr_tree_base clonemap;
 
 class CoreExport UserManager
 {
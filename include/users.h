@@ -197,6 +197,12 @@ class CoreExport User : public Extensible
 	 */
 	std::string nick;
 
+	/** The nick folded for the current casemapping, as filed in UserManager::clientlist.
+	 * Whenever nick changes while the user is in the nick hash, this must be updated
+	 * along with the hash entry.
+	 */
+	irc::namekey nickkey;
+
 	/** The user's unique identifier.
 	 * This is the unique identifier which the user has across the network.
 	 */
@@ -321,6 +327,10 @@ class CoreExport User : public Extensible
 	 */
 	User(const std::string &uid, const std::string& srv, int objtype);
 
+	/** Users (and remote users, which are only slightly bigger) are allocated from a SlabPool */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
+
 	/** Check if the user matches a G or K line, and disconnect them if they do.
 	 * @param doZline True if ZLines should be checked (if IP has changed since initial connect)
 	 * Returns true if the user matched a ban, false else.
@@ -640,6 +650,7 @@ class CoreExport User : public Extensible
 };
 
 class UserIOHandler;
+class Timer;
 
 typedef unsigned int already_sent_t;
 
@@ -655,6 +666,10 @@ class CoreExport LocalUser : public User
 	LocalUser(int fd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server);
 	CullResult cull();
 
+	/** Local users have a SlabPool of their own */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr, size_t size);
+
 	UserIOHandler* const eh;
 
 	/** Stats counter for bytes inbound
@@ -710,6 +725,24 @@ class CoreExport LocalUser : public User
 	 */
 	unsigned int CommandFloodPenalty;
 
+	/** Timer which runs the ping and registration timeout checks for this user
+	 */
+	Timer* check_timer;
+
+	/** Timer which lets CommandFloodPenalty decay once a second, or NULL if
+	 * the user has no penalty and no sendq
+	 */
+	Timer* flood_timer;
+
+	/** Start the timer which runs the ping and registration timeout checks
+	 */
+	void StartCheckTimer();
+
+	/** Start the flood timer if the user has a penalty or a sendq and it is not running yet.
+	 * The timer also resumes processing lines which were held back by the penalty or sendq.
+	 */
+	void CheckFloodTimer();
+
 	static already_sent_t already_sent_id;
 	already_sent_t already_sent;
 
@@ -738,6 +771,18 @@ class CoreExport LocalUser : public User
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write a line which has been formatted once for many users.
+	 * @param line The line to send, as built by MakeSharedLine()
+	 */
+	void Write(SharedLine* line);
+
+	/** Build a line for sending to many local users with Write(SharedLine*).
+	 * The text is cropped in the same way as Write() does, and CR/LF is appended.
+	 * @param text The line to send, without CR/LF
+	 * @return A new SharedLine, which should be held in a reference
+	 */
+	static SharedLine* MakeSharedLine(const std::string& text);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
@@ -797,6 +842,7 @@ class CoreExport FakeUser : public User
 	FakeUser(const std::string &uid, const std::string& srv) : User(uid, srv, USERTYPE_SERVER)
 	{
 		nick = srv;
+		nickkey = nick;
 	}
 
 	virtual CullResult cull();
@@ -0,0 +1,101 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef INSPIRCD_WILDCARD_H
+#define INSPIRCD_WILDCARD_H
+
+namespace irc
+{
+	/** A wildcard mask ('*' and '?') compiled for repeated matching.
+	 *
+	 * InspIRCd::Match() walks the raw mask for every string it is given; this
+	 * is fine for a one-off comparison, but ban lists, X-lines and commands such
+	 * as WHO match the same mask against many strings. A wildmask splits the mask
+	 * into the literal runs between its stars once, so that matching checks the
+	 * length bounds first, compares the anchored head and tail directly and only
+	 * searches for the runs in between (using SSE2 where available).
+	 *
+	 * Matching gives exactly the same results as InspIRCd::Match() with the same
+	 * case mapping. A mask compiled with the default (national) case mapping is
+	 * recompiled automatically when that mapping changes.
+	 */
+	class CoreExport wildmask
+	{
+		/** One run of the mask between two stars, already case folded ('?' is kept) */
+		struct segment
+		{
+			std::string text;
+			/** Offset of the first character in text which is not '?', or npos */
+			size_t lead;
+			/** Number of raw bytes which fold to text[lead]; 0 if more than two */
+			unsigned char nalts;
+			/** The raw bytes which fold to text[lead], if nalts is 1 or 2 */
+			unsigned char alts[2];
+		};
+
+		/** The mask as given */
+		std::string mask;
+		/** True if no case mapping was given and the national one is used */
+		bool national;
+		/** The mapping the mask was compiled with */
+		mutable const unsigned char* map;
+		/** Value of national_case_generation when the mask was compiled */
+		mutable unsigned int generation;
+		/** True if the mask has at least one '*' */
+		mutable bool star;
+		/** Minimum length of a matching string (exact length if there is no '*') */
+		mutable size_t minlen;
+		/** The run before the first '*', which must match at the start */
+		mutable segment head;
+		/** The run after the last '*', which must match at the end */
+		mutable segment tail;
+		/** Runs between stars, each of which must be found in order */
+		mutable std::vector<segment> middle;
+
+		void Compile() const;
+		void MakeSegment(segment& seg, const char* start, size_t len) const;
+		inline bool SegmentAt(const segment& seg, const unsigned char* str) const;
+		const unsigned char* Find(const segment& seg, const unsigned char* str, const unsigned char* end) const;
+
+	 public:
+		/** Create an empty mask, which only matches the empty string */
+		wildmask();
+
+		/** Compile a mask
+		 * @param Mask The wildcard mask
+		 * @param Map The case mapping to match with, or NULL for national_case_insensitive_map
+		 */
+		explicit wildmask(const std::string& Mask, const unsigned char* Map = NULL);
+
+		/** Replace the mask with another one, see the constructor */
+		void assign(const std::string& Mask, const unsigned char* Map = NULL);
+
+		/** Get the mask as given */
+		inline const std::string& str() const { return mask; }
+
+		/** Check whether a string matches the mask
+		 * @param str The string to match
+		 * @return True if the string matches
+		 */
+		bool Match(const std::string& str) const;
+
+		/** Check whether a string matches the mask
+		 * @param str The string to match, which need not be NUL terminated
+		 * @param len The length of the string
+		 * @return True if the string matches
+		 */
+		bool Match(const char* str, size_t len) const;
+	};
+}
+
+#endif
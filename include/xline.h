@@ -107,6 +107,12 @@ class CoreExport XLine : public classbase
 	 */
 	virtual void OnAdd() { }
 
+	/** Returns the mask which a user's host or IP must match (ignoring case) for
+	 * Matches(User*) to return true, so that XLineManager can index the line by it.
+	 * Lines which can match users in other ways must return NULL, which is the default.
+	 */
+	virtual const std::string* GetIndexMask() { return NULL; }
+
 	/** The time the line was added.
 	 */
 	time_t set_time;
@@ -150,7 +156,8 @@ class CoreExport KLine : public XLine
 	 * @param host Host to match
 	 */
 	KLine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
-		: XLine(s_time, d, src, re, "K"), identmask(ident), hostmask(host)
+		: XLine(s_time, d, src, re, "K"), identmask(ident), hostmask(host),
+		identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -172,6 +179,8 @@ class CoreExport KLine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual const std::string* GetIndexMask() { return &hostmask; }
+
 	virtual bool IsBurstable();
 
 	/** Ident mask (ident part only)
@@ -182,6 +191,10 @@ class CoreExport KLine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** identmask and hostmask, compiled for matching against users
+	 */
+	irc::wildmask identmatch, hostmatch;
 };
 
 /** GLine class
@@ -198,7 +211,8 @@ class CoreExport GLine : public XLine
 	 * @param host Host to match
 	 */
 	GLine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
-		: XLine(s_time, d, src, re, "G"), identmask(ident), hostmask(host)
+		: XLine(s_time, d, src, re, "G"), identmask(ident), hostmask(host),
+		identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -220,6 +234,8 @@ class CoreExport GLine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual const std::string* GetIndexMask() { return &hostmask; }
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -228,6 +244,10 @@ class CoreExport GLine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** identmask and hostmask, compiled for matching against users
+	 */
+	irc::wildmask identmatch, hostmatch;
 };
 
 /** ELine class
@@ -244,7 +264,8 @@ class CoreExport ELine : public XLine
 	 * @param host Host to match
 	 */
 	ELine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
-		: XLine(s_time, d, src, re, "E"), identmask(ident), hostmask(host)
+		: XLine(s_time, d, src, re, "E"), identmask(ident), hostmask(host),
+		identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -266,6 +287,8 @@ class CoreExport ELine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual const std::string* GetIndexMask() { return &hostmask; }
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -274,6 +297,10 @@ class CoreExport ELine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** identmask and hostmask, compiled for matching against users
+	 */
+	irc::wildmask identmatch, hostmatch;
 };
 
 /** ZLine class
@@ -289,7 +316,7 @@ class CoreExport ZLine : public XLine
 	 * @param ip IP to match
 	 */
 	ZLine(time_t s_time, long d, std::string src, std::string re, std::string ip)
-		: XLine(s_time, d, src, re, "Z"), ipaddr(ip)
+		: XLine(s_time, d, src, re, "Z"), ipaddr(ip), ipmatch(ip)
 	{
 	}
 
@@ -309,9 +336,15 @@ class CoreExport ZLine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual const std::string* GetIndexMask() { return &ipaddr; }
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
+
+	/** ipaddr, compiled for matching
+	 */
+	irc::wildmask ipmatch;
 };
 
 /** QLine class
@@ -327,7 +360,7 @@ class CoreExport QLine : public XLine
 	 * @param nickname Nickname to match
 	 */
 	QLine(time_t s_time, long d, std::string src, std::string re, std::string nickname)
-		: XLine(s_time, d, src, re, "Q"), nick(nickname)
+		: XLine(s_time, d, src, re, "Q"), nick(nickname), nickmatch(nickname)
 	{
 	}
 
@@ -349,6 +382,10 @@ class CoreExport QLine : public XLine
 	/** Nickname mask
 	 */
 	std::string nick;
+
+	/** nick, compiled for matching
+	 */
+	irc::wildmask nickmatch;
 };
 
 /** XLineFactory is used to generate an XLine pointer, given just the
@@ -394,6 +431,64 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+/** An index over the lines of one type, which XLineManager::MatchesLine uses to
+ * find the lines that can match a user without calling Matches() on all of them.
+ *
+ * Lines are filed by the mask returned by XLine::GetIndexMask():
+ *  - masks without wildcards go into a hash of exact hosts,
+ *  - valid CIDR masks also go into an irc::sockets::cidr_tree,
+ *  - masks of the form *literal go into a trie of reversed suffixes, and
+ *    masks of the form literal* into a trie of prefixes.
+ * Everything else, including every line without an index mask, is kept in a
+ * list which is checked for every user.
+ */
+class CoreExport XLineIndex
+{
+ public:
+	/** Trie node, defined in xline.cpp */
+	struct TextNode;
+
+ private:
+	typedef irc::hash_map<std::string, std::vector<XLine*>, irc::hash> ExactMap;
+
+	/** Lines by lowercased literal host or IP */
+	ExactMap exact;
+	/** Lines by CIDR range */
+	irc::sockets::cidr_tree<std::vector<XLine*> > ranges;
+	/** Lines by lowercased prefix, and by reversed, lowercased suffix */
+	TextNode* prefixes;
+	TextNode* suffixes;
+	/** Lines which must always be checked */
+	std::vector<XLine*> residue;
+
+	/** Add a line to or remove it from the index it belongs in
+	 * @return False if the line is not indexable and belongs in the residue
+	 */
+	bool File(XLine* line, bool add);
+	void LookupHost(const std::string& host, std::vector<XLine*>& out);
+
+	XLineIndex(const XLineIndex&);
+	XLineIndex& operator=(const XLineIndex&);
+ public:
+	XLineIndex();
+	~XLineIndex();
+
+	/** Add a line to the index */
+	void Add(XLine* line);
+
+	/** Remove a line from the index */
+	void Remove(XLine* line);
+
+	/** Get the lines which may match a user. A line may be returned more than once.
+	 * @param user The user to look up
+	 * @param out Vector to append the lines to
+	 */
+	void GetCandidates(User* user, std::vector<XLine*>& out);
+
+	/** Number of lines which are checked against every user */
+	inline size_t ResidueSize() const { return residue.size(); }
+};
+
 /** XLineManager is a class used to manage glines, klines, elines, zlines and qlines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -416,6 +511,10 @@ class CoreExport XLineManager
 	 */
 	XLineContainer lookup_lines;
 
+	/** Index of the lines in lookup_lines, by type
+	 */
+	std::map<std::string, XLineIndex*> line_index;
+
  public:
 
 	/** Constructor
@@ -0,0 +1,16 @@
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <unistd.h>
+
+int main() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, 8, &params);
+	if (fd < 0)
+		return 1;
+	close(fd);
+
+	// The engine needs timed waits and poll requests which are never dropped
+	return !((params.features & IORING_FEAT_EXT_ARG) && (params.features & IORING_FEAT_NODROP));
+}
@@ -271,6 +271,8 @@ InspIRCd 1.0.x, are also allowed.
   --enable-optimization=[n]    Optimize using -O[n] gcc flag
   --enable-epoll               Enable epoll() where supported [set]
   --enable-kqueue              Enable kqueue() where supported [set]
+  --enable-uring               Use io_uring instead of epoll() where
+                               supported [not set]
   --disable-epoll              Do not enable epoll(), fall back
                                to select() [not set]
   --disable-kqueue             Do not enable kqueue(), fall back
@@ -15,153 +15,265 @@
 
 #include "inspircd.h"
 #include "bancache.h"
+#include "xline.h"
+#include <fstream>
 
-BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason)
+/** Parse an IP address or CIDR range, as found in X-line masks */
+static bool ParseRange(const std::string& mask, irc::sockets::cidr_mask& range)
 {
-	BanCacheHit *b;
-
-	if (this->BanHash->find(ip) != this->BanHash->end()) // can't have two cache entries on the same IP, sorry..
-		return NULL;
+	std::string::size_type slash = mask.rfind('/');
+	irc::sockets::sockaddrs sa;
+	if (slash == std::string::npos)
+	{
+		if (!irc::sockets::aptosa(mask, 0, sa))
+			return false;
+		range = irc::sockets::cidr_mask(sa, 128);
+		return true;
+	}
 
-	b = new BanCacheHit(ip, type, reason);
+	if (slash + 1 == mask.length())
+		return false;
+	for (std::string::size_type i = slash + 1; i < mask.length(); i++)
+		if (!isdigit(mask[i]))
+			return false;
+	if (!irc::sockets::aptosa(mask.substr(0, slash), 0, sa))
+		return false;
+	range = irc::sockets::cidr_mask(sa, atoi(mask.c_str() + slash + 1));
+	return true;
+}
 
-	this->BanHash->insert(std::make_pair(ip, b));
-	return b;
+BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason)
+{
+	return AddHit(ip, type, reason, 86400); // a day. this might seem long, but entries will be removed as glines/etc expire.
 }
 
 BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds)
 {
-	BanCacheHit *b;
+	if (this->BanHash.find(ip) != this->BanHash.end()) // can't have two cache entries on the same IP, sorry..
+		return NULL;
 
-	if (this->BanHash->find(ip) != this->BanHash->end()) // can't have two cache entries on the same IP, sorry..
+	Trim(ServerInstance->Config->BanCacheSize ? ServerInstance->Config->BanCacheSize - 1 : 0);
+	if (!ServerInstance->Config->BanCacheSize)
 		return NULL;
 
-	b = new BanCacheHit(ip, type, reason, seconds);
+	entries.push_front(BanCacheHit(ip, type, reason, seconds));
+	BanHash[ip] = entries.begin();
+
+	irc::sockets::sockaddrs sa;
+	if (irc::sockets::aptosa(ip, 0, sa))
+		byaddr[irc::sockets::cidr_mask(sa, 128)] = entries.begin();
 
-	this->BanHash->insert(std::make_pair(ip, b));
-	return b;
+	return &entries.front();
 }
 
 BanCacheHit *BanCacheManager::GetHit(const std::string &ip)
 {
-	BanCacheHash::iterator i = this->BanHash->find(ip);
+	BanCacheHash::iterator i = this->BanHash.find(ip);
 
-	if (i == this->BanHash->end())
-		return NULL; // free and safe
-	else
+	if (i == this->BanHash.end())
 	{
-		if (ServerInstance->Time() > i->second->Expiry)
-		{
-			ServerInstance->Logs->Log("BANCACHE", DEBUG, "Hit on " + ip + " is out of date, removing!");
-			RemoveHit(i->second);
-			return NULL; // out of date
-		}
+		misses++;
+		return NULL; // free and safe
+	}
 
-		return i->second; // hit.
+	if (ServerInstance->Time() > i->second->Expiry)
+	{
+		ServerInstance->Logs->Log("BANCACHE", DEBUG, "Hit on " + ip + " is out of date, removing!");
+		Erase(i->second);
+		misses++;
+		return NULL; // out of date
 	}
+
+	// Most recently used first
+	entries.splice(entries.begin(), entries, i->second);
+	hits++;
+	return &entries.front(); // hit.
 }
 
 bool BanCacheManager::RemoveHit(BanCacheHit *b)
 {
-	BanCacheHash::iterator i;
-
 	if (!b)
 		return false; // I don't think so.
 
-	i = this->BanHash->find(b->IP);
+	BanCacheHash::iterator i = this->BanHash.find(b->IP);
 
-	if (i == this->BanHash->end())
+	if (i == this->BanHash.end())
 	{
 		// err..
 		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveHit(): I got asked to remove a hit that wasn't in the hash(?)");
+		return false;
 	}
-	else
+
+	Erase(i->second);
+	return true;
+}
+
+void BanCacheManager::Erase(BanCacheList::iterator i)
+{
+	irc::sockets::sockaddrs sa;
+	if (irc::sockets::aptosa(i->IP, 0, sa))
+		byaddr.erase(irc::sockets::cidr_mask(sa, 128));
+	BanHash.erase(i->IP);
+	entries.erase(i);
+}
+
+void BanCacheManager::Trim(size_t max)
+{
+	while (BanHash.size() > max)
 	{
-		this->BanHash->erase(i);
+		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager: Evicting the hit on " + entries.back().IP);
+		Erase(--entries.end());
+		evictions++;
 	}
+}
 
-	delete b;
-	return true;
+bool BanCacheManager::Selected(const BanCacheHit& b, const std::string& type, bool positive)
+{
+	// if removing negative hits, ignore type..
+	if (positive)
+		return !b.Reason.empty() && b.Type == type;
+	return b.Reason.empty();
 }
 
 unsigned int BanCacheManager::RemoveEntries(const std::string &type, bool positive)
 {
-	int removed = 0;
-
-	BanCacheHash::iterator safei;
+	unsigned int removed = 0;
 
 	if (positive)
 		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveEntries(): Removing positive hits for " + type);
 	else
 		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveEntries(): Removing negative hits for " + type);
 
-	for (BanCacheHash::iterator n = BanHash->begin(); n != BanHash->end(); )
+	for (BanCacheList::iterator n = entries.begin(); n != entries.end(); )
 	{
-		safei = n;
-		safei++;
+		BanCacheList::iterator safei = n++;
+		if (Selected(*safei, type, positive))
+		{
+			Erase(safei);
+			removed++;
+		}
+	}
 
-		BanCacheHit *b = n->second;
+	invalidations += removed;
+	return removed;
+}
+
+unsigned int BanCacheManager::RemoveEntries(const std::string &type, bool positive, const std::string &mask, bool ipmask)
+{
+	irc::sockets::cidr_mask range;
+	if (mask.find_first_of("*?") != std::string::npos || !ParseRange(mask, range))
+	{
+		if (!ipmask)
+			return RemoveEntries(type, positive);
 
-		/* Safe to delete items here through iterator 'n' */
-		if (b->Type == type || !positive) // if removing negative hits, ignore type..
+		unsigned int removed = 0;
+		for (BanCacheList::iterator n = entries.begin(); n != entries.end(); )
 		{
-			if ((positive && !b->Reason.empty()) || b->Reason.empty())
+			BanCacheList::iterator safei = n++;
+			if (Selected(*safei, type, positive) && InspIRCd::MatchCIDR(safei->IP, mask, ascii_case_insensitive_map))
 			{
-				/* we need to remove this one. */
-				ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + b->IP);
-				delete b;
-				b = NULL;
-				BanHash->erase(n); // WORD TO THE WISE: don't use RemoveHit here, because we MUST remove the iterator in a safe way.
+				Erase(safei);
 				removed++;
 			}
 		}
-
-		/* End of safe section */
-		n = safei;
+		invalidations += removed;
+		return removed;
 	}
 
+	ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveEntries(): Removing %s hits for %s within %s",
+		positive ? "positive" : "negative", type.c_str(), range.str().c_str());
+
+	std::vector<BanCacheList::iterator*> found;
+	byaddr.within(range, found);
+	unsigned int removed = 0;
+	for (std::vector<BanCacheList::iterator*>::iterator i = found.begin(); i != found.end(); ++i)
+	{
+		BanCacheList::iterator entry = **i;
+		if (Selected(*entry, type, positive))
+		{
+			Erase(entry);
+			removed++;
+		}
+	}
 
+	invalidations += removed;
 	return removed;
 }
 
 void BanCacheManager::RehashCache()
 {
-	BanCacheHash* NewHash = new BanCacheHash();
-
-	BanCacheHash::iterator safei;
-	for (BanCacheHash::iterator n = BanHash->begin(); n != BanHash->end(); )
+	for (BanCacheList::iterator n = entries.begin(); n != entries.end(); )
 	{
-		safei = n;
-		safei++;
-
-		/* Safe to delete items here through iterator 'n' */
-		BanCacheHit *b = n->second;
+		BanCacheList::iterator safei = n++;
+		if (ServerInstance->Time() > safei->Expiry)
+			Erase(safei);
+	}
+	Trim(ServerInstance->Config->BanCacheSize);
+}
 
-		if (ServerInstance->Time() > b->Expiry)
-		{
-			/* we need to remove this one. */
-			delete b;
-			b = NULL;
-			BanHash->erase(n); // WORD TO THE WISE: don't use RemoveHit here, because we MUST remove the iterator in a safe way.
-		}
-		else
-		{
-			/* Actually inserts a std::pair */
-			NewHash->insert(*n);
-		}
+void BanCacheManager::Save()
+{
+	const std::string& file = ServerInstance->Config->BanCacheFile;
+	if (file.empty())
+		return;
+
+	// Write a temporary file and rename it, so a crash never leaves half a cache behind
+	std::string tmpfile = file + ".new";
+	std::ofstream stream(tmpfile.c_str());
+	if (!stream.is_open())
+	{
+		ServerInstance->Logs->Log("BANCACHE", DEFAULT, "BanCacheManager: Cannot write %s: %s", tmpfile.c_str(), strerror(errno));
+		return;
+	}
 
-		/* End of safe section */
+	// Positive hits are not kept, as the lines which caused them may be gone by the time we are back.
+	// Least recently used first, so that loading them puts them back in the same order.
+	unsigned long count = 0;
+	for (BanCacheList::reverse_iterator i = entries.rbegin(); i != entries.rend(); ++i)
+	{
+		if (!i->Reason.empty() || ServerInstance->Time() > i->Expiry)
+			continue;
+		stream << i->IP << " " << i->Expiry << "\n";
+		count++;
+	}
+	stream.close();
 
-		n = safei;
+	if (stream.fail() || rename(tmpfile.c_str(), file.c_str()) < 0)
+	{
+		ServerInstance->Logs->Log("BANCACHE", DEFAULT, "BanCacheManager: Cannot write %s: %s", file.c_str(), strerror(errno));
+		unlink(tmpfile.c_str());
+		return;
 	}
+	ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager: Saved %lu hits to %s", count, file.c_str());
+}
 
-	delete BanHash;
-	BanHash = NewHash;
+void BanCacheManager::Load()
+{
+	const std::string& file = ServerInstance->Config->BanCacheFile;
+	if (file.empty())
+		return;
+
+	std::ifstream stream(file.c_str());
+	if (!stream.is_open())
+		return;
+
+	unsigned long count = 0;
+	std::string ip;
+	time_t expiry;
+	while (stream >> ip >> expiry)
+	{
+		// Lines may have been added while we were away
+		if (expiry < ServerInstance->Time() || ServerInstance->XLines->MatchesLine("Z", ip))
+			continue;
+		if (AddHit(ip, "", "", expiry - ServerInstance->Time()))
+			count++;
+	}
+	ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager: Loaded %lu hits from %s", count, file.c_str());
 }
 
-BanCacheManager::~BanCacheManager()
+std::string BanCacheManager::GetStats()
 {
-	for (BanCacheHash::iterator n = BanHash->begin(); n != BanHash->end(); ++n)
-		delete n->second;
-	delete BanHash;
+	return "Ban cache: " + ConvToStr(BanHash.size()) + " entries (limit " + ConvToStr(ServerInstance->Config->BanCacheSize) + "), " +
+		ConvToStr(hits) + " hits, " + ConvToStr(misses) + " misses, " + ConvToStr(evictions) + " evictions, " +
+		ConvToStr(invalidations) + " invalidated";
 }
@@ -13,26 +13,41 @@
 
 #include "inspircd.h"
 #include "cull_list.h"
+#include "inspsocket.h"
 #include <cstdarg>
 #include "mode.h"
+#include "slab.h"
+
+static SlabPool ChannelPool("Channel", sizeof(Channel));
+static SlabPool MembershipPool("Membership", sizeof(Membership));
 
 Channel::Channel(const std::string &cname, time_t ts)
-	: Extensible(EXTENSIBLE_CHANNEL), name(cname), age(ts)
+	: Extensible(EXTENSIBLE_CHANNEL), name(cname), namekey(cname), age(ts)
 {
 	if (!age)
 		throw CoreException("Cannot create channel with zero timestamp");
 
-	chan_hash::iterator findchan = ServerInstance->chanlist->find(name);
+	chan_hash::iterator findchan = ServerInstance->chanlist->find(namekey);
 	if (findchan != ServerInstance->chanlist->end())
 		throw CoreException("Cannot create duplicate channel " + name);
 
 
-	ServerInstance->chanlist->insert(std::make_pair(name, this));
+	ServerInstance->chanlist->insert(std::make_pair(namekey, this));
 
 	maxbans = topicset = 0;
 	modebits.reset();
 }
 
+void* Channel::operator new(size_t size)
+{
+	return ChannelPool.Allocate(size);
+}
+
+void Channel::operator delete(void* ptr, size_t size)
+{
+	ChannelPool.Deallocate(ptr, size);
+}
+
 bool Channel::IsModeSet(char mode)
 {
 	ModeHandler* mh = ServerInstance->Modes->FindMode(mode, MODETYPE_CHANNEL);
@@ -120,7 +135,7 @@ long Channel::GetUserCounter()
 Membership* Channel::AddUser(User* user)
 {
 	Membership* memb = new Membership(user, this);
-	userlist[user] = memb;
+	userlist.insert(user, memb);
 	return memb;
 }
 
@@ -130,9 +145,10 @@ void Channel::DelUser(User* user)
 
 	if (a != userlist.end())
 	{
-		a->second->cull();
-		delete a->second;
+		Membership* memb = a->second;
 		userlist.erase(a);
+		memb->cull();
+		delete memb;
 	}
 
 	if (!userlist.empty())
@@ -143,7 +159,7 @@ void Channel::DelUser(User* user)
 	if (res == MOD_RES_DENY)
 		return;
 	/* kill the record */
-	chan_hash::iterator iter = ServerInstance->chanlist->find(this->name);
+	chan_hash::iterator iter = ServerInstance->chanlist->find(this->namekey);
 	if (iter != ServerInstance->chanlist->end() && iter->second == this)
 	{
 		FOREACH_MOD(I_OnChannelDelete, OnChannelDelete(this));
@@ -384,7 +400,7 @@ bool Channel::IsBanned(User* user)
 	{
 		for (modelist::const_iterator it = bans->begin(); it != bans->end(); it++)
 		{
-			if (CheckBan(user, it->mask))
+			if (CheckBan(user, *it))
 				return true;
 		}
 	}
@@ -420,6 +436,39 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 	return false;
 }
 
+bool Channel::CheckBan(User* user, const BanItem& ban)
+{
+	ModResult result;
+	FIRST_MOD_RESULT(OnCheckBan, result, (user, this, ban.mask));
+	if (result != MOD_RES_PASSTHRU)
+		return (result == MOD_RES_DENY);
+
+	if (ban.mask[1] == ':')
+		return false;
+
+	std::string::size_type at = ban.mask.find('@');
+	if (at == std::string::npos)
+		return false;
+
+	if (!ban.compiled)
+	{
+		ban.userpart.assign(ban.mask.substr(0, at));
+		ban.hostpart.assign(ban.mask.substr(at + 1));
+		ban.compiled = true;
+	}
+
+	char tomatch[MAXBUF];
+	int len = snprintf(tomatch, MAXBUF, "%s!%s", user->nick.c_str(), user->ident.c_str());
+	if (ban.userpart.Match(tomatch, std::min(len, MAXBUF - 1)))
+	{
+		if (InspIRCd::Match(user->host, ban.hostpart) ||
+			InspIRCd::Match(user->dhost, ban.hostpart) ||
+			InspIRCd::MatchCIDR(user->GetIPString(), ban.hostpart))
+			return true;
+	}
+	return false;
+}
+
 ModResult Channel::GetExtBanStatus(User *user, char type)
 {
 	ModResult rv;
@@ -548,12 +597,12 @@ void Channel::WriteChannel(User* user, const std::string &text)
 		return;
 
 	snprintf(tb,MAXBUF,":%s %s", user->GetFullHost().c_str(), text.c_str());
-	std::string out = tb;
+	reference<SharedLine> out = LocalUser::MakeSharedLine(tb);
 
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(out);
+		if (i->local)
+			i->local->Write(out);
 	}
 }
 
@@ -577,12 +626,12 @@ void Channel::WriteChannelWithServ(const std::string& ServName, const std::strin
 	char tb[MAXBUF];
 
 	snprintf(tb,MAXBUF,":%s %s", ServName.empty() ? ServerInstance->Config->ServerName.c_str() : ServName.c_str(), text.c_str());
-	std::string out = tb;
+	reference<SharedLine> out = LocalUser::MakeSharedLine(tb);
 
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(out);
+		if (i->local)
+			i->local->Write(out);
 	}
 }
 
@@ -625,7 +674,6 @@ void Channel::WriteAllExcept(User* user, bool serversource, char status, CUList
 	char tb[MAXBUF];
 
 	snprintf(tb,MAXBUF,":%s %s", serversource ? ServerInstance->Config->ServerName.c_str() : user->GetFullHost().c_str(), text.c_str());
-	std::string out = tb;
 
 	this->RawWriteAllExcept(user, serversource, status, except_list, std::string(tb));
 }
@@ -639,16 +687,16 @@ void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CULi
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
+	/* Format the line once; every recipient's sendq holds a reference to it */
+	reference<SharedLine> line = LocalUser::MakeSharedLine(out);
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first) && (except_list.find(i->first) == except_list.end()))
-		{
-			/* User doesn't have the status we're after */
-			if (minrank && i->second->GetAccessRank() < minrank)
-				continue;
+		/* User is remote, or doesn't have the status we're after */
+		if (!i->local || i->rank < minrank)
+			continue;
 
-			i->first->Write(out);
-		}
+		if (except_list.empty() || except_list.find(i->local) == except_list.end())
+			i->local->Write(line);
 	}
 }
 
@@ -828,6 +876,16 @@ const char* Channel::GetPrefixChar(User *user)
 	return pf;
 }
 
+void* Membership::operator new(size_t size)
+{
+	return MembershipPool.Allocate(size);
+}
+
+void Membership::operator delete(void* ptr, size_t size)
+{
+	MembershipPool.Deallocate(ptr, size);
+}
+
 unsigned int Membership::GetAccessRank()
 {
 	char mchar = modes.c_str()[0];
@@ -855,6 +913,105 @@ unsigned int Membership::GetProtectRank()
 	return rv;
 }
 
+size_t UserMembList::FindSlot(User* user) const
+{
+	size_t mask = index.size() - 1;
+	size_t slot = Hash(user) & mask;
+	while (index[slot] && entries[index[slot] - 1].first != user)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+void UserMembList::Reindex()
+{
+	if (entries.size() <= INDEX_MIN)
+	{
+		std::vector<unsigned int>().swap(index);
+		return;
+	}
+
+	// Keep the table between a quarter and half full
+	size_t want = 32;
+	while (want < entries.size() * 2)
+		want *= 2;
+	index.assign(want, 0);
+	for (size_t i = 0; i < entries.size(); i++)
+		index[FindSlot(entries[i].first)] = i + 1;
+}
+
+void UserMembList::IndexErase(size_t slot)
+{
+	// Shift later entries of the probe sequence back so that no lookup stops early at the hole
+	size_t mask = index.size() - 1;
+	size_t next = (slot + 1) & mask;
+	while (index[next])
+	{
+		size_t home = Hash(entries[index[next] - 1].first) & mask;
+		// Move the entry into the hole unless its home slot lies cyclically in (slot, next]
+		if (((next - home) & mask) >= ((next - slot) & mask))
+		{
+			index[slot] = index[next];
+			slot = next;
+		}
+		next = (next + 1) & mask;
+	}
+	index[slot] = 0;
+}
+
+UserMembList::iterator UserMembList::find(User* user)
+{
+	if (index.empty())
+	{
+		for (iterator i = entries.begin(); i != entries.end(); ++i)
+			if (i->first == user)
+				return i;
+		return entries.end();
+	}
+	unsigned int pos = index[FindSlot(user)];
+	return pos ? entries.begin() + (pos - 1) : entries.end();
+}
+
+UserMembList::const_iterator UserMembList::find(User* user) const
+{
+	return const_cast<UserMembList*>(this)->find(user);
+}
+
+void UserMembList::insert(User* user, Membership* memb)
+{
+	entries.push_back(UserMembEntry(user, memb, IS_LOCAL(user)));
+	if (index.empty() ? entries.size() > INDEX_MIN : entries.size() * 2 > index.size())
+		Reindex();
+	else if (!index.empty())
+		index[FindSlot(user)] = entries.size();
+}
+
+void UserMembList::erase(iterator i)
+{
+	size_t pos = i - entries.begin();
+	size_t last = entries.size() - 1;
+	if (!index.empty())
+	{
+		IndexErase(FindSlot(i->first));
+		if (pos != last)
+			index[FindSlot(entries[last].first)] = pos + 1;
+	}
+	if (pos != last)
+		entries[pos] = entries[last];
+	entries.pop_back();
+
+	// Give the memory back once a big channel has emptied out
+	if (!index.empty() && entries.size() * 8 < index.size())
+		Reindex();
+	if (entries.capacity() > 64 && entries.size() * 4 < entries.capacity())
+		std::vector<UserMembEntry>(entries).swap(entries);
+}
+
+void UserMembList::clear()
+{
+	std::vector<UserMembEntry>().swap(entries);
+	std::vector<unsigned int>().swap(index);
+}
+
 const char* Channel::GetAllPrefixChars(User* user)
 {
 	static char prefix[64];
@@ -884,6 +1041,8 @@ bool Channel::SetPrefix(User* user, char prefix, bool adding)
 	UserMembIter m = userlist.find(user);
 	if (m == userlist.end())
 		return false;
+	bool changed = adding;
+	bool placed = false;
 	for(unsigned int i=0; i < m->second->modes.length(); i++)
 	{
 		char mchar = m->second->modes[i];
@@ -894,12 +1053,22 @@ bool Channel::SetPrefix(User* user, char prefix, bool adding)
 				m->second->modes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
 				m->second->modes.substr(mchar == prefix ? i+1 : i);
-			return adding != (mchar == prefix);
+			changed = adding != (mchar == prefix);
+			placed = true;
+			break;
 		}
 	}
-	if (adding)
+	if (adding && !placed)
 		m->second->modes += std::string(1, prefix);
-	return adding;
+	/* Keep the rank used by status filtered writes in step with the modes */
+	m->rank = m->second->GetAccessRank();
+	return changed;
+}
+
+void Channel::UpdateRanks()
+{
+	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
+		i->rank = i->second->GetAccessRank();
 }
 
 void Channel::RemoveAllPrefixes(User* user)
@@ -908,6 +1077,7 @@ void Channel::RemoveAllPrefixes(User* user)
 	if (m != userlist.end())
 	{
 		m->second->modes.clear();
+		m->rank = 0;
 	}
 }
 
@@ -933,7 +1103,7 @@ Channel* Channel::Nuke(Channel* old, const std::string& channel, time_t newTS)
 	ServerInstance->Modes->Send(ServerInstance->FakeClient, old, stack);
 
 	// unhook the old channel
-	chan_hash::iterator iter = ServerInstance->chanlist->find(old->name);
+	chan_hash::iterator iter = ServerInstance->chanlist->find(old->namekey);
 	ServerInstance->chanlist->erase(iter);
 
 	// create the new channel (which inserts itself in chanlist)
@@ -959,3 +1129,51 @@ Channel* Channel::Nuke(Channel* old, const std::string& channel, time_t newTS)
 
 	return chan;
 }
+
+void Channel::Absorb(Channel* old)
+{
+	ServerInstance->SNO->WriteToSnoMask('d', "Merging channel %s into %s after casemapping change", old->name.c_str(), this->name.c_str());
+	bool keepstatus = (old->age == this->age);
+
+	for (UserMembIter i = old->userlist.begin(); i != old->userlist.end(); i++)
+	{
+		User* u = i->first;
+		Membership* memb = i->second;
+		std::string modes = keepstatus ? memb->modes : "";
+		u->chans.erase(memb);
+		memb->cull();
+		delete memb;
+
+		if (IS_LOCAL(u))
+			u->WriteFrom(u, "PART %s :Channel merged into %s", old->name.c_str(), this->name.c_str());
+		if (HasUser(u))
+			continue;
+
+		memb = AddUser(u);
+		u->chans.insert(memb);
+		for (std::string::const_iterator x = modes.begin(); x != modes.end(); x++)
+			SetPrefix(u, *x, true);
+		FOREACH_MOD(I_OnPostJoin,OnPostJoin(memb));
+
+		this->WriteChannel(u, "JOIN :%s", this->name.c_str());
+		std::string ms = memb->modes;
+		for (unsigned int m = 0; m < memb->modes.length(); m++)
+			ms.append(" ").append(u->nick);
+		if (!memb->modes.empty())
+			this->WriteAllExceptSender(u, true, 0, "MODE %s +%s", this->name.c_str(), ms.c_str());
+		if (IS_LOCAL(u))
+		{
+			if (this->topicset)
+			{
+				u->WriteNumeric(RPL_TOPIC, "%s %s :%s", u->nick.c_str(), this->name.c_str(), this->topic.c_str());
+				u->WriteNumeric(RPL_TOPICTIME, "%s %s %s %lu", u->nick.c_str(), this->name.c_str(), this->setby.c_str(), (unsigned long)this->topicset);
+			}
+			this->UserList(u);
+		}
+	}
+
+	FOREACH_MOD(I_OnChannelDelete, OnChannelDelete(old));
+	old->userlist.clear();
+	old->cull();
+	delete old;
+}
@@ -87,4 +87,297 @@ bool irc::sockets::MatchCIDR(const std::string &address, const std::string &cidr
 	return mask == mask2;
 }
 
+static inline unsigned int GetBit(const unsigned char* bits, unsigned int n)
+{
+	return (bits[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+/** Number of leading bits which a and b have in common, up to max */
+static unsigned int CommonBits(const unsigned char* a, const unsigned char* b, unsigned int max)
+{
+	for (unsigned int i = 0; i * 8 < max; i++)
+	{
+		unsigned char diff = a[i] ^ b[i];
+		if (diff)
+		{
+			unsigned int n = i * 8;
+			while (!(diff & 0x80))
+			{
+				diff <<= 1;
+				n++;
+			}
+			return std::min(n, max);
+		}
+	}
+	return max;
+}
+
+static irc::sockets::cidr_node* NewNode(const unsigned char* bits, unsigned int length)
+{
+	irc::sockets::cidr_node* n = new irc::sockets::cidr_node;
+	memcpy(n->bits, bits, sizeof(n->bits));
+	n->length = length;
+	n->child[0] = n->child[1] = NULL;
+	n->value = NULL;
+	n->count = n->total = 0;
+	return n;
+}
+
+static void DeleteNodes(irc::sockets::cidr_node* n)
+{
+	if (!n)
+		return;
+	DeleteNodes(n->child[0]);
+	DeleteNodes(n->child[1]);
+	delete n;
+}
+
+/** Append the nodes with a value in the subtrees on the stack to out */
+static void CollectValues(std::vector<irc::sockets::cidr_node*>& stack, std::vector<irc::sockets::cidr_node*>& out)
+{
+	while (!stack.empty())
+	{
+		irc::sockets::cidr_node* n = stack.back();
+		stack.pop_back();
+		if (!n)
+			continue;
+		if (n->value)
+			out.push_back(n);
+		stack.push_back(n->child[0]);
+		stack.push_back(n->child[1]);
+	}
+}
+
+/** Root slot for the address family of a range, or NULL if it is neither IPv4 nor IPv6 */
+static inline irc::sockets::cidr_node* const* RootFor(irc::sockets::cidr_node* const* roots, unsigned char type)
+{
+	if (type == AF_INET)
+		return &roots[0];
+	if (type == AF_INET6)
+		return &roots[1];
+	return NULL;
+}
+
+irc::sockets::cidr_tree_base::cidr_tree_base() : values(0)
+{
+	roots[0] = roots[1] = NULL;
+}
+
+irc::sockets::cidr_tree_base::~cidr_tree_base()
+{
+	Clear();
+}
+
+void irc::sockets::cidr_tree_base::Clear()
+{
+	DeleteNodes(roots[0]);
+	DeleteNodes(roots[1]);
+	roots[0] = roots[1] = NULL;
+	values = 0;
+}
+
+irc::sockets::cidr_node* irc::sockets::cidr_tree_base::Find(const cidr_mask& range) const
+{
+	cidr_node* const* root = RootFor(roots, range.type);
+	cidr_node* n = root ? *root : NULL;
+	while (n && n->length < range.length)
+		n = n->child[GetBit(range.bits, n->length)];
+	if (!n || n->length != range.length || CommonBits(n->bits, range.bits, range.length) != range.length)
+		return NULL;
+	return n;
+}
+
+irc::sockets::cidr_node* irc::sockets::cidr_tree_base::Insert(const cidr_mask& range, unsigned long add)
+{
+	cidr_node** slot = const_cast<cidr_node**>(RootFor(roots, range.type));
+	if (!slot)
+		throw CoreException("Cannot add a range which is not IPv4 or IPv6 to a CIDR tree");
+
+	while (*slot)
+	{
+		cidr_node* n = *slot;
+		unsigned int common = CommonBits(n->bits, range.bits, std::min(n->length, range.length));
+		if (common == n->length)
+		{
+			n->total += add;
+			if (n->length == range.length)
+				return n;
+			slot = &n->child[GetBit(range.bits, n->length)];
+			continue;
+		}
+
+		// The range ends or branches off inside this node's prefix, so a new node goes above it
+		cidr_node* split = NewNode(range.bits, common);
+		split->child[GetBit(n->bits, common)] = n;
+		split->total = n->total + add;
+		*slot = split;
+		if (common == range.length)
+			return split;
+
+		cidr_node* leaf = NewNode(range.bits, range.length);
+		leaf->total = add;
+		split->child[GetBit(range.bits, common)] = leaf;
+		return leaf;
+	}
+	*slot = NewNode(range.bits, range.length);
+	(*slot)->total = add;
+	return *slot;
+}
+
+/** Remove a node which holds nothing and has fewer than two children */
+static void PruneNode(irc::sockets::cidr_node** slot)
+{
+	irc::sockets::cidr_node* n = *slot;
+	if (n->value || n->count || (n->child[0] && n->child[1]))
+		return;
+	*slot = n->child[0] ? n->child[0] : n->child[1];
+	delete n;
+}
+
+void irc::sockets::cidr_tree_base::Prune(const cidr_mask& range)
+{
+	cidr_node** slot = const_cast<cidr_node**>(RootFor(roots, range.type));
+	if (!slot)
+		return;
+	cidr_node** parent = NULL;
+	while (*slot && (*slot)->length < range.length)
+	{
+		parent = slot;
+		slot = &(*slot)->child[GetBit(range.bits, (*slot)->length)];
+	}
+	if (!*slot || (*slot)->length != range.length)
+		return;
+	PruneNode(slot);
+	// The parent may have been a split point which is no longer needed
+	if (parent)
+		PruneNode(parent);
+}
+
+unsigned int irc::sockets::cidr_tree_base::Lookup(const sockaddrs& addr, void** out) const
+{
+	cidr_mask full(addr, 128);
+	cidr_node* const* root = RootFor(roots, full.type);
+	cidr_node* path[129];
+	unsigned int depth = 0;
+	cidr_node* last = NULL;
+	for (cidr_node* n = root ? *root : NULL; n; n = n->child[GetBit(full.bits, n->length)])
+	{
+		last = n;
+		if (n->value)
+			path[depth++] = n;
+		if (n->length == full.length)
+			break;
+	}
+	if (!last)
+		return 0;
+
+	// Every node on the way down holds a prefix of the last one, so the ranges
+	// which contain the address are the ones no longer than the bits they share
+	unsigned int common = CommonBits(last->bits, full.bits, last->length);
+	unsigned int found = 0;
+	for (unsigned int i = 0; i < depth && path[i]->length <= common; i++)
+		out[found++] = path[i]->value;
+	return found;
+}
+
+void irc::sockets::cidr_tree_base::GetValues(std::vector<cidr_node*>& out) const
+{
+	std::vector<cidr_node*> stack(roots, roots + 2);
+	CollectValues(stack, out);
+}
+
+void irc::sockets::cidr_tree_base::GetValues(const cidr_mask& range, std::vector<cidr_node*>& out) const
+{
+	cidr_node* const* root = RootFor(roots, range.type);
+	cidr_node* n = root ? *root : NULL;
+	while (n && n->length < range.length)
+		n = n->child[GetBit(range.bits, n->length)];
+	if (!n || CommonBits(n->bits, range.bits, range.length) != range.length)
+		return;
+	std::vector<cidr_node*> stack(1, n);
+	CollectValues(stack, out);
+}
+
+void irc::sockets::cidr_tree_base::AddCount(const cidr_mask& range, long delta)
+{
+	// Users without an IP address are not counted
+	cidr_node** slot = const_cast<cidr_node**>(RootFor(roots, range.type));
+	if (!slot || !delta)
+		return;
+
+	if (delta > 0)
+	{
+		Insert(range, delta)->count += delta;
+		return;
+	}
+
+	// Find the node, remembering the way down to take the count off the totals above it
+	cidr_node** path[129];
+	unsigned int depth = 0;
+	while (*slot && (*slot)->length < range.length)
+	{
+		path[depth++] = slot;
+		slot = &(*slot)->child[GetBit(range.bits, (*slot)->length)];
+	}
+	cidr_node* target = *slot;
+	if (!target || target->length != range.length || CommonBits(target->bits, range.bits, range.length) != range.length)
+		return;
+
+	// Never take away more than was added
+	unsigned long take = std::min(target->count, static_cast<unsigned long>(-delta));
+	target->count -= take;
+	target->total -= take;
+	for (unsigned int i = 0; i < depth; i++)
+		(*path[i])->total -= take;
+
+	if (!target->count)
+	{
+		PruneNode(slot);
+		if (depth)
+			PruneNode(path[depth - 1]);
+	}
+}
+
+unsigned long irc::sockets::cidr_tree_base::GetCount(const cidr_mask& range) const
+{
+	cidr_node* const* root = RootFor(roots, range.type);
+	cidr_node* n = root ? *root : NULL;
+	// Everything within the range is below the first node at least as long as it. Nodes
+	// share the bits of all nodes above them, so only that node's bits need to be checked.
+	while (n && n->length < range.length)
+		n = n->child[GetBit(range.bits, n->length)];
+	if (!n || CommonBits(n->bits, range.bits, range.length) != range.length)
+		return 0;
+	return n->total;
+}
 
+void irc::sockets::cidr_tree_base::GetCounts(unsigned char type, unsigned char length, std::vector<std::pair<cidr_mask, unsigned long> >& out) const
+{
+	cidr_node* const* root = RootFor(roots, type);
+	length = std::min<unsigned char>(length, type == AF_INET ? 32 : 128);
+	std::vector<cidr_node*> stack(1, root ? *root : NULL);
+	while (!stack.empty())
+	{
+		cidr_node* n = stack.back();
+		stack.pop_back();
+		if (!n)
+			continue;
+		if (n->length < length)
+		{
+			stack.push_back(n->child[1]);
+			stack.push_back(n->child[0]);
+			continue;
+		}
+		if (!n->total)
+			continue;
+
+		cidr_mask range;
+		range.type = type;
+		range.length = length;
+		memset(range.bits, 0, sizeof(range.bits));
+		memcpy(range.bits, n->bits, length / 8);
+		if (length % 8)
+			range.bits[length / 8] = n->bits[length / 8] & inverted_bits[length % 8];
+		out.push_back(std::make_pair(range, n->total));
+	}
+}
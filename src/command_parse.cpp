@@ -173,7 +173,7 @@ bool CommandParser::ProcessCommand(LocalUser *user, const std::string &cmd)
 {
 	CrashState cmd_tracer(HERE_STR, cmd.c_str());
 	std::vector<std::string> command_p;
-	irc::tokenstream tokens(cmd);
+	irc::tokenstream tokens(cmd.data(), cmd.length());
 	std::string command, token;
 	tokens.GetToken(command);
 
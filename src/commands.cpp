@@ -29,11 +29,12 @@ bool InspIRCd::HostMatchesEveryone(const std::string &mask, User* user)
 		return false;
 
 	float itrigger = insane->getFloat("trigger", 95.5);
+	irc::wildmask compiled(mask, ascii_case_insensitive_map);
 
 	for (user_hash::iterator u = this->Users->clientlist->begin(); u != this->Users->clientlist->end(); u++)
 	{
-		if ((InspIRCd::Match(u->second->MakeHost(), mask, ascii_case_insensitive_map)) ||
-		    (InspIRCd::Match(u->second->MakeHostIP(), mask, ascii_case_insensitive_map)))
+		if ((InspIRCd::Match(u->second->MakeHost(), compiled)) ||
+		    (InspIRCd::Match(u->second->MakeHostIP(), compiled)))
 		{
 			matches++;
 		}
@@ -61,10 +62,11 @@ bool InspIRCd::IPMatchesEveryone(const std::string &ip, User* user)
 		return false;
 
 	float itrigger = insane->getFloat("trigger", 95.5);
+	irc::wildmask compiled(ip, ascii_case_insensitive_map);
 
 	for (user_hash::iterator u = this->Users->clientlist->begin(); u != this->Users->clientlist->end(); u++)
 	{
-		if (InspIRCd::Match(u->second->GetIPString(), ip, ascii_case_insensitive_map))
+		if (InspIRCd::Match(u->second->GetIPString(), compiled))
 			matches++;
 	}
 
@@ -90,10 +92,11 @@ bool InspIRCd::NickMatchesEveryone(const std::string &nick, User* user)
 		return false;
 
 	float itrigger = insane->getFloat("trigger", 95.5);
+	irc::wildmask compiled(nick);
 
 	for (user_hash::iterator u = this->Users->clientlist->begin(); u != this->Users->clientlist->end(); u++)
 	{
-		if (InspIRCd::Match(u->second->nick, nick))
+		if (InspIRCd::Match(u->second->nick, compiled))
 			matches++;
 	}
 
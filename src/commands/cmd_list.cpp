@@ -55,6 +55,11 @@ CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User
 		}
 	}
 
+	irc::wildmask mask;
+	bool usemask = (parameters.size() && (parameters[0][0] != '<' && parameters[0][0] != '>'));
+	if (usemask)
+		mask.assign(parameters[0]);
+
 	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); i++)
 	{
 		// attempt to match a glob pattern
@@ -66,9 +71,9 @@ CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User
 		if (too_many || too_few)
 			continue;
 
-		if (parameters.size() && (parameters[0][0] != '<' && parameters[0][0] != '>'))
+		if (usemask)
 		{
-			if (!InspIRCd::Match(i->second->name, parameters[0]) && !InspIRCd::Match(i->second->topic, parameters[0]))
+			if (!InspIRCd::Match(i->second->name, mask) && !InspIRCd::Match(i->second->topic, mask))
 				continue;
 		}
 
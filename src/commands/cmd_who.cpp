@@ -32,6 +32,11 @@ class CommandWho : public Command
 	bool opt_local;
 	bool opt_far;
 	bool opt_time;
+	/** The mask being searched for, compiled once per WHO, with the
+	 * national and the ASCII case mapping
+	 */
+	irc::wildmask mask;
+	irc::wildmask asciimask;
 
  public:
 	/** Constructor for who.
@@ -108,15 +113,15 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 			match = false;
 			const Extensible::ExtensibleStore& list = user->GetExtList();
 			for(Extensible::ExtensibleStore::const_iterator i = list.begin(); i != list.end(); ++i)
-				if (InspIRCd::Match(i->first->name, matchtext))
+				if (InspIRCd::Match(i->first->name, mask))
 					match = true;
 		}
 		else if (opt_realname)
-			match = InspIRCd::Match(user->fullname, matchtext);
+			match = InspIRCd::Match(user->fullname, mask);
 		else if (opt_showrealhost)
-			match = InspIRCd::Match(user->host, matchtext, ascii_case_insensitive_map);
+			match = InspIRCd::Match(user->host, asciimask);
 		else if (opt_ident)
-			match = InspIRCd::Match(user->ident, matchtext, ascii_case_insensitive_map);
+			match = InspIRCd::Match(user->ident, asciimask);
 		else if (opt_port)
 		{
 			irc::portparser portrange(matchtext, false);
@@ -129,7 +134,7 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 				}
 		}
 		else if (opt_away)
-			match = InspIRCd::Match(user->awaymsg, matchtext);
+			match = InspIRCd::Match(user->awaymsg, mask);
 		else if (opt_time)
 		{
 			long seconds = ServerInstance->Duration(matchtext);
@@ -147,14 +152,14 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 		 * -- w00t
 		 */
 		if (!match)
-			match = InspIRCd::Match(user->dhost, matchtext, ascii_case_insensitive_map);
+			match = InspIRCd::Match(user->dhost, asciimask);
 
 		if (!match)
-			match = InspIRCd::Match(user->nick, matchtext);
+			match = InspIRCd::Match(user->nick, mask);
 
 		/* Don't allow server name matches if HideWhoisServer is enabled, unless the command user has the priv */
 		if (!match && (ServerInstance->Config->HideWhoisServer.empty() || cuser->HasPrivPermission("users/auspex")))
-			match = InspIRCd::Match(user->server, matchtext);
+			match = InspIRCd::Match(user->server, mask);
 
 		return match;
 	}
@@ -256,6 +261,9 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 	else
 		strlcpy(matchtext, parameters[0].c_str(), MAXBUF);
 
+	mask.assign(matchtext);
+	asciimask.assign(matchtext, ascii_case_insensitive_map);
+
 	for (const char* check = matchtext; *check; check++)
 	{
 		if (*check == '*' || *check == '?')
@@ -27,8 +27,12 @@ ServerConfig::ServerConfig(RehashReason reason) : status(reason)
 	RawLog = NoUserDns = HideBans = HideSplits = UndernetMsgPrefix = NameOnlyModes = false;
 	WildcardIPv6 = CycleHosts = InvBypassModes = true;
 	dns_timeout = 5;
+	dns_retry = 1;
+	dns_port = 53;
+	dns_cachesize = 16384;
 	MaxTargets = 20;
 	NetBufferSize = 10240;
+	BanCacheSize = 16384;
 	SoftLimit = ServerInstance->SE->GetMaxFds();
 	MaxConn = SOMAXCONN;
 	c_ipv4_range = 32;
@@ -167,24 +171,28 @@ static void FindDNS(std::string& server)
 	if (!server.empty())
 		return;
 
-	// attempt to look up their nameserver from /etc/resolv.conf
-	ServerInstance->Logs->Log("CONFIG",DEFAULT,"WARNING: <dns:server> not defined, attempting to find working server in /etc/resolv.conf...");
+	// attempt to look up their nameservers from /etc/resolv.conf
+	ServerInstance->Logs->Log("CONFIG",DEFAULT,"WARNING: <dns:server> not defined, attempting to find working servers in /etc/resolv.conf...");
 
 	std::ifstream resolv("/etc/resolv.conf");
+	std::string word;
 
-	while (resolv >> server)
+	while (resolv >> word)
 	{
-		if (server == "nameserver")
+		if (word == "nameserver")
 		{
-			resolv >> server;
-			if (server.find_first_not_of("0123456789.") == std::string::npos)
+			resolv >> word;
+			if (word.find_first_not_of("0123456789.") == std::string::npos)
 			{
-				ServerInstance->Logs->Log("CONFIG",DEFAULT,"<dns:server> set to '%s' as first resolver in /etc/resolv.conf.",server.c_str());
-				return;
+				ServerInstance->Logs->Log("CONFIG",DEFAULT,"Using '%s' from /etc/resolv.conf as a nameserver.",word.c_str());
+				server.append(server.empty() ? "" : " ").append(word);
 			}
 		}
 	}
 
+	if (!server.empty())
+		return;
+
 	ServerInstance->Logs->Log("CONFIG",DEFAULT,"/etc/resolv.conf contains no viable nameserver entries! Defaulting to nameserver '127.0.0.1'!");
 	server = "127.0.0.1";
 }
@@ -348,6 +356,48 @@ void ServerConfig::CrossCheckConnectBlocks(ServerConfig* current)
 	}
 }
 
+/** Parse a mask which is an exact CIDR range (no wildcards) into a range. A
+ * leading ident@ is dropped, as connect blocks never match the ident.
+ */
+static bool ParseRange(const std::string& mask, irc::sockets::cidr_mask& range)
+{
+	std::string::size_type at = mask.rfind('@');
+	std::string addr = (at == std::string::npos) ? mask : mask.substr(at + 1);
+	std::string::size_type slash = addr.rfind('/');
+	if (slash == std::string::npos || slash + 1 == addr.length())
+		return false;
+	for (std::string::size_type i = slash + 1; i < addr.length(); i++)
+		if (!isdigit(addr[i]))
+			return false;
+
+	irc::sockets::sockaddrs sa;
+	if (!irc::sockets::aptosa(addr.substr(0, slash), 0, sa))
+		return false;
+	range = irc::sockets::cidr_mask(sa, atoi(addr.c_str() + slash + 1));
+	return true;
+}
+
+void ServerConfig::IndexConnectBlocks()
+{
+	ClassRanges.clear();
+	ClassMasks.clear();
+	ClassMasks.resize(Classes.size());
+	for (unsigned int i = 0; i < Classes.size(); i++)
+	{
+		irc::spacesepstream HostList(Classes[i]->host);
+		std::string h;
+		while (HostList.GetToken(h))
+		{
+			// A range never matches a host (which cannot contain '/') as a plain mask
+			irc::sockets::cidr_mask range;
+			if (ParseRange(h, range))
+				ClassRanges[range].push_back(i);
+			else
+				ClassMasks[i].push_back(irc::wildmask(h));
+		}
+	}
+}
+
 /** Represents a deprecated configuration tag.
  */
 struct Deprecated
@@ -408,7 +458,15 @@ void ServerConfig::Fill()
 	AdminNick = GetTag("admin")->getString("nick", "admin");
 	ModPath = GetTag("path")->getString("moduledir", MOD_PATH);
 	NetBufferSize = GetTag("performance")->getInt("netbuffersize", 10240);
+	IOThreads = GetTag("performance")->getInt("iothreads", 0);
+	LogBuffer = GetTag("performance")->getInt("logbuffer", 1048576);
+	LogOverflowWait = (GetTag("performance")->getString("logoverflow", "drop") == "wait");
+	BanCacheSize = GetTag("bancache")->getInt("size", 16384);
+	BanCacheFile = GetTag("bancache")->getString("file");
 	dns_timeout = GetTag("dns")->getInt("timeout", 5);
+	dns_retry = GetTag("dns")->getInt("retry", 1);
+	dns_port = GetTag("dns")->getInt("port", 53);
+	dns_cachesize = GetTag("dns")->getInt("cachesize", 16384);
 	DisabledDontExist = GetTag("disabled")->getBool("fakenonexistant");
 	UserStats = security->getString("userstats");
 	CustomVersion = security->getString("customversion", Network + " IRCd");
@@ -449,6 +507,13 @@ void ServerConfig::Fill()
 	range(MaxConn, 0, SOMAXCONN, SOMAXCONN, "<performance:somaxconn>");
 	range(MaxTargets, 1, 31, 20, "<security:maxtargets>");
 	range(NetBufferSize, 1024, 65534, 10240, "<performance:netbuffersize>");
+	range(IOThreads, 0, 64, 0, "<performance:iothreads>");
+	range(dns_timeout, 1, 60, 5, "<dns:timeout>");
+	range(dns_retry, 1, dns_timeout, 1, "<dns:retry>");
+	range(dns_port, 1, 65535, 53, "<dns:port>");
+	range(dns_cachesize, 0, 1000000, 16384, "<dns:cachesize>");
+	if (LogBuffer)
+		range(LogBuffer, 65536, 268435456, 1048576, "<performance:logbuffer>");
 	range(WhoWasGroupSize, 0, 10000, 10, "<whowas:groupsize>");
 	range(WhoWasMaxGroups, 0, 1000000, 10240, "<whowas:maxgroups>");
 	range(WhoWasMaxKeep, 3600, INT_MAX, 3600, "<whowas:maxkeep>");
@@ -459,7 +524,10 @@ void ServerConfig::Fill()
 			ServerName = hostname;
 	}
 
-	ValidIP(DNSServer, "<dns:server>");
+	irc::spacesepstream dnsservers(DNSServer);
+	std::string dnsserver;
+	while (dnsservers.GetToken(dnsserver))
+		ValidIP(dnsserver, "<dns:server>");
 	ValidHost(ServerName, "<server:name>");
 	if (!sid.empty() && !ServerInstance->IsSID(sid))
 		throw CoreException(sid + " is not a valid server ID. A server ID must be 3 characters long, with the first character a digit and the next two characters a digit or letter.");
@@ -482,7 +550,19 @@ void ServerConfig::Fill()
 		else
 			ServerInstance->SE->Close(socktest);
 	}
-	ConfigTagList tags = GetTags("uline");
+	ConfigTagList tags = GetTags("threadpool");
+	for(ConfigIter i = tags.first; i != tags.second; ++i)
+	{
+		ConfigTag* tag = i->second;
+		std::string name;
+		if (!tag->readString("name", name))
+			throw CoreException("<threadpool> tag missing name at " + tag->getTagLocation());
+		int threads = tag->getInt("threads", 1);
+		range(threads, 1, 64, 1, "<threadpool:threads>");
+		ThreadPools[name] = threads;
+	}
+
+	tags = GetTags("uline");
 	for(ConfigIter i = tags.first; i != tags.second; ++i)
 	{
 		ConfigTag* tag = i->second;
@@ -578,6 +658,7 @@ void ServerConfig::Apply(ServerConfig* old, const std::string& TheUserUID)
 			// Handle special items
 			CrossCheckOperClassType();
 			CrossCheckConnectBlocks(old);
+			IndexConnectBlocks();
 		}
 		catch (CoreException &ce)
 		{
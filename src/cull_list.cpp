@@ -13,6 +13,7 @@
 
 #include "inspircd.h"
 #include "cull_list.h"
+#include "slab.h"
 #include <typeinfo>
 
 void CullList::Apply()
@@ -60,6 +61,8 @@ void CullList::Apply()
 		ServerInstance->Logs->Log("CULLLIST",DEBUG, "WARNING: Objects added to cull list in a destructor");
 		Apply();
 	}
+	/* The objects deleted above went back to their slabs; unmap any slabs that are now empty */
+	SlabPool::ReleaseEmpty();
 }
 
 void ActionList::Run()
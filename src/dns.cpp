@@ -34,8 +34,13 @@ looks like this, walks like this or tastes like this.
 #include "inspircd.h"
 #include "dns.h"
 #include "timer.h"
+#include "inspsocket.h"
+#include "cull_list.h"
 
 #define DN_COMP_BITMASK	0xC000		/* highest 6 bits in a DN label header */
+#define DNS_MAX_PACKET	4096		/* largest reply accepted over TCP; UDP replies are at most 512 bytes */
+#define DNS_QUERY_SOA	6		/* only looked for in the authority section of negative answers */
+#define MAX_NEGATIVE_TTL	10800	/* RFC 2308 suggests negative answers are cached for at most one to three hours */
 
 /** Masks to mask off the responses we get from the DNSRequest methods
  */
@@ -81,24 +86,87 @@ class DNSHeader
 	unsigned int	ancount;	/* Answer count */
 	unsigned int	nscount;	/* Nameserver count */
 	unsigned int	arcount;
-	unsigned char	payload[512];	/* Packet payload */
+	unsigned char	payload[DNS_MAX_PACKET - 12];	/* Packet payload */
 };
 
+class RequestTimeout;
+class DNSTCPSocket;
+
 class DNSRequest
 {
  public:
 	unsigned char   id[2];		/* Request id */
-	unsigned char*  res;		/* Result processing buffer */
+	unsigned char   res[1024];	/* Result processing buffer */
 	unsigned int    rr_class;       /* Request class */
 	QueryType       type;		/* Request type */
 	DNS*            dnsobj;		/* DNS caller (where we get our FD from) */
-	unsigned long	ttl;		/* Time to live */
+	unsigned long	ttl;		/* Time to live, or for a negative answer the time to cache it for */
 	std::string     orig;		/* Original requested name/ip */
+	irc::string	key;		/* Key in the cache and in the requests in flight */
+	std::string	packet;		/* The query as sent, for sending it again */
+	irc::sockets::sockaddrs server;	/* The server it was last sent to */
+	unsigned int	failed;		/* Number of servers which answered with a failure */
+	uint64_t	deadline;	/* When to give up, in milliseconds */
+	bool		negative;	/* The answer says the name or record does not exist */
+	RequestTimeout*	timer;		/* Sends the query again, and times it out */
+	DNSTCPSocket*	tcp;		/* The connection asking again over TCP, if the answer was truncated */
 
 	DNSRequest(DNS* dns, int id, const std::string &original);
 	~DNSRequest();
 	DNSInfo ResultIsReady(DNSHeader &h, unsigned length);
+	void NegativeAnswer(const DNSHeader &h, unsigned length);
 	int SendRequests(const DNSHeader *header, const int length, QueryType qt);
+	int Resend();
+	bool NextServer();
+	bool StartTCP();
+};
+
+/** Asks a nameserver again over TCP, for an answer which was too large for UDP */
+class DNSTCPSocket : public BufferedSocket
+{
+ public:
+	/** The request, or -1 once the request has gone */
+	int id;
+
+	DNSTCPSocket(int rid, const irc::sockets::sockaddrs& server, const std::string& packet) : id(rid)
+	{
+		irc::sockets::sockaddrs bind;
+		memset(&bind, 0, sizeof(bind));
+		if (BeginConnect(server, bind, ServerInstance->Config->dns_timeout) != I_ERR_NONE)
+		{
+			state = I_ERROR;
+			return;
+		}
+		// Over TCP, each message is preceded by its length
+		std::string query;
+		query.push_back(packet.length() >> 8);
+		query.push_back(packet.length() & 0xFF);
+		query.append(packet);
+		WriteData(query);
+	}
+
+	void OnDataReady()
+	{
+		if (id == -1 || recvq.length() - recvq_pos < 2)
+			return;
+		const unsigned char* data = (const unsigned char*)recvq.data() + recvq_pos;
+		unsigned int length = (data[0] << 8) + data[1];
+		if (length > DNS_MAX_PACKET)
+		{
+			ServerInstance->Res->FailRequest(id, RESOLVER_NSDOWN, "Reply over TCP is too large");
+			return;
+		}
+		if (recvq.length() - recvq_pos < length + 2)
+			return;
+		DNSResult result = ServerInstance->Res->ProcessReply(data + 2, length);
+		ServerInstance->Res->DeliverResult(result);
+	}
+
+	void OnError(BufferedSocketError)
+	{
+		if (id != -1)
+			ServerInstance->Res->FailRequest(id, RESOLVER_NSDOWN, "TCP connection to nameserver failed: " + getError());
+	}
 };
 
 class CacheTimer : public Timer
@@ -115,38 +183,50 @@ class CacheTimer : public Timer
 	}
 };
 
+/** Sends an unanswered query again, to the next nameserver, every <dns:retry>
+ * seconds, and times the request out after <dns:timeout> seconds.
+ * This belongs to the request, which deletes it.
+ */
 class RequestTimeout : public Timer
 {
 	DNSRequest* watch;
 	int watchid;
  public:
-	RequestTimeout(unsigned long n, DNSRequest* watching, int id) : Timer(n, ServerInstance->Time()), watch(watching), watchid(id)
+	RequestTimeout(unsigned long ms, DNSRequest* watching, int id, bool repeating)
+		: Timer(0, ServerInstance->Time(), repeating), watch(watching), watchid(id)
 	{
-	}
-	~RequestTimeout()
-	{
-		if (ServerInstance->Res)
-			Tick(0);
+		SetInterval(ms);
 	}
 
 	void Tick(time_t)
 	{
-		if (ServerInstance->Res->requests[watchid] == watch)
+		DNS* dns = ServerInstance->Res;
+		uint64_t now = ServerInstance->Time_ms();
+		if (now < watch->deadline)
 		{
-			/* Still exists, whack it */
-			if (ServerInstance->Res->Classes[watchid])
+			// A connection over TCP has its own timeout
+			if (!watch->tcp && watch->NextServer())
+			{
+				dns->retries++;
+				ServerInstance->Logs->Log("RESOLVER", DEBUG, "Request %d not answered, sending it to %s", watchid, watch->server.str().c_str());
+				watch->Resend();
+			}
+			// Give up at the deadline itself rather than at the first retry after it
+			if (now + GetInterval() > watch->deadline)
 			{
-				ServerInstance->Res->Classes[watchid]->OnError(RESOLVER_TIMEOUT, "Request timed out");
-				delete ServerInstance->Res->Classes[watchid];
-				ServerInstance->Res->Classes[watchid] = NULL;
+				CancelRepeat();
+				watch->timer = new RequestTimeout(watch->deadline - now, watch, watchid, false);
+				ServerInstance->Timers->AddTimer(watch->timer);
 			}
-			ServerInstance->Res->requests[watchid] = NULL;
-			delete watch;
+			return;
 		}
+		CancelRepeat();
+		watch->timer = NULL;
+		dns->FailRequest(watchid, RESOLVER_TIMEOUT, "Request timed out");
 	}
 };
 
-CachedQuery::CachedQuery(const std::string &res, unsigned int ttl) : data(res)
+CachedQuery::CachedQuery(const std::string &res, unsigned int ttl, bool neg) : data(res), negative(neg)
 {
 	expires = ServerInstance->Time() + ttl;
 }
@@ -157,23 +237,28 @@ int CachedQuery::CalcTTLRemaining()
 	return (n < 0 ? 0 : n);
 }
 
-/* Allocate the processing buffer */
-DNSRequest::DNSRequest(DNS* dns, int rid, const std::string &original) : dnsobj(dns)
+DNSRequest::DNSRequest(DNS* dns, int rid, const std::string &original)
+	: dnsobj(dns), server(dns->servers[dns->currserver]), failed(0), negative(false), tcp(NULL)
 {
-	/* hardening against overflow here:  make our work buffer twice the theoretical
-	 * maximum size so that hostile input doesn't screw us over.
-	 */
-	res = new unsigned char[sizeof(DNSHeader) * 2];
 	*res = 0;
 	orig = original;
-	RequestTimeout* RT = new RequestTimeout(ServerInstance->Config->dns_timeout ? ServerInstance->Config->dns_timeout : 5, this, rid);
-	ServerInstance->Timers->AddTimer(RT); /* The timer manager frees this */
+	unsigned long timeout = (ServerInstance->Config->dns_timeout ? ServerInstance->Config->dns_timeout : 5) * 1000;
+	unsigned long retry = ServerInstance->Config->dns_retry * 1000;
+	deadline = ServerInstance->Time_ms() + timeout;
+	timer = new RequestTimeout(std::min(retry, timeout), this, rid, retry < timeout);
+	ServerInstance->Timers->AddTimer(timer);
 }
 
-/* Deallocate the processing buffer */
 DNSRequest::~DNSRequest()
 {
-	delete[] res;
+	if (timer)
+		ServerInstance->Timers->DelTimer(timer);
+	if (tcp)
+	{
+		tcp->id = -1;
+		tcp->Close();
+		ServerInstance->GlobalCulls->AddItem(tcp);
+	}
 }
 
 /** Fill a ResourceRecord class based on raw data input */
@@ -228,14 +313,60 @@ int DNSRequest::SendRequests(const DNSHeader *header, const int length, QueryTyp
 	this->type = qt;
 
 	DNS::EmptyHeader(payload,header,length);
+	packet.assign((const char*)payload, length + 12);
 
-	if (ServerInstance->SE->SendTo(dnsobj, payload, length + 12, 0, &(dnsobj->myserver.sa), sa_size(dnsobj->myserver)) != length+12)
+	if (Resend() == -1)
 		return -1;
 
 	ServerInstance->Logs->Log("RESOLVER",DEBUG,"Sent OK");
 	return 0;
 }
 
+/** Send the query to the current server */
+int DNSRequest::Resend()
+{
+	if (ServerInstance->SE->SendTo(dnsobj, packet.data(), packet.length(), 0, &server.sa, sa_size(server)) != (int)packet.length())
+		return -1;
+	return 0;
+}
+
+/** Move on to the server after the one the query was last sent to
+ * @return False if there are no servers left to send it to
+ */
+bool DNSRequest::NextServer()
+{
+	const std::vector<irc::sockets::sockaddrs>& servers = dnsobj->servers;
+	if (servers.empty())
+		return false;
+
+	/* A rehash may have changed the list since the query was sent */
+	std::vector<irc::sockets::sockaddrs>::const_iterator last = std::find(servers.begin(), servers.end(), server);
+	if (last == servers.end())
+	{
+		server = servers[dnsobj->currserver];
+		return true;
+	}
+
+	unsigned int index = last - servers.begin();
+	unsigned int next = (index + 1) % servers.size();
+	if (dnsobj->currserver == index)
+		dnsobj->currserver = next;
+	server = servers[next];
+	return true;
+}
+
+/** Ask the same server again over TCP */
+bool DNSRequest::StartTCP()
+{
+	tcp = new DNSTCPSocket((id[0] << 8) + id[1], server, packet);
+	if (tcp->state != I_ERROR)
+		return true;
+	tcp->Close();
+	ServerInstance->GlobalCulls->AddItem(tcp);
+	tcp = NULL;
+	return false;
+}
+
 /** Add a query with a predefined header, and allocate an ID for it. */
 DNSRequest* DNS::AddQuery(DNSHeader *header, int &id, const char* original)
 {
@@ -271,28 +402,70 @@ DNSRequest* DNS::AddQuery(DNSHeader *header, int &id, const char* original)
 int DNS::ClearCache()
 {
 	/* This ensures the buckets are reset to sane levels */
-	int rv = this->cache->size();
-	delete this->cache;
-	this->cache = new dnscache();
+	int rv = this->cache.size();
+	dnscache().swap(this->cache);
+	this->cachelist.clear();
 	return rv;
 }
 
 int DNS::PruneCache()
 {
 	int n = 0;
-	dnscache* newcache = new dnscache();
-	for (dnscache::iterator i = this->cache->begin(); i != this->cache->end(); i++)
-		/* Dont include expired items (theres no point) */
+	for (dnscachelist::iterator i = this->cachelist.begin(); i != this->cachelist.end(); )
+	{
+		/* Dont keep expired items (theres no point) */
 		if (i->second.CalcTTLRemaining())
-			newcache->insert(*i);
-		else
-			n++;
-
-	delete this->cache;
-	this->cache = newcache;
+		{
+			i++;
+			continue;
+		}
+		this->cache.erase(i->first);
+		i = this->cachelist.erase(i);
+		n++;
+	}
 	return n;
 }
 
+irc::string DNS::MakeKey(QueryType qt, const std::string& source)
+{
+	if (qt == DNS_QUERY_PTR4 || qt == DNS_QUERY_PTR6)
+		qt = DNS_QUERY_PTR;
+	return irc::string(ConvToStr((int)qt) + " " + source);
+}
+
+void DNS::AddCache(const irc::string& key, const CachedQuery& item)
+{
+	dnscache::iterator i = this->cache.find(key);
+	if (i != this->cache.end())
+	{
+		this->cachelist.erase(i->second);
+		this->cache.erase(i);
+	}
+	if (!ServerInstance->Config->dns_cachesize)
+		return;
+	while (this->cache.size() >= ServerInstance->Config->dns_cachesize)
+	{
+		this->cache.erase(this->cachelist.back().first);
+		this->cachelist.pop_back();
+		evictions++;
+	}
+	this->cachelist.push_front(std::make_pair(key, item));
+	this->cache[key] = this->cachelist.begin();
+}
+
+int DNS::FindRequest(QueryType qt, const std::string& source)
+{
+	std::map<irc::string, int>::iterator i = inflight.find(MakeKey(qt, source));
+	return (i == inflight.end() ? -1 : i->second);
+}
+
+std::string DNS::GetStats()
+{
+	return "dns cache " + ConvToStr(cache.size()) + " entries (max " + ConvToStr(ServerInstance->Config->dns_cachesize) + ") hits " + ConvToStr(cachehits) +
+		" negative hits " + ConvToStr(negativehits) + " misses " + ConvToStr(cachemisses) + " evictions " + ConvToStr(evictions) +
+		"; queries retried " + ConvToStr(retries) + " over tcp " + ConvToStr(tcpretries) + " shared " + ConvToStr(shared);
+}
+
 void DNS::Rehash()
 {
 	if (this->GetFd() > -1)
@@ -305,16 +478,39 @@ void DNS::Rehash()
 		/* Rehash the cache */
 		this->PruneCache();
 	}
-	else
+
+	/* Every server is reached through the same socket, so they must all be of the same address family */
+	servers.clear();
+	currserver = 0;
+	irc::spacesepstream serverlist(ServerInstance->Config->DNSServer);
+	std::string address;
+	while (serverlist.GetToken(address))
+	{
+		irc::sockets::sockaddrs server;
+		if (!irc::sockets::aptosa(address, ServerInstance->Config->dns_port, server))
+			continue;
+		if (!servers.empty() && server.sa.sa_family != servers[0].sa.sa_family)
+		{
+			ServerInstance->Logs->Log("RESOLVER",DEFAULT,"Not using nameserver %s, as it is not of the same address family as %s", address.c_str(), servers[0].addr().c_str());
+			continue;
+		}
+		servers.push_back(server);
+	}
+	if (servers.empty())
 	{
-		/* Create initial dns cache */
-		this->cache = new dnscache();
+		ServerInstance->Logs->Log("RESOLVER",SPARSE,"No usable nameservers - hostnames will NOT resolve");
+		return;
 	}
 
-	irc::sockets::aptosa(ServerInstance->Config->DNSServer, DNS::QUERY_PORT, myserver);
+	/* Evict whatever no longer fits if the cache was made smaller */
+	while (this->cache.size() > ServerInstance->Config->dns_cachesize)
+	{
+		this->cache.erase(this->cachelist.back().first);
+		this->cachelist.pop_back();
+	}
 
 	/* Initialize mastersocket */
-	int s = socket(myserver.sa.sa_family, SOCK_DGRAM, 0);
+	int s = socket(servers[0].sa.sa_family, SOCK_DGRAM, 0);
 	this->SetFd(s);
 
 	/* Have we got a socket and is it nonblocking? */
@@ -324,7 +520,7 @@ void DNS::Rehash()
 		ServerInstance->SE->NonBlocking(s);
 		irc::sockets::sockaddrs bindto;
 		memset(&bindto, 0, sizeof(bindto));
-		bindto.sa.sa_family = myserver.sa.sa_family;
+		bindto.sa.sa_family = servers[0].sa.sa_family;
 		if (ServerInstance->SE->Bind(this->GetFd(), bindto) < 0)
 		{
 			/* Failed to bind */
@@ -361,9 +557,9 @@ DNS::DNS()
 	 */
 	currid = 0;
 
-	/* DNS::Rehash() sets this to a valid ptr
-	 */
-	this->cache = NULL;
+	currserver = 0;
+	cachehits = negativehits = cachemisses = evictions = 0;
+	retries = tcpretries = shared = 0;
 
 	/* Again, DNS::Rehash() sets this to a
 	 * valid value
@@ -416,67 +612,61 @@ int DNS::MakePayload(const char * const name, const QueryType rr, const unsigned
 	return payloadpos + 4;
 }
 
-/** Start lookup of an hostname to an IP address */
-int DNS::GetIP(const char *name)
+/** Build, add and send a query, returning its id */
+int DNS::SendQuery(const char* name, QueryType qt, const char* original)
 {
 	DNSHeader h;
 	int id;
 	int length;
 
-	if ((length = this->MakePayload(name, DNS_QUERY_A, 1, (unsigned char*)&h.payload)) == -1)
+	if ((length = this->MakePayload(name, qt, 1, (unsigned char*)&h.payload)) == -1)
+	{
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"DNS::SendQuery can't query '%s' because it's too long", name);
 		return -1;
+	}
 
-	DNSRequest* req = this->AddQuery(&h, id, name);
+	DNSRequest* req = this->AddQuery(&h, id, original);
+	if (!req)
+	{
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"DNS::SendQuery can't add query (resolver down?)");
+		return -1;
+	}
 
-	if ((!req) || (req->SendRequests(&h, length, DNS_QUERY_A) == -1))
+	if (req->SendRequests(&h, length, qt) == -1)
+	{
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"DNS::SendQuery can't send (firewall?)");
+		requests[id] = NULL;
+		delete req;
 		return -1;
+	}
 
+	req->key = MakeKey(qt, original);
+	inflight[req->key] = id;
 	return id;
 }
 
+/** Start lookup of an hostname to an IP address */
+int DNS::GetIP(const char *name)
+{
+	return SendQuery(name, DNS_QUERY_A, name);
+}
+
 /** Start lookup of an hostname to an IPv6 address */
 int DNS::GetIP6(const char *name)
 {
-	DNSHeader h;
-	int id;
-	int length;
-
-	if ((length = this->MakePayload(name, DNS_QUERY_AAAA, 1, (unsigned char*)&h.payload)) == -1)
-		return -1;
-
-	DNSRequest* req = this->AddQuery(&h, id, name);
-
-	if ((!req) || (req->SendRequests(&h, length, DNS_QUERY_AAAA) == -1))
-		return -1;
-
-	return id;
+	return SendQuery(name, DNS_QUERY_AAAA, name);
 }
 
 /** Start lookup of a cname to another name */
 int DNS::GetCName(const char *alias)
 {
-	DNSHeader h;
-	int id;
-	int length;
-
-	if ((length = this->MakePayload(alias, DNS_QUERY_CNAME, 1, (unsigned char*)&h.payload)) == -1)
-		return -1;
-
-	DNSRequest* req = this->AddQuery(&h, id, alias);
-
-	if ((!req) || (req->SendRequests(&h, length, DNS_QUERY_CNAME) == -1))
-		return -1;
-
-	return id;
+	return SendQuery(alias, DNS_QUERY_CNAME, alias);
 }
 
 /** Start lookup of an IP address to a hostname */
 int DNS::GetNameForce(const char *ip, ForceProtocol fp)
 {
 	char query[128];
-	DNSHeader h;
-	int id;
-	int length;
 
 	if (fp == PROTOCOL_IPV6)
 	{
@@ -508,28 +698,7 @@ int DNS::GetNameForce(const char *ip, ForceProtocol fp)
 		}
 	}
 
-	length = this->MakePayload(query, DNS_QUERY_PTR, 1, (unsigned char*)&h.payload);
-	if (length == -1)
-	{
-		ServerInstance->Logs->Log("RESOLVER",DEBUG,"DNS::GetNameForce can't query '%s' using '%s' because it's too long", ip, query);
-		return -1;
-	}
-
-	DNSRequest* req = this->AddQuery(&h, id, ip);
-
-	if (!req)
-	{
-		ServerInstance->Logs->Log("RESOLVER",DEBUG,"DNS::GetNameForce can't add query (resolver down?)");
-		return -1;
-	}
-
-	if (req->SendRequests(&h, length, DNS_QUERY_PTR) == -1)
-	{
-		ServerInstance->Logs->Log("RESOLVER",DEBUG,"DNS::GetNameForce can't send (firewall?)");
-		return -1;
-	}
-
-	return id;
+	return SendQuery(query, DNS_QUERY_PTR, ip);
 }
 
 /** Build an ipv6 reverse domain from an in6_addr
@@ -554,8 +723,6 @@ void DNS::MakeIP6Int(char* query, const in6_addr *ip)
 DNSResult DNS::GetResult()
 {
 	/* Fetch dns query response and decide where it belongs */
-	DNSHeader header;
-	DNSRequest *req;
 	unsigned char buffer[sizeof(DNSHeader)];
 	irc::sockets::sockaddrs from;
 	memset(&from, 0, sizeof(from));
@@ -572,21 +739,32 @@ DNSResult DNS::GetResult()
 	}
 
 	/* Check wether the reply came from a different DNS
-	 * server to the one we sent it to, or the source-port
-	 * is not 53.
+	 * server to the ones we send to, or the source-port
+	 * is not the one we send to.
 	 * A user could in theory still spoof dns packets anyway
 	 * but this is less trivial than just sending garbage
 	 * to the server, which is possible without this check.
 	 *
 	 * -- Thanks jilles for pointing this one out.
 	 */
-	if (from != myserver)
+	if (std::find(servers.begin(), servers.end(), from) == servers.end())
 	{
-		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' != '%s'",
-			from.str().c_str(), myserver.str().c_str());
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s'",
+			from.str().c_str());
 		return DNSResult(-1,"",0,"");
 	}
 
+	return ProcessReply(buffer, length);
+}
+
+DNSResult DNS::ProcessReply(const unsigned char* buffer, int length)
+{
+	DNSHeader header;
+	DNSRequest *req;
+
+	if (length < 12)
+		return DNSResult(-1,"",0,"");
+
 	/* Put the read header info into a header class */
 	DNS::FillHeader(&header,buffer,length - 12);
 
@@ -597,19 +775,40 @@ DNSResult DNS::GetResult()
 	unsigned long this_id = header.id[1] + (header.id[0] << 8);
 
 	/* Do we have a pending request matching this id? */
-	if (!requests[this_id])
+	if (this_id >= (unsigned long)MAX_REQUEST_ID || !requests[this_id])
 	{
 		/* Somehow we got a DNS response for a request we never made... */
 		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Hmm, got a result that we didn't ask for (id=%lx). Ignoring.", this_id);
 		return DNSResult(-1,"",0,"");
 	}
-	else
+	req = requests[this_id];
+
+	/* The answer did not fit into a UDP packet, so ask again over TCP */
+	if ((header.flags1 & FLAGS_MASK_TC) && !req->tcp)
 	{
-		/* Remove the query from the list of pending queries */
-		req = requests[this_id];
-		requests[this_id] = NULL;
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Reply to request %lu was truncated, asking again over TCP", this_id);
+		if (req->StartTCP())
+		{
+			tcpretries++;
+			return DNSResult(-1,"",0,"");
+		}
+		/* Otherwise make do with what did fit */
+	}
+
+	/* SERVFAIL, NOTIMP and REFUSED are problems with the server rather than answers, so try another one */
+	unsigned int rcode = header.flags2 & FLAGS_MASK_RCODE;
+	if ((rcode == 2 || rcode == 4 || rcode == 5) && !req->tcp && ++req->failed < servers.size() && req->NextServer())
+	{
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Nameserver failed request %lu (rcode %u), sending it to %s", this_id, rcode, req->server.str().c_str());
+		retries++;
+		req->Resend();
+		return DNSResult(-1,"",0,"");
 	}
 
+	/* Remove the query from the list of pending queries */
+	requests[this_id] = NULL;
+	inflight.erase(req->key);
+
 	/* Inform the DNSRequest class that it has a result to be read.
 	 * When its finished it will return a DNSInfo which is a pair of
 	 * unsigned char* resource record data, and an error message.
@@ -625,7 +824,11 @@ DNSResult DNS::GetResult()
 		 * the dns_deal_with_classes() function knows that its
 		 * an error response and needs to be treated uniquely.
 		 * Put the error message in the second field.
+		 * An answer that the name or record does not exist
+		 * is cached for as long as the zone's SOA allows.
 		 */
+		if (req->negative)
+			AddCache(req->key, CachedQuery(data.second, req->ttl, true));
 		std::string ro = req->orig;
 		delete req;
 		return DNSResult(this_id | ERROR_MASK, data.second, 0, ro);
@@ -682,6 +885,8 @@ DNSResult DNS::GetResult()
 			break;
 		}
 
+		AddCache(req->key, CachedQuery(resultstr, ttl));
+
 		/* Build the reply with the id and hostname/ip in it */
 		std::string ro = req->orig;
 		delete req;
@@ -711,10 +916,18 @@ DNSInfo DNSRequest::ResultIsReady(DNSHeader &header, unsigned length)
 		return std::make_pair((unsigned char*)NULL,"Unexpected value in DNS reply packet");
 
 	if (header.flags2 & FLAGS_MASK_RCODE)
+	{
+		/* NXDOMAIN */
+		if ((header.flags2 & FLAGS_MASK_RCODE) == 3)
+			NegativeAnswer(header, length - 12);
 		return std::make_pair((unsigned char*)NULL,"Domain name not found");
+	}
 
 	if (header.ancount < 1)
+	{
+		NegativeAnswer(header, length - 12);
 		return std::make_pair((unsigned char*)NULL,"No resource records returned");
+	}
 
 	/* Subtract the length of the header from the length of the packet */
 	length -= 12;
@@ -780,7 +993,10 @@ DNSInfo DNSRequest::ResultIsReady(DNSHeader &header, unsigned length)
 		break;
 	}
 	if ((unsigned int)curanswer == header.ancount)
+	{
+		NegativeAnswer(header, length);
 		return std::make_pair((unsigned char*)NULL,"No A, AAAA or PTR type answers (" + ConvToStr(header.ancount) + " answers)");
+	}
 
 	if (i + rr.rdlength > (unsigned int)length)
 		return std::make_pair((unsigned char*)NULL,"Resource record larger than stated");
@@ -836,7 +1052,7 @@ DNSInfo DNSRequest::ResultIsReady(DNSHeader &header, unsigned length)
 						if (o != 0)
 							res[o++] = '.';
 
-						if (o + header.payload[i] > sizeof(DNSHeader))
+						if (o + header.payload[i] >= sizeof(res))
 							return std::make_pair((unsigned char *) NULL, "DN label decompression is impossible -- malformed/hostile packet?");
 
 						memcpy(&res[o], &header.payload[i + 1], header.payload[i]);
@@ -869,55 +1085,139 @@ DNSInfo DNSRequest::ResultIsReady(DNSHeader &header, unsigned length)
 	return std::make_pair(res,"No error");
 }
 
+/** Skip over a name, which may be compressed, in a reply */
+static bool SkipName(const unsigned char* payload, unsigned int length, unsigned int& i)
+{
+	while (i < length)
+	{
+		if (payload[i] == 0)
+		{
+			i++;
+			return true;
+		}
+		if ((payload[i] & 0xC0) == 0xC0)
+		{
+			i += 2;
+			return (i <= length);
+		}
+		i += payload[i] + 1;
+	}
+	return false;
+}
+
+/** The answer says the name, or a record of the type asked for, does not exist.
+ * Such an answer may be cached if it comes with the SOA of the zone, for
+ * the lower of the SOA's TTL and its minimum field (RFC 2308).
+ */
+void DNSRequest::NegativeAnswer(const DNSHeader &header, unsigned length)
+{
+	unsigned int i = 0;
+	for (unsigned int q = 0; q < header.qdcount; q++)
+	{
+		if (!SkipName(header.payload, length, i))
+			return;
+		i += 4;
+	}
+
+	/* The SOA is in the authority section, after any answers (such as a CNAME) */
+	for (unsigned int n = 0; n < header.ancount + header.nscount; n++)
+	{
+		ResourceRecord rr;
+		if (!SkipName(header.payload, length, i) || i + 10 > length)
+			return;
+		DNS::FillResourceRecord(&rr, &header.payload[i]);
+		i += 10;
+		if (i + rr.rdlength > length)
+			return;
+		if (n >= header.ancount && rr.type == DNS_QUERY_SOA && rr.rdlength >= 22)
+		{
+			const unsigned char* m = &header.payload[i + rr.rdlength - 4];
+			unsigned long minimum = ((unsigned long)m[0] << 24) + (m[1] << 16) + (m[2] << 8) + m[3];
+			this->negative = true;
+			this->ttl = std::min(std::min(rr.ttl, minimum), (unsigned long)MAX_NEGATIVE_TTL);
+			return;
+		}
+		i += rr.rdlength;
+	}
+}
+
 /** Close the master socket */
 DNS::~DNS()
 {
+	for (int i = 0; i < MAX_REQUEST_ID; i++)
+		delete requests[i];
 	ServerInstance->SE->Shutdown(this, 2);
 	ServerInstance->SE->Close(this);
 	ServerInstance->Timers->DelTimer(this->PruneTimer);
-	delete cache;
 }
 
-CachedQuery* DNS::GetCache(const std::string &source)
+CachedQuery* DNS::GetCache(QueryType qt, const std::string &source)
 {
-	dnscache::iterator x = cache->find(source.c_str());
-	if (x != cache->end())
-		return &(x->second);
-	else
+	dnscache::iterator x = cache.find(MakeKey(qt, source));
+	if (x == cache.end())
 		return NULL;
+	/* Move it to the front, as the most recently used */
+	cachelist.splice(cachelist.begin(), cachelist, x->second);
+	return &(x->second->second);
 }
 
-void DNS::DelCache(const std::string &source)
+void DNS::DelCache(QueryType qt, const std::string &source)
 {
-	cache->erase(source.c_str());
+	dnscache::iterator x = cache.find(MakeKey(qt, source));
+	if (x == cache.end())
+		return;
+	cachelist.erase(x->second);
+	cache.erase(x);
 }
 
 void Resolver::TriggerCachedResult()
 {
-	if (CQ)
+	if (!CQ)
+		return;
+	if (CQ->negative)
+		OnError(RESOLVER_NXDOMAIN, CQ->data);
+	else
 		OnLookupComplete(CQ->data, time_left, true);
 }
 
 /** High level abstraction of dns used by application at large */
-Resolver::Resolver(const std::string &source, QueryType qt, bool &cached, Module* creator) : Creator(creator), input(source), querytype(qt)
+Resolver::Resolver(const std::string &source, QueryType qt, bool &cached, Module* creator) : Creator(creator), input(source), querytype(qt), next(NULL)
 {
 	ServerInstance->Logs->Log("RESOLVER",DEBUG,"Resolver::Resolver");
 	cached = false;
+	DNS* dns = ServerInstance->Res;
 
-	CQ = ServerInstance->Res->GetCache(source);
+	CQ = dns->GetCache(qt, source);
 	if (CQ)
 	{
 		time_left = CQ->CalcTTLRemaining();
 		if (!time_left)
 		{
-			ServerInstance->Res->DelCache(source);
+			dns->DelCache(qt, source);
+			CQ = NULL;
 		}
 		else
 		{
+			if (CQ->negative)
+				dns->negativehits++;
+			else
+				dns->cachehits++;
 			cached = true;
 			return;
 		}
 	}
+	dns->cachemisses++;
+
+	/* Wait for the same lookup if it is already in flight */
+	this->myid = dns->FindRequest(qt, source);
+	if (this->myid != -1)
+	{
+		if (querytype == DNS_QUERY_PTR4 || querytype == DNS_QUERY_PTR6)
+			querytype = DNS_QUERY_PTR;
+		dns->shared++;
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"DNS request id %d is already in flight", this->myid);
+		return;
+	}
 
 	switch (querytype)
 	{
@@ -985,52 +1285,77 @@ Module* Resolver::GetCreator()
 void DNS::HandleEvent(EventType, int)
 {
 	/* Fetch the id and result of the next available packet */
-	DNSResult res(0,"",0,"");
-	res.id = 0;
 	ServerInstance->Logs->Log("RESOLVER",DEBUG,"Handle DNS event");
 
-	res = this->GetResult();
+	DNSResult res = this->GetResult();
 
 	ServerInstance->Logs->Log("RESOLVER",DEBUG,"Result id %d", res.id);
 
+	DeliverResult(res);
+}
+
+/** Pass a result to every Resolver waiting for it */
+void DNS::DeliverResult(DNSResult& res)
+{
 	/* Is there a usable request id? */
-	if (res.id != -1)
+	if (res.id == -1)
+		return;
+
+	/* Its an error reply */
+	if (res.id & ERROR_MASK)
 	{
-		/* Its an error reply */
-		if (res.id & ERROR_MASK)
+		/* Mask off the error bit */
+		res.id -= ERROR_MASK;
+		/* Marshall the error to the correct classes */
+		Resolver* r = Classes[res.id];
+		Classes[res.id] = NULL;
+		while (r)
 		{
-			/* Mask off the error bit */
-			res.id -= ERROR_MASK;
-			/* Marshall the error to the correct class */
-			if (Classes[res.id])
-			{
-				if (ServerInstance && ServerInstance->stats)
-					ServerInstance->stats->statsDnsBad++;
-				Classes[res.id]->OnError(RESOLVER_NXDOMAIN, res.result);
-				delete Classes[res.id];
-				Classes[res.id] = NULL;
-			}
-			return;
+			Resolver* n = r->next;
+			if (ServerInstance && ServerInstance->stats)
+				ServerInstance->stats->statsDnsBad++;
+			r->OnError(RESOLVER_NXDOMAIN, res.result);
+			delete r;
+			r = n;
 		}
-		else
-		{
-			/* It is a non-error result, marshall the result to the correct class */
-			if (Classes[res.id])
-			{
-				if (ServerInstance && ServerInstance->stats)
-					ServerInstance->stats->statsDnsGood++;
+		return;
+	}
 
-				if (!this->GetCache(res.original.c_str()))
-					this->cache->insert(std::make_pair(res.original.c_str(), CachedQuery(res.result, res.ttl)));
+	/* It is a non-error result, marshall the result to the correct classes */
+	Resolver* r = Classes[res.id];
+	Classes[res.id] = NULL;
+	while (r)
+	{
+		Resolver* n = r->next;
+		if (ServerInstance && ServerInstance->stats)
+			ServerInstance->stats->statsDnsGood++;
+		r->OnLookupComplete(res.result, res.ttl, false);
+		delete r;
+		r = n;
+	}
 
-				Classes[res.id]->OnLookupComplete(res.result, res.ttl, false);
-				delete Classes[res.id];
-				Classes[res.id] = NULL;
-			}
-		}
+	if (ServerInstance && ServerInstance->stats)
+		ServerInstance->stats->statsDns++;
+}
 
-		if (ServerInstance && ServerInstance->stats)
-			ServerInstance->stats->statsDns++;
+/** Give up on a request, telling every Resolver waiting for it */
+void DNS::FailRequest(int id, ResolverError e, const std::string& errormessage)
+{
+	DNSRequest* req = requests[id];
+	if (!req)
+		return;
+	requests[id] = NULL;
+	inflight.erase(req->key);
+	delete req;
+
+	Resolver* r = Classes[id];
+	Classes[id] = NULL;
+	while (r)
+	{
+		Resolver* n = r->next;
+		r->OnError(e, errormessage);
+		delete r;
+		r = n;
 	}
 }
 
@@ -1041,19 +1366,14 @@ bool DNS::AddResolverClass(Resolver* r)
 	/* Check the pointers validity and the id's validity */
 	if ((r) && (r->GetId() > -1))
 	{
-		/* Check the slot isnt already occupied -
-		 * This should NEVER happen unless we have
-		 * a severely broken DNS server somewhere
+		/* Several Resolvers may wait for the same request;
+		 * they are told of the result in the order they were added
 		 */
-		if (!Classes[r->GetId()])
-		{
-			/* Set up the pointer to the class */
-			Classes[r->GetId()] = r;
-			return true;
-		}
-		else
-			/* Duplicate id */
-			return false;
+		Resolver** tail = &Classes[r->GetId()];
+		while (*tail)
+			tail = &(*tail)->next;
+		*tail = r;
+		return true;
 	}
 	else
 	{
@@ -1070,14 +1390,18 @@ void DNS::CleanResolvers(Module* module)
 {
 	for (int i = 0; i < MAX_REQUEST_ID; i++)
 	{
-		if (Classes[i])
+		Resolver** r = &Classes[i];
+		while (*r)
 		{
-			if (Classes[i]->GetCreator() == module)
+			if ((*r)->GetCreator() == module)
 			{
-				Classes[i]->OnError(RESOLVER_FORCEUNLOAD, "Parent module is unloading");
-				delete Classes[i];
-				Classes[i] = NULL;
+				Resolver* gone = *r;
+				*r = gone->next;
+				gone->OnError(RESOLVER_FORCEUNLOAD, "Parent module is unloading");
+				delete gone;
 			}
+			else
+				r = &(*r)->next;
 		}
 	}
 }
@@ -15,7 +15,6 @@
 
 #include "inspircd.h"
 #include "hashcomp.h"
-#include "hash_map.h"
 
 /******************************************************
  *
@@ -26,13 +25,10 @@
  * scene spend a lot of time debating (arguing) about
  * the best way to write hash functions to hash irc
  * nicknames, channels etc.
- * We are lucky as C++ developers as hash_map does
- * a lot of this for us. It does intellegent memory
- * requests, bucketing, search functions, insertion
- * and deletion etc. All we have to do is write some
- * overloaded comparison and hash value operators which
- * cause it to act in an irc-like way. The features we
- * add to the standard hash_map are:
+ * The table itself is irc::hash_map (see hash_map.h),
+ * which only needs a hash and a comparison functor to
+ * act in an irc-like way. The features these give us
+ * over plain string hashing are:
  *
  * Case insensitivity: The hash_map will be case
  * insensitive.
@@ -100,57 +96,44 @@ unsigned const char rfc_case_sensitive_map[256] = {
         241, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254, 255
 };
 
-/* convert a string to lowercase. Note following special circumstances
- * taken from RFC 1459. Many "official" server branches still hold to this
- * rule so i will too;
+/* Note following special circumstances taken from RFC 1459. Many
+ * "official" server branches still hold to this rule so i will too;
  *
  *  Because of IRC's scandanavian origin, the characters {}| are
  *  considered to be the lower case equivalents of the characters []\,
  *  respectively. This is a critical issue when determining the
  *  equivalence of two nicknames.
+ *
+ * Both hashes are FNV-1a; the insensitive one runs each character through
+ * national_case_insensitive_map first, so that no lowercased copy is made.
  */
-void nspace::strlower(char *n)
+size_t irc::insensitive::operator()(const std::string &s) const
 {
-	if (n)
-	{
-		for (char* t = n; *t; t++)
-			*t = national_case_insensitive_map[(unsigned char)*t];
-	}
+	size_t t = 2166136261U;
+	for (std::string::const_iterator x = s.begin(); x != s.end(); ++x)
+		t = (t ^ national_case_insensitive_map[(unsigned char)*x]) * 16777619U;
+	return t;
 }
 
-#if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
-	size_t nspace::hash_compare<std::string, std::less<std::string> >::operator()(const std::string &s) const
-#else
-	#ifdef HASHMAP_DEPRECATED
-		size_t CoreExport nspace::insensitive::operator()(const std::string &s) const
-	#else
-		size_t nspace::hash<std::string>::operator()(const std::string &s) const
-	#endif
-#endif
-{
-	/* XXX: NO DATA COPIES! :)
-	 * The hash function here is practically
-	 * a copy of the one in STL's hash_fun.h,
-	 * only with *x replaced with national_case_insensitive_map[*x].
-	 * This avoids a copy to use hash<const char*>
-	 */
-	register size_t t = 0;
-	for (std::string::const_iterator x = s.begin(); x != s.end(); ++x) /* ++x not x++, as its faster */
-		t = 5 * t + national_case_insensitive_map[(unsigned char)*x];
+size_t irc::hash::operator()(const std::string &s) const
+{
+	size_t t = 2166136261U;
+	for (std::string::const_iterator x = s.begin(); x != s.end(); ++x)
+		t = (t ^ (unsigned char)*x) * 16777619U;
 	return t;
 }
 
-
-#if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
-	size_t nspace::hash_compare<irc::string, std::less<irc::string> >::operator()(const irc::string &s) const
-#else
-	size_t CoreExport nspace::hash<irc::string>::operator()(const irc::string &s) const
-#endif
+void irc::namekey::Fold(const char* name, size_t len)
 {
-	register size_t t = 0;
-	for (std::string::const_iterator x = s.value.begin(); x != s.value.end(); ++x) /* ++x not x++, as its faster */
-		t = 5 * t + national_case_insensitive_map[(unsigned char)*x];
-	return t;
+	folded.resize(len);
+	size_t t = 2166136261U;
+	for (size_t i = 0; i < len; i++)
+	{
+		unsigned char c = national_case_insensitive_map[(unsigned char)name[i]];
+		folded[i] = c;
+		t = (t ^ c) * 16777619U;
+	}
+	hashval = t;
 }
 
 bool irc::StrHashComp::operator()(const std::string& s1, const std::string& s2) const
@@ -228,8 +211,14 @@ std::string irc::irc_char_traits::remap(const std::string& source)
 irc::tokenstream::tokenstream(const std::string &source) : tokens(source), last_pushed(false)
 {
 	/* Record starting position and current position */
-	last_starting_position = tokens.begin();
-	n = tokens.begin();
+	last_starting_position = n = tokens.data();
+	end = n + tokens.length();
+}
+
+irc::tokenstream::tokenstream(const char* source, size_t len) : last_pushed(false)
+{
+	last_starting_position = n = source;
+	end = source + len;
 }
 
 irc::tokenstream::~tokenstream()
@@ -238,13 +227,13 @@ irc::tokenstream::~tokenstream()
 
 bool irc::tokenstream::GetToken(std::string &token)
 {
-	std::string::iterator lsp = last_starting_position;
+	const char* lsp = last_starting_position;
 
-	while (n != tokens.end())
+	while (n != end)
 	{
 		/** Skip multi space, converting "  " into " "
 		 */
-		while ((n+1 != tokens.end()) && (*n == ' ') && (*(n+1) == ' '))
+		while ((n+1 != end) && (*n == ' ') && (*(n+1) == ' '))
 			n++;
 
 		if ((last_pushed) && (*n == ':'))
@@ -252,26 +241,26 @@ bool irc::tokenstream::GetToken(std::string &token)
 			/* If we find a token thats not the first and starts with :,
 			 * this is the last token on the line
 			 */
-			std::string::iterator curr = ++n;
-			n = tokens.end();
-			token = std::string(curr, tokens.end());
+			const char* curr = ++n;
+			n = end;
+			token.assign(curr, end - curr);
 			return true;
 		}
 
 		last_pushed = false;
 
-		if ((*n == ' ') || (n+1 == tokens.end()))
+		if ((*n == ' ') || (n+1 == end))
 		{
 			/* If we find a space, or end of string, this is the end of a token.
 			 */
 			last_starting_position = n+1;
 			last_pushed = *n == ' ';
 
-			std::string strip(lsp, n+1 == tokens.end() ? n+1  : n++);
-			while ((strip.length()) && (strip.find_last_of(' ') == strip.length() - 1))
-				strip.erase(strip.end() - 1);
+			const char* strip = (n+1 == end) ? n+1 : n++;
+			while ((strip > lsp) && (*(strip - 1) == ' '))
+				strip--;
 
-			token = strip;
+			token.assign(lsp, strip - lsp);
 			return !token.empty();
 		}
 
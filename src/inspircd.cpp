@@ -18,6 +18,7 @@
 #include "protocol.h"
 #include "bancache.h"
 #include "threadengine.h"
+#include "iothreads.h"
 #include "timer.h"
 #include <signal.h>
 
@@ -52,6 +53,7 @@ int* mysig = NULL;
  * e.g. for national character support.
  */
 unsigned const char *national_case_insensitive_map = rfc_case_insensitive_map;
+unsigned int national_case_generation = 0;
 
 
 /* Moved from exitcodes.h -- due to duplicate symbols -- Burlex
@@ -122,6 +124,8 @@ void InspIRCd::Cleanup()
 	DeleteZero(this->Parser);
 	DeleteZero(this->stats);
 	DeleteZero(this->Modules);
+	if (BanCache)
+		BanCache->Save();
 	DeleteZero(this->BanCache);
 	DeleteZero(this->SNO);
 	DeleteZero(this->Config);
@@ -129,6 +133,7 @@ void InspIRCd::Cleanup()
 	DeleteZero(this->chanlist);
 	DeleteZero(this->PI);
 	DeleteZero(this->Threads);
+	DeleteZero(this->IOThreads);
 	DeleteZero(this->Timers);
 	DeleteZero(this->SE);
 	DeleteZero(this->AtomicActions);
@@ -173,8 +178,8 @@ void InspIRCd::ResetMaxBans()
 		i->second->ResetMaxBans();
 }
 
-/** Because hash_map doesn't free its buckets when we delete items, we occasionally
- * recreate the hash to free them up.
+/** Because hash_map doesn't shrink (or clear out its tombstones) when we delete
+ * items, we occasionally recreate the hash to free them up.
  * We do this by copying the entries from the old hash to a new hash, causing all
  * empty buckets to be weeded out of the hash.
  * Since this is quite expensive, it's not done very often.
@@ -226,10 +231,86 @@ void InspIRCd::DoGarbageCollect()
 	{
 		(**i).already_sent = 0;
 	}
+	BanCache->RehashCache();
+
 	UpdateTime();
 	ServerInstance->Logs->Log("core", DEBUG, "Garbage Collect finished at %ld.%09ld", (long)Time(), Time_ns());
 }
 
+void InspIRCd::UpdateCaseMapping()
+{
+	national_case_generation++;
+
+	user_hash* old_users = Users->clientlist;
+	user_hash* old_uuid  = Users->uuidlist;
+	chan_hash* old_chans = chanlist;
+
+	Users->clientlist = new user_hash();
+	Users->uuidlist = new user_hash();
+	chanlist = new chan_hash();
+	Users->clientlist->reserve(old_users->size());
+	Users->uuidlist->reserve(old_uuid->size());
+	chanlist->reserve(old_chans->size());
+
+	for (user_hash::const_iterator n = old_uuid->begin(); n != old_uuid->end(); n++)
+		Users->uuidlist->insert(std::make_pair(irc::namekey(n->second->uuid), n->second));
+
+	/* Nicks which were different under the old casemapping may be the same now.
+	 * As in a nick collision, all of them lose and are moved to their UIDs; every
+	 * server does the same, and the protocol module sends a SAVE for remote users
+	 * as it does for a nick collision. Until then only one of them is indexed by nick.
+	 */
+	std::set<User*> collided;
+	for (user_hash::const_iterator n = old_users->begin(); n != old_users->end(); n++)
+	{
+		User* u = n->second;
+		u->nickkey = u->nick;
+		std::pair<user_hash::iterator, bool> res = Users->clientlist->insert(std::make_pair(u->nickkey, u));
+		if (res.second)
+			continue;
+
+		Logs->Log("CASEMAPPING", DEFAULT, "Nick %s of %s collides with %s of %s after casemapping change",
+			u->nick.c_str(), u->uuid.c_str(), res.first->second->nick.c_str(), res.first->second->uuid.c_str());
+		collided.insert(u);
+		collided.insert(res.first->second);
+	}
+
+	/* Channels which collide are merged into the oldest of them, which every server picks alike */
+	std::vector<Channel*> merged;
+	for (chan_hash::const_iterator n = old_chans->begin(); n != old_chans->end(); n++)
+	{
+		Channel* c = n->second;
+		c->namekey = c->name;
+		std::pair<chan_hash::iterator, bool> res = chanlist->insert(std::make_pair(c->namekey, c));
+		if (res.second)
+			continue;
+
+		Channel* kept = res.first->second;
+		if (c->age < kept->age || (c->age == kept->age && c->name < kept->name))
+			std::swap(c, kept);
+		res.first->second = kept;
+		merged.push_back(c);
+	}
+
+	delete old_users;
+	delete old_uuid;
+	delete old_chans;
+
+	for (std::set<User*>::iterator i = collided.begin(); i != collided.end(); ++i)
+	{
+		if (!(*i)->ForceNickChange((*i)->uuid))
+			Users->QuitUser(*i, "Nickname collision");
+	}
+
+	/* Look up the channel kept for each name, as it may have lost to another since */
+	for (std::vector<Channel*>::iterator i = merged.begin(); i != merged.end(); ++i)
+	{
+		Channel* into = FindChan((*i)->name);
+		Logs->Log("CASEMAPPING", DEFAULT, "Channel %s collides with %s after casemapping change", (*i)->name.c_str(), into->name.c_str());
+		into->Absorb(*i);
+	}
+}
+
 void InspIRCd::SetSignals()
 {
 #ifndef WIN32
@@ -352,6 +433,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	this->TraceData = 0;
 	this->Logs = 0;
 	this->Threads = 0;
+	this->IOThreads = 0;
 	this->PI = 0;
 	this->Users = 0;
 	this->chanlist = 0;
@@ -381,6 +463,8 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 
 	this->Threads = new ThreadEngine;
 
+	this->IOThreads = new IOThreadPool;
+
 	/* Default implementation does nothing */
 	this->PI = new ProtocolInterface;
 
@@ -557,6 +641,10 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	Config->Apply(NULL, "");
 	Logs->OpenFileLogs();
 
+	/* Threads do not survive the fork, so these must be started afterwards */
+	this->IOThreads->Start(Config->IOThreads);
+	Logs->StartWriter();
+
 	this->Res = new DNS();
 
 	/*
@@ -591,6 +679,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	printf("\n");
 
 	this->Modules->LoadAll();
+	this->BanCache->Load();
 
 	/* Just in case no modules were loaded - fix for bug #101 */
 	this->BuildISupport();
@@ -784,8 +873,6 @@ void InspIRCd::Run()
 				this->DoGarbageCollect();
 			}
 
-			Timers->TickTimers(TIME.tv_sec);
-			this->DoBackgroundUserStuff();
 
 			if ((TIME.tv_sec % 5) == 0)
 			{
@@ -796,6 +883,11 @@ void InspIRCd::Run()
 			Logs->Log("core", DEBUG, "Finished background events: %ld.%09ld", (long)Time(), Time_ns());
 		}
 
+		/* Timers have millisecond resolution, and the socket engine
+		 * only waits until the next one is due.
+		 */
+		Timers->TickTimers(Time_ms());
+
 		/* Call the socket engine to wait on the active
 		 * file descriptors. The socket engine has everything's
 		 * descriptors in its list... dns, modules, users,
@@ -803,7 +895,6 @@ void InspIRCd::Run()
 		 * This will cause any read or write events to be
 		 * dispatched to their handlers.
 		 */
-		this->SE->DispatchTrialWrites();
 		this->SE->DispatchEvents();
 
 		UpdateTime();
@@ -814,6 +905,13 @@ void InspIRCd::Run()
 		GlobalCulls->Apply();
 		AtomicActions->Run();
 
+		/* Everything written to during this iteration is flushed here,
+		 * with a single write per socket.
+		 */
+		this->SE->DispatchTrialWrites();
+		this->IOThreads->Flush();
+		this->Logs->Flush();
+
 		if (this->s_signal)
 		{
 			this->SignalHandler(s_signal);
@@ -15,6 +15,7 @@
 #include "cull_list.h"
 #include "inspsocket.h"
 #include "timer.h"
+#include "iothreads.h"
 
 #ifndef DISABLE_WRITEV
 #include <sys/uio.h>
@@ -22,6 +23,9 @@
 #define IOV_MAX 1024
 #endif
 #endif
+#ifndef WINDOWS
+#include <netinet/tcp.h>
+#endif
 
 BufferedSocket::BufferedSocket()
 {
@@ -136,9 +140,18 @@ void StreamSocket::Close()
 			delete hook;
 			hook = NULL;
 		}
-		ServerInstance->SE->Shutdown(this, 2);
-		ServerInstance->SE->DelFd(this);
-		ServerInstance->SE->Close(this);
+		if (ioconn)
+		{
+			// The I/O thread writes out what it can of the data it holds, then closes the socket
+			ServerInstance->SE->DelFd(this);
+			ServerInstance->IOThreads->Detach(this);
+		}
+		else
+		{
+			ServerInstance->SE->Shutdown(this, 2);
+			ServerInstance->SE->DelFd(this);
+			ServerInstance->SE->Close(this);
+		}
 		fd = -1;
 	}
 }
@@ -151,17 +164,23 @@ CullResult StreamSocket::cull()
 
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
+	std::string::size_type i = recvq.find(delim, recvq_pos);
 	if (i == std::string::npos)
 		return false;
-	line = recvq.substr(0, i);
-	// TODO is this the most efficient way to split?
-	recvq = recvq.substr(i + 1);
+	line.assign(recvq, recvq_pos, i - recvq_pos);
+	recvq_pos = i + 1;
 	return true;
 }
 
 void StreamSocket::DoRead()
 {
+	if (recvq_pos)
+	{
+		// Drop the lines consumed since the last read in one go
+		recvq.erase(0, recvq_pos);
+		recvq_pos = 0;
+	}
+
 	if (hook)
 	{
 		int rv = -1;
@@ -217,9 +236,219 @@ void StreamSocket::DoRead()
 	}
 }
 
+const size_t SendQueue::BLOCK_SIZE;
+
+/** A fixed-size piece of send queue storage */
+struct SendQueue::Block
+{
+	/** Next block on the free list */
+	Block* next;
+	/** Number of bytes of data that have been filled */
+	size_t used;
+	/** Number of queue chunks pointing into this block */
+	size_t refs;
+	char data[BLOCK_SIZE];
+};
+
+/* Blocks are recycled through this list rather than going back to the heap,
+ * up to a limit so that a burst of sendq does not pin memory forever.
+ */
+static const size_t MAX_SPARE_BLOCKS = 256;
+static SendQueue::Block* spare_blocks = NULL;
+static size_t spare_count = 0;
+static size_t inuse_count = 0;
+
+static SendQueue::Block* AllocBlock()
+{
+	SendQueue::Block* b = spare_blocks;
+	if (b)
+	{
+		spare_blocks = b->next;
+		spare_count--;
+	}
+	else
+	{
+		b = new SendQueue::Block;
+	}
+	b->next = NULL;
+	b->used = 0;
+	b->refs = 0;
+	inuse_count++;
+	return b;
+}
+
+static void FreeBlock(SendQueue::Block* b)
+{
+	inuse_count--;
+	if (spare_count < MAX_SPARE_BLOCKS)
+	{
+		b->next = spare_blocks;
+		spare_blocks = b;
+		spare_count++;
+	}
+	else
+	{
+		delete b;
+	}
+}
+
+void SendQueue::GetBlockStats(size_t& inuse, size_t& spare)
+{
+	inuse = inuse_count;
+	spare = spare_count;
+}
+
+SendQueue::~SendQueue()
+{
+	clear();
+	delete[] ring;
+}
+
+SendQueue::Chunk& SendQueue::append()
+{
+	if (count == ring_size)
+	{
+		// Full (or not yet allocated); double the ring, unwrapping it as we go
+		size_t newsize = ring_size ? ring_size * 2 : 8;
+		Chunk* newring = new Chunk[newsize];
+		for (size_t i = 0; i < count; i++)
+			newring[i] = ring[(head + i) & (ring_size - 1)];
+		delete[] ring;
+		ring = newring;
+		ring_size = newsize;
+		head = 0;
+	}
+	count++;
+	return tail();
+}
+
+void SendQueue::release(Chunk& c)
+{
+	if (c.block)
+	{
+		if (--c.block->refs == 0)
+		{
+			if (c.block == last)
+				last = NULL;
+			FreeBlock(c.block);
+		}
+		c.block = NULL;
+	}
+	c.line = NULL;
+}
+
+void SendQueue::push_back(const char* data, size_t len)
+{
+	bytes += len;
+	while (len)
+	{
+		if (!last || last->used == BLOCK_SIZE)
+			last = AllocBlock();
+
+		size_t n = BLOCK_SIZE - last->used;
+		if (n > len)
+			n = len;
+		char* dest = last->data + last->used;
+		memcpy(dest, data, n);
+		last->used += n;
+
+		// Extend the last chunk if the new data directly follows it
+		if (count && tail().block == last && tail().data + tail().len == dest)
+		{
+			tail().len += n;
+		}
+		else
+		{
+			Chunk& c = append();
+			c.data = dest;
+			c.len = n;
+			c.block = last;
+			last->refs++;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+void SendQueue::push_back(SharedLine* line)
+{
+	if (line->data.empty())
+		return;
+	Chunk& c = append();
+	c.data = line->data.data();
+	c.len = line->data.length();
+	c.block = NULL;
+	c.line = line;
+	bytes += c.len;
+}
+
+void SendQueue::consume(size_t len)
+{
+	bytes -= len;
+	while (len)
+	{
+		Chunk& c = ring[head];
+		if (c.len <= len)
+		{
+			len -= c.len;
+			release(c);
+			head = (head + 1) & (ring_size - 1);
+			count--;
+		}
+		else
+		{
+			// Partial write: only the read cursor moves
+			c.data += len;
+			c.len -= len;
+			len = 0;
+		}
+	}
+}
+
+void SendQueue::flatten(std::string& out) const
+{
+	out.clear();
+	out.reserve(bytes);
+	for (size_t i = 0; i < count; i++)
+	{
+		const Chunk& c = ring[(head + i) & (ring_size - 1)];
+		out.append(c.data, c.len);
+	}
+}
+
+void SendQueue::clear()
+{
+	for (size_t i = 0; i < count; i++)
+		release(ring[(head + i) & (ring_size - 1)]);
+	head = count = bytes = 0;
+	last = NULL;
+}
+
+void SendQueue::swap(SendQueue& other)
+{
+	std::swap(ring, other.ring);
+	std::swap(ring_size, other.ring_size);
+	std::swap(head, other.head);
+	std::swap(count, other.count);
+	std::swap(bytes, other.bytes);
+	std::swap(last, other.last);
+}
+
 /* Don't try to prepare huge blobs of data to send to a blocked socket */
 static const int MYIOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
 
+#ifdef TCP_CORK
+/* An IOHook turns a large write into several TLS records, each written
+ * separately; corking the socket lets the kernel send them as full segments.
+ */
+static const size_t CORK_THRESHOLD = 16384;
+
+static void SetCork(int fd, int on)
+{
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+#endif
+
 void StreamSocket::DoWrite()
 {
 	if (sendq.empty())
@@ -230,6 +459,12 @@ void StreamSocket::DoWrite()
 		return;
 	}
 
+	if (ioconn)
+	{
+		ServerInstance->IOThreads->Write(this);
+		return;
+	}
+
 #ifndef DISABLE_WRITEV
 	if (hook)
 #endif
@@ -239,40 +474,58 @@ void StreamSocket::DoWrite()
 		{
 			while (error.empty() && !sendq.empty())
 			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
-				{
-					// Avoid multiple repeated SSL encryption invocations
-					// This adds a single copy of the queue, but avoids
-					// much more overhead in terms of system calls invoked
-					// by the IOHook.
-					//
-					// The length limit of 1024 is to prevent merging strings
-					// more than once when writes begin to block.
-					std::string tmp;
-					tmp.reserve(sendq_len);
-					for(unsigned int i=0; i < sendq.size(); i++)
-						tmp.append(sendq[i]);
-					sendq.clear();
-					sendq.push_back(tmp);
-				}
-				std::string& front = sendq.front();
-				int itemlen = front.length();
 				if (hook)
 				{
-					rv = hook->OnWrite(this, front);
+					if (hookq.empty())
+					{
+						size_t len;
+						const char* data = sendq.chunk(0, len);
+						if (sendq.chunks() > 1 && len < 1024)
+						{
+							// Avoid multiple repeated SSL encryption invocations
+							// This adds a single copy of the queue, but avoids
+							// much more overhead in terms of system calls invoked
+							// by the IOHook.
+							//
+							// The length limit of 1024 is to prevent merging strings
+							// more than once when writes begin to block.
+							sendq.flatten(hookq);
+						}
+						else
+							hookq.assign(data, len);
+					}
+					size_t itemlen = hookq.length();
+					ServerInstance->stats->statsWriteCalls++;
+#ifdef TCP_CORK
+					bool cork = itemlen > CORK_THRESHOLD;
+					if (cork)
+						SetCork(fd, 1);
+					rv = hook->OnWrite(this, hookq);
+					if (cork)
+						SetCork(fd, 0);
+#else
+					rv = hook->OnWrite(this, hookq);
+#endif
 					if (rv > 0)
 					{
 						// consumed the entire string, and is ready for more
-						sendq_len -= itemlen;
-						sendq.pop_front();
+						sendq.consume(itemlen);
+						ServerInstance->stats->statsSendqWritten += itemlen;
+						// Do not keep a merged queue's worth of memory around for every socket
+						if (hookq.capacity() > SendQueue::BLOCK_SIZE)
+							std::string().swap(hookq);
+						else
+							hookq.clear();
 					}
 					else if (rv == 0)
 					{
 						// socket has blocked. Stop trying to send data.
 						// IOHook has requested unblock notification from the socketengine
 
-						// Since it is possible that a partial write took place, adjust sendq_len
-						sendq_len = sendq_len - itemlen + front.length();
+						// The hook removes whatever it wrote from the front of the buffer
+						size_t written = itemlen - hookq.length();
+						sendq.consume(written);
+						ServerInstance->stats->statsSendqWritten += written;
 						return;
 					}
 					else
@@ -284,7 +537,10 @@ void StreamSocket::DoWrite()
 #ifdef DISABLE_WRITEV
 				else
 				{
-					rv = ServerInstance->SE->Send(this, front.data(), itemlen, 0);
+					size_t itemlen;
+					const char* data = sendq.chunk(0, itemlen);
+					ServerInstance->stats->statsWriteCalls++;
+					rv = ServerInstance->SE->Send(this, data, itemlen, 0);
 					if (rv == 0)
 					{
 						SetError("Connection closed");
@@ -298,19 +554,16 @@ void StreamSocket::DoWrite()
 							SetError(strerror(errno));
 						return;
 					}
-					else if (rv < itemlen)
+					sendq.consume(rv);
+					ServerInstance->stats->statsSendqWritten += rv;
+					if ((size_t)rv < itemlen)
 					{
 						ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
-						front = front.substr(itemlen - rv);
-						sendq_len -= rv;
 						return;
 					}
-					else
+					else if (sendq.empty())
 					{
-						sendq_len -= itemlen;
-						sendq.pop_front();
-						if (sendq.empty())
-							ServerInstance->SE->ChangeEventMask(this, FD_WANT_EDGE_WRITE);
+						ServerInstance->SE->ChangeEventMask(this, FD_WANT_EDGE_WRITE);
 					}
 				}
 #endif
@@ -330,60 +583,47 @@ void StreamSocket::DoWrite()
 			return;
 		// start out optimistic - we won't need to write any more
 		int eventChange = FD_WANT_EDGE_WRITE;
-		while (error.empty() && sendq_len && eventChange == FD_WANT_EDGE_WRITE)
+		iovec iovecs[MYIOV_MAX];
+		while (error.empty() && !sendq.empty() && eventChange == FD_WANT_EDGE_WRITE)
 		{
 			// Prepare a writev() call to write all buffers efficiently
-			int bufcount = sendq.size();
+			size_t bufcount = sendq.chunks();
 
 			// cap the number of buffers at MYIOV_MAX
-			if (bufcount > MYIOV_MAX)
+			if (bufcount > (size_t)MYIOV_MAX)
 			{
 				bufcount = MYIOV_MAX;
 			}
 
-			int rv_max = 0;
-			iovec* iovecs = new iovec[bufcount];
-			for(int i=0; i < bufcount; i++)
+			size_t rv_max = 0;
+			for(size_t i=0; i < bufcount; i++)
 			{
-				iovecs[i].iov_base = const_cast<char*>(sendq[i].data());
-				iovecs[i].iov_len = sendq[i].length();
-				rv_max += sendq[i].length();
+				size_t len;
+				iovecs[i].iov_base = const_cast<char*>(sendq.chunk(i, len));
+				iovecs[i].iov_len = len;
+				rv_max += len;
 			}
-			int rv = writev(fd, iovecs, bufcount);
-			delete[] iovecs;
+			ServerInstance->stats->statsWriteCalls++;
+#ifdef MSG_MORE
+			// If this is not all of the sendq, tell the kernel more follows so it can fill whole segments
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iovecs;
+			msg.msg_iovlen = bufcount;
+			int rv = sendmsg(fd, &msg, bufcount < sendq.chunks() ? MSG_MORE : 0);
+#else
+			int rv = writev(fd, iovecs, (int)bufcount);
+#endif
 
-			if (rv == (int)sendq_len)
-			{
-				// it's our lucky day, everything got written out. Fast cleanup.
-				// This won't ever happen if the number of buffers got capped.
-				sendq_len = 0;
-				sendq.clear();
-			}
-			else if (rv > 0)
+			if (rv > 0)
 			{
-				// Partial write. Clean out strings from the sendq
-				if (rv < rv_max)
+				if ((size_t)rv < rv_max)
 				{
 					// it's going to block now
 					eventChange = FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK;
 				}
-				sendq_len -= rv;
-				while (rv > 0 && !sendq.empty())
-				{
-					std::string& front = sendq.front();
-					if (front.length() <= (size_t)rv)
-					{
-						// this string got fully written out
-						rv -= front.length();
-						sendq.pop_front();
-					}
-					else
-					{
-						// stopped in the middle of this string
-						front = front.substr(rv);
-						rv = 0;
-					}
-				}
+				sendq.consume(rv);
+				ServerInstance->stats->statsSendqWritten += rv;
 			}
 			else if (rv == 0)
 			{
@@ -426,8 +666,24 @@ void StreamSocket::WriteData(const std::string &data)
 	}
 
 	/* Append the data to the back of the queue ready for writing */
-	sendq.push_back(data);
-	sendq_len += data.length();
+	sendq.push_back(data.data(), data.length());
+	ServerInstance->stats->statsSendqQueued += data.length();
+
+	ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
+void StreamSocket::WriteData(SharedLine* line)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", DEBUG, "Attempt to write data to dead socket: %s",
+			line->data.c_str());
+		return;
+	}
+
+	/* Queue a reference to the line; every socket it is sent to shares the same copy */
+	sendq.push_back(line);
+	ServerInstance->stats->statsSendqQueued += line->data.length();
 
 	ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
@@ -481,6 +737,9 @@ BufferedSocket::~BufferedSocket()
 
 void StreamSocket::HandleEvent(EventType et, int errornum)
 {
+	// Reads and errors are seen by the socket's I/O thread, if it has one
+	if (ioconn && et != EVENT_WRITE)
+		return;
 	if (!error.empty())
 	{
 		ServerInstance->SE->DelFd(this);
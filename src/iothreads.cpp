@@ -0,0 +1,747 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+/* $Core */
+
+#include "inspircd.h"
+#include "inspsocket.h"
+#include "iothreads.h"
+#include "threadengine.h"
+
+#if (defined USE_EPOLL || defined USE_URING) && defined HAS_EVENTFD
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+/** A request to or result from an I/O thread */
+struct IOMessage
+{
+	enum Type
+	{
+		/* main thread to I/O thread */
+		IO_ATTACH, IO_WRITE, IO_CLOSE, IO_QUIT,
+		/* I/O thread to main thread */
+		IO_READ, IO_WRITTEN, IO_ERROR,
+		/* placeholder at the head of a queue */
+		IO_NONE
+	};
+	const Type type;
+	IOMessage* volatile next;
+	/** The connection a request is for */
+	IOThreadConn* conn;
+	/** The socket a result is for */
+	int fd;
+	unsigned long serial;
+	/** Data read */
+	std::string data;
+	/** Data to be written (IO_WRITE), taken over from the socket's sendq */
+	SendQueue* sendq;
+	/** Send queues the thread has finished with (IO_WRITTEN). They hold
+	 * blocks and shared lines which may only be released by the main thread.
+	 */
+	std::vector<SendQueue*> spent;
+	/** Bytes written (IO_WRITTEN) or errno (IO_ERROR) */
+	unsigned long count;
+	/** Number of send() calls made (IO_WRITTEN) */
+	unsigned long calls;
+
+	IOMessage(Type t) : type(t), next(NULL), conn(NULL), fd(-1), serial(0), sendq(NULL), count(0), calls(0) {}
+};
+
+/** A queue of messages with one producer thread and one consumer thread.
+ * The producer only touches the tail and the consumer only touches the head,
+ * so the only shared state is the next pointer of the newest message.
+ */
+class IOQueue
+{
+	/** The last message popped, kept as a placeholder; owned by the consumer */
+	IOMessage* head;
+	/** The last message pushed; owned by the producer */
+	IOMessage* tail;
+ public:
+	IOQueue()
+	{
+		head = tail = new IOMessage(IOMessage::IO_NONE);
+	}
+
+	~IOQueue()
+	{
+		while (head)
+		{
+			IOMessage* n = head->next;
+			delete head;
+			head = n;
+		}
+	}
+
+	void push(IOMessage* msg)
+	{
+		// Publish the contents of the message before linking it in
+		__sync_synchronize();
+		tail->next = msg;
+		tail = msg;
+	}
+
+	/** Get the next message. It remains valid until the following call.
+	 * @return The message, or NULL if the queue is empty
+	 */
+	IOMessage* pop()
+	{
+		IOMessage* n = head->next;
+		if (!n)
+			return NULL;
+		__sync_synchronize();
+		delete head;
+		head = n;
+		return n;
+	}
+};
+
+/** The I/O thread's view of a socket */
+struct IOThreadConn
+{
+	/* These never change, so both threads may read them */
+	IOThread* const thread;
+	const int fd;
+	const unsigned long serial;
+
+	/* Everything else belongs to the I/O thread */
+	/** Data waiting to be written, oldest first. The first out_chunk chunks of
+	 * the front queue and out_pos bytes of the next one have been written.
+	 */
+	std::deque<SendQueue*> out;
+	size_t out_chunk;
+	size_t out_pos;
+	/** True if the last write would have blocked */
+	bool blocked;
+	/** True if the connection has failed; nothing more is done but the close */
+	bool dead;
+	/** True if there may be more to read, after this connection used up its share */
+	bool backlogged;
+
+	IOThreadConn(IOThread* t, int f, unsigned long s)
+		: thread(t), fd(f), serial(s), out_chunk(0), out_pos(0), blocked(false), dead(false), backlogged(false) {}
+};
+
+/* Don't let one busy socket hold up the rest of the thread's sockets */
+static const size_t MAX_READ_PER_EVENT = 65536;
+static const int MAX_EVENTS = 128;
+/* Most chunks handed to one sendmsg() */
+static const int MAX_IOV = IOV_MAX < 128 ? IOV_MAX : 128;
+
+class IOThread
+{
+ public:
+	pthread_t id;
+	/** epoll set of the sockets handled by this thread, and its wakeup eventfd */
+	int epfd;
+	int wakefd;
+	/** eventfd used to wake the main thread */
+	const int mainfd;
+	/** Requests from the main thread */
+	IOQueue in;
+	/** Results for the main thread */
+	IOQueue out;
+	/** Set by the main thread when it has pushed requests but not yet woken us */
+	bool kick;
+	/** Size of a single recv() */
+	const size_t bufsize;
+	/** Set by the I/O thread when it has pushed results which the main thread does not know about */
+	bool results;
+	bool quitting;
+	std::vector<IOThreadConn*> backlog;
+	char* readbuf;
+	/** Counters, only touched by the I/O thread */
+	IOThreadStats stats;
+	/** A copy of the counters for the main thread, updated once per wakeup */
+	IOThreadStats published;
+	Mutex stats_lock;
+
+	IOThread(int main, size_t readsize)
+		: mainfd(main), kick(false), bufsize(readsize), results(false), quitting(false), readbuf(new char[readsize])
+	{
+		epfd = epoll_create(128);
+		if (epfd < 0)
+			throw CoreException("Could not create epoll set for I/O thread: " + std::string(strerror(errno)));
+		wakefd = eventfd(0, EFD_NONBLOCK);
+		if (wakefd < 0)
+		{
+			close(epfd);
+			throw CoreException("Could not create eventfd for I/O thread: " + std::string(strerror(errno)));
+		}
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+
+		if (pthread_create(&id, NULL, entry_point, this) != 0)
+		{
+			close(wakefd);
+			close(epfd);
+			throw CoreException("Unable to create new thread: " + std::string(strerror(errno)));
+		}
+	}
+
+	~IOThread()
+	{
+		in.push(new IOMessage(IOMessage::IO_QUIT));
+		eventfd_write(wakefd, 1);
+		pthread_join(id, NULL);
+		close(wakefd);
+		close(epfd);
+		delete[] readbuf;
+
+		IOMessage* msg;
+		while ((msg = out.pop()))
+			ReleaseSpent(msg);
+	}
+
+	/** Free the send queues an I/O thread has finished with; main thread only */
+	static void ReleaseSpent(IOMessage* msg)
+	{
+		for (std::vector<SendQueue*>::iterator i = msg->spent.begin(); i != msg->spent.end(); ++i)
+			delete *i;
+		msg->spent.clear();
+	}
+
+	static void* entry_point(void* parameter)
+	{
+		// Signals are for the main thread
+		sigset_t set;
+		sigfillset(&set);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+		static_cast<IOThread*>(parameter)->main_loop();
+		return parameter;
+	}
+
+	void Result(IOMessage* msg, IOThreadConn* conn)
+	{
+		msg->fd = conn->fd;
+		msg->serial = conn->serial;
+		out.push(msg);
+		results = true;
+	}
+
+	void Fail(IOThreadConn* conn, int err)
+	{
+		IOMessage* msg = new IOMessage(IOMessage::IO_ERROR);
+		msg->count = err;
+		Result(msg, conn);
+		conn->dead = true;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	}
+
+	void DoRead(IOThreadConn* conn)
+	{
+		size_t total = 0;
+		conn->backlogged = false;
+		while (true)
+		{
+			if (total >= MAX_READ_PER_EVENT)
+			{
+				// Come back to this one when the other sockets have had a turn
+				conn->backlogged = true;
+				backlog.push_back(conn);
+				return;
+			}
+			stats.reads++;
+			int n = recv(conn->fd, readbuf, bufsize, 0);
+			if (n > 0)
+			{
+				// One result per recv(), so that the main thread sees no more at once than StreamSocket::DoRead would give it
+				IOMessage* msg = new IOMessage(IOMessage::IO_READ);
+				msg->data.assign(readbuf, n);
+				Result(msg, conn);
+				total += n;
+				stats.bytes_in += n;
+			}
+			else if (n == 0)
+			{
+				Fail(conn, 0);
+				return;
+			}
+			else if (errno == EINTR)
+			{
+				continue;
+			}
+			else if (errno == EAGAIN)
+			{
+				return;
+			}
+			else
+			{
+				Fail(conn, errno);
+				return;
+			}
+		}
+	}
+
+	/** Move the write position on past data which has been written, and
+	 * hand back the queues which are now empty
+	 */
+	void Advance(IOThreadConn* conn, size_t len, std::vector<SendQueue*>& spent)
+	{
+		while (!conn->out.empty())
+		{
+			SendQueue* q = conn->out.front();
+			if (conn->out_chunk == q->chunks())
+			{
+				spent.push_back(q);
+				conn->out.pop_front();
+				conn->out_chunk = 0;
+				continue;
+			}
+			size_t chunklen;
+			q->chunk(conn->out_chunk, chunklen);
+			size_t left = chunklen - conn->out_pos;
+			if (len < left)
+			{
+				conn->out_pos += len;
+				return;
+			}
+			len -= left;
+			conn->out_chunk++;
+			conn->out_pos = 0;
+		}
+	}
+
+	void DoWrite(IOThreadConn* conn)
+	{
+		unsigned long written = 0, calls = 0;
+		std::vector<SendQueue*> spent;
+		while (!conn->out.empty())
+		{
+			// Write straight from the queued chunks, as StreamSocket::DoWrite does
+			iovec iovecs[MAX_IOV];
+			int count = 0;
+			size_t total = 0;
+			size_t chunk = conn->out_chunk, pos = conn->out_pos;
+			for (std::deque<SendQueue*>::iterator q = conn->out.begin(); q != conn->out.end() && count < MAX_IOV; ++q)
+			{
+				for (; chunk < (*q)->chunks() && count < MAX_IOV; chunk++, pos = 0)
+				{
+					size_t len;
+					const char* data = (*q)->chunk(chunk, len);
+					if (len == pos)
+						continue;
+					iovecs[count].iov_base = const_cast<char*>(data + pos);
+					iovecs[count].iov_len = len - pos;
+					total += len - pos;
+					count++;
+				}
+				chunk = pos = 0;
+			}
+			if (!count)
+			{
+				// Only empty chunks were left
+				Advance(conn, 0, spent);
+				break;
+			}
+
+			calls++;
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iovecs;
+			msg.msg_iovlen = count;
+			int n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+			if (n > 0)
+			{
+				Advance(conn, n, spent);
+				written += n;
+				if ((size_t)n < total)
+				{
+					conn->blocked = true;
+					break;
+				}
+			}
+			else if (n < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			else if (n < 0 && errno == EAGAIN)
+			{
+				conn->blocked = true;
+				break;
+			}
+			else
+			{
+				Fail(conn, n < 0 ? errno : 0);
+				break;
+			}
+		}
+		stats.writes += calls;
+		stats.bytes_out += written;
+		if (written || !spent.empty())
+		{
+			IOMessage* msg = new IOMessage(IOMessage::IO_WRITTEN);
+			msg->count = written;
+			msg->calls = calls;
+			msg->spent.swap(spent);
+			Result(msg, conn);
+		}
+	}
+
+	/** Hand everything still queued for a connection back to the main thread */
+	void DropOutput(IOThreadConn* conn)
+	{
+		if (conn->out.empty())
+			return;
+		IOMessage* msg = new IOMessage(IOMessage::IO_WRITTEN);
+		msg->spent.assign(conn->out.begin(), conn->out.end());
+		conn->out.clear();
+		conn->out_chunk = conn->out_pos = 0;
+		Result(msg, conn);
+	}
+
+	void DoRequests()
+	{
+		IOMessage* msg;
+		while ((msg = in.pop()))
+		{
+			IOThreadConn* conn = msg->conn;
+			switch (msg->type)
+			{
+				case IOMessage::IO_ATTACH:
+				{
+					struct epoll_event ev;
+					memset(&ev, 0, sizeof(ev));
+					// Edge triggered, so both directions can stay in the set for the life of the socket
+					ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+					ev.data.ptr = conn;
+					if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0)
+						Fail(conn, errno);
+					stats.sockets++;
+				}
+				break;
+				case IOMessage::IO_WRITE:
+					conn->out.push_back(msg->sendq);
+					msg->sendq = NULL;
+					if (conn->dead)
+						DropOutput(conn);
+					else if (!conn->blocked)
+						DoWrite(conn);
+				break;
+				case IOMessage::IO_CLOSE:
+					// final chance, dump as much of the output as we can
+					if (!conn->dead)
+					{
+						if (!conn->blocked)
+							DoWrite(conn);
+						epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+					}
+					DropOutput(conn);
+					shutdown(conn->fd, SHUT_RDWR);
+					close(conn->fd);
+					if (conn->backlogged)
+					{
+						std::vector<IOThreadConn*>::iterator i = std::find(backlog.begin(), backlog.end(), conn);
+						if (i != backlog.end())
+							backlog.erase(i);
+					}
+					delete conn;
+					stats.sockets--;
+				break;
+				case IOMessage::IO_QUIT:
+					quitting = true;
+				break;
+				default:
+				break;
+			}
+		}
+	}
+
+	void main_loop()
+	{
+		struct epoll_event events[MAX_EVENTS];
+		while (!quitting)
+		{
+			int n = epoll_wait(epfd, events, MAX_EVENTS, backlog.empty() ? -1 : 0);
+			stats.wakeups++;
+
+			std::vector<IOThreadConn*> retry;
+			retry.swap(backlog);
+			for (std::vector<IOThreadConn*>::iterator i = retry.begin(); i != retry.end(); ++i)
+			{
+				(*i)->backlogged = false;
+				if (!(*i)->dead)
+					DoRead(*i);
+			}
+
+			for (int j = 0; j < n; j++)
+			{
+				IOThreadConn* conn = static_cast<IOThreadConn*>(events[j].data.ptr);
+				if (!conn)
+				{
+					eventfd_t dummy;
+					eventfd_read(wakefd, &dummy);
+					continue;
+				}
+				if (conn->dead)
+					continue;
+				if ((events[j].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !conn->backlogged)
+					DoRead(conn);
+				if ((events[j].events & EPOLLOUT) && !conn->dead)
+				{
+					conn->blocked = false;
+					DoWrite(conn);
+				}
+			}
+
+			DoRequests();
+
+			{
+				Mutex::Lock lock(stats_lock);
+				published = stats;
+			}
+
+			if (results)
+			{
+				results = false;
+				eventfd_write(mainfd, 1);
+			}
+		}
+	}
+};
+
+/** The main thread end of the I/O threads */
+class IOThreadSignal : public EventHandler
+{
+ public:
+	IOThreadSignal()
+	{
+		SetFd(eventfd(0, EFD_NONBLOCK));
+		if (fd < 0)
+			throw CoreException("Could not create eventfd " + std::string(strerror(errno)));
+		ServerInstance->SE->AddFd(this, FD_WANT_FAST_READ | FD_WANT_NO_WRITE);
+	}
+
+	~IOThreadSignal()
+	{
+		ServerInstance->SE->DelFd(this);
+		close(fd);
+	}
+
+	void HandleEvent(EventType et, int errornum)
+	{
+		eventfd_t dummy;
+		eventfd_read(fd, &dummy);
+		ServerInstance->IOThreads->Process();
+	}
+};
+
+IOThreadPool::IOThreadPool() : serial(0), next(0), signal(NULL)
+{
+}
+
+IOThreadPool::~IOThreadPool()
+{
+	for (std::vector<IOThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+		delete *i;
+	delete signal;
+}
+
+void IOThreadPool::Start(unsigned int count)
+{
+	if (!count || Enabled())
+		return;
+	try
+	{
+		signal = new IOThreadSignal;
+		for (unsigned int i = 0; i < count; i++)
+			threads.push_back(new IOThread(signal->GetFd(), ServerInstance->Config->NetBufferSize));
+	}
+	catch (CoreException& ex)
+	{
+		ServerInstance->Logs->Log("SOCKET", DEFAULT, "Unable to start I/O threads, all socket I/O will be done in the main thread: %s",
+			ex.GetReason());
+		return;
+	}
+	ServerInstance->Logs->Log("SOCKET", DEFAULT, "Started %u I/O threads", count);
+}
+
+bool IOThreadPool::Attach(StreamSocket* sock)
+{
+	int fd = sock->GetFd();
+	if (!Enabled() || sock->GetIOHook() || sock->ioconn || fd < 0)
+		return false;
+
+	if ((size_t)fd >= sockets.size())
+		sockets.resize(fd + 1);
+	sockets[fd] = sock;
+
+	IOThread* thread = threads[next++ % threads.size()];
+	sock->ioconn = new IOThreadConn(thread, fd, ++serial);
+
+	// The main thread no longer watches the socket; only trial writes are dispatched to it
+	ServerInstance->SE->ChangeEventMask(sock, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+
+	IOMessage* msg = new IOMessage(IOMessage::IO_ATTACH);
+	msg->conn = sock->ioconn;
+	thread->in.push(msg);
+	thread->kick = true;
+	return true;
+}
+
+void IOThreadPool::Detach(StreamSocket* sock)
+{
+	IOThreadConn* conn = sock->ioconn;
+	sockets[conn->fd] = NULL;
+	sock->ioconn = NULL;
+	sock->io_pending = 0;
+
+	IOMessage* msg = new IOMessage(IOMessage::IO_CLOSE);
+	msg->conn = conn;
+	conn->thread->in.push(msg);
+	conn->thread->kick = true;
+}
+
+void IOThreadPool::Write(StreamSocket* sock)
+{
+	IOThreadConn* conn = sock->ioconn;
+	IOMessage* msg = new IOMessage(IOMessage::IO_WRITE);
+	msg->conn = conn;
+	// The thread takes over the queued chunks as they are, without copying them
+	msg->sendq = new SendQueue;
+	msg->sendq->swap(sock->sendq);
+	sock->io_pending += msg->sendq->size();
+	conn->thread->in.push(msg);
+	conn->thread->kick = true;
+}
+
+void IOThreadPool::Flush()
+{
+	for (std::vector<IOThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+		IOThread* thread = *i;
+		if (thread->kick)
+		{
+			thread->kick = false;
+			eventfd_write(thread->wakefd, 1);
+		}
+	}
+}
+
+void IOThreadPool::Process()
+{
+	for (std::vector<IOThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+		IOMessage* msg;
+		while ((msg = (*i)->out.pop()))
+		{
+			IOThread::ReleaseSpent(msg);
+			StreamSocket* sock = (size_t)msg->fd < sockets.size() ? sockets[msg->fd] : NULL;
+			if (!sock || sock->ioconn->serial != msg->serial || !sock->getError().empty())
+				continue;
+
+			try
+			{
+				switch (msg->type)
+				{
+					case IOMessage::IO_READ:
+						if (sock->recvq_pos)
+						{
+							sock->recvq.erase(0, sock->recvq_pos);
+							sock->recvq_pos = 0;
+						}
+						if (sock->recvq.empty())
+							sock->recvq.swap(msg->data);
+						else
+							sock->recvq.append(msg->data);
+						sock->OnDataReady();
+					break;
+					case IOMessage::IO_WRITTEN:
+						sock->io_pending -= msg->count;
+						ServerInstance->stats->statsSendqWritten += msg->count;
+						ServerInstance->stats->statsWriteCalls += msg->calls;
+					break;
+					case IOMessage::IO_ERROR:
+						sock->SetError(msg->count ? strerror(msg->count) : "Connection closed");
+					break;
+					default:
+					break;
+				}
+			}
+			catch (CoreException& ex)
+			{
+				ServerInstance->Logs->Log("SOCKET", DEFAULT, "Caught exception in socket processing on FD %d - '%s'",
+					msg->fd, ex.GetReason());
+				sock->SetError(ex.GetReason());
+			}
+
+			if (!sock->getError().empty())
+			{
+				ServerInstance->Logs->Log("SOCKET", DEBUG, "Error on FD %d - '%s'", msg->fd, sock->getError().c_str());
+				sock->OnError(I_ERR_OTHER);
+			}
+		}
+	}
+}
+
+void IOThreadPool::GetStats(std::vector<IOThreadStats>& out) const
+{
+	out.clear();
+	for (std::vector<IOThread*>::const_iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+		Mutex::Lock lock((*i)->stats_lock);
+		out.push_back((*i)->published);
+	}
+}
+
+#else
+
+IOThreadPool::IOThreadPool() : serial(0), next(0), signal(NULL)
+{
+}
+
+IOThreadPool::~IOThreadPool()
+{
+}
+
+void IOThreadPool::Start(unsigned int count)
+{
+	if (count)
+		ServerInstance->Logs->Log("SOCKET", DEFAULT, "I/O threads need epoll and eventfd support; all socket I/O will be done in the main thread");
+}
+
+bool IOThreadPool::Attach(StreamSocket*)
+{
+	return false;
+}
+
+void IOThreadPool::Detach(StreamSocket*)
+{
+}
+
+void IOThreadPool::Write(StreamSocket*)
+{
+}
+
+void IOThreadPool::Flush()
+{
+}
+
+void IOThreadPool::Process()
+{
+}
+
+void IOThreadPool::GetStats(std::vector<IOThreadStats>& out) const
+{
+	out.clear();
+}
+
+#endif
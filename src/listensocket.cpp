@@ -13,6 +13,7 @@
 
 #include "inspircd.h"
 #include "inspsocket.h"
+#include "iothreads.h"
 
 ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to)
 	: bind_tag(tag)
@@ -151,6 +152,7 @@ void ListenSocket::AcceptInternal()
 	ServerInstance->SE->NonBlocking(incomingSockfd);
 
 	StreamSocket* sock = NULL;
+	bool threaded = false;
 
 	DO_EACH_HOOK(OnAcceptConnection, sock, (incomingSockfd, this, &client, &server))
 	{
@@ -169,7 +171,10 @@ void ListenSocket::AcceptInternal()
 				LocalUser* New = new LocalUser(incomingSockfd, &client, &server);
 				ServerInstance->Users->AddUser(New, this);
 				if (!New->quitting)
+				{
 					sock = New->eh;
+					threaded = true;
+				}
 			}
 			catch (...)
 			{
@@ -193,6 +198,10 @@ void ListenSocket::AcceptInternal()
 			}
 			prov->OnServerConnection(sock, this);
 		}
+		else if (threaded)
+		{
+			ServerInstance->IOThreads->Attach(sock);
+		}
 		ServerInstance->stats->statsAccept++;
 	}
 	else
@@ -14,6 +14,9 @@
 #include "inspircd.h"
 
 #include "filelogger.h"
+#include "threadengine.h"
+#include <signal.h>
+#include <sys/uio.h>
 
 /*
  * Suggested implementation...
@@ -42,13 +45,288 @@
  *
  */
 
-LogManager::LogManager()
+/** Writes log lines to their files from a background thread.
+ *
+ * Lines are copied into a ring buffer by the main thread, each as a record
+ * holding the file descriptor, the length and the text. The writer thread
+ * takes as many consecutive records for the same file as it can (up to
+ * MAX_IOV) and writes them with one writev() call. Only the main thread
+ * moves head, and only the writer thread moves tail, so neither needs a
+ * lock; the writer only takes one to go to sleep when it has written
+ * everything. It is woken once per main loop iteration if there is
+ * anything new, so that lines logged together are written together.
+ */
+class LogWriter
+{
+ public:
+	struct Record
+	{
+		/** File to write to, or -1 to mark that the rest of the buffer is unused */
+		int fd;
+		unsigned int length;
+	};
+
+	static const unsigned int MAX_IOV = 64;
+	static const size_t ALIGN = sizeof(Record);
+
+	char* const buffer;
+	const size_t size;
+	const bool wait_when_full;
+
+	/** Bytes ever pushed by the main thread, and written by the writer thread */
+	volatile size_t head;
+	volatile size_t tail;
+
+	volatile bool quitting;
+	Mutex sleep_lock;
+	pthread_cond_var sleep_cond;
+	volatile int sleepers;
+	pthread_t id;
+
+	/** records, bytes, writes and failed are only changed by the writer thread, under stats_lock;
+	 * dropped is only changed and read by the main thread
+	 */
+	LogWriterStats stats;
+	Mutex stats_lock;
+
+	static size_t Align(size_t n)
+	{
+		return (n + ALIGN - 1) & ~(ALIGN - 1);
+	}
+
+	static void* entry_point(void* parameter)
+	{
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+		static_cast<LogWriter*>(parameter)->main_loop();
+		return parameter;
+	}
+
+	LogWriter(size_t Size, bool wait)
+		: buffer(new char[Size]), size(Size), wait_when_full(wait), head(0), tail(0), quitting(false), sleepers(0)
+	{
+		if (pthread_create(&id, NULL, entry_point, this) != 0)
+		{
+			delete[] buffer;
+			throw CoreException("Unable to create log writer thread: " + std::string(strerror(errno)));
+		}
+	}
+
+	~LogWriter()
+	{
+		quitting = true;
+		Wake();
+		pthread_join(id, NULL);
+		delete[] buffer;
+	}
+
+	/** Wake the writer thread if it is asleep */
+	void Wake()
+	{
+		__sync_synchronize();
+		if (sleepers)
+		{
+			Mutex::Lock lock(sleep_lock);
+			sleep_cond.signal_one();
+		}
+	}
+
+	void Push(int fd, const std::string& line)
+	{
+		// A line may not take more than a quarter of the buffer
+		size_t length = std::min(line.length(), size / 4 - sizeof(Record));
+		size_t need = sizeof(Record) + Align(length);
+		size_t pos, skip;
+		while (true)
+		{
+			pos = head & (size - 1);
+			skip = (size - pos < need) ? size - pos : 0;
+			if (size - (head - tail) >= need + skip)
+				break;
+			if (!wait_when_full)
+			{
+				stats.dropped++;
+				return;
+			}
+			Wake();
+			usleep(1000);
+		}
+
+		if (skip)
+		{
+			reinterpret_cast<Record*>(buffer + pos)->fd = -1;
+			pos = 0;
+		}
+		Record* rec = reinterpret_cast<Record*>(buffer + pos);
+		rec->fd = fd;
+		rec->length = length;
+		memcpy(rec + 1, line.data(), length);
+
+		// The record must be complete before the writer can see it
+		__sync_synchronize();
+		head += skip + need;
+
+		if (head - tail > size / 2)
+			Wake();
+	}
+
+	/** Write the given records, retrying after partial writes */
+	void Write(int fd, struct iovec* iov, unsigned int count)
+	{
+		unsigned long records = count, writes = 0, bytes = 0, failed = 0;
+		while (count)
+		{
+			ssize_t rv = writev(fd, iov, count);
+			if (rv < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				failed = count;
+				break;
+			}
+			writes++;
+			bytes += rv;
+			size_t done = rv;
+			while (count && done >= iov->iov_len)
+			{
+				done -= iov->iov_len;
+				iov++;
+				count--;
+			}
+			if (count)
+			{
+				iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+				iov->iov_len -= done;
+			}
+		}
+
+		Mutex::Lock lock(stats_lock);
+		stats.records += records;
+		stats.writes += writes;
+		stats.bytes += bytes;
+		stats.failed += failed;
+	}
+
+	void main_loop()
+	{
+		struct iovec iov[MAX_IOV];
+		while (true)
+		{
+			size_t pos = tail;
+			size_t end = head;
+			__sync_synchronize();
+
+			if (pos == end)
+			{
+				if (quitting)
+					return;
+				Mutex::Lock lock(sleep_lock);
+				__sync_fetch_and_add(&sleepers, 1);
+				while (head == tail && !quitting)
+					sleep_cond.wait(sleep_lock);
+				__sync_fetch_and_sub(&sleepers, 1);
+				continue;
+			}
+
+			int fd = -1;
+			unsigned int count = 0;
+			while (pos != end && count < MAX_IOV)
+			{
+				size_t offset = pos & (size - 1);
+				Record* rec = reinterpret_cast<Record*>(buffer + offset);
+				if (rec->fd == -1)
+				{
+					pos += size - offset;
+					continue;
+				}
+				if (count && rec->fd != fd)
+					break;
+				fd = rec->fd;
+				iov[count].iov_base = rec + 1;
+				iov[count].iov_len = rec->length;
+				count++;
+				pos += sizeof(Record) + Align(rec->length);
+			}
+			if (count)
+				Write(fd, iov, count);
+
+			// Done with the records, so the main thread may reuse their space
+			__sync_synchronize();
+			tail = pos;
+		}
+	}
+};
+
+LogManager::LogManager() : Writer(NULL)
 {
 	Logging = false;
 }
 
 LogManager::~LogManager()
 {
+	StopWriter();
+}
+
+void LogManager::StartWriter()
+{
+	unsigned long size = ServerInstance->Config->LogBuffer;
+	if (Writer || !size)
+		return;
+
+	// Round up to a power of two
+	unsigned long bits = 1;
+	while (bits < size)
+		bits <<= 1;
+
+	// Anything stdio is holding must be written before the thread writes after it
+	fflush(NULL);
+	Writer = new LogWriter(bits, ServerInstance->Config->LogOverflowWait);
+}
+
+void LogManager::StopWriter()
+{
+	if (!Writer)
+		return;
+	LogWriter* w = Writer;
+	Writer = NULL;
+	delete w;
+}
+
+bool LogManager::QueueWrite(int fd, const std::string& line)
+{
+	if (!Writer)
+		return false;
+	Writer->Push(fd, line);
+	return true;
+}
+
+void LogManager::WaitForWriter()
+{
+	if (!Writer)
+		return;
+	while (Writer->tail != Writer->head)
+	{
+		Writer->Wake();
+		usleep(1000);
+	}
+}
+
+void LogManager::Flush()
+{
+	if (Writer && Writer->head != Writer->tail)
+		Writer->Wake();
+}
+
+bool LogManager::GetWriterStats(LogWriterStats& out) const
+{
+	if (!Writer)
+		return false;
+	Mutex::Lock lock(Writer->stats_lock);
+	out = Writer->stats;
+	return true;
 }
 
 void LogManager::OpenFileLogs()
@@ -345,6 +623,9 @@ void FileWriter::WriteLogLine(const std::string &line)
 // XXX: For now, just return. Don't throw an exception. It'd be nice to find out if this is happening, but I'm terrified of breaking so close to final release. -- w00t
 //		throw CoreException("FileWriter::WriteLogLine called with a closed logfile");
 
+	if (ServerInstance->Logs && ServerInstance->Logs->QueueWrite(fileno(log), line))
+		return;
+
 	fprintf(log,"%s",line.c_str());
 	if (writeops++ % 20)
 	{
@@ -356,6 +637,8 @@ FileWriter::~FileWriter()
 {
 	if (log)
 	{
+		if (ServerInstance->Logs)
+			ServerInstance->Logs->WaitForWriter();
 		fflush(log);
 		fclose(log);
 		log = NULL;
@@ -769,6 +769,8 @@ void ModeParser::AddMode(ModeHandler* mh)
 			continue;
 		mh->id.SetID(id);
 		handlers[id] = mh;
+		if (mh->GetPrefixRank())
+			UpdateRanks();
 		return;
 	}
 	// whoops, you need to increase MODE_ID_MAX
@@ -801,10 +803,18 @@ bool ModeParser::DelMode(ModeHandler* mh)
 
 	handlers[mh->id.GetID()] = NULL;
 	mh->id.SetID(0);
+	if (mh->GetPrefixRank())
+		UpdateRanks();
 
 	return true;
 }
 
+void ModeParser::UpdateRanks()
+{
+	for (chan_hash::iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); i++)
+		i->second->UpdateRanks();
+}
+
 ModeHandler* ModeParser::FindMode(const std::string& name)
 {
 	for(int id = 1; id < MODE_ID_MAX; id++)
@@ -286,7 +286,7 @@ class QueryJob : public Job
 	MySQLresult* result;
  public:
 	QueryJob(SQLQuery* Q, SQLConnection* C)
-		: Job(C->creator), query(Q), conn(C), result(NULL)
+		: Job(C->creator, "sql"), query(Q), conn(C), result(NULL)
 	{
 	}
 	~QueryJob() { }
@@ -432,7 +432,7 @@ class CleanupJob : public Job
 {
  public:
 	SQLConnection* conn;
-	CleanupJob(SQLConnection* c) : Job(c->creator), conn(c) {}
+	CleanupJob(SQLConnection* c) : Job(c->creator, "sql"), conn(c) {}
 	void run()
 	{
 		conn->lock.lock();
@@ -37,9 +37,32 @@ class CensorChannel : public SimpleChannelModeHandler
 	CensorChannel(Module* Creator) : SimpleChannelModeHandler(Creator, "censor", 'G') { fixed_letter = false; }
 };
 
+/** Orders occurrences of words by where they start, longest first, so that
+ * the ones to replace can be taken leftmost-longest in one walk
+ */
+class LeftmostLongest
+{
+	const irc::multisearch& words;
+ public:
+	LeftmostLongest(const irc::multisearch& w) : words(w) { }
+
+	bool operator()(const irc::multisearch::hit& a, const irc::multisearch::hit& b) const
+	{
+		size_t astart = a.first - words[a.second].length();
+		size_t bstart = b.first - words[b.second].length();
+		if (astart != bstart)
+			return astart < bstart;
+		return words[a.second].length() > words[b.second].length();
+	}
+};
+
 class ModuleCensor : public Module
 {
-	censor_t censors;
+	/** The words, all found in one pass over a message whatever their number */
+	irc::multisearch words;
+	/** The replacement for each word, by its index in words; empty to block the message */
+	std::vector<std::string> replacements;
+	std::vector<irc::multisearch::hit> hits;
 	CensorUser cu;
 	CensorChannel cc;
 
@@ -82,21 +105,36 @@ class ModuleCensor : public Module
 		if (!active)
 			return MOD_RES_PASSTHRU;
 
-		std::string text2 = irc::irc_char_traits::remap(text);
-		for (censor_t::iterator index = censors.begin(); index != censors.end(); index++)
+		hits.clear();
+		words.Search(text, hits);
+		if (hits.empty())
+			return MOD_RES_PASSTHRU;
+
+		std::sort(hits.begin(), hits.end(), LeftmostLongest(words));
+		for (std::vector<irc::multisearch::hit>::iterator h = hits.begin(); h != hits.end(); ++h)
 		{
-			if (text2.find(index->first) != std::string::npos)
+			if (replacements[h->second].empty())
 			{
-				if (index->second.empty())
-				{
-					user->WriteNumeric(ERR_WORDFILTERED, "%s %s %s :Your message contained a censored word, and was blocked", user->nick.c_str(), ((Channel*)dest)->name.c_str(), index->first.c_str());
-					return MOD_RES_DENY;
-				}
-
-				SearchAndReplace(text2, index->first, index->second);
+				user->WriteNumeric(ERR_WORDFILTERED, "%s %s %s :Your message contained a censored word, and was blocked", user->nick.c_str(), ((Channel*)dest)->name.c_str(), words[h->second].c_str());
+				return MOD_RES_DENY;
 			}
 		}
-		text = text2.c_str();
+
+		/* Replace the occurrences which do not overlap one already replaced */
+		std::string result;
+		result.reserve(text.length());
+		size_t done = 0;
+		for (std::vector<irc::multisearch::hit>::iterator h = hits.begin(); h != hits.end(); ++h)
+		{
+			size_t start = h->first - words[h->second].length();
+			if (start < done)
+				continue;
+			result.append(text, done, start - done);
+			result.append(replacements[h->second]);
+			done = h->first;
+		}
+		result.append(text, done, std::string::npos);
+		text.swap(result);
 		return MOD_RES_PASSTHRU;
 	}
 
@@ -111,7 +149,7 @@ class ModuleCensor : public Module
 		 * reload our config file on rehash - we must destroy and re-allocate the classes
 		 * to call the constructor again and re-read our data.
 		 */
-		censors.clear();
+		censor_t censors;
 
 		ConfigTagList badwords = ServerInstance->Config->GetTags("badword");
 		for(ConfigIter i = badwords.first; i != badwords.second; ++i)
@@ -121,6 +159,14 @@ class ModuleCensor : public Module
 			std::string replace = tag->getString("replace");
 			censors[pattern] = replace;
 		}
+
+		words.clear();
+		replacements.clear();
+		for (censor_t::iterator i = censors.begin(); i != censors.end(); ++i)
+		{
+			words.add(i->first);
+			replacements.push_back(i->second);
+		}
 	}
 
 	virtual Version GetVersion()
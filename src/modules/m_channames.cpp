@@ -81,10 +81,14 @@ class ModuleChannelNames : public Module
 			Channel* c = *c2++;
 			irc::modestacker tmpmodes(modes);
 			ServerInstance->SendMode(ServerInstance->FakeClient, c, tmpmodes, true);
+			/* Kicking changes the member list, so find who to kick first */
+			std::vector<User*> kick;
 			const UserMembList* users = c->GetUsers();
 			for(UserMembCIter j = users->begin(); j != users->end(); ++j)
 				if (IS_LOCAL(j->first))
-					c->KickUser(ServerInstance->FakeClient, j->first, "Channel name no longer valid");
+					kick.push_back(j->first);
+			for (std::vector<User*>::iterator j = kick.begin(); j != kick.end(); ++j)
+				c->KickUser(ServerInstance->FakeClient, *j, "Channel name no longer valid");
 		}
 		badchan = false;
 	}
@@ -43,7 +43,10 @@ class CommandClones : public Command
 
 		/* hostname or other */
 		// XXX I really don't like marking global_clones public for this. at all. -- w00t
-		for (clonemap::iterator x = ServerInstance->Users->global_clones.begin(); x != ServerInstance->Users->global_clones.end(); x++)
+		std::vector<std::pair<irc::sockets::cidr_mask, unsigned long> > counts;
+		ServerInstance->Users->global_clones.GetCounts(AF_INET, ServerInstance->Config->c_ipv4_range, counts);
+		ServerInstance->Users->global_clones.GetCounts(AF_INET6, ServerInstance->Config->c_ipv6_range, counts);
+		for (std::vector<std::pair<irc::sockets::cidr_mask, unsigned long> >::iterator x = counts.begin(); x != counts.end(); x++)
 		{
 			if (x->second >= limit)
 				user->WriteServ("%s %s %s", clonesstr.c_str(), ConvToStr(x->second).c_str(), x->first.str().c_str());
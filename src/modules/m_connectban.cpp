@@ -19,7 +19,8 @@
 class ModuleConnectBan : public Module
 {
  private:
-	clonemap connects;
+	typedef std::map<irc::sockets::cidr_mask, unsigned int> ConnectMap;
+	ConnectMap connects;
 	unsigned int threshold;
 	unsigned int banduration;
 	unsigned int ipv4_cidr;
@@ -68,7 +69,7 @@ class ModuleConnectBan : public Module
 	virtual void OnUserConnect(LocalUser *u)
 	{
 		int range = 32;
-		clonemap::iterator i;
+		ConnectMap::iterator i;
 
 		switch (u->client_sa.sa.sa_family)
 		{
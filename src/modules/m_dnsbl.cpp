@@ -36,170 +36,59 @@ class DNSBLConfEntry
 		long duration;
 		int bitmask;
 		unsigned char records[256];
-		unsigned long stats_hits, stats_misses;
-		DNSBLConfEntry(): type(A_BITMASK),duration(86400),bitmask(0),stats_hits(0), stats_misses(0) {}
+		/** Hits count users matched from cached answers too; misses and errors only count answers */
+		unsigned long stats_hits, stats_misses, stats_errors;
+		/** Answers from this DNSBL, and milliseconds from starting the lookups of an IP to them */
+		unsigned long stats_answers, stats_latency_total, stats_latency_max;
+		DNSBLConfEntry(): type(A_BITMASK),duration(86400),bitmask(0),stats_hits(0), stats_misses(0), stats_errors(0), stats_answers(0), stats_latency_total(0), stats_latency_max(0) {}
 		~DNSBLConfEntry() { }
 };
 
-
-/** Resolver for CGI:IRC hostnames encoded in ident/GECOS
+/** The answers for one IP from every DNSBL. Users connecting from the IP
+ * while the lookups are in flight wait for the same answers, and the
+ * answers are kept for <dnsblcache:ttl> seconds afterwards for users
+ * connecting from it later.
  */
-class DNSBLResolver : public Resolver
+class DNSBLLookup
 {
-	std::string theiruid;
-	LocalStringExt& nameExt;
-	LocalIntExt& countExt;
-	DNSBLConfEntry *ConfEntry;
-
  public:
-
-	DNSBLResolver(Module *me, LocalStringExt& match, LocalIntExt& ctr, const std::string &hostname, LocalUser* u, DNSBLConfEntry *conf, bool &cached)
-		: Resolver(hostname, DNS_QUERY_A, cached, me), theiruid(u->uuid), nameExt(match), countExt(ctr), ConfEntry(conf)
+	/** Tells the answers for this lookup from those for one dropped on rehash */
+	const unsigned long serial;
+	/** For each DNSBL, the last octet of its answer if the IP is listed, or -1 */
+	std::vector<int> results;
+	/** The number of DNSBLs yet to answer */
+	unsigned int pending;
+	/** When the lookups were started, in milliseconds */
+	const uint64_t started;
+	/** When the answers are too old to use, once there are all of them */
+	time_t expires;
+	/** UUIDs of the users waiting for the answers */
+	std::vector<std::string> waiting;
+
+	DNSBLLookup(unsigned long Serial, unsigned int count)
+		: serial(Serial), results(count, -1), pending(count), started(ServerInstance->Time_ms()), expires(0)
 	{
 	}
+};
 
-	/* Note: This may be called multiple times for multiple A record results */
-	virtual void OnLookupComplete(const std::string &result, unsigned int ttl, bool cached)
-	{
-		/* Check the user still exists */
-		LocalUser* them = (LocalUser*)ServerInstance->FindUUID(theiruid);
-		if (them)
-		{
-			int i = countExt.get(them);
-			if (i)
-				countExt.set(them, i - 1);
-			// Now we calculate the bitmask: 256*(256*(256*a+b)+c)+d
-			if(result.length())
-			{
-				unsigned int bitmask = 0, record = 0;
-				bool match = false;
-				in_addr resultip;
-
-				inet_aton(result.c_str(), &resultip);
-
-				switch (ConfEntry->type)
-				{
-					case DNSBLConfEntry::A_BITMASK:
-						bitmask = resultip.s_addr >> 24; /* Last octet (network byte order) */
-						bitmask &= ConfEntry->bitmask;
-						match = (bitmask != 0);
-					break;
-					case DNSBLConfEntry::A_RECORD:
-						record = resultip.s_addr >> 24; /* Last octet */
-						match = (ConfEntry->records[record] == 1);
-					break;
-				}
-
-				if (match)
-				{
-					std::string reason = ConfEntry->reason;
-					std::string::size_type x = reason.find("%ip%");
-					while (x != std::string::npos)
-					{
-						reason.erase(x, 4);
-						reason.insert(x, them->GetIPString());
-						x = reason.find("%ip%");
-					}
+class ModuleDNSBL;
 
-					ConfEntry->stats_hits++;
+/** Resolver for one DNSBL entry of an IP
+ */
+class DNSBLResolver : public Resolver
+{
+	ModuleDNSBL* mod;
+	std::string ip;
+	unsigned long serial;
+	unsigned int index;
 
-					switch (ConfEntry->banaction)
-					{
-						case DNSBLConfEntry::I_KILL:
-						{
-							ServerInstance->Users->QuitUser(them, std::string("Killed (") + reason + ")");
-							break;
-						}
-						case DNSBLConfEntry::I_MARK:
-						{
-							if (!ConfEntry->ident.empty())
-							{
-								them->WriteServ("304 %s :Your ident has been set to %s because you matched %s", them->nick.c_str(), ConfEntry->ident.c_str(), reason.c_str());
-								them->ChangeIdent(ConfEntry->ident.c_str());
-							}
-
-							if (!ConfEntry->host.empty())
-							{
-								them->WriteServ("304 %s :Your host has been set to %s because you matched %s", them->nick.c_str(), ConfEntry->host.c_str(), reason.c_str());
-								them->ChangeDisplayedHost(ConfEntry->host.c_str());
-							}
-
-							nameExt.set(them, ConfEntry->name);
-							break;
-						}
-						case DNSBLConfEntry::I_KLINE:
-						{
-							KLine* kl = new KLine(ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName.c_str(), reason.c_str(),
-									"*", them->GetIPString());
-							if (ServerInstance->XLines->AddLine(kl,NULL))
-							{
-								ServerInstance->SNO->WriteGlobalSno('x',"K:line added due to DNSBL match on *@%s to expire on %s: %s", 
-									them->GetIPString(), ServerInstance->TimeString(kl->expiry).c_str(), reason.c_str());
-								ServerInstance->XLines->ApplyLines();
-							}
-							else
-								delete kl;
-							break;
-						}
-						case DNSBLConfEntry::I_GLINE:
-						{
-							GLine* gl = new GLine(ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName.c_str(), reason.c_str(),
-									"*", them->GetIPString());
-							if (ServerInstance->XLines->AddLine(gl,NULL))
-							{
-								ServerInstance->SNO->WriteGlobalSno('x',"G:line added due to DNSBL match on *@%s to expire on %s: %s", 
-									them->GetIPString(), ServerInstance->TimeString(gl->expiry).c_str(), reason.c_str());
-								ServerInstance->XLines->ApplyLines();
-							}
-							else
-								delete gl;
-							break;
-						}
-						case DNSBLConfEntry::I_ZLINE:
-						{
-							ZLine* zl = new ZLine(ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName.c_str(), reason.c_str(),
-									them->GetIPString());
-							if (ServerInstance->XLines->AddLine(zl,NULL))
-							{
-								ServerInstance->SNO->WriteGlobalSno('x',"Z:line added due to DNSBL match on *@%s to expire on %s: %s", 
-									them->GetIPString(), ServerInstance->TimeString(zl->expiry).c_str(), reason.c_str());
-								ServerInstance->XLines->ApplyLines();
-							}
-							else
-								delete zl;
-							break;
-						}
-						case DNSBLConfEntry::I_UNKNOWN:
-						{
-							break;
-						}
-						break;
-					}
+ public:
 
-					ServerInstance->SNO->WriteGlobalSno('a', "Connecting user %s detected as being on a DNS blacklist (%s) with result %d", them->GetFullRealHost().c_str(), ConfEntry->domain.c_str(), (ConfEntry->type==DNSBLConfEntry::A_BITMASK) ? bitmask : record);
-				}
-				else
-					ConfEntry->stats_misses++;
-			}
-			else
-				ConfEntry->stats_misses++;
-		}
-	}
+	DNSBLResolver(ModuleDNSBL *me, const std::string& theirip, unsigned long lookupserial, unsigned int entry, const std::string &hostname, bool &cached);
 
-	virtual void OnError(ResolverError e, const std::string &errormessage)
-	{
-		LocalUser* them = (LocalUser*)ServerInstance->FindUUID(theiruid);
-		if (them)
-		{
-			int i = countExt.get(them);
-			if (i)
-				countExt.set(them, i - 1);
-		}
-	}
+	virtual void OnLookupComplete(const std::string &result, unsigned int ttl, bool cached);
 
-	virtual ~DNSBLResolver()
-	{
-	}
+	virtual void OnError(ResolverError e, const std::string &errormessage);
 };
 
 class ModuleDNSBL : public Module
@@ -208,6 +97,19 @@ class ModuleDNSBL : public Module
 	LocalStringExt nameExt;
 	LocalIntExt countExt;
 
+	/** Lookups in flight and cached answers, by IP */
+	std::map<std::string, DNSBLLookup*> lookups;
+	/** IP and serial of each lookup which has all its answers, oldest first, so also in order of expiry.
+	 * Lookups dropped some other way are skipped when they come up.
+	 */
+	std::deque<std::pair<std::string, unsigned long> > expiring;
+	unsigned long serial;
+	/** How long to keep answers, and for how many IPs at most */
+	time_t cachettl;
+	unsigned long cachesize;
+	/** Users who were started a lookup for, waited for one in flight, or used cached answers */
+	unsigned long stats_started, stats_shared, stats_cached;
+
 	/*
 	 *	Convert a string to EnumBanaction
 	 */
@@ -227,21 +129,239 @@ class ModuleDNSBL : public Module
 		return DNSBLConfEntry::I_UNKNOWN;
 	}
  public:
-	ModuleDNSBL() : nameExt(EXTENSIBLE_USER, "dnsbl_match", this), countExt(EXTENSIBLE_USER, "dnsbl_pending", this) { }
+	ModuleDNSBL() : nameExt(EXTENSIBLE_USER, "dnsbl_match", this), countExt(EXTENSIBLE_USER, "dnsbl_pending", this),
+		serial(0), cachettl(300), cachesize(10000), stats_started(0), stats_shared(0), stats_cached(0) { }
 
 	void init()
 	{
 		ServerInstance->Modules->AddService(nameExt);
 		ServerInstance->Modules->AddService(countExt);
-		Implementation eventlist[] = { I_OnUserInit, I_OnStats, I_OnSetConnectClass, I_OnCheckReady };
+		Implementation eventlist[] = { I_OnUserInit, I_OnStats, I_OnSetConnectClass, I_OnCheckReady, I_OnGarbageCollect };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 	}
 
 	virtual ~ModuleDNSBL()
 	{
+		ClearLookups();
 		ClearEntries();
 	}
 
+	/** Find a local user waiting for a lookup, if they are still connected
+	 */
+	LocalUser* FindWaiting(const std::string& uuid)
+	{
+		User* u = ServerInstance->FindUUID(uuid);
+		return u ? IS_LOCAL(u) : NULL;
+	}
+
+	/** Forget all lookups; answers still to come for them are ignored
+	 */
+	void ClearLookups()
+	{
+		for (std::map<std::string, DNSBLLookup*>::iterator i = lookups.begin(); i != lookups.end(); i++)
+		{
+			DNSBLLookup* l = i->second;
+			for (std::vector<std::string>::iterator u = l->waiting.begin(); u != l->waiting.end(); u++)
+			{
+				LocalUser* them = FindWaiting(*u);
+				if (them)
+					countExt.set(them, 0);
+			}
+			delete l;
+		}
+		lookups.clear();
+		expiring.clear();
+	}
+
+	/** Drop cached answers, oldest first, which have expired or do not fit in the cache
+	 */
+	void TrimCache()
+	{
+		while (!expiring.empty())
+		{
+			std::map<std::string, DNSBLLookup*>::iterator i = lookups.find(expiring.front().first);
+			if (i != lookups.end() && i->second->serial == expiring.front().second)
+			{
+				if (i->second->expires > ServerInstance->Time() && lookups.size() <= cachesize)
+					return;
+				delete i->second;
+				lookups.erase(i);
+			}
+			expiring.pop_front();
+		}
+	}
+
+	/** Take the action of a DNSBL against a user it lists
+	 */
+	void Act(LocalUser* them, DNSBLConfEntry* ConfEntry, int result)
+	{
+		std::string reason = ConfEntry->reason;
+		std::string::size_type x = reason.find("%ip%");
+		while (x != std::string::npos)
+		{
+			reason.erase(x, 4);
+			reason.insert(x, them->GetIPString());
+			x = reason.find("%ip%");
+		}
+
+		switch (ConfEntry->banaction)
+		{
+			case DNSBLConfEntry::I_KILL:
+			{
+				ServerInstance->Users->QuitUser(them, std::string("Killed (") + reason + ")");
+				break;
+			}
+			case DNSBLConfEntry::I_MARK:
+			{
+				if (!ConfEntry->ident.empty())
+				{
+					them->WriteServ("304 %s :Your ident has been set to %s because you matched %s", them->nick.c_str(), ConfEntry->ident.c_str(), reason.c_str());
+					them->ChangeIdent(ConfEntry->ident.c_str());
+				}
+
+				if (!ConfEntry->host.empty())
+				{
+					them->WriteServ("304 %s :Your host has been set to %s because you matched %s", them->nick.c_str(), ConfEntry->host.c_str(), reason.c_str());
+					them->ChangeDisplayedHost(ConfEntry->host.c_str());
+				}
+
+				nameExt.set(them, ConfEntry->name);
+				break;
+			}
+			case DNSBLConfEntry::I_KLINE:
+			{
+				KLine* kl = new KLine(ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName.c_str(), reason.c_str(),
+						"*", them->GetIPString());
+				if (ServerInstance->XLines->AddLine(kl,NULL))
+				{
+					ServerInstance->SNO->WriteGlobalSno('x',"K:line added due to DNSBL match on *@%s to expire on %s: %s", 
+						them->GetIPString(), ServerInstance->TimeString(kl->expiry).c_str(), reason.c_str());
+					ServerInstance->XLines->ApplyLines();
+				}
+				else
+					delete kl;
+				break;
+			}
+			case DNSBLConfEntry::I_GLINE:
+			{
+				GLine* gl = new GLine(ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName.c_str(), reason.c_str(),
+						"*", them->GetIPString());
+				if (ServerInstance->XLines->AddLine(gl,NULL))
+				{
+					ServerInstance->SNO->WriteGlobalSno('x',"G:line added due to DNSBL match on *@%s to expire on %s: %s", 
+						them->GetIPString(), ServerInstance->TimeString(gl->expiry).c_str(), reason.c_str());
+					ServerInstance->XLines->ApplyLines();
+				}
+				else
+					delete gl;
+				break;
+			}
+			case DNSBLConfEntry::I_ZLINE:
+			{
+				ZLine* zl = new ZLine(ServerInstance->Time(), ConfEntry->duration, ServerInstance->Config->ServerName.c_str(), reason.c_str(),
+						them->GetIPString());
+				if (ServerInstance->XLines->AddLine(zl,NULL))
+				{
+					ServerInstance->SNO->WriteGlobalSno('x',"Z:line added due to DNSBL match on *@%s to expire on %s: %s", 
+						them->GetIPString(), ServerInstance->TimeString(zl->expiry).c_str(), reason.c_str());
+					ServerInstance->XLines->ApplyLines();
+				}
+				else
+					delete zl;
+				break;
+			}
+			case DNSBLConfEntry::I_UNKNOWN:
+			{
+				break;
+			}
+			break;
+		}
+
+		ServerInstance->SNO->WriteGlobalSno('a', "Connecting user %s detected as being on a DNS blacklist (%s) with result %d", them->GetFullRealHost().c_str(), ConfEntry->domain.c_str(), result);
+	}
+
+	/** Called with the answer of one DNSBL for an IP
+	 * @param result The answer, or NULL if the IP is not listed or the lookup failed
+	 */
+	void OnListResult(const std::string& ip, unsigned long lookupserial, unsigned int index, const std::string* result, bool failed)
+	{
+		std::map<std::string, DNSBLLookup*>::iterator i = lookups.find(ip);
+		if (i == lookups.end() || i->second->serial != lookupserial)
+			return;
+		DNSBLLookup* l = i->second;
+		DNSBLConfEntry* ConfEntry = DNSBLConfEntries[index];
+
+		unsigned long latency = ServerInstance->Time_ms() - l->started;
+		ConfEntry->stats_answers++;
+		ConfEntry->stats_latency_total += latency;
+		if (latency > ConfEntry->stats_latency_max)
+			ConfEntry->stats_latency_max = latency;
+
+		// Now we calculate the bitmask: 256*(256*(256*a+b)+c)+d
+		if (result && result->length())
+		{
+			unsigned int bitmask = 0, record = 0;
+			bool match = false;
+			in_addr resultip;
+
+			inet_aton(result->c_str(), &resultip);
+
+			switch (ConfEntry->type)
+			{
+				case DNSBLConfEntry::A_BITMASK:
+					bitmask = resultip.s_addr >> 24; /* Last octet (network byte order) */
+					bitmask &= ConfEntry->bitmask;
+					match = (bitmask != 0);
+				break;
+				case DNSBLConfEntry::A_RECORD:
+					record = resultip.s_addr >> 24; /* Last octet */
+					match = (ConfEntry->records[record] == 1);
+				break;
+			}
+
+			if (match)
+			{
+				l->results[index] = (ConfEntry->type == DNSBLConfEntry::A_BITMASK) ? bitmask : record;
+				ConfEntry->stats_hits++;
+				for (std::vector<std::string>::iterator u = l->waiting.begin(); u != l->waiting.end(); u++)
+				{
+					LocalUser* them = FindWaiting(*u);
+					if (them && !them->quitting)
+						Act(them, ConfEntry, l->results[index]);
+				}
+			}
+			else
+				ConfEntry->stats_misses++;
+		}
+		else if (failed)
+			ConfEntry->stats_errors++;
+		else
+			ConfEntry->stats_misses++;
+
+		if (--l->pending)
+			return;
+
+		// Every DNSBL has answered, so the users may go on connecting
+		for (std::vector<std::string>::iterator u = l->waiting.begin(); u != l->waiting.end(); u++)
+		{
+			LocalUser* them = FindWaiting(*u);
+			if (them)
+				countExt.set(them, 0);
+		}
+		l->waiting.clear();
+		if (!cachettl)
+		{
+			delete l;
+			lookups.erase(i);
+			return;
+		}
+
+		// A full cache makes room by dropping the answers which would expire first
+		l->expires = ServerInstance->Time() + cachettl;
+		expiring.push_back(std::make_pair(ip, l->serial));
+		TrimCache();
+	}
+
 	Version GetVersion()
 	{
 		return Version("Provides handling of DNS blacklists", VF_VENDOR);
@@ -260,8 +380,14 @@ class ModuleDNSBL : public Module
 	 */
 	void ReadConf()
 	{
+		// The answers are by position in the list of DNSBLs, which may change
+		ClearLookups();
 		ClearEntries();
 
+		ConfigTag* cache = ServerInstance->Config->GetTag("dnsblcache");
+		cachettl = cache->getInt("ttl", 300);
+		cachesize = cache->getInt("size", 10000);
+
 		ConfigTagList dnsbls = ServerInstance->Config->GetTags("dnsbl");
 		for(ConfigIter i = dnsbls.first; i != dnsbls.second; ++i)
 		{
@@ -340,7 +466,7 @@ class ModuleDNSBL : public Module
 
 	void OnUserInit(LocalUser* user)
 	{
-		if (user->exempt)
+		if (user->exempt || DNSBLConfEntries.empty())
 			return;
 
 		unsigned char a, b, c, d;
@@ -350,6 +476,36 @@ class ModuleDNSBL : public Module
 		if (user->client_sa.sa.sa_family != AF_INET)
 			return;
 
+		std::string ip = user->GetIPString();
+		std::map<std::string, DNSBLLookup*>::iterator found = lookups.find(ip);
+		if (found != lookups.end())
+		{
+			DNSBLLookup* l = found->second;
+			if (l->pending || l->expires > ServerInstance->Time())
+			{
+				// Take the answers there are, and wait for the rest of the lookups in flight
+				for (unsigned int i = 0; i < l->results.size() && !user->quitting; i++)
+				{
+					if (l->results[i] >= 0)
+					{
+						DNSBLConfEntries[i]->stats_hits++;
+						Act(user, DNSBLConfEntries[i], l->results[i]);
+					}
+				}
+				if (!l->pending)
+				{
+					stats_cached++;
+					return;
+				}
+				l->waiting.push_back(user->uuid);
+				countExt.set(user, 1);
+				stats_shared++;
+				return;
+			}
+			delete l;
+			lookups.erase(found);
+		}
+
 		d = (unsigned char) (user->client_sa.in4.sin_addr.s_addr >> 24) & 0xFF;
 		c = (unsigned char) (user->client_sa.in4.sin_addr.s_addr >> 16) & 0xFF;
 		b = (unsigned char) (user->client_sa.in4.sin_addr.s_addr >> 8) & 0xFF;
@@ -358,20 +514,35 @@ class ModuleDNSBL : public Module
 		snprintf(reversedipbuf, 128, "%d.%d.%d.%d", d, c, b, a);
 		reversedip = std::string(reversedipbuf);
 
+		DNSBLLookup* l = new DNSBLLookup(++serial, DNSBLConfEntries.size());
+		l->waiting.push_back(user->uuid);
+		lookups[ip] = l;
+		countExt.set(user, 1);
+		stats_started++;
+
 		// For each DNSBL, we will run through this lookup
-		unsigned int i = 0;
-		while (i < DNSBLConfEntries.size())
+		for (unsigned int i = 0; i < DNSBLConfEntries.size(); i++)
 		{
 			// Fill hostname with a dnsbl style host (d.c.b.a.domain.tld)
 			std::string hostname = reversedip + "." + DNSBLConfEntries[i]->domain;
 
 			/* now we'd need to fire off lookups for `hostname'. */
 			bool cached;
-			DNSBLResolver *r = new DNSBLResolver(this, nameExt, countExt, hostname, user, DNSBLConfEntries[i], cached);
-			ServerInstance->AddResolver(r, cached);
-			i++;
+			try
+			{
+				DNSBLResolver *r = new DNSBLResolver(this, ip, serial, i, hostname, cached);
+				ServerInstance->AddResolver(r, cached);
+			}
+			catch (CoreException& e)
+			{
+				OnListResult(ip, serial, i, NULL, true);
+			}
 		}
-		countExt.set(user, i);
+	}
+
+	void OnGarbageCollect()
+	{
+		TrimCache();
 	}
 
 	ModResult OnSetConnectClass(LocalUser* user, ConnectClass* myclass)
@@ -405,15 +576,35 @@ class ModuleDNSBL : public Module
 			total_hits += (*i)->stats_hits;
 			total_misses += (*i)->stats_misses;
 
+			unsigned long answers = (*i)->stats_answers;
 			results.push_back(std::string(ServerInstance->Config->ServerName.c_str()) + " 304 " + user->nick + " :DNSBLSTATS DNSbl \"" + (*i)->name + "\" had " +
-					ConvToStr((*i)->stats_hits) + " hits and " + ConvToStr((*i)->stats_misses) + " misses");
+					ConvToStr((*i)->stats_hits) + " hits and " + ConvToStr((*i)->stats_misses) + " misses, " + ConvToStr((*i)->stats_errors) + " errors, latency avg " +
+					ConvToStr(answers ? (*i)->stats_latency_total / answers : 0) + "ms max " + ConvToStr((*i)->stats_latency_max) + "ms");
 		}
 
 		results.push_back(std::string(ServerInstance->Config->ServerName.c_str()) + " 304 " + user->nick + " :DNSBLSTATS Total hits: " + ConvToStr(total_hits));
 		results.push_back(std::string(ServerInstance->Config->ServerName.c_str()) + " 304 " + user->nick + " :DNSBLSTATS Total misses: " + ConvToStr(total_misses));
+		results.push_back(std::string(ServerInstance->Config->ServerName.c_str()) + " 304 " + user->nick + " :DNSBLSTATS Users looked up: " + ConvToStr(stats_started) +
+				", waited for a lookup in flight: " + ConvToStr(stats_shared) + ", answered from cache: " + ConvToStr(stats_cached) + " (" + ConvToStr(lookups.size()) + " IPs)");
 
 		return MOD_RES_PASSTHRU;
 	}
 };
 
+DNSBLResolver::DNSBLResolver(ModuleDNSBL *me, const std::string& theirip, unsigned long lookupserial, unsigned int entry, const std::string &hostname, bool &cached)
+	: Resolver(hostname, DNS_QUERY_A, cached, me), mod(me), ip(theirip), serial(lookupserial), index(entry)
+{
+}
+
+void DNSBLResolver::OnLookupComplete(const std::string &result, unsigned int ttl, bool cached)
+{
+	mod->OnListResult(ip, serial, index, &result, false);
+}
+
+void DNSBLResolver::OnError(ResolverError e, const std::string &errormessage)
+{
+	/* NXDOMAIN is the answer for an IP which is not listed */
+	mod->OnListResult(ip, serial, index, NULL, e != RESOLVER_NXDOMAIN);
+}
+
 MODULE_INIT(ModuleDNSBL)
@@ -16,6 +16,8 @@
 #include "protocol.h"
 #include "xline.h"
 #include "m_regex.h"
+#include <fstream>
+#include <iostream>
 
 /* $ModDesc: Text (spam) filtering */
 
@@ -126,6 +128,50 @@ class ImplFilter : public FilterResult
 	ImplFilter(ModuleFilter* mymodule, const std::string &rea, const std::string &act, long glinetime, const std::string &pat, const std::string &flgs);
 };
 
+/** Finds the filters which may match a text in one pass over it.
+ *
+ * Most filters contain a run of plain characters which every text they match
+ * must contain. Those runs are searched for all at once with an Aho-Corasick
+ * automaton, and only the filters whose run was found (and those without one)
+ * have their pattern matched against the text.
+ */
+class FilterIndex
+{
+	/** The required run of each filter which has one */
+	irc::multisearch literals;
+	/** For each run in literals, the index of its filter */
+	std::vector<unsigned int> owners;
+	/** Filters without a required run, which are always candidates */
+	std::vector<unsigned int> always;
+	std::vector<irc::multisearch::hit> hits;
+
+ public:
+	/** Runs are searched for without case, so that the index works whatever
+	 * the case sensitivity of the engine
+	 */
+	FilterIndex() : literals(ascii_case_insensitive_map) { }
+
+	/** Index a list of filters
+	 * @param filters The filters, in priority order
+	 * @param glob True if the patterns are globs rather than regular expressions
+	 */
+	void Build(const std::vector<ImplFilter>& filters, bool glob);
+
+	/** Get the filters which may match a text
+	 * @param text The text to check
+	 * @param candidates Set to the indexes of the filters, in priority order
+	 */
+	void Candidates(const std::string& text, std::vector<unsigned int>& candidates);
+
+	/** Get every filter which matches a text, in priority order */
+	void Match(std::vector<ImplFilter>& filters, const std::string& text, std::vector<ImplFilter*>& found);
+
+	/** Get the longest run of characters which any text matching a pattern must contain.
+	 * Anything not understood gives an empty run, which makes the filter always a candidate.
+	 */
+	static std::string RequiredRun(const std::string& pattern, bool glob);
+};
+
 
 class ModuleFilter : public Module
 {
@@ -133,7 +179,12 @@ class ModuleFilter : public Module
 	CommandFilter filtcommand;
 	dynamic_reference<RegexFactory> RegexEngine;
 
+	/** The filters, in priority order */
 	std::vector<ImplFilter> filters;
+	FilterIndex index;
+	/** True if the index must be rebuilt before it is used */
+	bool reindex;
+	std::vector<unsigned int> candidates;
 	const char *error;
 	int erroffset;
 	int flags;
@@ -160,6 +211,7 @@ class ModuleFilter : public Module
 	ModResult OnPreCommand(std::string &command, std::vector<std::string> &parameters, LocalUser *user, bool validated, const std::string &original_line);
 	bool AppliesToMe(User* user, FilterResult* filter, int flags);
 	void ReadFilters(ConfigReadStatus&);
+	void RunTestSuite();
 };
 
 CmdResult CommandFilter::Handle(const std::vector<std::string> &parameters, User *user)
@@ -255,7 +307,7 @@ bool ModuleFilter::AppliesToMe(User* user, FilterResult* filter, int iflags)
 	return true;
 }
 
-ModuleFilter::ModuleFilter() : filtcommand(this), RegexEngine("")
+ModuleFilter::ModuleFilter() : filtcommand(this), RegexEngine(""), reindex(true)
 {
 }
 
@@ -451,6 +503,7 @@ void ModuleFilter::ReadConfig(ConfigReadStatus& status)
 	//ServerInstance->XLines->DelAll("R");
 
 	RegexEngine.SetProvider(newrxengine);
+	reindex = true;
 	if (!RegexEngine)
 	{
 		status.ReportError("Regex engine '" + newrxengine + "' is not loaded - m_filter has been disabled.");
@@ -529,28 +582,166 @@ ImplFilter::ImplFilter(ModuleFilter* mymodule, const std::string &rea, const std
 
 FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int flgs)
 {
-	for (std::vector<ImplFilter>::iterator index = filters.begin(); index != filters.end(); index++)
+	if (reindex)
+	{
+		index.Build(filters, RegexEngine && RegexEngine->name == "regex/glob");
+		reindex = false;
+	}
+
+	index.Candidates(text, candidates);
+	for (std::vector<unsigned int>::iterator i = candidates.begin(); i != candidates.end(); ++i)
 	{
+		ImplFilter* filter = &filters[*i];
 		/* Skip ones that dont apply to us */
-		if (!AppliesToMe(user, static_cast<FilterResult*>(&(*index)), flgs))
+		if (!AppliesToMe(user, filter, flgs))
 			continue;
 
-		//ServerInstance->Logs->Log("m_filter", DEBUG, "Match '%s' against '%s'", text.c_str(), index->freeform.c_str());
-		if (index->regex->Matches(text))
+		if (filter->regex->Matches(text))
+			return filter;
+	}
+	return NULL;
+}
+
+void FilterIndex::Build(const std::vector<ImplFilter>& filters, bool glob)
+{
+	literals.clear();
+	owners.clear();
+	always.clear();
+	for (unsigned int i = 0; i < filters.size(); i++)
+	{
+		std::string run = RequiredRun(filters[i].freeform, glob);
+		if (run.empty())
+			always.push_back(i);
+		else
 		{
-			//ServerInstance->Logs->Log("m_filter", DEBUG, "MATCH");
-			ImplFilter fr = *index;
-			if (index != filters.begin())
+			literals.add(run);
+			owners.push_back(i);
+		}
+	}
+}
+
+void FilterIndex::Candidates(const std::string& text, std::vector<unsigned int>& candidates)
+{
+	hits.clear();
+	literals.Search(text, hits);
+	candidates.assign(always.begin(), always.end());
+	for (std::vector<irc::multisearch::hit>::iterator h = hits.begin(); h != hits.end(); ++h)
+		candidates.push_back(owners[h->second]);
+	if (hits.empty())
+		return;
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+}
+
+void FilterIndex::Match(std::vector<ImplFilter>& filters, const std::string& text, std::vector<ImplFilter*>& found)
+{
+	std::vector<unsigned int> candidates;
+	Candidates(text, candidates);
+	found.clear();
+	for (std::vector<unsigned int>::iterator i = candidates.begin(); i != candidates.end(); ++i)
+		if (filters[*i].regex->Matches(text))
+			found.push_back(&filters[*i]);
+}
+
+std::string FilterIndex::RequiredRun(const std::string& pattern, bool glob)
+{
+	std::string best, run;
+	if (glob)
+	{
+		/* Every run between wildcards must appear in a matching text */
+		for (std::string::const_iterator c = pattern.begin(); c != pattern.end(); ++c)
+		{
+			if (*c == '*' || *c == '?')
 			{
-				/* Move to head of list for efficiency */
-				filters.erase(index);
-				filters.insert(filters.begin(), fr);
+				if (run.length() > best.length())
+					best = run;
+				run.clear();
 			}
-			return &*filters.begin();
+			else
+				run.push_back(*c);
 		}
-		//ServerInstance->Logs->Log("m_filter", DEBUG, "NO MATCH");
+		return run.length() > best.length() ? run : best;
 	}
-	return NULL;
+
+	/* Plain characters outside of any group, up to something which may make
+	 * them optional. Alternation and anything else which could change the
+	 * meaning of plain characters give up.
+	 */
+	int depth = 0;
+	for (std::string::size_type i = 0; i < pattern.length(); i++)
+	{
+		char c = pattern[i];
+		bool end = true;
+		switch (c)
+		{
+			case '|':
+				/* Alternatives within a group do not matter outside of it */
+				if (depth == 0)
+					return "";
+			break;
+			case '(':
+				if (i + 1 < pattern.length() && pattern[i + 1] == '?')
+					return "";
+				depth++;
+			break;
+			case ')':
+				depth--;
+			break;
+			case '[':
+				/* Skip the class; a ']' straight after the '[' or '[^' is part of it */
+				i++;
+				if (i < pattern.length() && pattern[i] == '^')
+					i++;
+				if (i < pattern.length() && pattern[i] == ']')
+					i++;
+				while (i < pattern.length() && pattern[i] != ']')
+					i++;
+			break;
+			case '*':
+			case '?':
+			case '{':
+				/* The last character may not be there at all */
+				if (!run.empty())
+					run.erase(run.length() - 1);
+				if (c == '{')
+					while (i < pattern.length() && pattern[i] != '}')
+						i++;
+			break;
+			case '+':
+			case '.':
+			case '^':
+			case '$':
+			break;
+			case '\\':
+				if (++i >= pattern.length())
+					return "";
+				c = pattern[i];
+				/* Escapes which begin a group or a repeat in basic regexes, or take an argument */
+				if (strchr("(){}|+?", c) || (isalnum((unsigned char)c) && strchr("xopPcgkNQEuU0123456789", c)))
+					return "";
+				/* Other letters, and word and buffer anchors, are not plain characters */
+				if (!isalnum((unsigned char)c) && !strchr("<>`'", c) && depth == 0)
+				{
+					run.push_back(c);
+					end = false;
+				}
+			break;
+			default:
+				if (depth == 0)
+				{
+					run.push_back(c);
+					end = false;
+				}
+			break;
+		}
+		if (end)
+		{
+			if (run.length() > best.length())
+				best = run;
+			run.clear();
+		}
+	}
+	return run.length() > best.length() ? run : best;
 }
 
 bool ModuleFilter::DeleteFilter(const std::string &freeform)
@@ -561,6 +752,7 @@ bool ModuleFilter::DeleteFilter(const std::string &freeform)
 		{
 			delete i->regex;
 			filters.erase(i);
+			reindex = true;
 			return true;
 		}
 	}
@@ -588,6 +780,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string &freeform
 	try
 	{
 		filters.push_back(ImplFilter(this, reason, type, duration, freeform, flgs));
+		reindex = true;
 	}
 	catch (ModuleException &e)
 	{
@@ -616,6 +809,7 @@ void ModuleFilter::ReadFilters(ConfigReadStatus &MyConf)
 		try
 		{
 			filters.push_back(ImplFilter(this, reason, action, gline_time, pattern, flgs));
+			reindex = true;
 			ServerInstance->Logs->Log("m_filter", DEFAULT, "Regular expression %s loaded.", pattern.c_str());
 		}
 		catch (ModuleException &e)
@@ -642,4 +836,134 @@ ModResult ModuleFilter::OnStats(char symbol, User* user, string_list &results)
 	return MOD_RES_PASSTHRU;
 }
 
+static double Elapsed(const timeval& start)
+{
+	timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+/** Replay a file of captured messages against a file of filters, with the
+ * index and one filter at a time, and check that both find the same filters.
+ * The filter file has one pattern per line. The message file has one message
+ * per line, either raw IRC lines (PRIVMSG, NOTICE, PART or QUIT, of which the
+ * last parameter is used) or plain text.
+ */
+void ModuleFilter::RunTestSuite()
+{
+	std::cout << "m_filter benchmark" << std::endl << std::endl;
+	if (!RegexEngine)
+	{
+		std::cout << "Regex engine '" << RegexEngine.GetProvider() << "' is not loaded, skipped" << std::endl;
+		return;
+	}
+
+	std::string filterfile, corpusfile, line;
+	std::cout << "Filter file: ";
+	std::cin >> filterfile;
+	std::cout << "Message file: ";
+	std::cin >> corpusfile;
+
+	std::vector<ImplFilter> bench;
+	std::ifstream ffile(filterfile.c_str());
+	while (std::getline(ffile, line))
+	{
+		if (line.empty())
+			continue;
+		try
+		{
+			bench.push_back(ImplFilter(this, "benchmark", "none", 0, line, "*"));
+		}
+		catch (ModuleException& e)
+		{
+			std::cout << "Skipped '" << line << "': " << e.GetReason() << std::endl;
+		}
+	}
+
+	std::vector<std::string> corpus;
+	std::ifstream cfile(corpusfile.c_str());
+	while (std::getline(cfile, line))
+	{
+		if (!line.empty() && line[line.length() - 1] == '\r')
+			line.erase(line.length() - 1);
+		irc::tokenstream tokens(line);
+		std::string command, text;
+		tokens.GetToken(command);
+		if (!command.empty() && command[0] == ':')
+			tokens.GetToken(command);
+		if (command == "PRIVMSG" || command == "NOTICE" || command == "PART" || command == "QUIT")
+		{
+			while (tokens.GetToken(text))
+				;
+			corpus.push_back(text);
+		}
+		else
+			corpus.push_back(line);
+	}
+
+	if (bench.empty() || corpus.empty())
+	{
+		std::cout << "FAILURE: no filters or no messages read" << std::endl;
+		return;
+	}
+
+	const unsigned int repeats = 10;
+	FilterIndex benchindex;
+	bool glob = (RegexEngine->name == "regex/glob");
+	timeval start;
+	gettimeofday(&start, NULL);
+	benchindex.Build(bench, glob);
+	double buildtime = Elapsed(start);
+
+	unsigned long withrun = 0;
+	for (std::vector<ImplFilter>::iterator i = bench.begin(); i != bench.end(); ++i)
+		if (!FilterIndex::RequiredRun(i->freeform, glob).empty())
+			withrun++;
+
+	/* Every filter which matches each message, one filter at a time */
+	std::vector<std::vector<ImplFilter*> > expected(corpus.size());
+	gettimeofday(&start, NULL);
+	for (unsigned int r = 0; r < repeats; r++)
+	{
+		for (unsigned int m = 0; m < corpus.size(); m++)
+		{
+			expected[m].clear();
+			for (std::vector<ImplFilter>::iterator i = bench.begin(); i != bench.end(); ++i)
+				if (i->regex->Matches(corpus[m]))
+					expected[m].push_back(&*i);
+		}
+	}
+	double oldtime = Elapsed(start);
+
+	std::vector<ImplFilter*> found;
+	unsigned long mismatches = 0, matched = 0;
+	gettimeofday(&start, NULL);
+	for (unsigned int r = 0; r < repeats; r++)
+	{
+		for (unsigned int m = 0; m < corpus.size(); m++)
+		{
+			benchindex.Match(bench, corpus[m], found);
+			if (r)
+				continue;
+			if (found != expected[m])
+			{
+				if (mismatches++ < 10)
+					std::cout << "Mismatch on message '" << corpus[m] << "'" << std::endl;
+			}
+			if (!found.empty())
+				matched++;
+		}
+	}
+	double newtime = Elapsed(start);
+
+	unsigned long total = corpus.size() * repeats;
+	std::cout << bench.size() << " filters (" << withrun << " indexed, built in " << (unsigned long)(buildtime * 1000000) << "us), "
+		<< corpus.size() << " messages (" << matched << " matched): " << (mismatches ? "FAILURE" : "SUCCESS") << ", "
+		<< (unsigned long)(newtime * 1000000000 / total) << "ns per message (one by one "
+		<< (unsigned long)(oldtime * 1000000000 / total) << "ns)" << std::endl;
+
+	for (std::vector<ImplFilter>::iterator i = bench.begin(); i != bench.end(); ++i)
+		delete i->regex;
+}
+
 MODULE_INIT(ModuleFilter)
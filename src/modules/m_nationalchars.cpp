@@ -223,13 +223,15 @@ class ModuleNationalChars : public Module
  public:
 	ModuleNationalChars() : rememberer(ServerInstance->IsNick)
 	{
+		memcpy(m_lower, rfc_case_insensitive_map, 256);
 	}
 
 	void init()
 	{
+		/* ReadConfig has already loaded the tables, so start using them */
 		lowermap_rememberer = national_case_insensitive_map;
-		memcpy(m_lower, rfc_case_insensitive_map, 256);
 		national_case_insensitive_map = m_lower;
+		ServerInstance->UpdateCaseMapping();
 
 		ServerInstance->IsNick = &myhandler;
 
@@ -253,6 +255,9 @@ class ModuleNationalChars : public Module
 			charset.insert(0, "../locales/");
 		unsigned char * tables[8] = { m_additional, m_additionalMB, m_additionalUp, m_lower, m_upper, m_additionalUtf8, m_additionalUtf8range, m_additionalUtf8interval };
 		loadtables(charset, tables, 8, 5);
+		/* On load, init() starts using the tables */
+		if (national_case_insensitive_map == m_lower)
+			ServerInstance->UpdateCaseMapping();
 		forcequit = tag->getBool("forcequit");
 		CheckForceQuit("National character set changed");
 	}
@@ -275,6 +280,7 @@ class ModuleNationalChars : public Module
 	{
 		ServerInstance->IsNick = rememberer;
 		national_case_insensitive_map = lowermap_rememberer;
+		ServerInstance->UpdateCaseMapping();
 		CheckForceQuit("National characters module unloaded");
 	}
 
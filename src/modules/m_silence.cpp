@@ -35,8 +35,12 @@
  *       an entry.
  */
 
-// pair of hostmask and flags
-typedef std::pair<std::string, int> silenceset;
+// pair of hostmask and flags, with the hostmask compiled for matching
+struct silenceset : public std::pair<std::string, int>
+{
+	irc::wildmask match;
+	silenceset(const std::string& mask, int flags) : std::pair<std::string, int>(mask, flags), match(mask) {}
+};
 
 // deque list of pairs
 typedef std::deque<silenceset> silencelist;
@@ -372,7 +376,7 @@ class ModuleSilence : public Module
 		{
 			for (silencelist::const_iterator c = sl->begin(); c != sl->end(); c++)
 			{
-				if (((((c->second & pattern) > 0)) || ((c->second & SILENCE_ALL) > 0)) && (InspIRCd::Match(source->GetFullHost(), c->first)))
+				if (((((c->second & pattern) > 0)) || ((c->second & SILENCE_ALL) > 0)) && (InspIRCd::Match(source->GetFullHost(), c->match)))
 					return (c->second & SILENCE_EXCLUDE) ? MOD_RES_PASSTHRU : MOD_RES_DENY;
 			}
 		}
@@ -19,6 +19,7 @@
 #include "utils.h"
 #include "link.h"
 #include "main.h"
+#include "framing.h"
 
 std::string TreeSocket::MyModules(int filter)
 {
@@ -151,7 +152,9 @@ void TreeSocket::SendCapabilities(int phase)
 			" PREFIX="+ServerInstance->Modes->BuildPrefixes()+
 			" CHANMODES="+ServerInstance->Modes->GiveModeList(MODETYPE_CHANNEL)+
 			" USERMODES="+ServerInstance->Modes->GiveModeList(MODETYPE_USER)+
-			" SVSPART=1");
+			" SVSPART=1"+
+			" COMPRESS=zlib"+
+			" BINARY="+ConvToStr(BinaryFraming::CommandCount));
 
 	this->WriteLine("CAPAB END");
 }
@@ -15,6 +15,7 @@
 #include "command_parse.h"
 #include "main.h"
 #include "treesocket.h"
+#include "framing.h"
 
 static const char* const forge_common_1201[] = {
 	"m_allowinvite.so",
@@ -186,7 +187,7 @@ void TreeSocket::WriteLine(std::string line)
 				std::string target = line.substr(d + 1, e - d - 1);
 
 				ServerInstance->Logs->Log("m_spanningtree",DEBUG,"Forging acceptance of CHGIDENT from 1201-protocol server");
-				recvq.insert(0, ":" + target + " FIDENT " + line.substr(e) + "\n");
+				recvq.insert(recvq_pos, ":" + target + " FIDENT " + line.substr(e) + "\n");
 			}
 
 			Command* thiscmd = ServerInstance->Parser->GetHandler(subcmd);
@@ -204,9 +205,31 @@ void TreeSocket::WriteLine(std::string line)
 	}
 
 	ServerInstance->Logs->Log("m_spanningtree", RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
-	this->WriteData(line);
-	if (proto_version < 1202)
-		this->WriteData(wide_newline);
+	std::string frame;
+	if (binary_commands)
+		BinaryFraming::Encode(line.data(), line.length(), binary_commands, frame);
+	else if (proto_version < 1202)
+		line.append(wide_newline);
+	else
+		line.append(newline);
+	const std::string& data = binary_commands ? frame : line;
+	if (burst && burst->Defer(line, data))
+		return;
+	this->WriteRaw(data, !burst || !burst->generating);
+}
+
+void TreeSocket::WriteLine(SharedLine* line)
+{
+	size_t len = line->data.length();
+	if (proto_version != ProtocolVersion || burst || deflater)
+	{
+		WriteLine(line->data.substr(0, len - 1));
+		return;
+	}
+
+	ServerInstance->Logs->Log("m_spanningtree", RAWIO, "S[%d] O %.*s", this->GetFd(), (int)len - 1, line->data.c_str());
+	if (binary_commands)
+		this->WriteData(Utils->MakeFrame(line, binary_commands));
 	else
-		this->WriteData(newline);
+		this->WriteData(line);
 }
@@ -0,0 +1,180 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+/* $LinkerFlags: -lz */
+
+#include "inspircd.h"
+
+#include "treesocket.h"
+#include "compress.h"
+
+LinkDeflater::LinkDeflater() : ready(false)
+{
+	memset(&stream, 0, sizeof(stream));
+}
+
+LinkDeflater::~LinkDeflater()
+{
+	if (ready)
+		deflateEnd(&stream);
+}
+
+bool LinkDeflater::Init()
+{
+	ready = (deflateInit(&stream, Z_DEFAULT_COMPRESSION) == Z_OK);
+	return ready;
+}
+
+bool LinkDeflater::Compress(const std::string& data, bool flush, std::string& out)
+{
+	char buffer[16384];
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+	stream.avail_in = data.length();
+	do
+	{
+		stream.next_out = (Bytef*)buffer;
+		stream.avail_out = sizeof(buffer);
+		int rv = deflate(&stream, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+		/* Z_BUF_ERROR only means there was nothing to do */
+		if (rv != Z_OK && rv != Z_BUF_ERROR)
+			return false;
+		out.append(buffer, sizeof(buffer) - stream.avail_out);
+	} while (stream.avail_out == 0);
+	return true;
+}
+
+LinkInflater::LinkInflater() : ready(false)
+{
+	memset(&stream, 0, sizeof(stream));
+}
+
+LinkInflater::~LinkInflater()
+{
+	if (ready)
+		inflateEnd(&stream);
+}
+
+bool LinkInflater::Init()
+{
+	ready = (inflateInit(&stream) == Z_OK);
+	return ready;
+}
+
+bool LinkInflater::Decompress(const char* data, size_t len, std::string& out)
+{
+	char buffer[16384];
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	stream.avail_in = len;
+	do
+	{
+		stream.next_out = (Bytef*)buffer;
+		stream.avail_out = sizeof(buffer);
+		int rv = inflate(&stream, Z_SYNC_FLUSH);
+		/* The stream is never finished, so Z_STREAM_END is an error as well */
+		if (rv != Z_OK && rv != Z_BUF_ERROR)
+			return false;
+		out.append(buffer, sizeof(buffer) - stream.avail_out);
+		if (rv == Z_BUF_ERROR)
+			break;
+	} while (stream.avail_in || !stream.avail_out);
+	return true;
+}
+
+bool TreeSocket::StartDeflate()
+{
+	if (deflater)
+		return true;
+	deflater = new LinkDeflater;
+	if (deflater->Init())
+		return true;
+	delete deflater;
+	deflater = NULL;
+	return false;
+}
+
+bool TreeSocket::StartInflate()
+{
+	if (inflater)
+		return true;
+	inflater = new LinkInflater;
+	if (inflater->Init())
+		return true;
+	delete inflater;
+	inflater = NULL;
+	return false;
+}
+
+void TreeSocket::WriteRaw(const std::string& data, bool flush)
+{
+	if (!deflater)
+	{
+		if (data.empty())
+			return;
+		this->WriteData(data);
+		if (burst && burst->generating)
+		{
+			burst->rawbytes += data.length();
+			burst->sentbytes += data.length();
+		}
+		return;
+	}
+
+	std::string out;
+	if (!deflater->Compress(data, flush, out))
+	{
+		SetError("Compression failed");
+		return;
+	}
+	if (!out.empty())
+		this->WriteData(out);
+	if (burst && burst->generating)
+	{
+		burst->rawbytes += data.length();
+		burst->sentbytes += out.length();
+	}
+}
+
+bool TreeSocket::Inflate()
+{
+	if (recvq_pos < recvq.length())
+	{
+		bool ok = inflater->Decompress(recvq.data() + recvq_pos, recvq.length() - recvq_pos, inflated);
+		recvq_pos = recvq.length();
+		if (!ok)
+		{
+			SendError("Decompression failed");
+			return false;
+		}
+	}
+	return true;
+}
+
+bool TreeSocket::ReadLine(std::string& line)
+{
+	if (!inflater)
+		return GetNextLine(line);
+
+	if (!Inflate())
+		return false;
+
+	std::string::size_type i = inflated.find('\n', inflated_pos);
+	if (i == std::string::npos)
+	{
+		inflated.erase(0, inflated_pos);
+		inflated_pos = 0;
+		return false;
+	}
+	line.assign(inflated, inflated_pos, i - inflated_pos);
+	inflated_pos = i + 1;
+	return true;
+}
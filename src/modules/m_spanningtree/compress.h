@@ -0,0 +1,62 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <zlib.h>
+
+/** Compresses everything sent down a server link as a single zlib stream.
+ * The stream is flushed at the end of every write, so that the other side
+ * can decompress each line as soon as it arrives.
+ */
+class LinkDeflater
+{
+	z_stream stream;
+	bool ready;
+ public:
+	LinkDeflater();
+	~LinkDeflater();
+
+	/** Set up the stream; must succeed before anything is compressed */
+	bool Init();
+
+	/** Compress some data
+	 * @param data The data to compress
+	 * @param flush True to flush everything compressed so far to out
+	 * @param out String to append the compressed data to
+	 */
+	bool Compress(const std::string& data, bool flush, std::string& out);
+};
+
+/** Decompresses everything received from a server link after it started compressing */
+class LinkInflater
+{
+	z_stream stream;
+	bool ready;
+ public:
+	LinkInflater();
+	~LinkInflater();
+
+	/** Set up the stream; must succeed before anything is decompressed */
+	bool Init();
+
+	/** Decompress some data
+	 * @param data The data to decompress
+	 * @param len The length of the data
+	 * @param out String to append the decompressed data to
+	 */
+	bool Decompress(const char* data, size_t len, std::string& out);
+};
+
+#endif
@@ -0,0 +1,578 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include <iostream>
+
+#include "main.h"
+#include "treesocket.h"
+#include "framing.h"
+
+/** The interned command table. Entry n is sent as n + 1; 0 means the
+ * command follows as a string. Only ever append to this.
+ */
+static const char* const commands[] = {
+	"PRIVMSG", "NOTICE", "UID", "FJOIN", "FMODE", "FTOPIC", "METADATA", "QUIT",
+	"NICK", "PART", "KICK", "MODE", "TOPIC", "PING", "PONG", "BURST",
+	"ENDBURST", "VERSION", "SERVER", "SQUIT", "RSQUIT", "ADDLINE", "DELLINE", "ENCAP",
+	"SVSNICK", "SVSJOIN", "SVSPART", "SVSMODE", "OPERTYPE", "OPERQUIT", "FHOST", "FNAME",
+	"FIDENT", "AWAY", "KILL", "INVITE", "SNONOTICE", "SAVE", "ERROR", "PUSH",
+	"IDLE", "RESYNC", "WALLOPS"
+};
+
+const unsigned int BinaryFraming::CommandCount = sizeof(commands) / sizeof(*commands);
+
+/** How each field (the prefix, a literal command, or a parameter) is sent.
+ * The type is in the low 3 bits of the first byte of the field.
+ */
+enum FieldType
+{
+	FIELD_NONE,	/* No prefix */
+	FIELD_STRING,	/* Length in the upper 5 bits, or SHORT_STRING and then (length - SHORT_STRING) as a varint; then the bytes */
+	FIELD_NUMBER,	/* Decimal number without leading zeroes, as a varint */
+	FIELD_SID,	/* 3 characters of [0-9A-Z], as a 2 byte base 36 number */
+	FIELD_UUID	/* 9 characters of [0-9A-Z], as a 6 byte base 36 number */
+};
+
+static const unsigned int SHORT_STRING = 31;
+
+static const char base36[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+static inline int Base36Value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static void PutVarint(std::string& out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back((char)((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+static bool GetVarint(const char*& p, const char* end, uint64_t& value)
+{
+	value = 0;
+	for (unsigned int shift = 0; p != end && shift < 64; shift += 7)
+	{
+		unsigned char c = *p++;
+		value |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static void PutField(std::string& out, const char* s, size_t len)
+{
+	if (len && len <= 19 && (s[0] != '0' || len == 1))
+	{
+		uint64_t value = 0;
+		size_t i = 0;
+		for (; i < len && s[i] >= '0' && s[i] <= '9'; i++)
+			value = value * 10 + (s[i] - '0');
+		if (i == len)
+		{
+			out.push_back(FIELD_NUMBER);
+			PutVarint(out, value);
+			return;
+		}
+	}
+
+	if (len == 3 || len == 9)
+	{
+		uint64_t value = 0;
+		size_t i = 0;
+		for (int digit; i < len && (digit = Base36Value(s[i])) >= 0; i++)
+			value = value * 36 + digit;
+		if (i == len)
+		{
+			out.push_back(len == 3 ? FIELD_SID : FIELD_UUID);
+			for (int shift = (len == 3 ? 8 : 40); shift >= 0; shift -= 8)
+				out.push_back((char)(value >> shift));
+			return;
+		}
+	}
+
+	if (len < SHORT_STRING)
+		out.push_back((char)(FIELD_STRING | (len << 3)));
+	else
+	{
+		out.push_back((char)(FIELD_STRING | (SHORT_STRING << 3)));
+		PutVarint(out, len - SHORT_STRING);
+	}
+	out.append(s, len);
+}
+
+static bool GetField(const char*& p, const char* end, std::string& out)
+{
+	if (p == end)
+		return false;
+	unsigned char type = *p++;
+	switch (type & 7)
+	{
+		case FIELD_STRING:
+		{
+			uint64_t len = type >> 3;
+			if (len == SHORT_STRING)
+			{
+				uint64_t more;
+				if (!GetVarint(p, end, more) || more > (uint64_t)(end - p))
+					return false;
+				len += more;
+			}
+			if (len > (uint64_t)(end - p))
+				return false;
+			/* Nothing a line could not have held */
+			for (const char* c = p; c != p + len; c++)
+				if (*c == '\0' || *c == '\r' || *c == '\n')
+					return false;
+			out.assign(p, len);
+			p += len;
+			return true;
+		}
+		case FIELD_NUMBER:
+		{
+			uint64_t value;
+			if ((type >> 3) || !GetVarint(p, end, value))
+				return false;
+			char buf[24];
+			char* s = buf + sizeof(buf);
+			do
+			{
+				*--s = '0' + (value % 10);
+				value /= 10;
+			} while (value);
+			out.assign(s, buf + sizeof(buf) - s);
+			return true;
+		}
+		case FIELD_SID:
+		case FIELD_UUID:
+		{
+			size_t bytes = ((type & 7) == FIELD_SID) ? 2 : 6;
+			size_t len = ((type & 7) == FIELD_SID) ? 3 : 9;
+			if ((type >> 3) || (size_t)(end - p) < bytes)
+				return false;
+			uint64_t value = 0;
+			for (size_t i = 0; i < bytes; i++)
+				value = (value << 8) | (unsigned char)*p++;
+			out.resize(len);
+			for (size_t i = len; i > 0; i--)
+			{
+				out[i - 1] = base36[value % 36];
+				value /= 36;
+			}
+			/* Anything left over did not come from len base 36 digits */
+			return !value;
+		}
+	}
+	return false;
+}
+
+/** Split a line the way irc::tokenstream would, for the usual case of
+ * tokens separated by single spaces.
+ * @return False if the line is anything else
+ */
+static bool SplitSimple(const char* line, size_t len, std::vector<std::pair<const char*, size_t> >& tokens)
+{
+	const char* p = line;
+	const char* end = line + len;
+	if (p == end || *p == ' ')
+		return false;
+
+	if (*p == ':')
+	{
+		const char* start = ++p;
+		while (p != end && *p != ' ')
+			p++;
+		if (p == start || p == end)
+			return false;
+		tokens.push_back(std::make_pair(start, p - start));
+		p++;
+	}
+	else
+		tokens.push_back(std::make_pair((const char*)NULL, 0));
+
+	while (true)
+	{
+		if (p == end || *p == ' ')
+			return false;
+		if (*p == ':')
+		{
+			/* A command is never a trailing parameter */
+			if (tokens.size() < 2)
+				return false;
+			tokens.push_back(std::make_pair(p + 1, end - p - 1));
+			return true;
+		}
+		const char* start = p;
+		while (p != end && *p != ' ')
+			p++;
+		tokens.push_back(std::make_pair(start, p - start));
+		if (p == end)
+			return true;
+		p++;
+	}
+}
+
+void BinaryFraming::Encode(const char* line, size_t len, unsigned int commandcount, std::string& out)
+{
+	static std::map<std::string, unsigned int> ids;
+	if (ids.empty())
+	{
+		for (unsigned int i = 0; i < CommandCount; i++)
+			ids[commands[i]] = i + 1;
+	}
+
+	/* The prefix (NULL if there is none), the command, then the parameters */
+	static std::vector<std::pair<const char*, size_t> > tokens;
+	static std::vector<std::string> words;
+	tokens.clear();
+	if (!SplitSimple(line, len, tokens))
+	{
+		/* Anything unusual goes through irc::tokenstream, as TreeSocket::Split does */
+		tokens.clear();
+		words.clear();
+		irc::tokenstream stream(line, len);
+		std::string word;
+		while (stream.GetToken(word))
+			words.push_back(word);
+		if (!words.empty() && words[0][0] == ':')
+			tokens.push_back(std::make_pair(words[0].data() + 1, words[0].length() - 1));
+		else
+			tokens.push_back(std::make_pair((const char*)NULL, 0));
+		for (unsigned int i = (tokens[0].first ? 1 : 0); i < words.size(); i++)
+			tokens.push_back(std::make_pair(words[i].data(), words[i].length()));
+	}
+	if (tokens.size() < 2 || !tokens[1].second)
+		return;
+
+	static std::string body;
+	body.clear();
+	std::map<std::string, unsigned int>::iterator id = ids.find(std::string(tokens[1].first, tokens[1].second));
+	if (id != ids.end() && id->second <= commandcount)
+		PutVarint(body, id->second);
+	else
+	{
+		PutVarint(body, 0);
+		PutField(body, tokens[1].first, tokens[1].second);
+	}
+	if (tokens[0].first)
+		PutField(body, tokens[0].first, tokens[0].second);
+	else
+		body.push_back(FIELD_NONE);
+	PutVarint(body, tokens.size() - 2);
+	for (unsigned int i = 2; i < tokens.size(); i++)
+		PutField(body, tokens[i].first, tokens[i].second);
+
+	PutVarint(out, body.length());
+	out.append(body);
+}
+
+int BinaryFraming::Decode(const std::string& buf, std::string::size_type& pos, std::string& prefix, std::string& command, parameterlist& params)
+{
+	const char* start = buf.data() + pos;
+	const char* end = buf.data() + buf.length();
+	const char* p = start;
+
+	uint64_t len;
+	if (!GetVarint(p, end, len))
+		return (end - start < 10) ? 0 : -1;
+	if (len > MaxFrame)
+		return -1;
+	if (len > (uint64_t)(end - p))
+		return 0;
+	end = p + len;
+
+	uint64_t id;
+	if (!GetVarint(p, end, id))
+		return -1;
+	if (!id)
+	{
+		if (!GetField(p, end, command))
+			return -1;
+	}
+	else if (id <= CommandCount)
+		command = commands[id - 1];
+	else
+		return -1;
+	if (command.empty() || command.find(' ') != std::string::npos)
+		return -1;
+
+	if (p == end)
+		return -1;
+	if (*p == FIELD_NONE)
+	{
+		prefix.clear();
+		p++;
+	}
+	else if (!GetField(p, end, prefix) || prefix.empty() || prefix.find(' ') != std::string::npos)
+		return -1;
+
+	uint64_t count;
+	if (!GetVarint(p, end, count) || count > (uint64_t)(end - p))
+		return -1;
+	params.resize(count);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (!GetField(p, end, params[i]))
+			return -1;
+		/* Only the last parameter may be empty, have spaces, or start with ':' */
+		const std::string& param = params[i];
+		if (i + 1 < count && (param.empty() || param[0] == ':' || param.find(' ') != std::string::npos))
+			return -1;
+	}
+	if (p != end)
+		return -1;
+
+	pos = end - buf.data();
+	return 1;
+}
+
+bool TreeSocket::ReadFrame(std::string& prefix, std::string& command, parameterlist& params)
+{
+	if (inflater && !Inflate())
+		return false;
+
+	std::string& buf = inflater ? inflated : recvq;
+	std::string::size_type& pos = inflater ? inflated_pos : recvq_pos;
+	int rv = BinaryFraming::Decode(buf, pos, prefix, command, params);
+	if (rv < 0)
+	{
+		SendError("Malformed frame received");
+		return false;
+	}
+	if (!rv && inflater)
+	{
+		inflated.erase(0, inflated_pos);
+		inflated_pos = 0;
+	}
+	return rv > 0;
+}
+
+void TreeSocket::ProcessFrame(std::string& prefix, std::string& command, parameterlist& params)
+{
+	/* The text of the line is only rebuilt for the log and crash reports */
+	std::string line = prefix.empty() ? command : ":" + prefix + " " + command;
+	for (unsigned int i = 0; i < params.size(); i++)
+	{
+		line.push_back(' ');
+		if (i + 1 == params.size() && (params[i].empty() || params[i][0] == ':' || params[i].find(' ') != std::string::npos))
+			line.push_back(':');
+		line.append(params[i]);
+	}
+	CrashState cmd_tracer(HERE_STR, line.c_str());
+
+	ServerInstance->Logs->Log("m_spanningtree", RAWIO, "S[%d] I %s", this->GetFd(), line.c_str());
+
+	/* Frames only start after BURST, which put us in the CONNECTED state */
+	if (this->LinkState == CONNECTED)
+		this->ProcessConnectedLine(prefix, command, params);
+}
+
+/** Encode a line and decode it again, checking that the result is what
+ * irc::tokenstream makes of the line, and that every truncation of the
+ * frame is reported as incomplete rather than decoded or refused.
+ */
+static bool RoundTrip(const std::string& line, unsigned int commandcount)
+{
+	std::string frame;
+	BinaryFraming::Encode(line.data(), line.length(), commandcount, frame);
+
+	std::string expprefix, expcommand, word;
+	parameterlist expparams;
+	irc::tokenstream stream(line);
+	for (bool first = true; stream.GetToken(word); first = false)
+	{
+		if (first && !word.empty() && word[0] == ':')
+			expprefix = word.substr(1);
+		else if (expcommand.empty())
+			expcommand = word;
+		else
+			expparams.push_back(word);
+	}
+
+	std::string prefix, command;
+	parameterlist params;
+	std::string::size_type pos = 0;
+	if (BinaryFraming::Decode(frame, pos, prefix, command, params) != 1 || pos != frame.length())
+		return false;
+	if (prefix != expprefix || command != expcommand || params != expparams)
+		return false;
+
+	for (std::string::size_type len = 0; len < frame.length(); len++)
+	{
+		std::string part(frame, 0, len);
+		pos = 0;
+		if (BinaryFraming::Decode(part, pos, prefix, command, params) != 0 || pos)
+			return false;
+	}
+	return true;
+}
+
+/** Decode a hand built frame body, returning what Decode did with it */
+static int DecodeBody(const std::string& body)
+{
+	std::string frame, prefix, command;
+	PutVarint(frame, body.length());
+	frame.append(body);
+	parameterlist params;
+	std::string::size_type pos = 0;
+	return BinaryFraming::Decode(frame, pos, prefix, command, params);
+}
+
+/** Start a frame body for the given interned command with no prefix and count parameters */
+static std::string Body(unsigned int id, unsigned int count)
+{
+	std::string body;
+	PutVarint(body, id);
+	body.push_back(FIELD_NONE);
+	PutVarint(body, count);
+	return body;
+}
+
+void ModuleSpanningTree::RunTestSuite()
+{
+	std::cout << "Binary framing tests" << std::endl << std::endl;
+	bool failed = false, testpassed;
+
+	static const char* const lines[] = {
+		":0AA PRIVMSG #chan :hello world",
+		":0AAAAAAAB PRIVMSG #chan :",
+		":0AAAAAAAB PRIVMSG #chan ::-)",
+		":0AAAAAAAB PRIVMSG #chan :::",
+		":0AA FJOIN #chan 1234567890 +nt :o,0AAAAAAAB ,0AAAAAAAC",
+		":0AA FMODE #chan 9999999999999999999 +b *!*@*",
+		":0AA FMODE #chan 18446744073709551615 +b *!*@*",
+		":0AA FMODE #chan 99999999999999999999 +b *!*@*",
+		":0AA PING 0 007 00 123 ZZZ zzz 0AAAAAAAA ZZZZZZZZZ 123456789 0AAAAAAA",
+		":0AA METADATA 0AAAAAAAB accountname :",
+		":0AA ENCAP * FOO bar :baz qux",
+		"SERVER hub.test password 0 0AA :Hub server",
+		"FOOBAR a b",
+		":0AA  PRIVMSG  #chan  :two  spaces ",
+		"PING  0AA",
+		":0AA PRIVMSG #chan  :",
+		":0AA PRIVMSG #chan :trailing  ",
+		NULL
+	};
+	testpassed = true;
+	for (unsigned int i = 0; lines[i] && testpassed; i++)
+	{
+		testpassed = RoundTrip(lines[i], BinaryFraming::CommandCount) && RoundTrip(lines[i], 5);
+		if (!testpassed)
+			std::cout << "'" << lines[i] << "' ";
+	}
+	std::cout << "lines decode to their tokens: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	std::string frame, prefix, command;
+	parameterlist params;
+	std::string::size_type pos = 0;
+	BinaryFraming::Encode(":0AA", 4, BinaryFraming::CommandCount, frame);
+	testpassed = frame.empty();
+	std::cout << "lines without a command are dropped: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	BinaryFraming::Encode(":0AA PING 0AB", 13, BinaryFraming::CommandCount, frame);
+	std::string::size_type first = frame.length();
+	BinaryFraming::Encode(":0AB PONG 0AA", 13, BinaryFraming::CommandCount, frame);
+	testpassed = (BinaryFraming::Decode(frame, pos, prefix, command, params) == 1 && pos == first && command == "PING"
+		&& BinaryFraming::Decode(frame, pos, prefix, command, params) == 1 && pos == frame.length() && command == "PONG" && prefix == "0AB"
+		&& BinaryFraming::Decode(frame, pos, prefix, command, params) == 0);
+	std::cout << "consecutive frames: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	/* A frame which ends before its last field does, followed by the rest of that field */
+	std::string body;
+	BinaryFraming::Encode(":0AA PING :some text", 20, BinaryFraming::CommandCount, body);
+	body.erase(0, 1);
+	frame.clear();
+	PutVarint(frame, body.length() - 1);
+	frame.append(body);
+	pos = 0;
+	testpassed = (BinaryFraming::Decode(frame, pos, prefix, command, params) == -1 && !pos);
+	std::cout << "fields never run past the frame: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	frame.assign(9, (char)0x80);
+	pos = 0;
+	testpassed = (BinaryFraming::Decode(frame, pos, prefix, command, params) == 0);
+	frame.push_back((char)0x80);
+	testpassed = testpassed && (BinaryFraming::Decode(frame, pos, prefix, command, params) == -1);
+	frame.clear();
+	PutVarint(frame, BinaryFraming::MaxFrame + 1);
+	testpassed = testpassed && (BinaryFraming::Decode(frame, pos, prefix, command, params) == -1) && !pos;
+	std::cout << "bad frame lengths: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	testpassed = (DecodeBody(Body(BinaryFraming::CommandCount, 0)) == 1 && DecodeBody(Body(BinaryFraming::CommandCount + 1, 0)) == -1);
+	body = Body(0, 0);
+	body.insert(1, 1, (char)FIELD_STRING);
+	testpassed = testpassed && (DecodeBody(body) == -1);
+	body = Body(0, 0);
+	body.insert(1, 1, (char)FIELD_NONE);
+	testpassed = testpassed && (DecodeBody(body) == -1);
+	std::cout << "bad commands: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	testpassed = (DecodeBody(Body(1, 200)) == -1);
+	body = Body(1, 2);
+	PutField(body, "", 0);
+	PutField(body, "x", 1);
+	testpassed = testpassed && (DecodeBody(body) == -1);
+	body = Body(1, 2);
+	PutField(body, ":x", 2);
+	PutField(body, "x", 1);
+	testpassed = testpassed && (DecodeBody(body) == -1);
+	body = Body(1, 2);
+	PutField(body, "a b", 3);
+	PutField(body, "x", 1);
+	testpassed = testpassed && (DecodeBody(body) == -1);
+	body = Body(1, 1);
+	PutField(body, "a\nb", 3);
+	testpassed = testpassed && (DecodeBody(body) == -1);
+	body = Body(1, 1);
+	PutField(body, "x", 1);
+	body.push_back('x');
+	testpassed = testpassed && (DecodeBody(body) == -1);
+	std::cout << "bad parameters: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	body = Body(1, 1);
+	body.push_back(FIELD_SID);
+	body.append(2, (char)0xFF);
+	testpassed = (DecodeBody(body) == -1);
+	body = Body(1, 1);
+	body.push_back(FIELD_UUID);
+	body.append(6, (char)0xFF);
+	testpassed = testpassed && (DecodeBody(body) == -1);
+	body = Body(1, 1);
+	body.push_back((char)(FIELD_NUMBER | (1 << 3)));
+	PutVarint(body, 1);
+	testpassed = testpassed && (DecodeBody(body) == -1);
+	body = Body(1, 1);
+	body.push_back(5);
+	testpassed = testpassed && (DecodeBody(body) == -1);
+	std::cout << "bad field types: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	std::cout << std::endl << "Result of binary framing tests:" << std::endl << (failed ? "FAILURE" : "SUCCESS") << std::endl << std::endl;
+}
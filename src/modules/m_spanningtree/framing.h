@@ -0,0 +1,59 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __FRAMING_H__
+#define __FRAMING_H__
+
+/** Length-prefixed binary encoding of server protocol lines.
+ *
+ * Servers which advertise BINARY=<n> in CAPAB may be sent this instead of
+ * text from the start of the netburst. Each line becomes a frame: its length
+ * as a varint, then the command, the prefix and the parameters. Commands in
+ * the interned command table are sent as their index in it, decimal numbers
+ * such as timestamps as varints, and SIDs and UUIDs packed into 2 and 6
+ * bytes. The receiver gets exactly the prefix, command and parameters it
+ * would have got from the text line, without having to tokenize it.
+ *
+ * The n in BINARY=<n> is the size of the interned command table, which may
+ * only ever be appended to; senders only use the entries both sides know.
+ */
+class BinaryFraming
+{
+ public:
+	/** Number of entries in the interned command table */
+	static const unsigned int CommandCount;
+
+	/** Largest frame accepted */
+	static const size_t MaxFrame = 1024 * 1024;
+
+	/** Encode a line as a frame. Lines without a command are dropped,
+	 * as the receiver would ignore them anyway.
+	 * @param line The line, without its line ending
+	 * @param len The length of the line
+	 * @param commands Number of interned commands the receiver knows
+	 * @param out String to append the frame to
+	 */
+	static void Encode(const char* line, size_t len, unsigned int commands, std::string& out);
+
+	/** Decode a frame
+	 * @param buf The received data
+	 * @param pos Offset of the frame in buf, moved past it if it is decoded
+	 * @param prefix Set to the prefix of the line, or cleared if there is none
+	 * @param command Set to the command
+	 * @param params Set to the parameters
+	 * @return 1 if a frame was decoded, 0 if buf does not hold all of it yet, or -1 if it is malformed
+	 */
+	static int Decode(const std::string& buf, std::string::size_type& pos, std::string& prefix, std::string& command, parameterlist& params);
+};
+
+#endif
@@ -30,6 +30,8 @@ class Link : public refcountbase
 	int Timeout;
 	std::string Bind;
 	bool Hidden;
+	bool Compress;
+	bool Binary;
 	Link(ConfigTag* Tag) : tag(Tag) {}
 };
 
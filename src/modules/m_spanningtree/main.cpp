@@ -359,9 +359,12 @@ void ModuleSpanningTree::OnUserNotice(User* user, void* dest, int target_type, c
 					cname = status + cname;
 				TreeSocketSet list;
 				Utils->GetListOfServersForChannel(c,list,status,exempt_list);
+				if (list.empty())
+					return;
+				reference<SharedLine> line = Utils->MakeLine(":"+std::string(user->uuid)+" NOTICE "+cname+" :"+text);
 				for (TreeSocketSet::iterator i = list.begin(); i != list.end(); i++)
 				{
-					(**i).WriteLine(":"+std::string(user->uuid)+" NOTICE "+cname+" :"+text);
+					(**i).WriteLine(line);
 				}
 			}
 		}
@@ -410,9 +413,12 @@ void ModuleSpanningTree::OnUserMessage(User* user, void* dest, int target_type,
 					cname = status + cname;
 				TreeSocketSet list;
 				Utils->GetListOfServersForChannel(c,list,status,exempt_list);
+				if (list.empty())
+					return;
+				reference<SharedLine> line = Utils->MakeLine(":"+std::string(user->uuid)+" PRIVMSG "+cname+" :"+text);
 				for (TreeSocketSet::iterator i = list.begin(); i != list.end(); i++)
 				{
-					(**i).WriteLine(":"+std::string(user->uuid)+" PRIVMSG "+cname+" :"+text);
+					(**i).WriteLine(line);
 				}
 			}
 		}
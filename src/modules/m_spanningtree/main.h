@@ -148,6 +148,8 @@ class ModuleSpanningTree : public Module
 	~ModuleSpanningTree();
 	Version GetVersion();
 	void Prioritize();
+	/** Check that binary frames decode to what was encoded, and that malformed ones are refused */
+	void RunTestSuite();
 };
 
 #endif
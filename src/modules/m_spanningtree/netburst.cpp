@@ -18,35 +18,202 @@
 #include "treeserver.h"
 #include "utils.h"
 #include "main.h"
+#include "link.h"
+#include "framing.h"
 
 /** This function is called when we want to send a netburst to a local
  * server. There is a set order we must do this, because for example
  * users require their servers to exist, and channels require their
  * users to exist. You get the idea.
+ *
+ * Only the server tree is sent here. The users, channels and xlines to
+ * send are recorded, and sent a piece at a time by ContinueBurst() as the
+ * sendq drains, so that a large burst neither fills memory nor holds up
+ * everything else while it is generated.
  */
 void TreeSocket::DoBurst(TreeServer* s)
 {
 	std::string name = s->GetName();
-	std::string burst = ":" + ServerInstance->Config->GetSID() + " BURST " +ConvToStr(ServerInstance->Time());
-	std::string endburst = ":" + ServerInstance->Config->GetSID() + " ENDBURST";
-	ServerInstance->SNO->WriteToSnoMask('l',"Bursting to \2%s\2 (Authentication: %s%s).",
+	std::string burstline = ":" + ServerInstance->Config->GetSID() + " BURST " +ConvToStr(ServerInstance->Time());
+
+	/* Compress the rest of the link if we want to and they can decompress it */
+	bool compress = false;
+	if (capab->link && capab->link->Compress)
+	{
+		std::map<std::string,std::string>::iterator n = capab->CapKeys.find("COMPRESS");
+		if (n != capab->CapKeys.end())
+		{
+			irc::commasepstream methods(n->second);
+			std::string method;
+			while (!compress && methods.GetToken(method))
+				compress = (method == "zlib");
+		}
+	}
+
+	/* Likewise send it binary framed, using the interned commands we both know */
+	unsigned int binary = 0;
+	if (capab->link && capab->link->Binary && proto_version == ProtocolVersion)
+	{
+		std::map<std::string,std::string>::iterator n = capab->CapKeys.find("BINARY");
+		int known = (n != capab->CapKeys.end()) ? atoi(n->second.c_str()) : 0;
+		if (known > 0)
+			binary = std::min((unsigned int)known, BinaryFraming::CommandCount);
+	}
+
+	ServerInstance->SNO->WriteToSnoMask('l',"Bursting to \2%s\2 (Authentication: %s%s%s%s).",
 		name.c_str(),
 		capab->auth_fingerprint ? "SSL Fingerprint and " : "",
-		capab->auth_challenge ? "challenge-response" : "plaintext password");
+		capab->auth_challenge ? "challenge-response" : "plaintext password",
+		compress ? ", compressed" : "",
+		binary ? ", binary" : "");
 	this->CleanNegotiationInfo();
-	this->WriteLine(burst);
+	if (compress)
+		burstline.append(" zlib");
+	if (binary)
+		burstline.append(" binary");
+	this->WriteLine(burstline);
+	if (compress && !StartDeflate())
+	{
+		SetError("Could not start compression");
+		return;
+	}
+	binary_commands = binary;
+
+	burst = new BurstState;
+	burst->start = ServerInstance->Time_ms();
+	burst->generating = true;
 	/* send our version string */
 	this->WriteLine(std::string(":")+ServerInstance->Config->GetSID()+" VERSION :"+ServerInstance->GetVersionString());
 	/* Send server tree */
 	this->SendServers(Utils->TreeRoot,s,1);
-	/* Send users and their oper status */
-	this->SendUsers(s);
-	/* Send everything else (channel modes, xlines etc) */
-	this->SendChannelModes(s);
-	this->SendXLines(s);
-	FOREACH_MOD(I_OnSyncNetwork,OnSyncNetwork(&sync));
-	this->WriteLine(endburst);
-	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+name+"\2.");
+	burst->generating = false;
+
+	for (user_hash::iterator u = ServerInstance->Users->clientlist->begin(); u != ServerInstance->Users->clientlist->end(); u++)
+	{
+		if (u->second->registered == REG_ALL)
+			burst->users.push_back(u->second->uuid);
+	}
+	for (chan_hash::iterator c = ServerInstance->chanlist->begin(); c != ServerInstance->chanlist->end(); c++)
+		burst->channels.push_back(c->second->name);
+
+	std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
+	time_t current = ServerInstance->Time();
+	for (std::vector<std::string>::iterator it = types.begin(); it != types.end(); ++it)
+	{
+		XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
+		if (!lookup)
+			continue;
+		for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
+		{
+			/* Is it burstable? this is better than an explicit check for type 'K'.
+			 * We break the loop as NONE of the items in this group are worth iterating.
+			 */
+			if (!i->second->IsBurstable())
+				break;
+
+			/* If it's expired, don't bother to burst it
+			 */
+			if (i->second->duration && current > i->second->expiry)
+				continue;
+
+			burst->xlines.push_back(std::make_pair(*it, i->first));
+		}
+	}
+
+	ContinueBurst();
+}
+
+bool BurstState::Defer(const std::string& line, const std::string& data)
+{
+	if (generating)
+		return false;
+
+	/* Pings and errors still go straight through */
+	std::string::size_type a = (line[0] == ':') ? line.find(' ') : std::string::npos;
+	std::string::size_type b = line.find_first_of(" \r\n", a + 1);
+	std::string command = line.substr(a + 1, b - a - 1);
+	if (command == "PING" || command == "PONG" || command == "ERROR")
+		return false;
+
+	deferred.append(data);
+	return true;
+}
+
+/** Send the next piece of the netburst: items are sent until at least
+ * <spanningtree:burstbuffer> bytes have been generated, or none are left.
+ */
+void TreeSocket::ContinueBurst()
+{
+	unsigned long target = burst->rawbytes + Utils->BurstBuffer;
+	burst->generating = true;
+	while (burst->phase != BurstState::BURST_DONE && burst->rawbytes < target)
+	{
+		if (burst->phase == BurstState::BURST_USERS && burst->position < burst->users.size())
+		{
+			User* u = ServerInstance->FindUUID(burst->users[burst->position++]);
+			if (u && u->registered == REG_ALL && !u->quitting)
+				SendUser(u);
+		}
+		else if (burst->phase == BurstState::BURST_CHANNELS && burst->position < burst->channels.size())
+		{
+			Channel* c = ServerInstance->FindChan(burst->channels[burst->position++]);
+			if (c)
+				SendFJoins(c);
+		}
+		else if (burst->phase == BurstState::BURST_XLINES && burst->position < burst->xlines.size())
+		{
+			const std::pair<std::string, std::string>& item = burst->xlines[burst->position++];
+			XLineLookup* lookup = ServerInstance->XLines->GetAll(item.first);
+			if (lookup)
+			{
+				LookupIter i = lookup->find(item.second);
+				if (i != lookup->end())
+					SendXLine(i->second);
+			}
+		}
+		else
+		{
+			burst->phase = BurstState::Phase(burst->phase + 1);
+			burst->position = 0;
+		}
+	}
+
+	if (burst->phase == BurstState::BURST_DONE)
+	{
+		FOREACH_MOD(I_OnSyncNetwork,OnSyncNetwork(&sync));
+		this->WriteLine(":" + ServerInstance->Config->GetSID() + " ENDBURST");
+	}
+	WriteRaw("");
+	burst->generating = false;
+	burst->peaksendq = std::max(burst->peaksendq, getSendQSize());
+
+	if (burst->phase == BurstState::BURST_DONE)
+		EndBurst();
+}
+
+void TreeSocket::EndBurst()
+{
+	BurstState* done = burst;
+	burst = NULL;
+
+	uint64_t took = ServerInstance->Time_ms() - done->start;
+	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2%s\2: %lu users, %lu channels and %lu xlines in %lu.%03lu secs, "
+		"peak sendq %lu bytes, %lu bytes sent (%lu before compression, %lu saved).",
+		MyRoot ? MyRoot->GetName().c_str() : linkID.c_str(),
+		(unsigned long)done->users.size(), (unsigned long)done->channels.size(), (unsigned long)done->xlines.size(),
+		(unsigned long)(took / 1000), (unsigned long)(took % 1000), (unsigned long)done->peaksendq,
+		done->sentbytes, done->rawbytes, done->rawbytes > done->sentbytes ? done->rawbytes - done->sentbytes : 0);
+
+	if (!done->deferred.empty())
+		WriteRaw(done->deferred);
+	delete done;
+}
+
+void TreeSocket::DoWrite()
+{
+	BufferedSocket::DoWrite();
+	if (burst && LinkState == CONNECTED && getError().empty() && getSendQSize() < Utils->BurstBuffer)
+		ContinueBurst();
 }
 
 /** Recursively send the server tree with distances as hops.
@@ -163,102 +330,57 @@ void TreeSocket::SendFJoins(Channel* c)
 	FOREACH_MOD(I_OnSyncChannel,OnSyncChannel(c, &sync));
 }
 
-/** Send G, Q, Z and E lines */
-void TreeSocket::SendXLines(TreeServer* Current)
+/** Send a G, Q, Z or E line */
+void TreeSocket::SendXLine(XLine* x)
 {
 	char data[MAXBUF];
-	std::string n = ServerInstance->Config->GetSID();
-	const char* sn = n.c_str();
-
-	std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
-	time_t current = ServerInstance->Time();
+	snprintf(data,MAXBUF,":%s ADDLINE %s %s %s %lu %lu :%s",ServerInstance->Config->GetSID().c_str(), x->type.c_str(), x->Displayable(),
+			x->source.c_str(),
+			(unsigned long)x->set_time,
+			(unsigned long)x->duration,
+			x->reason.c_str());
+	this->WriteLine(data);
+}
 
-	for (std::vector<std::string>::iterator it = types.begin(); it != types.end(); ++it)
+/** Send a user, their oper state/modes and metadata */
+void TreeSocket::SendUser(User* u)
+{
+	char data[MAXBUF];
+	TreeServer* theirserver = Utils->FindServer(u->server);
+	if (theirserver)
 	{
-		XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
-
-		if (lookup)
+		snprintf(data,MAXBUF,":%s UID %s %lu %s %s %s %s %s %lu +%s :%s",
+				theirserver->GetID().c_str(),	/* Prefix: SID */
+				u->uuid.c_str(),		/* 0: UUID */
+				(unsigned long)u->age,		/* 1: TS */
+				u->nick.c_str(),		/* 2: Nick */
+				u->host.c_str(),		/* 3: Displayed Host */
+				u->dhost.c_str(),		/* 4: Real host */
+				u->ident.c_str(),		/* 5: Ident */
+				u->GetIPString(),		/* 6: IP string */
+				(unsigned long)u->signon,	/* 7: Signon time for WHOWAS */
+				u->FormatModes(true),		/* 8...n: Modes and params */
+				u->fullname.c_str());		/* size-1: GECOS */
+		this->WriteLine(data);
+		if (IS_OPER(u))
 		{
-			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
-			{
-				/* Is it burstable? this is better than an explicit check for type 'K'.
-				 * We break the loop as NONE of the items in this group are worth iterating.
-				 */
-				if (!i->second->IsBurstable())
-					break;
-
-				/* If it's expired, don't bother to burst it
-				 */
-				if (i->second->duration && current > i->second->expiry)
-					continue;
-
-				snprintf(data,MAXBUF,":%s ADDLINE %s %s %s %lu %lu :%s",sn, it->c_str(), i->second->Displayable(),
-						i->second->source.c_str(),
-						(unsigned long)i->second->set_time,
-						(unsigned long)i->second->duration,
-						i->second->reason.c_str());
-				this->WriteLine(data);
-			}
+			snprintf(data,MAXBUF,":%s OPERTYPE %s", u->uuid.c_str(), u->oper->name.c_str());
+			this->WriteLine(data);
+		}
+		if (IS_AWAY(u))
+		{
+			snprintf(data,MAXBUF,":%s AWAY %ld :%s", u->uuid.c_str(), (long)u->awaytime, u->awaymsg.c_str());
+			this->WriteLine(data);
 		}
 	}
-}
 
-/** Send channel modes and topics */
-void TreeSocket::SendChannelModes(TreeServer* Current)
-{
-	for (chan_hash::iterator c = ServerInstance->chanlist->begin(); c != ServerInstance->chanlist->end(); c++)
+	for(Extensible::ExtensibleStore::const_iterator i = u->GetExtList().begin(); i != u->GetExtList().end(); i++)
 	{
-		SendFJoins(c->second);
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_NETWORK, u, i->second);
+		if (!value.empty())
+			sync.SendMetaData(u, item->name, value);
 	}
-}
-
-/** send all users and their oper state/modes */
-void TreeSocket::SendUsers(TreeServer* Current)
-{
-	char data[MAXBUF];
-	std::string dataline;
-	for (user_hash::iterator u = ServerInstance->Users->clientlist->begin(); u != ServerInstance->Users->clientlist->end(); u++)
-	{
-		if (u->second->registered == REG_ALL)
-		{
-			TreeServer* theirserver = Utils->FindServer(u->second->server);
-			if (theirserver)
-			{
-				snprintf(data,MAXBUF,":%s UID %s %lu %s %s %s %s %s %lu +%s :%s",
-						theirserver->GetID().c_str(),	/* Prefix: SID */
-						u->second->uuid.c_str(),	/* 0: UUID */
-						(unsigned long)u->second->age,	/* 1: TS */
-						u->second->nick.c_str(),	/* 2: Nick */
-						u->second->host.c_str(),	/* 3: Displayed Host */
-						u->second->dhost.c_str(),	/* 4: Real host */
-						u->second->ident.c_str(),	/* 5: Ident */
-						u->second->GetIPString(),	/* 6: IP string */
-						(unsigned long)u->second->signon, /* 7: Signon time for WHOWAS */
-						u->second->FormatModes(true),	/* 8...n: Modes and params */
-						u->second->fullname.c_str());	/* size-1: GECOS */
-				this->WriteLine(data);
-				if (IS_OPER(u->second))
-				{
-					snprintf(data,MAXBUF,":%s OPERTYPE %s", u->second->uuid.c_str(), u->second->oper->name.c_str());
-					this->WriteLine(data);
-				}
-				if (IS_AWAY(u->second))
-				{
-					snprintf(data,MAXBUF,":%s AWAY %ld :%s", u->second->uuid.c_str(), (long)u->second->awaytime, u->second->awaymsg.c_str());
-					this->WriteLine(data);
-				}
-			}
 
-			for(Extensible::ExtensibleStore::const_iterator i = u->second->GetExtList().begin(); i != u->second->GetExtList().end(); i++)
-			{
-				ExtensionItem* item = i->first;
-				std::string value = item->serialize(FORMAT_NETWORK, u->second, i->second);
-				if (!value.empty())
-					sync.SendMetaData(u->second, item->name, value);
-			}
-
-			FOREACH_MOD(I_OnSyncUser,OnSyncUser(u->second,&sync));
-		}
-	}
+	FOREACH_MOD(I_OnSyncUser,OnSyncUser(u,&sync));
 }
-
@@ -33,6 +33,10 @@ void ModuleSpanningTree::OnPostCommand(const std::string &command, const std::ve
 
 void SpanningTreeUtilities::RouteCommand(TreeServer* origin, const std::string &command, const parameterlist& parameters, User *user)
 {
+	/* Nowhere to route it */
+	if (!TreeRoot->ChildCount())
+		return;
+
 	if (!ServerInstance->IsValidModuleCommand(command, parameters.size(), user))
 		return;
 
@@ -93,6 +97,9 @@ void SpanningTreeUtilities::RouteCommand(TreeServer* origin, const std::string &
 
 	params.push_back(output_text);
 
+	/* Formatted once here, and queued by reference on every link it goes to */
+	reference<SharedLine> line = MakeLine(user->uuid, sent_cmd, params);
+
 	if (routing.type == ROUTE_TYPE_MESSAGE)
 	{
 		char pfx = 0;
@@ -110,23 +117,20 @@ void SpanningTreeUtilities::RouteCommand(TreeServer* origin, const std::string &
 			TreeSocketSet list;
 			// TODO OnBuildExemptList hook was here
 			GetListOfServersForChannel(c,list,pfx, CUList());
-			std::string data = ":" + user->uuid + " " + sent_cmd;
-			for (unsigned int x = 0; x < params.size(); x++)
-				data += " " + params[x];
 			for (TreeSocketSet::iterator i = list.begin(); i != list.end(); i++)
 			{
 				TreeSocket* Sock = *i;
 				if (origin && origin->GetSocket() == Sock)
 					continue;
-				Sock->WriteLine(data);
+				Sock->WriteLine(line);
 			}
 		}
 		else if (dest[0] == '$')
 		{
 			if (origin)
-				DoOneToAllButSender(user->uuid, sent_cmd, params, origin->GetName());
+				DoOneToAllButSender(line, origin->GetName());
 			else
-				DoOneToMany(user->uuid, sent_cmd, params);
+				DoOneToMany(line);
 		}
 		else
 		{
@@ -138,20 +142,20 @@ void SpanningTreeUtilities::RouteCommand(TreeServer* origin, const std::string &
 			if (origin && tsd->GetSocket() == origin->GetSocket())
 				// huh? no routing stuff around in a circle, please.
 				return;
-			DoOneToOne(user->uuid, sent_cmd, params, d->server);
+			DoOneToOne(line, d->server);
 		}
 	}
 	else if (routing.type == ROUTE_TYPE_BROADCAST || routing.type == ROUTE_TYPE_OPT_BCAST)
 	{
 		if (origin)
-			DoOneToAllButSender(user->uuid, sent_cmd, params, origin->GetName());
+			DoOneToAllButSender(line, origin->GetName());
 		else
-			DoOneToMany(user->uuid, sent_cmd, params);
+			DoOneToMany(line);
 	}
 	else if (routing.type == ROUTE_TYPE_UNICAST || routing.type == ROUTE_TYPE_OPT_UCAST)
 	{
 		if (origin && routing.serverdest == origin->GetName())
 			return;
-		DoOneToOne(user->uuid, sent_cmd, params, routing.serverdest);
+		DoOneToOne(line, routing.serverdest);
 	}
 }
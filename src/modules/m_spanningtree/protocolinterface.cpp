@@ -151,9 +151,12 @@ void SpanningTreeProtocolInterface::SendChannel(Channel* target, char status, co
 	TreeSocketSet list;
 	CUList exempt_list;
 	Utils->GetListOfServersForChannel(target,list,status,exempt_list);
+	if (list.empty())
+		return;
+	reference<SharedLine> line = Utils->MakeLine(text);
 	for (TreeSocketSet::iterator i = list.begin(); i != list.end(); i++)
 	{
-		(**i).WriteLine(text);
+		(**i).WriteLine(line);
 	}
 }
 
@@ -241,6 +241,7 @@ bool TreeSocket::Inbound_Server(parameterlist &params)
 
 		ServerInstance->SNO->WriteToSnoMask('l',"Verified incoming server connection " + linkID + " ("+description+")");
 		linkID = sname;
+		capab->link = x;
 
 		// this is good. Send our details: Our server name and description and hopcount of 0,
 		// along with the sendpass from this block.
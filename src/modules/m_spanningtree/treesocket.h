@@ -72,6 +72,38 @@ struct CapabData
 	bool auth_challenge;			/* Did we auth using challenge/response */
 };
 
+/** Progress of a netburst which is being sent a piece at a time.
+ * The users and channels to send are recorded when the burst starts, and
+ * looked up again when their turn comes, so that any which have gone in
+ * the meantime are skipped. Anything else sent down the link during the
+ * burst is held back until ENDBURST.
+ */
+struct BurstState
+{
+	enum Phase { BURST_USERS, BURST_CHANNELS, BURST_XLINES, BURST_DONE };
+	Phase phase;				/* What is being sent now */
+	size_t position;			/* Next item of the current phase */
+	std::vector<std::string> users;		/* UUIDs of the users to send */
+	std::vector<std::string> channels;	/* Names of the channels to send */
+	std::vector<std::pair<std::string, std::string> > xlines;	/* Type and mask of the xlines to send */
+	bool generating;			/* Lines written now are part of the burst */
+	std::string deferred;			/* Other lines, sent after ENDBURST */
+	uint64_t start;				/* Time the burst started, in milliseconds */
+	size_t peaksendq;			/* Largest sendq seen during the burst */
+	unsigned long rawbytes;			/* Bytes of burst before compression */
+	unsigned long sentbytes;		/* Bytes of burst actually queued */
+	BurstState() : phase(BURST_USERS), position(0), generating(false), start(0), peaksendq(0), rawbytes(0), sentbytes(0) {}
+
+	/** Hold back a line written during the burst if it is not part of it
+	 * @param line The line
+	 * @param data What is sent for the line: the line with its line ending, or its frame
+	 * @return True if the line was held back
+	 */
+	bool Defer(const std::string& line, const std::string& data);
+};
+
+class LinkDeflater;
+class LinkInflater;
 class TreeSocket;
 
 class SpanningTreeSyncTarget : public SyncTarget
@@ -95,6 +127,39 @@ class TreeSocket : public BufferedSocket
 	ServerState LinkState;			/* Link state */
 	CapabData* capab;			/* Link setup data (held until burst is sent) */
 	TreeServer* MyRoot;			/* The server we are talking to */
+	BurstState* burst;			/* Netburst being sent, if any */
+	LinkDeflater* deflater;			/* Compressor for what we send, if enabled */
+	LinkInflater* inflater;			/* Decompressor for what we receive, if enabled */
+	std::string inflated;			/* Decompressed data not yet processed */
+	std::string::size_type inflated_pos;	/* Offset of the first unprocessed byte of inflated */
+	unsigned int binary_commands;		/* Interned commands the other side knows if what we send is binary framed, else 0 */
+	bool binary_in;				/* What we receive is binary framed */
+
+	/** Send the next piece of the netburst, and finish it if nothing is left */
+	void ContinueBurst();
+
+	/** Send ENDBURST, report on the burst, and send the lines held back during it */
+	void EndBurst();
+
+	/** Queue data to be sent, compressing it if compression is enabled
+	 * @param data One or more complete lines
+	 * @param flush True to flush the compressor, so the data can be decompressed as soon as it arrives
+	 */
+	void WriteRaw(const std::string& data, bool flush = true);
+
+	/** Decompress everything received so far */
+	bool Inflate();
+
+	/** Get the next line received, decompressing it if compression is enabled */
+	bool ReadLine(std::string& line);
+
+	/** Get the next frame received, decompressing it if compression is enabled */
+	bool ReadFrame(std::string& prefix, std::string& command, parameterlist& params);
+
+	/** Act on the options given after the timestamp in BURST by the server
+	 * we are talking to, and remove them so that BURST can be passed on
+	 */
+	bool BurstOptions(parameterlist& params);
  public:
 	int proto_version;			/* Remote protocol version */
 	SpanningTreeSyncTarget sync;
@@ -222,14 +287,11 @@ class TreeSocket : public BufferedSocket
 	 */
 	void SendFJoins(Channel* c);
 
-	/** Send G, Q, Z and E lines */
-	void SendXLines(TreeServer* Current);
-
-	/** Send channel modes and topics */
-	void SendChannelModes(TreeServer* Current);
+	/** Send a G, Q, Z or E line */
+	void SendXLine(XLine* x);
 
-	/** send all users and their oper state/modes */
-	void SendUsers(TreeServer* Current);
+	/** Send a user, their oper state/modes and metadata */
+	void SendUser(User* u);
 
 	/** This function is called when we want to send a netburst to a local
 	 * server. There is a set order we must do this, because for example
@@ -238,6 +300,19 @@ class TreeSocket : public BufferedSocket
 	 */
 	void DoBurst(TreeServer* s);
 
+	/** True while our netburst to this server is still being sent */
+	bool IsBursting() const { return burst != NULL; }
+
+	/** Compress everything sent from now on */
+	bool StartDeflate();
+
+	/** Decompress everything received from now on */
+	bool StartInflate();
+
+	/** Flush the sendq, and send more of the netburst if it has drained enough
+	 */
+	virtual void DoWrite();
+
 	/** This function is called when we receive data from a remote
 	 * server.
 	 */
@@ -247,6 +322,12 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLine(std::string line);
 
+	/** Send a line which is also being sent to other servers. It is queued
+	 * by reference unless it has to be rewritten or compressed for this link.
+	 * @param line The line, as built by SpanningTreeUtilities::MakeLine()
+	 */
+	void WriteLine(SharedLine* line);
+
 	/** Handle ERROR command */
 	void Error(parameterlist &params);
 
@@ -314,6 +395,10 @@ class TreeSocket : public BufferedSocket
 
 	void ProcessConnectedLine(std::string& prefix, std::string& command, parameterlist& params);
 
+	/** Process a frame received on a binary framed link
+	 */
+	void ProcessFrame(std::string& prefix, std::string& command, parameterlist& params);
+
 	/** Handle socket timeout from connect()
 	 */
 	virtual void OnTimeout();
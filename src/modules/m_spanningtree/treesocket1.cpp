@@ -20,6 +20,7 @@
 #include "link.h"
 #include "treesocket.h"
 #include "resolvers.h"
+#include "compress.h"
 
 /** Because most of the I/O gubbins are encapsulated within
  * BufferedSocket, we just call the superclass constructor for
@@ -27,7 +28,8 @@
  * to it.
  */
 TreeSocket::TreeSocket(SpanningTreeUtilities* Util, Link* link, Autoconnect* myac, const std::string& ipaddr)
-	: Utils(Util), linkID(link->Name), LinkState(CONNECTING), MyRoot(NULL), proto_version(0),
+	: Utils(Util), linkID(link->Name), LinkState(CONNECTING), MyRoot(NULL), burst(NULL),
+	  deflater(NULL), inflater(NULL), inflated_pos(0), binary_commands(0), binary_in(false), proto_version(0),
 	  sync(this), age(ServerInstance->Time()), NextPing(age + link->Timeout), LastPingWasGood(false)
 {
 	capab = new CapabData;
@@ -54,7 +56,8 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, Link* link, Autoconnect* mya
  * connection. This constructor is used for this purpose.
  */
 TreeSocket::TreeSocket(SpanningTreeUtilities* Util, int newfd, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
-	: BufferedSocket(newfd), Utils(Util), LinkState(WAIT_AUTH_1), MyRoot(NULL), proto_version(0),
+	: BufferedSocket(newfd), Utils(Util), LinkState(WAIT_AUTH_1), MyRoot(NULL), burst(NULL),
+	  deflater(NULL), inflater(NULL), inflated_pos(0), binary_commands(0), binary_in(false), proto_version(0),
 	  sync(this), age(ServerInstance->Time()), NextPing(age + 30), LastPingWasGood(false)
 {
 	capab = new CapabData;
@@ -100,6 +103,9 @@ CullResult TreeSocket::cull()
 TreeSocket::~TreeSocket()
 {
 	delete capab;
+	delete burst;
+	delete deflater;
+	delete inflater;
 }
 
 /** When an outbound connection finishes connecting, we receive
@@ -132,12 +138,13 @@ void TreeSocket::OnError(BufferedSocketError e)
 void TreeSocket::SendError(const std::string &errormessage)
 {
 	WriteLine("ERROR :"+errormessage);
-	DoWrite();
+	// the link is dying before the write, so that no more of a burst is sent
 	if (LinkState != DYING)
 	{
 		ServerInstance->GlobalCulls->AddItem(this);
 		LinkState = DYING;
 	}
+	DoWrite();
 	SetError(errormessage);
 }
 
@@ -217,21 +224,36 @@ void TreeSocket::OnDataReady()
 {
 	Utils->Creator->loopCall = true;
 	std::string line;
-	while (GetNextLine(line))
+	while (true)
 	{
-		std::string::size_type rline = line.find('\r');
-		if (rline != std::string::npos)
-			line = line.substr(0,rline);
-		if (line.find('\0') != std::string::npos)
+		/* BURST may switch the link to frames part way through */
+		if (binary_in)
 		{
-			SendError("Read null character from socket");
-			break;
+			std::string prefix;
+			std::string command;
+			parameterlist params;
+			if (!ReadFrame(prefix, command, params))
+				break;
+			ProcessFrame(prefix, command, params);
+		}
+		else
+		{
+			if (!ReadLine(line))
+				break;
+			std::string::size_type rline = line.find('\r');
+			if (rline != std::string::npos)
+				line.erase(rline);
+			if (line.find('\0') != std::string::npos)
+			{
+				SendError("Read null character from socket");
+				break;
+			}
+			ProcessLine(line);
 		}
-		ProcessLine(line);
 		if (!getError().empty())
 			break;
 	}
-	if (LinkState != CONNECTED && recvq.length() > 4096)
+	if (LinkState != CONNECTED && getRecvQSize() > 4096)
 		SendError("RecvQ overrun (line too long)");
 	Utils->Creator->loopCall = false;
 }
@@ -30,7 +30,7 @@ void TreeSocket::Error(parameterlist &params)
 
 void TreeSocket::Split(const std::string& line, std::string& prefix, std::string& command, parameterlist& params)
 {
-	irc::tokenstream tokens(line);
+	irc::tokenstream tokens(line.data(), line.length());
 
 	if (!tokens.GetToken(prefix))
 		return;
@@ -65,6 +65,26 @@ void TreeSocket::Split(const std::string& line, std::string& prefix, std::string
 	}
 }
 
+/** Everything after a BURST with a compression method is compressed, and
+ * everything after one with "binary" is binary framed
+ */
+bool TreeSocket::BurstOptions(parameterlist& params)
+{
+	for (unsigned int i = 1; i < params.size(); i++)
+	{
+		if (params[i] == "zlib" && !StartInflate())
+		{
+			SendError("Could not start decompression");
+			return false;
+		}
+		else if (params[i] == "binary")
+			binary_in = true;
+	}
+	if (params.size() > 1)
+		params.resize(1);
+	return true;
+}
+
 void TreeSocket::ProcessLine(const std::string &line)
 {
 	std::string prefix;
@@ -156,6 +176,9 @@ void TreeSocket::ProcessLine(const std::string &line)
 				NextPing = ServerInstance->Time() + Utils->PingFreq;
 				LastPingWasGood = true;
 
+				if (!BurstOptions(params))
+					return;
+
 				parameterlist sparams;
 				Utils->DoOneToAllButSender(MyRoot->GetID(), "BURST", params, MyRoot->GetName());
 				MyRoot->bursting = true;
@@ -360,6 +383,8 @@ void TreeSocket::ProcessConnectedLine(std::string& prefix, std::string& command,
 		}
 
 		ServerSource->bursting = true;
+		if (ServerSource == MyRoot && !BurstOptions(params))
+			return;
 		Utils->DoOneToAllButSender(prefix, command, params, prefix);
 	}
 	else if (command == "ENDBURST")
@@ -86,8 +86,9 @@ CmdResult CommandUID::Handle(const parameterlist &params, User* serversrc)
 	{
 		return CMD_INVALID;
 	}
-	(*(ServerInstance->Users->clientlist))[params[2]] = _new;
 	_new->nick = params[2];
+	_new->nickkey = _new->nick;
+	(*(ServerInstance->Users->clientlist))[_new->nickkey] = _new;
 	_new->host = params[3];
 	_new->dhost = params[4];
 	_new->ident = params[5];
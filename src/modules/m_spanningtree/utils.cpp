@@ -19,6 +19,7 @@
 #include "link.h"
 #include "treesocket.h"
 #include "resolvers.h"
+#include "framing.h"
 
 /* Create server sockets off a listener. */
 StreamSocket* ModuleSpanningTree::OnAcceptConnection(int newsock, ListenSocket* from, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
@@ -94,7 +95,7 @@ bool SpanningTreeUtilities::IsServer(const std::string &ServerName)
 	return (FindServer(ServerName) != NULL);
 }
 
-SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C) : Creator(C)
+SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C) : Creator(C), framecommands(0)
 {
 	TreeRoot = new TreeServer(this);
 	this->ReadConfiguration();
@@ -176,15 +177,48 @@ bool SpanningTreeUtilities::DoOneToAllButSenderRaw(const std::string &data, cons
 	return true;
 }
 
-bool SpanningTreeUtilities::DoOneToAllButSender(const std::string &prefix, const std::string &command, const parameterlist &params, std::string omit)
+SharedLine* SpanningTreeUtilities::MakeLine(const std::string &prefix, const std::string &command, const parameterlist &params)
 {
-	TreeServer* omitroute = this->FindServer(omit);
-	std::string FullLine = ":" + prefix + " " + command;
-	unsigned int words = params.size();
-	for (unsigned int x = 0; x < words; x++)
+	size_t length = prefix.length() + command.length() + 3;
+	for (parameterlist::const_iterator i = params.begin(); i != params.end(); ++i)
+		length += i->length() + 1;
+
+	std::string line;
+	line.reserve(length);
+	line.push_back(':');
+	line.append(prefix);
+	line.push_back(' ');
+	line.append(command);
+	for (parameterlist::const_iterator i = params.begin(); i != params.end(); ++i)
+	{
+		line.push_back(' ');
+		line.append(*i);
+	}
+	line.push_back('\n');
+	return new SharedLine(line);
+}
+
+SharedLine* SpanningTreeUtilities::MakeLine(const std::string &text)
+{
+	return new SharedLine(text + "\n");
+}
+
+SharedLine* SpanningTreeUtilities::MakeFrame(SharedLine* line, unsigned int commands)
+{
+	if (line != framedline || commands != framecommands)
 	{
-		FullLine = FullLine + " " + params[x];
+		std::string data;
+		BinaryFraming::Encode(line->data.data(), line->data.length() - 1, commands, data);
+		framedline = line;
+		framecommands = commands;
+		frame = new SharedLine(data);
 	}
+	return frame;
+}
+
+void SpanningTreeUtilities::DoOneToAllButSender(SharedLine* line, const std::string& omit)
+{
+	TreeServer* omitroute = this->FindServer(omit);
 	unsigned int items = this->TreeRoot->ChildCount();
 	for (unsigned int x = 0; x < items; x++)
 	{
@@ -197,20 +231,13 @@ bool SpanningTreeUtilities::DoOneToAllButSender(const std::string &prefix, const
 		{
 			TreeSocket* Sock = Route->GetSocket();
 			if (Sock)
-				Sock->WriteLine(FullLine);
+				Sock->WriteLine(line);
 		}
 	}
-	return true;
 }
 
-bool SpanningTreeUtilities::DoOneToMany(const std::string &prefix, const std::string &command, const parameterlist &params)
+void SpanningTreeUtilities::DoOneToMany(SharedLine* line)
 {
-	std::string FullLine = ":" + prefix + " " + command;
-	unsigned int words = params.size();
-	for (unsigned int x = 0; x < words; x++)
-	{
-		FullLine = FullLine + " " + params[x];
-	}
 	unsigned int items = this->TreeRoot->ChildCount();
 	for (unsigned int x = 0; x < items; x++)
 	{
@@ -219,9 +246,34 @@ bool SpanningTreeUtilities::DoOneToMany(const std::string &prefix, const std::st
 		{
 			TreeSocket* Sock = Route->GetSocket();
 			if (Sock)
-				Sock->WriteLine(FullLine);
+				Sock->WriteLine(line);
 		}
 	}
+}
+
+bool SpanningTreeUtilities::DoOneToOne(SharedLine* line, const std::string& target)
+{
+	TreeServer* Route = this->FindServer(target);
+	if (!Route)
+		return false;
+
+	TreeSocket* Sock = Route->GetSocket();
+	if (Sock)
+		Sock->WriteLine(line);
+	return true;
+}
+
+bool SpanningTreeUtilities::DoOneToAllButSender(const std::string &prefix, const std::string &command, const parameterlist &params, std::string omit)
+{
+	reference<SharedLine> line = MakeLine(prefix, command, params);
+	DoOneToAllButSender(line, omit);
+	return true;
+}
+
+bool SpanningTreeUtilities::DoOneToMany(const std::string &prefix, const std::string &command, const parameterlist &params)
+{
+	reference<SharedLine> line = MakeLine(prefix, command, params);
+	DoOneToMany(line);
 	return true;
 }
 
@@ -241,27 +293,10 @@ bool SpanningTreeUtilities::DoOneToAllButSender(const char* prefix, const char*
 
 bool SpanningTreeUtilities::DoOneToOne(const std::string &prefix, const std::string &command, const parameterlist &params, std::string target)
 {
-	TreeServer* Route = this->FindServer(target);
-	if (Route)
-	{
-		std::string FullLine = ":" + prefix + " " + command;
-		unsigned int words = params.size();
-		for (unsigned int x = 0; x < words; x++)
-		{
-			FullLine = FullLine + " " + params[x];
-		}
-		if (Route && Route->GetSocket())
-		{
-			TreeSocket* Sock = Route->GetSocket();
-			if (Sock)
-				Sock->WriteLine(FullLine);
-		}
-		return true;
-	}
-	else
-	{
+	if (!this->FindServer(target))
 		return false;
-	}
+	reference<SharedLine> line = MakeLine(prefix, command, params);
+	return DoOneToOne(line, target);
 }
 
 void SpanningTreeUtilities::RefreshIPCache()
@@ -309,9 +344,11 @@ void SpanningTreeUtilities::ReadConfiguration()
 	quiet_bursts = tag->getBool("quietbursts");
 	PingWarnTime = tag->getInt("pingwarning");
 	PingFreq = tag->getInt("serverpingfreq", 60);
+	long burstbuffer = tag->getInt("burstbuffer", 65536);
 
 	if (PingWarnTime < 0 || PingWarnTime > PingFreq - 1)
 		PingWarnTime = 0;
+	BurstBuffer = burstbuffer < 1024 ? 1024 : burstbuffer;
 
 	AutoconnectBlocks.clear();
 	LinkBlocks.clear();
@@ -333,6 +370,8 @@ void SpanningTreeUtilities::ReadConfiguration()
 		L->Hook = tag->getString("ssl");
 		L->Bind = tag->getString("bind");
 		L->Hidden = tag->getBool("hidden");
+		L->Compress = tag->getBool("compress");
+		L->Binary = tag->getBool("binary");
 
 		if (L->Fingerprint.find(':') != std::string::npos)
 		{
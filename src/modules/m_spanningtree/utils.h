@@ -29,15 +29,7 @@ class SpanningTreeUtilities;
 /* This hash_map holds the hash equivalent of the server
  * tree, used for rapid linear lookups.
  */
-#if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
-	typedef nspace::hash_map<std::string, TreeServer*, nspace::hash_compare<std::string, std::less<std::string> > > server_hash;
-#else
-	#ifdef HASHCOMP_DEPRECATED
-		typedef nspace::hash_map<std::string, TreeServer*, nspace::insensitive, irc::StrHashComp> server_hash;
-	#else
-		typedef nspace::hash_map<std::string, TreeServer*, nspace::hash<std::string>, irc::StrHashComp> server_hash;
-	#endif
-#endif
+typedef irc::hash_map<std::string, TreeServer*, irc::insensitive, irc::StrHashComp> server_hash;
 
 typedef std::set<TreeSocket*> TreeSocketSet;
 
@@ -81,6 +73,10 @@ class SpanningTreeUtilities : public classbase
 	 * before opers are warned of high latency.
 	 */
 	int PingWarnTime;
+	/** Bytes of netburst generated at a time; more is generated once a
+	 * bursting link's sendq drops below this
+	 */
+	unsigned long BurstBuffer;
 	/** IPs allowed to link to us (collected from link blocks)
 	 */
 	std::vector<std::string> ValidIPs;
@@ -103,6 +99,11 @@ class SpanningTreeUtilities : public classbase
 	/** Lookup hash for servers by SID
 	 */
 	server_hash sidlist;
+	/** The line last encoded by MakeFrame, the interned commands it was encoded for, and its frame
+	 */
+	reference<SharedLine> framedline;
+	unsigned int framecommands;
+	reference<SharedLine> frame;
 
 
 	/** Initialise utility class
@@ -139,6 +140,35 @@ class SpanningTreeUtilities : public classbase
 	 */
 	bool DoOneToMany(const char* prefix, const char* command, const parameterlist &params);
 
+	/** Format a message once, for sending to any number of servers by the
+	 * SharedLine versions of the functions below
+	 * @return A new SharedLine, which should be held in a reference
+	 */
+	static SharedLine* MakeLine(const std::string &prefix, const std::string &command, const parameterlist &params);
+
+	/** Make an already formatted message (without line ending) into a SharedLine, see above
+	 */
+	static SharedLine* MakeLine(const std::string &text);
+
+	/** Get the frame to send for a SharedLine on binary framed links. The last
+	 * one made is kept, so a line sent to many links is only encoded once.
+	 * @param line The line, as made by MakeLine
+	 * @param commands Number of interned commands the receiver knows
+	 */
+	SharedLine* MakeFrame(SharedLine* line, unsigned int commands);
+
+	/** Send a formatted message to one other server, local or remote
+	 */
+	bool DoOneToOne(SharedLine* line, const std::string& target);
+
+	/** Send a formatted message to all servers but one, local or remote
+	 */
+	void DoOneToAllButSender(SharedLine* line, const std::string& omit);
+
+	/** Send a formatted message to all other servers
+	 */
+	void DoOneToMany(SharedLine* line);
+
 	/** Send a message from this server to all others, without doing any processing on the command (e.g. send it as-is with colons and all)
 	 */
 	bool DoOneToAllButSenderRaw(const std::string &data, const std::string &omit, const std::string &prefix, const irc::string &command, const parameterlist &params);
@@ -85,14 +85,9 @@
  */
 
 /*
- * Before you start screaming, this definition is only used here, so moving it to a header is pointless.
- * Yes, it's horrid. Blame cl for being different. -- w00t
+ * This definition is only used here, so moving it to a header is pointless.
  */
-#if defined(WINDOWS) && !defined(HASHMAP_DEPRECATED)
-	typedef nspace::hash_map<irc::string, std::deque<User*>, nspace::hash_compare<irc::string, std::less<irc::string> > > watchentries;
-#else
-	typedef nspace::hash_map<irc::string, std::deque<User*>, nspace::hash<irc::string> > watchentries;
-#endif
+typedef irc::hash_map<irc::string, std::deque<User*>, irc::insensitive> watchentries;
 typedef std::map<irc::string, std::string> watchlist;
 
 /* Who's watching each nickname.
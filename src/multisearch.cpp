@@ -0,0 +1,143 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+/* $Core */
+
+#include "inspircd.h"
+#include "multisearch.h"
+
+irc::multisearch::multisearch(const unsigned char* Map)
+	: national(!Map), map(Map), generation(0), dirty(true), columns(1)
+{
+}
+
+unsigned int irc::multisearch::add(const std::string& word)
+{
+	words.push_back(word);
+	dirty = true;
+	return words.size() - 1;
+}
+
+void irc::multisearch::clear()
+{
+	words.clear();
+	dirty = true;
+}
+
+void irc::multisearch::Compile() const
+{
+	if (national)
+	{
+		map = national_case_insensitive_map;
+		generation = national_case_generation;
+	}
+	dirty = false;
+
+	/* Give every folded character used in a word a column; everything
+	 * else shares column 0, which always leads back to the root.
+	 */
+	unsigned int foldedcolumn[256];
+	memset(foldedcolumn, 0, sizeof(foldedcolumn));
+	columns = 1;
+	for (std::vector<std::string>::const_iterator w = words.begin(); w != words.end(); ++w)
+	{
+		for (std::string::const_iterator c = w->begin(); c != w->end(); ++c)
+		{
+			unsigned char folded = map[(unsigned char)*c];
+			if (!foldedcolumn[folded])
+				foldedcolumn[folded] = columns++;
+		}
+	}
+	for (unsigned int c = 0; c < 256; c++)
+		column[c] = foldedcolumn[map[c]];
+
+	/* Build the trie of the words, with -1 for missing edges */
+	std::vector<int> trie(columns, -1);
+	output.assign(1, -1);
+	sameend.assign(words.size(), -1);
+	for (unsigned int w = 0; w < words.size(); w++)
+	{
+		if (words[w].empty())
+			continue;
+		unsigned int state = 0;
+		for (std::string::const_iterator c = words[w].begin(); c != words[w].end(); ++c)
+		{
+			int& edge = trie[state * columns + column[(unsigned char)*c]];
+			if (edge < 0)
+			{
+				edge = output.size();
+				output.push_back(-1);
+				trie.resize(trie.size() + columns, -1);
+			}
+			state = trie[state * columns + column[(unsigned char)*c]];
+		}
+		sameend[w] = output[state];
+		output[state] = w;
+	}
+
+	/* Walk the trie breadth first, so that the failure state of each state
+	 * is complete before it is used, and fill in the missing edges from it.
+	 */
+	unsigned int states = output.size();
+	next.assign(states * columns, 0);
+	report.assign(states, -1);
+	more.assign(states, -1);
+	std::vector<unsigned int> fail(states, 0);
+	std::vector<unsigned int> queue;
+	queue.reserve(states);
+	for (unsigned int c = 0; c < columns; c++)
+	{
+		int child = trie[c];
+		if (child > 0)
+		{
+			next[c] = child;
+			queue.push_back(child);
+		}
+	}
+	for (unsigned int q = 0; q < queue.size(); q++)
+	{
+		unsigned int state = queue[q];
+		more[state] = report[fail[state]];
+		report[state] = (output[state] >= 0) ? (int)state : more[state];
+		for (unsigned int c = 0; c < columns; c++)
+		{
+			int child = trie[state * columns + c];
+			if (child > 0)
+			{
+				fail[child] = next[fail[state] * columns + c];
+				next[state * columns + c] = child;
+				queue.push_back(child);
+			}
+			else
+				next[state * columns + c] = next[fail[state] * columns + c];
+		}
+	}
+}
+
+void irc::multisearch::Search(const char* text, size_t len, std::vector<hit>& hits) const
+{
+	if (dirty || (national && generation != national_case_generation))
+		Compile();
+
+	const unsigned char* str = reinterpret_cast<const unsigned char*>(text);
+	const unsigned int* table = &next[0];
+	const int* reports = &report[0];
+	unsigned int state = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		state = table[state * columns + column[str[i]]];
+		for (int r = reports[state]; r >= 0; r = more[r])
+			for (int w = output[r]; w >= 0; w = sameend[w])
+				hits.push_back(hit(i + 1, w));
+	}
+}
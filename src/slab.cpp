@@ -0,0 +1,212 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+/* $Core */
+
+#include "inspircd.h"
+#include "slab.h"
+
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
+
+/* Each block starts with a pointer to its slab, padded so the object keeps the alignment operator new would give it */
+static const size_t BLOCK_HEADER = 16;
+static const size_t MIN_SLAB_SIZE = 65536;
+static const size_t MIN_SLAB_OBJECTS = 32;
+static const size_t PAGE_SIZE_GUESS = 4096;
+/* Room for the Slab at the start of each slab, before the first block */
+static const size_t SLAB_HEADER = 64;
+
+struct SlabPool::Slab
+{
+	Slab* prev;
+	Slab* next;
+	/** Free blocks of this slab, linked through their first word */
+	char* free;
+	/** Number of objects in this slab */
+	size_t used;
+	/** True if the slab is on the pool's partial list */
+	bool listed;
+};
+
+static inline size_t RoundUp(size_t n, size_t to)
+{
+	return (n + to - 1) / to * to;
+}
+
+static size_t CalcPerSlab(size_t stride)
+{
+	size_t bytes = RoundUp(std::max(MIN_SLAB_SIZE, SLAB_HEADER + stride * MIN_SLAB_OBJECTS), PAGE_SIZE_GUESS);
+	return (bytes - SLAB_HEADER) / stride;
+}
+
+SlabPool::SlabPool(const char* Name, size_t size)
+	: name(Name), objsize(RoundUp(size, sizeof(void*))), stride(RoundUp(BLOCK_HEADER + objsize, BLOCK_HEADER)),
+	perslab(CalcPerSlab(stride)), partial(NULL), live(0), slabs(0), heapobjs(0)
+{
+	// Compile time check that the slab header fits
+	typedef char SlabHeaderFits[sizeof(Slab) <= SLAB_HEADER ? 1 : -1];
+	(void)sizeof(SlabHeaderFits);
+
+	// Pools are static objects, so this runs before main(); AllPools makes sure the list exists first
+	AllPools().push_back(this);
+}
+
+std::vector<SlabPool*>& SlabPool::AllPools()
+{
+	static std::vector<SlabPool*> pools;
+	return pools;
+}
+
+const std::vector<SlabPool*>& SlabPool::GetPools()
+{
+	return AllPools();
+}
+
+size_t SlabPool::GetSlabSize() const
+{
+	return RoundUp(SLAB_HEADER + stride * perslab, PAGE_SIZE_GUESS);
+}
+
+SlabPool::Slab* SlabPool::NewSlab()
+{
+	size_t bytes = GetSlabSize();
+#ifndef WINDOWS
+	void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		throw std::bad_alloc();
+#else
+	void* mem = ::operator new(bytes);
+#endif
+	Slab* slab = static_cast<Slab*>(mem);
+	slab->prev = slab->next = NULL;
+	slab->used = 0;
+	slab->listed = false;
+
+	// Thread the blocks onto the free list, lowest address first
+	char* base = static_cast<char*>(mem) + SLAB_HEADER;
+	slab->free = NULL;
+	for (size_t i = perslab; i-- > 0; )
+	{
+		char* block = base + i * stride;
+		*reinterpret_cast<Slab**>(block) = slab;
+		*reinterpret_cast<char**>(block + BLOCK_HEADER) = slab->free;
+		slab->free = block;
+	}
+	slabs++;
+	return slab;
+}
+
+void SlabPool::Unlink(Slab* slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		partial = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+	slab->prev = slab->next = NULL;
+	slab->listed = false;
+}
+
+void* SlabPool::Allocate(size_t size)
+{
+	if (size > objsize)
+	{
+		heapobjs++;
+		return ::operator new(size);
+	}
+
+	if (!partial)
+	{
+		Slab* slab;
+		if (!empty.empty())
+		{
+			slab = empty.back();
+			empty.pop_back();
+		}
+		else
+		{
+			slab = NewSlab();
+		}
+		slab->listed = true;
+		partial = slab;
+	}
+
+	Slab* slab = partial;
+	char* block = slab->free;
+	slab->free = *reinterpret_cast<char**>(block + BLOCK_HEADER);
+	slab->used++;
+	live++;
+	if (!slab->free)
+		Unlink(slab);
+	return block + BLOCK_HEADER;
+}
+
+void SlabPool::Deallocate(void* ptr, size_t size)
+{
+	if (!ptr)
+		return;
+	if (size > objsize)
+	{
+		heapobjs--;
+		::operator delete(ptr);
+		return;
+	}
+
+	char* block = static_cast<char*>(ptr) - BLOCK_HEADER;
+	Slab* slab = *reinterpret_cast<Slab**>(block);
+	*reinterpret_cast<char**>(block + BLOCK_HEADER) = slab->free;
+	slab->free = block;
+	slab->used--;
+	live--;
+
+	if (slab->used == 0)
+	{
+		// Kept aside until ReleaseEmpty, rather than unmapped in the middle of a cull
+		if (slab->listed)
+			Unlink(slab);
+		empty.push_back(slab);
+	}
+	else if (!slab->listed)
+	{
+		slab->next = partial;
+		if (partial)
+			partial->prev = slab;
+		partial = slab;
+		slab->listed = true;
+	}
+}
+
+void SlabPool::Release(size_t keep)
+{
+	while (empty.size() > keep)
+	{
+		Slab* slab = empty.back();
+		empty.pop_back();
+#ifndef WINDOWS
+		munmap(slab, GetSlabSize());
+#else
+		::operator delete(slab);
+#endif
+		slabs--;
+	}
+}
+
+void SlabPool::ReleaseEmpty()
+{
+	const std::vector<SlabPool*>& pools = GetPools();
+	for (std::vector<SlabPool*>::const_iterator i = pools.begin(); i != pools.end(); ++i)
+		(*i)->Release(1);
+}
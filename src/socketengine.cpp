@@ -12,6 +12,7 @@
  */
 
 #include "inspircd.h"
+#include "timer.h"
 
 EventHandler::EventHandler()
 {
@@ -26,7 +27,8 @@ void EventHandler::SetFd(int FD)
 
 SocketEngine::SocketEngine()
 {
-	TotalEvents = WriteEvents = ReadEvents = ErrorEvents = 0;
+	TotalEvents = WriteEvents = ReadEvents = ErrorEvents = Syscalls = 0;
+	FlushPasses = FlushedSockets = LastFlushSockets = MaxFlushSockets = 0;
 	lastempty = ServerInstance->Time();
 	indata = outdata = 0;
 }
@@ -53,7 +55,7 @@ void SocketEngine::ChangeEventMask(EventHandler* eh, int change)
 	
 	// if adding a trial read/write, insert it into the set
 	if (change & FD_TRIAL_NOTE_MASK && !(old_m & FD_TRIAL_NOTE_MASK))
-		trials.insert(eh->GetFd());
+		trials.push_back(eh->GetFd());
 
 	new_m |= change;
 	if (new_m == old_m)
@@ -63,12 +65,37 @@ void SocketEngine::ChangeEventMask(EventHandler* eh, int change)
 	OnSetEvent(eh, old_m, new_m);
 }
 
+int SocketEngine::GetMaxWait() const
+{
+	return trials.empty() ? ServerInstance->Timers->GetMaxWait() : 0;
+}
+
 void SocketEngine::DispatchTrialWrites()
 {
 	std::vector<int> working_list;
-	working_list.reserve(trials.size());
-	working_list.assign(trials.begin(), trials.end());
+	working_list.swap(trials);
+
+	// Reads first: the lines they process usually queue writes to other handlers
+	for(unsigned int i=0; i < working_list.size(); i++)
+	{
+		EventHandler* eh = GetRef(working_list[i]);
+		if (!eh)
+			continue;
+		int mask = eh->event_mask;
+		if (!(mask & FD_ADD_TRIAL_READ))
+			continue;
+		// Clear both flags, so a trial read requested again by the handler puts it back on the list
+		eh->event_mask &= ~(FD_ADD_TRIAL_READ | FD_ADD_TRIAL_WRITE);
+		if (!(mask & FD_READ_WILL_BLOCK))
+			eh->HandleEvent(EVENT_READ, 0);
+		if ((mask & FD_ADD_TRIAL_WRITE) && GetRef(working_list[i]) == eh)
+			ChangeEventMask(eh, FD_ADD_TRIAL_WRITE);
+	}
+
+	// Then one write for every handler that is still dirty, including those made dirty by the reads
+	working_list.insert(working_list.end(), trials.begin(), trials.end());
 	trials.clear();
+	unsigned long flushed = 0;
 	for(unsigned int i=0; i < working_list.size(); i++)
 	{
 		int fd = working_list[i];
@@ -76,12 +103,28 @@ void SocketEngine::DispatchTrialWrites()
 		if (!eh)
 			continue;
 		int mask = eh->event_mask;
-		eh->event_mask &= ~(FD_ADD_TRIAL_READ | FD_ADD_TRIAL_WRITE);
-		if ((mask & (FD_ADD_TRIAL_READ | FD_READ_WILL_BLOCK)) == FD_ADD_TRIAL_READ)
-			eh->HandleEvent(EVENT_READ, 0);
-		if ((mask & (FD_ADD_TRIAL_WRITE | FD_WRITE_WILL_BLOCK)) == FD_ADD_TRIAL_WRITE)
+		if (!(mask & FD_ADD_TRIAL_WRITE))
+		{
+			// A trial read requested during this pass waits for the next one
+			if (mask & FD_ADD_TRIAL_READ)
+				trials.push_back(fd);
+			continue;
+		}
+		eh->event_mask &= ~FD_ADD_TRIAL_WRITE;
+		if (mask & FD_ADD_TRIAL_READ)
+			trials.push_back(fd);
+		if (!(mask & FD_WRITE_WILL_BLOCK))
+		{
+			flushed++;
 			eh->HandleEvent(EVENT_WRITE, 0);
+		}
 	}
+
+	FlushPasses++;
+	FlushedSockets += flushed;
+	LastFlushSockets = flushed;
+	if (flushed > MaxFlushSockets)
+		MaxFlushSockets = flushed;
 }
 
 bool SocketEngine::HasFd(int fd)
@@ -105,6 +105,15 @@ static int mask_to_epoll(int event_mask)
 	return rv;
 }
 
+/** A handler which wants no events at all is kept out of the epoll set, as
+ * the kernel reports EPOLLHUP and EPOLLERR whatever it is asked for. This
+ * is the case for sockets whose I/O is done by an I/O thread.
+ */
+static inline bool watched(int epoll_events)
+{
+	return epoll_events & (EPOLLIN | EPOLLOUT);
+}
+
 bool EPollEngine::AddFd(EventHandler* eh, int event_mask)
 {
 	int fd = eh->GetFd();
@@ -124,11 +133,15 @@ bool EPollEngine::AddFd(EventHandler* eh, int event_mask)
 	memset(&ev,0,sizeof(ev));
 	ev.events = mask_to_epoll(event_mask);
 	ev.data.fd = fd;
-	int i = epoll_ctl(EngineHandle, EPOLL_CTL_ADD, fd, &ev);
-	if (i < 0)
+	if (watched(ev.events))
 	{
-		ServerInstance->Logs->Log("SOCKET",DEBUG,"Error adding fd: %d to socketengine: %s", fd, strerror(errno));
-		return false;
+		Syscalls++;
+		int i = epoll_ctl(EngineHandle, EPOLL_CTL_ADD, fd, &ev);
+		if (i < 0)
+		{
+			ServerInstance->Logs->Log("SOCKET",DEBUG,"Error adding fd: %d to socketengine: %s", fd, strerror(errno));
+			return false;
+		}
 	}
 
 	ServerInstance->Logs->Log("SOCKET",DEBUG,"New file descriptor: %d", fd);
@@ -143,14 +156,16 @@ void EPollEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 {
 	int old_events = mask_to_epoll(old_mask);
 	int new_events = mask_to_epoll(new_mask);
-	if (old_events != new_events)
+	if (old_events != new_events && (watched(old_events) || watched(new_events)))
 	{
 		// ok, we actually have something to tell the kernel about
 		struct epoll_event ev;
 		memset(&ev,0,sizeof(ev));
 		ev.events = new_events;
 		ev.data.fd = eh->GetFd();
-		epoll_ctl(EngineHandle, EPOLL_CTL_MOD, eh->GetFd(), &ev);
+		int op = !watched(old_events) ? EPOLL_CTL_ADD : !watched(new_events) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+		Syscalls++;
+		epoll_ctl(EngineHandle, op, eh->GetFd(), &ev);
 	}
 }
 
@@ -163,14 +178,18 @@ void EPollEngine::DelFd(EventHandler* eh)
 		return;
 	}
 
-	struct epoll_event ev;
-	memset(&ev,0,sizeof(ev));
-	ev.data.fd = fd;
-	int i = epoll_ctl(EngineHandle, EPOLL_CTL_DEL, fd, &ev);
-
-	if (i < 0)
+	if (watched(mask_to_epoll(eh->GetEventMask())))
 	{
-		ServerInstance->Logs->Log("SOCKET",DEBUG,"epoll_ctl can't remove socket: %s", strerror(errno));
+		struct epoll_event ev;
+		memset(&ev,0,sizeof(ev));
+		ev.data.fd = fd;
+		Syscalls++;
+		int i = epoll_ctl(EngineHandle, EPOLL_CTL_DEL, fd, &ev);
+
+		if (i < 0)
+		{
+			ServerInstance->Logs->Log("SOCKET",DEBUG,"epoll_ctl can't remove socket: %s", strerror(errno));
+		}
 	}
 
 	ref[fd] = NULL;
@@ -186,7 +205,8 @@ int EPollEngine::DispatchEvents()
 	ServerInstance->UpdateTime();
 	ServerInstance->Logs->Log("SOCKET", DEBUG, "Waiting for events: %ld.%09ld",
 		(long)ServerInstance->Time(), ServerInstance->Time_ns());
-	int i = epoll_wait(EngineHandle, events, GetMaxFds() - 1, 1000);
+	Syscalls++;
+	int i = epoll_wait(EngineHandle, events, GetMaxFds() - 1, GetMaxWait());
 	ServerInstance->UpdateTime();
 	if (i)
 		ServerInstance->Logs->Log("SOCKET", DEBUG, "Dispatching %d socket events: %ld.%09ld",
@@ -201,6 +221,7 @@ int EPollEngine::DispatchEvents()
 		if (!eh)
 		{
 			ServerInstance->Logs->Log("SOCKET",DEBUG,"Got event on unknown fd: %d", events[j].data.fd);
+			Syscalls++;
 			epoll_ctl(EngineHandle, EPOLL_CTL_DEL, events[j].data.fd, &events[j]);
 			continue;
 		}
@@ -109,6 +109,7 @@ bool KQueueEngine::AddFd(EventHandler* eh, int event_mask)
 	struct kevent ke;
 	EV_SET(&ke, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
 
+	Syscalls++;
 	int i = kevent(EngineHandle, &ke, 1, 0, 0, NULL);
 	if (i == -1)
 	{
@@ -141,10 +142,12 @@ void KQueueEngine::DelFd(EventHandler* eh)
 	// First remove the write filter ignoring errors, since we can't be
 	// sure if there are actually any write filters registered.
 	EV_SET(&ke, eh->GetFd(), EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	Syscalls++;
 	kevent(EngineHandle, &ke, 1, 0, 0, NULL);
 
 	// Then remove the read filter.
 	EV_SET(&ke, eh->GetFd(), EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	Syscalls++;
 	int j = kevent(EngineHandle, &ke, 1, 0, 0, NULL);
 
 	if (j < 0)
@@ -166,6 +169,7 @@ void KQueueEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 		// new poll-style write
 		struct kevent ke;
 		EV_SET(&ke, eh->GetFd(), EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+		Syscalls++;
 		int i = kevent(EngineHandle, &ke, 1, 0, 0, NULL);
 		if (i < 0) {
 			ServerInstance->Logs->Log("SOCKET",DEFAULT,"Failed to mark for writing: %d %s",
@@ -177,6 +181,7 @@ void KQueueEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 		// removing poll-style write
 		struct kevent ke;
 		EV_SET(&ke, eh->GetFd(), EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		Syscalls++;
 		int i = kevent(EngineHandle, &ke, 1, 0, 0, NULL);
 		if (i < 0) {
 			ServerInstance->Logs->Log("SOCKET",DEFAULT,"Failed to mark for writing: %d %s",
@@ -188,6 +193,7 @@ void KQueueEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 		// new one-shot write
 		struct kevent ke;
 		EV_SET(&ke, eh->GetFd(), EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+		Syscalls++;
 		int i = kevent(EngineHandle, &ke, 1, 0, 0, NULL);
 		if (i < 0) {
 			ServerInstance->Logs->Log("SOCKET",DEFAULT,"Failed to mark for writing: %d %s",
@@ -198,9 +204,11 @@ void KQueueEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 
 int KQueueEngine::DispatchEvents()
 {
-	ts.tv_nsec = 0;
-	ts.tv_sec = 1;
+	int wait = GetMaxWait();
+	ts.tv_nsec = (wait % 1000) * 1000000L;
+	ts.tv_sec = wait / 1000;
 
+	Syscalls++;
 	int i = kevent(EngineHandle, NULL, 0, &ke_list[0], GetMaxFds(), &ts);
 	ServerInstance->UpdateTime();
 
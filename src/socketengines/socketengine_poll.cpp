@@ -214,7 +214,8 @@ void PollEngine::DelFd(EventHandler* eh)
 
 int PollEngine::DispatchEvents()
 {
-	int i = poll(events, CurrentSetSize, 1000);
+	Syscalls++;
+	int i = poll(events, CurrentSetSize, GetMaxWait());
 	int index;
 	socklen_t codesize = sizeof(int);
 	int errcode;
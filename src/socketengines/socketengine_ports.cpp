@@ -114,6 +114,7 @@ bool PortsEngine::AddFd(EventHandler* eh, int event_mask)
 
 	ref[fd] = eh;
 	SocketEngine::SetEventMask(eh, event_mask);
+	Syscalls++;
 	port_associate(EngineHandle, PORT_SOURCE_FD, fd, mask_to_events(event_mask), eh);
 
 	ServerInstance->Logs->Log("SOCKET",DEBUG,"New file descriptor: %d", fd);
@@ -124,7 +125,10 @@ bool PortsEngine::AddFd(EventHandler* eh, int event_mask)
 void PortsEngine::WantWrite(EventHandler* eh, int old_mask, int new_mask)
 {
 	if (mask_to_events(new_mask) != mask_to_events(old_mask))
+	{
+		Syscalls++;
 		port_associate(EngineHandle, PORT_SOURCE_FD, eh->GetFd(), mask_to_events(new_mask), eh);
+	}
 }
 
 void PortsEngine::DelFd(EventHandler* eh)
@@ -133,6 +137,7 @@ void PortsEngine::DelFd(EventHandler* eh)
 	if ((fd < 0) || (fd > GetMaxFds() - 1))
 		return;
 
+	Syscalls++;
 	port_dissociate(EngineHandle, PORT_SOURCE_FD, fd);
 
 	CurrentSetSize--;
@@ -146,10 +151,12 @@ int PortsEngine::DispatchEvents()
 {
 	struct timespec poll_time;
 
-	poll_time.tv_sec = 1;
-	poll_time.tv_nsec = 0;
+	int wait = GetMaxWait();
+	poll_time.tv_sec = wait / 1000;
+	poll_time.tv_nsec = (wait % 1000) * 1000000L;
 
 	unsigned int nget = 1; // used to denote a retrieve request.
+	Syscalls++;
 	int i = port_getn(EngineHandle, this->events, GetMaxFds() - 1, &nget, &poll_time);
 	ServerInstance->UpdateTime();
 
@@ -176,6 +183,7 @@ int PortsEngine::DispatchEvents()
 						mask &= ~FD_READ_WILL_BLOCK;
 					// reinsert port for next time around, pretending to be one-shot for writes
 					SetEventMask(ev, mask);
+					Syscalls++;
 					port_associate(EngineHandle, PORT_SOURCE_FD, fd, mask_to_events(mask), eh);
 					if (events[i].portev_events & POLLRDNORM)
 					{
@@ -122,10 +122,12 @@ void SelectEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 
 int SelectEngine::DispatchEvents()
 {
-	static timeval tval = { 1, 0 };
+	int wait = GetMaxWait();
+	timeval tval = { wait / 1000, (wait % 1000) * 1000 };
 
 	fd_set rfdset = ReadSet, wfdset = WriteSet, errfdset = ErrSet;
 
+	Syscalls++;
 	int sresult = select(MaxFD + 1, &rfdset, &wfdset, &errfdset, &tval);
 	ServerInstance->UpdateTime();
 
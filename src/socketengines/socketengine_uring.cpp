@@ -0,0 +1,526 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2011 InspIRCd Development Team
+ * See: http://wiki.inspircd.org/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include <vector>
+#include <string>
+#include "inspircd.h"
+#include "exitcodes.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <ulimit.h>
+
+/** Number of submission queue entries; changes beyond this are submitted early */
+#define URING_SQ_ENTRIES 4096
+
+/** user_data of the POLL_REMOVE requests, whose completions are ignored */
+#define URING_REMOVE_TAG (~(__u64)0)
+
+/** A specialisation of the SocketEngine class, designed to use linux io_uring.
+ *
+ * Each file descriptor has a poll request on the ring: multishot for the
+ * edge-triggered states, and oneshot (rearmed after every event) for the
+ * polling states, mirroring the way the epoll engine uses EPOLLET. Changes to
+ * the polled events are not made straight away; they are queued on the
+ * submission ring and handed to the kernel together with the wait for events,
+ * so a whole main loop iteration costs one io_uring_enter() however many
+ * sockets changed state.
+ */
+class URingEngine : public SocketEngine
+{
+private:
+	/** The poll request of a file descriptor */
+	struct FdState
+	{
+		/** Events of the poll request on the ring, or 0 if there is none */
+		unsigned int armed;
+		/** True if the poll request on the ring is multishot */
+		bool multishot;
+		/** True if the file descriptor is in the dirty list */
+		bool dirty;
+		/** Changed whenever a poll request is removed, so that late completions of it can be told apart */
+		unsigned int gen;
+	};
+
+	int EngineHandle;
+	FdState* state;
+	/** File descriptors whose poll request must be checked before the next wait */
+	std::vector<int> dirtylist;
+	/** user_data of poll requests whose removal did not fit on the submission ring yet */
+	std::vector<__u64> removals;
+	/** Completions copied off the ring before they are dispatched */
+	std::vector<struct io_uring_cqe> completions;
+
+	/** The mapped submission and completion rings */
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned sq_entries;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	/** Submission queue tail which has not been published to the kernel yet */
+	unsigned sq_local_tail;
+
+	int Enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags, void* arg, size_t argsize);
+	struct io_uring_sqe* GetSQE();
+	unsigned int Publish();
+	void MarkDirty(int fd);
+	bool QueueRemove(__u64 user_data);
+	void SubmitChanges();
+	void Remove(int fd);
+public:
+	/** Create a new URingEngine
+	 */
+	URingEngine();
+	/** Delete a URingEngine
+	 */
+	virtual ~URingEngine();
+	virtual bool AddFd(EventHandler* eh, int event_mask);
+	virtual void OnSetEvent(EventHandler* eh, int old_mask, int new_mask);
+	virtual void DelFd(EventHandler* eh);
+	virtual int DispatchEvents();
+	virtual std::string GetName();
+};
+
+static void Fatal(const char* what)
+{
+	ServerInstance->Logs->Log("SOCKET",DEFAULT, "ERROR: Could not initialize socket engine: %s: %s", what, strerror(errno));
+	ServerInstance->Logs->Log("SOCKET",DEFAULT, "ERROR: Your kernel probably does not have the proper features. This is a fatal error, exiting now.");
+	printf("ERROR: Could not initialize io_uring socket engine: %s: %s\n", what, strerror(errno));
+	printf("ERROR: Your kernel probably does not have the proper features. This is a fatal error, exiting now.\n");
+	ServerInstance->Exit(EXIT_STATUS_SOCKETENGINE);
+}
+
+URingEngine::URingEngine()
+{
+	int max = ulimit(4, 0);
+	if (max > 0)
+	{
+		MAX_DESCRIPTORS = max;
+	}
+	else
+	{
+		ServerInstance->Logs->Log("SOCKET", DEFAULT, "ERROR: Can't determine maximum number of open sockets!");
+		printf("ERROR: Can't determine maximum number of open sockets!\n");
+		ServerInstance->Exit(EXIT_STATUS_SOCKETENGINE);
+	}
+
+	/* Every socket may have a completion waiting, plus one for the removal of its old poll request */
+	unsigned int cq_wanted = 2 * URING_SQ_ENTRIES;
+	while (cq_wanted < (unsigned int)GetMaxFds() * 2 && cq_wanted < 65536)
+		cq_wanted *= 2;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = cq_wanted;
+	EngineHandle = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+	if (EngineHandle < 0)
+		Fatal("io_uring_setup");
+
+	if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG))
+	{
+		errno = ENOSYS;
+		Fatal("io_uring_setup");
+	}
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		Fatal("mmap");
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		cq_ring = sq_ring;
+	}
+	else
+	{
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+			Fatal("mmap");
+	}
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe*)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		Fatal("mmap");
+
+	char* sq = (char*)sq_ring;
+	sq_head = (unsigned*)(sq + params.sq_off.head);
+	sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	sq_array = (unsigned*)(sq + params.sq_off.array);
+	sq_entries = params.sq_entries;
+	sq_local_tail = *sq_tail;
+
+	char* cq = (char*)cq_ring;
+	cq_head = (unsigned*)(cq + params.cq_off.head);
+	cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	ref = new EventHandler* [GetMaxFds()];
+	state = new FdState[GetMaxFds()];
+
+	memset(ref, 0, GetMaxFds() * sizeof(EventHandler*));
+	memset(state, 0, GetMaxFds() * sizeof(FdState));
+}
+
+URingEngine::~URingEngine()
+{
+	munmap(sqes, sqes_size);
+	if (cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	munmap(sq_ring, sq_ring_size);
+	this->Close(EngineHandle);
+	delete[] ref;
+	delete[] state;
+}
+
+int URingEngine::Enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags, void* arg, size_t argsize)
+{
+	Syscalls++;
+	return syscall(__NR_io_uring_enter, EngineHandle, to_submit, min_complete, flags, arg, argsize);
+}
+
+/** Make the queued entries visible to the kernel, returning how many it has not consumed yet */
+unsigned int URingEngine::Publish()
+{
+	__sync_synchronize();
+	*sq_tail = sq_local_tail;
+	__sync_synchronize();
+	return sq_local_tail - *sq_head;
+}
+
+struct io_uring_sqe* URingEngine::GetSQE()
+{
+	__sync_synchronize();
+	if (sq_local_tail - *sq_head >= sq_entries)
+	{
+		// The ring is full; hand what we have to the kernel before the wait does
+		Enter(Publish(), 0, 0, NULL, 0);
+		if (sq_local_tail - *sq_head >= sq_entries)
+			return NULL;
+	}
+
+	unsigned int index = sq_local_tail & *sq_mask;
+	struct io_uring_sqe* sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	sq_local_tail++;
+	return sqe;
+}
+
+static unsigned int mask_to_poll(int event_mask, bool& multishot)
+{
+	unsigned int rv = 0;
+	if (event_mask & (FD_WANT_POLL_READ | FD_WANT_POLL_WRITE | FD_WANT_SINGLE_WRITE))
+	{
+		// level-triggered: a oneshot poll which is rearmed after each event
+		multishot = false;
+		if (event_mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ))
+			rv |= POLLIN;
+		if (event_mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+			rv |= POLLOUT;
+	}
+	else
+	{
+		// edge-triggered: a multishot poll, which only completes on a wakeup
+		multishot = true;
+		if (event_mask & (FD_WANT_FAST_READ | FD_WANT_EDGE_READ))
+			rv |= POLLIN;
+		if (event_mask & (FD_WANT_FAST_WRITE | FD_WANT_EDGE_WRITE))
+			rv |= POLLOUT;
+	}
+	return rv;
+}
+
+static inline __u64 make_user_data(int fd, unsigned int gen)
+{
+	return ((__u64)gen << 32) | (unsigned int)fd;
+}
+
+void URingEngine::MarkDirty(int fd)
+{
+	if (!state[fd].dirty)
+	{
+		state[fd].dirty = true;
+		dirtylist.push_back(fd);
+	}
+}
+
+/** Queue the removal of a poll request, returning false if the submission ring is full */
+bool URingEngine::QueueRemove(__u64 user_data)
+{
+	struct io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return false;
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = URING_REMOVE_TAG;
+	return true;
+}
+
+void URingEngine::Remove(int fd)
+{
+	FdState& st = state[fd];
+	if (st.armed)
+	{
+		// The poll request holds a reference to the file, so the removal must not be lost
+		__u64 user_data = make_user_data(fd, st.gen);
+		if (!QueueRemove(user_data))
+		{
+			ServerInstance->Logs->Log("SOCKET",DEBUG,"Submission ring full, removing the poll of fd %d later", fd);
+			removals.push_back(user_data);
+		}
+	}
+	// A new generation makes any further completions of the old request stale
+	st.gen++;
+	st.armed = 0;
+}
+
+void URingEngine::SubmitChanges()
+{
+	while (!removals.empty() && QueueRemove(removals.back()))
+		removals.pop_back();
+
+	// File descriptors which do not fit on the ring stay dirty for the next call
+	size_t kept = 0;
+	for (size_t i = 0; i < dirtylist.size(); i++)
+	{
+		int fd = dirtylist[i];
+		FdState& st = state[fd];
+		EventHandler* eh = ref[fd];
+		if (!eh)
+		{
+			st.dirty = false;
+			continue;
+		}
+
+		bool multishot;
+		unsigned int events = mask_to_poll(eh->GetEventMask(), multishot);
+		if (st.armed && (st.armed != events || st.multishot != multishot))
+			Remove(fd);
+
+		if (events && !st.armed)
+		{
+			struct io_uring_sqe* sqe = GetSQE();
+			if (!sqe)
+			{
+				ServerInstance->Logs->Log("SOCKET",DEBUG,"Submission ring full, polling fd %d later", fd);
+				dirtylist[kept++] = fd;
+				continue;
+			}
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = fd;
+			sqe->poll32_events = events;
+			if (multishot)
+				sqe->len = IORING_POLL_ADD_MULTI;
+			sqe->user_data = make_user_data(fd, st.gen);
+			st.armed = events;
+			st.multishot = multishot;
+		}
+		st.dirty = false;
+	}
+	dirtylist.resize(kept);
+}
+
+bool URingEngine::AddFd(EventHandler* eh, int event_mask)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+	{
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"AddFd out of range: (fd: %d, max: %d)", fd, GetMaxFds());
+		return false;
+	}
+
+	if (ref[fd])
+	{
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"Attempt to add duplicate fd: %d", fd);
+		return false;
+	}
+
+	ServerInstance->Logs->Log("SOCKET",DEBUG,"New file descriptor: %d", fd);
+
+	ref[fd] = eh;
+	SocketEngine::SetEventMask(eh, event_mask);
+	MarkDirty(fd);
+	CurrentSetSize++;
+	return true;
+}
+
+void URingEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
+{
+	bool old_multi, new_multi;
+	unsigned int old_events = mask_to_poll(old_mask, old_multi);
+	unsigned int new_events = mask_to_poll(new_mask, new_multi);
+	if (old_events != new_events || old_multi != new_multi)
+		MarkDirty(eh->GetFd());
+}
+
+void URingEngine::DelFd(EventHandler* eh)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+	{
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"DelFd out of range: (fd: %d, max: %d)", fd, GetMaxFds());
+		return;
+	}
+
+	// The removal is matched by user_data, not fd, so it is safe to queue it before the fd is closed
+	Remove(fd);
+	ref[fd] = NULL;
+
+	ServerInstance->Logs->Log("SOCKET",DEBUG,"Remove file descriptor: %d", fd);
+	CurrentSetSize--;
+}
+
+int URingEngine::DispatchEvents()
+{
+	socklen_t codesize = sizeof(int);
+	int errcode;
+
+	SubmitChanges();
+
+	// Anything left over is retried as soon as the completions have been taken off the ring
+	int wait = (dirtylist.empty() && removals.empty()) ? GetMaxWait() : 0;
+	struct __kernel_timespec ts;
+	ts.tv_sec = wait / 1000;
+	ts.tv_nsec = (wait % 1000) * 1000000L;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (__u64)(unsigned long)&ts;
+
+	ServerInstance->UpdateTime();
+	ServerInstance->Logs->Log("SOCKET", DEBUG, "Waiting for events: %ld.%09ld",
+		(long)ServerInstance->Time(), ServerInstance->Time_ns());
+	if (Enter(Publish(), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 && errno != ETIME && errno != EINTR)
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"io_uring_enter failed: %s", strerror(errno));
+	ServerInstance->UpdateTime();
+
+	// Take the completions off the ring first, so that the handlers are free to queue new requests
+	completions.clear();
+	__sync_synchronize();
+	unsigned int head = *cq_head;
+	unsigned int tail = *cq_tail;
+	__sync_synchronize();
+	for (; head != tail; head++)
+		completions.push_back(cqes[head & *cq_mask]);
+	__sync_synchronize();
+	*cq_head = head;
+
+	int i = 0;
+	for (std::vector<struct io_uring_cqe>::iterator c = completions.begin(); c != completions.end(); ++c)
+	{
+		if (c->user_data == URING_REMOVE_TAG)
+			continue;
+		int fd = (int)(c->user_data & 0xFFFFFFFF);
+		unsigned int gen = (unsigned int)(c->user_data >> 32);
+		if (fd < 0 || fd >= GetMaxFds() || state[fd].gen != gen)
+			continue;
+
+		EventHandler* eh = ref[fd];
+		if (!eh)
+			continue;
+		if (!(c->flags & IORING_CQE_F_MORE))
+		{
+			// The poll request has finished, either because it was oneshot or because the kernel ended it
+			state[fd].armed = 0;
+			MarkDirty(fd);
+		}
+
+		i++;
+		CrashState trace_handler(HERE_STR, eh);
+		if (c->res < 0)
+		{
+			ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, -c->res);
+			continue;
+		}
+
+		unsigned int revents = c->res;
+		if (revents & POLLHUP)
+		{
+			ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, 0);
+			continue;
+		}
+		if (revents & POLLERR)
+		{
+			ErrorEvents++;
+			/* Get error number */
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &codesize) < 0)
+				errcode = errno;
+			eh->HandleEvent(EVENT_ERROR, errcode);
+			continue;
+		}
+		int mask = eh->GetEventMask();
+		if (revents & POLLIN)
+			mask &= ~FD_READ_WILL_BLOCK;
+		if (revents & POLLOUT)
+		{
+			mask &= ~FD_WRITE_WILL_BLOCK;
+			if (mask & FD_WANT_SINGLE_WRITE)
+			{
+				int nm = mask & ~FD_WANT_SINGLE_WRITE;
+				OnSetEvent(eh, mask, nm);
+				mask = nm;
+			}
+		}
+		SetEventMask(eh, mask);
+		if (revents & POLLIN)
+		{
+			ReadEvents++;
+			eh->HandleEvent(EVENT_READ);
+			if (eh != ref[fd])
+				// whoops, deleted out from under us
+				continue;
+		}
+		if (revents & POLLOUT)
+		{
+			WriteEvents++;
+			eh->HandleEvent(EVENT_WRITE);
+		}
+	}
+
+	TotalEvents += i;
+	if (i)
+		ServerInstance->Logs->Log("SOCKET", DEBUG, "Dispatched %d socket events: %ld.%09ld",
+			i, (long)ServerInstance->Time(), ServerInstance->Time_ns());
+
+	return i;
+}
+
+std::string URingEngine::GetName()
+{
+	return "io_uring";
+}
+
+SocketEngine* CreateSocketEngine()
+{
+	return new URingEngine;
+}
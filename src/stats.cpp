@@ -14,6 +14,11 @@
 #include "inspircd.h"
 #include "command_parse.h"
 #include "inspsocket.h"
+#include "iothreads.h"
+#include "threadengine.h"
+#include "dns.h"
+#include "slab.h"
+#include "bancache.h"
 #include "xline.h"
 #include "commands/cmd_whowas.h"
 
@@ -152,6 +157,49 @@ void InspIRCd::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :Read events:  "+ConvToStr(this->SE->ReadEvents));
 			results.push_back(sn+" 249 "+user->nick+" :Write events: "+ConvToStr(this->SE->WriteEvents));
 			results.push_back(sn+" 249 "+user->nick+" :Error events: "+ConvToStr(this->SE->ErrorEvents));
+			results.push_back(sn+" 249 "+user->nick+" :Engine syscalls: "+ConvToStr(this->SE->Syscalls)+" ("+this->SE->GetName()+")");
+			results.push_back(sn+" 249 "+user->nick+" :Flush passes: "+ConvToStr(this->SE->FlushPasses)+", sockets flushed: "+ConvToStr(this->SE->FlushedSockets)+
+				" (last pass "+ConvToStr(this->SE->LastFlushSockets)+", busiest "+ConvToStr(this->SE->MaxFlushSockets)+")");
+		{
+			std::vector<IOThreadStats> iostats;
+			this->IOThreads->GetStats(iostats);
+			for (size_t i = 0; i < iostats.size(); i++)
+			{
+				const IOThreadStats& st = iostats[i];
+				results.push_back(sn+" 249 "+user->nick+" :I/O thread "+ConvToStr(i)+": "+ConvToStr(st.sockets)+" sockets, "+ConvToStr(st.wakeups)+" wakeups, "+
+					ConvToStr(st.reads)+" reads ("+ConvToStr(st.bytes_in)+" bytes), "+ConvToStr(st.writes)+" writes ("+ConvToStr(st.bytes_out)+" bytes)");
+			}
+		}
+		{
+			std::vector<ThreadEngine::PoolStats> poolstats;
+			this->Threads->GetStats(poolstats);
+			for (size_t i = 0; i < poolstats.size(); i++)
+			{
+				const ThreadEngine::PoolStats& st = poolstats[i];
+				unsigned long done = st.finished ? st.finished : 1;
+				results.push_back(sn+" 249 "+user->nick+" :Thread pool "+st.name+": "+ConvToStr(st.threads)+" threads, "+ConvToStr(st.submitted)+" jobs, "+
+					ConvToStr(st.queued)+" queued (max "+ConvToStr(st.max_queued)+"), wait avg "+ConvToStr(st.wait_total / done)+"us max "+ConvToStr(st.wait_max)+
+					"us, run avg "+ConvToStr(st.run_total / done)+"us max "+ConvToStr(st.run_max)+"us");
+			}
+
+			LogWriterStats logstats;
+			if (ServerInstance->Logs->GetWriterStats(logstats))
+				results.push_back(sn+" 249 "+user->nick+" :Log writer: "+ConvToStr(logstats.records)+" lines, "+ConvToStr(logstats.bytes)+" bytes in "+
+					ConvToStr(logstats.writes)+" writes, "+ConvToStr(logstats.dropped)+" dropped, "+ConvToStr(logstats.failed)+" failed");
+		}
+		break;
+
+		/* stats a (slab allocator pools) */
+		case 'a':
+		{
+			const std::vector<SlabPool*>& pools = SlabPool::GetPools();
+			for (std::vector<SlabPool*>::const_iterator i = pools.begin(); i != pools.end(); ++i)
+			{
+				SlabPool* pool = *i;
+				results.push_back(sn+" 249 "+user->nick+" :"+pool->GetName()+": "+ConvToStr(pool->GetLive())+" live, "+ConvToStr(pool->GetFree())+" free, "+
+					ConvToStr(pool->GetSlabs())+" slabs ("+ConvToStr(pool->GetSlabs() * pool->GetSlabSize() / 1024)+"K), "+ConvToStr(pool->GetHeapObjects())+" on heap");
+			}
+		}
 		break;
 
 		/* stats m (list number of times each command has been used, plus bytecount) */
@@ -173,6 +221,11 @@ void InspIRCd::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :Channels: "+ConvToStr(this->chanlist->size()));
 			results.push_back(sn+" 249 "+user->nick+" :Commands: "+ConvToStr(this->Parser->cmdlist.size()));
 
+			size_t sendq_inuse, sendq_spare;
+			SendQueue::GetBlockStats(sendq_inuse, sendq_spare);
+			results.push_back(sn+" 249 "+user->nick+" :SendQ blocks: "+ConvToStr(sendq_inuse)+" in use, "+ConvToStr(sendq_spare)+" spare ("+ConvToStr(SendQueue::BLOCK_SIZE)+" bytes each)");
+			results.push_back(sn+" 249 "+user->nick+" :"+this->BanCache->GetStats());
+
 			if (!this->Config->WhoWasGroupSize == 0 && !this->Config->WhoWasMaxGroups == 0)
 			{
 				dynamic_reference<WhoWasMaintainer> whowas("whowas_maintain");
@@ -244,10 +297,14 @@ void InspIRCd::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :unknown commands "+ConvToStr(this->stats->statsUnknown));
 			results.push_back(sn+" 249 "+user->nick+" :nick collisions "+ConvToStr(this->stats->statsCollisions));
 			results.push_back(sn+" 249 "+user->nick+" :dns requests "+ConvToStr(this->stats->statsDnsGood+this->stats->statsDnsBad)+" succeeded "+ConvToStr(this->stats->statsDnsGood)+" failed "+ConvToStr(this->stats->statsDnsBad));
+			results.push_back(sn+" 249 "+user->nick+" :"+this->Res->GetStats());
 			results.push_back(sn+" 249 "+user->nick+" :connection count "+ConvToStr(this->stats->statsConnects));
 			snprintf(buffer,MAXBUF," 249 %s :bytes sent %5.2fK recv %5.2fK",
 				user->nick.c_str(),this->stats->statsSent / 1024.0,this->stats->statsRecv / 1024.0);
 			results.push_back(sn+buffer);
+			snprintf(buffer,MAXBUF," 249 %s :sendq queued %5.2fK written %5.2fK in %lu writes",
+				user->nick.c_str(),this->stats->statsSendqQueued / 1024.0,this->stats->statsSendqWritten / 1024.0,this->stats->statsWriteCalls);
+			results.push_back(sn+buffer);
 		}
 		break;
 
@@ -15,15 +15,19 @@
 
 #include "inspircd.h"
 #include "cull_list.h"
+#include "inspsocket.h"
 #include "testsuite.h"
 #include <iostream>
+#ifndef WIN32
+#include <tr1/unordered_map>
+#endif
 
 #define COUTFAILED() std::cout << std::endl << (failed ? "FAILURE" : "SUCCESS") << std::endl << std::endl
 
 /* Test that x matches y with match() */
-#define WCTEST(x, y) do { std::cout << "match(\"" << x << "\",\"" << y "\") " << ((testpassed = (InspIRCd::Match(x, y, NULL))) ? "SUCCESS" : "FAILURE") << std::endl; failed = !testpassed || failed; } while(0)
+#define WCTEST(x, y) do { std::cout << "match(\"" << x << "\",\"" << y "\") " << ((testpassed = (InspIRCd::Match(x, y, NULL) && irc::wildmask(y).Match(x))) ? "SUCCESS" : "FAILURE") << std::endl; failed = !testpassed || failed; } while(0)
 /* Test that x does not match y with match() */
-#define WCTESTNOT(x, y) do { std::cout << "!match(\"" << x << "\",\"" << y "\") " << ((testpassed = ((!InspIRCd::Match(x, y, NULL)))) ? "SUCCESS" : "FAILURE") << std::endl; failed = !testpassed || failed; } while(0)
+#define WCTESTNOT(x, y) do { std::cout << "!match(\"" << x << "\",\"" << y "\") " << ((testpassed = ((!InspIRCd::Match(x, y, NULL) && !irc::wildmask(y).Match(x)))) ? "SUCCESS" : "FAILURE") << std::endl; failed = !testpassed || failed; } while(0)
 
 /* Test that x matches y with match() and cidr enabled */
 #define CIDRTEST(x, y) do { std::cout << "match(\"" << x << "\",\"" << y "\", true) " << ((testpassed = (InspIRCd::MatchCIDR(x, y, NULL))) ? "SUCCESS" : "FAILURE") << std::endl; failed = !testpassed || failed; } while(0)
@@ -71,6 +75,12 @@ static bool DoWildTests()
 	WCTEST("aaaaaaaaaa", "*a");
 	WCTEST("aaaaaaaaaaa", "*a");
 
+	WCTEST("Nick!Ident@Some-Long-Hostname.Example.Network.Org", "*!*@*long-host*.network.*");
+	WCTEST("Nick!Ident@Some-Long-Hostname.Example.Network.Org", "n*!*ident@*e?ample*ORG");
+	WCTEST("abababababababababababababababac", "*abac");
+	WCTEST("abababababababababababababababac", "*ab*ab?c");
+	WCTEST("{Bracket}!x@y", "[bracket]*");
+
 	WCTESTNOT("foobar", "bazqux");
 	WCTESTNOT("foobar", "*qux");
 	WCTESTNOT("foobar", "foo*x");
@@ -86,6 +96,9 @@ static bool DoWildTests()
 	WCTESTNOT("O", "OperServ");
 	WCTESTNOT("foobar.tst", "fo?bar.*g");
 	WCTESTNOT("foobar.test", "fo?bar.*tt");
+	WCTESTNOT("Nick!Ident@Some-Long-Hostname.Example.Network.Org", "*!*@*long-host*.network.*net");
+	WCTESTNOT("abababababababababababababababab", "*ab*ab?c");
+	WCTESTNOT("abc", "*abc*abc*");
 
 	CIDRTEST("brain@1.2.3.4", "*@1.2.0.0/16");
 	CIDRTEST("brain@1.2.3.4", "*@1.2.3.0/24");
@@ -191,12 +204,596 @@ static bool DoTokenStreamTests()
 	STREAMTEST(irc::tokenstream, ("with a space at the end : "), { "with", "a", "space", "at", "the", "end", " ", NULL });
 	STREAMTEST(irc::tokenstream, ("a :large token ending in a colon:"), { "a", "large token ending in a colon:", NULL });
 	STREAMTEST(irc::tokenstream, ("several tokens with the last ending in a colon:"), { "several", "tokens", "with", "the", "last", "ending", "in", "a", "colon:", NULL });
+	STREAMTEST(irc::tokenstream, ("only part of :this is used", 12), { "only", "part", "of", NULL });
+	STREAMTEST(irc::tokenstream, ("a view :with a final token\r\n", 26), { "a", "view", "with a final token", NULL });
 
 	std::cout << "Result of token stream tests:";
 	COUTFAILED();
 	return !failed;
 }
 
+/** A reproducible random address. Only a few values are used for the high
+ * bytes, so that random ranges often contain each other.
+ */
+static irc::sockets::sockaddrs RandomAddress(unsigned long& seed, bool v6, bool clustered = true)
+{
+	irc::sockets::sockaddrs sa;
+	memset(&sa, 0, sizeof(sa));
+	unsigned char* bytes;
+	unsigned int len;
+	if (v6)
+	{
+		sa.in6.sin6_family = AF_INET6;
+		bytes = sa.in6.sin6_addr.s6_addr;
+		len = 16;
+	}
+	else
+	{
+		sa.in4.sin_family = AF_INET;
+		bytes = (unsigned char*)&sa.in4.sin_addr;
+		len = 4;
+	}
+	for (unsigned int i = 0; i < len; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		bytes[i] = seed >> 16;
+		if (clustered && i < len / 2)
+			bytes[i] &= 0x81;
+	}
+	return sa;
+}
+
+static unsigned int RandomLength(unsigned long& seed, bool v6)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % (v6 ? 129 : 33);
+}
+
+/** Check cidr_tree::match against cidr_mask::match on every range which has not been erased */
+static bool CheckRangeLookups(const irc::sockets::cidr_tree<unsigned int>& tree, const std::vector<irc::sockets::cidr_mask>& ranges,
+	const std::vector<bool>& erased, unsigned long& seed)
+{
+	for (unsigned int i = 0; i < 5000; i++)
+	{
+		irc::sockets::sockaddrs addr = RandomAddress(seed, i & 1);
+		unsigned int* found[129];
+		unsigned int count = tree.match(addr, found);
+
+		std::vector<unsigned int> got, expected;
+		for (unsigned int f = 0; f < count; f++)
+		{
+			// Shortest range first
+			if (f && ranges[*found[f]].length <= ranges[*found[f - 1]].length)
+				return false;
+			got.push_back(*found[f]);
+		}
+		for (unsigned int r = 0; r < ranges.size(); r++)
+			if (!erased[r] && ranges[r].match(addr))
+				expected.push_back(r);
+		std::sort(got.begin(), got.end());
+		if (got != expected)
+			return false;
+	}
+	return true;
+}
+
+static bool DoCIDRTreeTests()
+{
+	std::cout << "CIDR tree tests" << std::endl << std::endl;
+	bool failed = false, testpassed;
+	unsigned long seed = 1;
+
+	// Values by range, compared with a linear search
+	irc::sockets::cidr_tree<unsigned int> tree;
+	std::vector<irc::sockets::cidr_mask> ranges;
+	for (unsigned int i = 0; i < 2000; i++)
+	{
+		bool v6 = i & 1;
+		unsigned int length = RandomLength(seed, v6);
+		irc::sockets::cidr_mask range(RandomAddress(seed, v6), length);
+		if (tree.find(range))
+			continue;
+		tree[range] = ranges.size();
+		ranges.push_back(range);
+	}
+	std::vector<bool> erased(ranges.size());
+	testpassed = (tree.size() == ranges.size()) && CheckRangeLookups(tree, ranges, erased, seed);
+	std::cout << "range lookups, " << ranges.size() << " ranges: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	for (unsigned int r = 0; r < ranges.size(); r += 2)
+	{
+		tree.erase(ranges[r]);
+		erased[r] = true;
+	}
+	testpassed = (tree.size() == ranges.size() / 2) && CheckRangeLookups(tree, ranges, erased, seed);
+	for (unsigned int r = 0; r < ranges.size(); r++)
+		testpassed = testpassed && ((tree.find(ranges[r]) == NULL) == erased[r]);
+	std::cout << "range lookups after erasing half: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	// Counts by address, compared with a map of the counts
+	typedef std::map<irc::sockets::cidr_mask, std::pair<irc::sockets::sockaddrs, unsigned long> > CountMap;
+	irc::sockets::cidr_tree_base counts;
+	CountMap expected;
+	for (unsigned int i = 0; i < 5000; i++)
+	{
+		irc::sockets::sockaddrs addr = RandomAddress(seed, i & 1);
+		irc::sockets::cidr_mask full(addr, 128);
+		unsigned long n = 1 + i % 3;
+		counts.AddCount(full, n);
+		expected[full].first = addr;
+		expected[full].second += n;
+	}
+	// Take some away again, and one more than there was from the first
+	for (CountMap::iterator i = expected.begin(); i != expected.end(); )
+	{
+		counts.AddCount(i->first, i == expected.begin() ? -100 : -1);
+		if (i == expected.begin() || !--i->second.second)
+			expected.erase(i++);
+		else
+			++i;
+	}
+
+	testpassed = true;
+	for (unsigned int i = 0; i < 2000 && testpassed; i++)
+	{
+		bool v6 = i & 1;
+		unsigned int length = RandomLength(seed, v6);
+		irc::sockets::cidr_mask range(RandomAddress(seed, v6), length);
+		unsigned long sum = 0;
+		for (CountMap::iterator e = expected.begin(); e != expected.end(); ++e)
+			if (range.match(e->second.first))
+				sum += e->second.second;
+		testpassed = (counts.GetCount(range) == sum);
+	}
+	std::cout << "counts within ranges: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	testpassed = true;
+	static const unsigned char lengths[] = { AF_INET, 0, AF_INET, 13, AF_INET, 24, AF_INET, 32, AF_INET6, 48, AF_INET6, 128, 0 };
+	for (unsigned int l = 0; lengths[l]; l += 2)
+	{
+		std::map<irc::sockets::cidr_mask, unsigned long> sums, got;
+		for (CountMap::iterator e = expected.begin(); e != expected.end(); ++e)
+			if (e->first.type == lengths[l])
+				sums[irc::sockets::cidr_mask(e->second.first, lengths[l + 1])] += e->second.second;
+		std::vector<std::pair<irc::sockets::cidr_mask, unsigned long> > list;
+		counts.GetCounts(lengths[l], lengths[l + 1], list);
+		for (unsigned int i = 0; i < list.size(); i++)
+			got[list[i].first] += list[i].second;
+		testpassed = testpassed && (got == sums) && (list.size() == sums.size());
+	}
+	std::cout << "counts by range length: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	for (CountMap::iterator e = expected.begin(); e != expected.end(); ++e)
+		counts.AddCount(e->first, -(long)e->second.second);
+	std::vector<std::pair<irc::sockets::cidr_mask, unsigned long> > left;
+	counts.GetCounts(AF_INET, 0, left);
+	counts.GetCounts(AF_INET6, 0, left);
+	testpassed = left.empty();
+	std::cout << "counts empty after removing everything: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	std::cout << std::endl << "Result of CIDR tree tests:";
+	COUTFAILED();
+	return !failed;
+}
+
+/** Find every occurrence of every word by comparing at each position */
+static void NaiveSearch(const std::vector<std::string>& words, const std::string& text, const unsigned char* map, std::vector<irc::multisearch::hit>& hits)
+{
+	for (size_t end = 1; end <= text.length(); end++)
+	{
+		for (unsigned int w = 0; w < words.size(); w++)
+		{
+			size_t len = words[w].length();
+			if (!len || len > end)
+				continue;
+			size_t i = 0;
+			while (i < len && map[(unsigned char)words[w][i]] == map[(unsigned char)text[end - len + i]])
+				i++;
+			if (i == len)
+				hits.push_back(irc::multisearch::hit(end, w));
+		}
+	}
+}
+
+static bool DoMultiSearchTests()
+{
+	std::cout << "Multiple word search tests" << std::endl << std::endl;
+	bool failed = false, testpassed;
+
+	irc::multisearch words(ascii_case_insensitive_map);
+	words.add("he");
+	words.add("she");
+	words.add("his");
+	words.add("hers");
+	words.add("");
+	std::vector<irc::multisearch::hit> hits;
+	words.Search("USHERS and hiS", hits);
+	testpassed = (hits.size() == 4 && hits[0] == irc::multisearch::hit(4, 1) && hits[1] == irc::multisearch::hit(4, 0)
+		&& hits[2] == irc::multisearch::hit(6, 3) && hits[3] == irc::multisearch::hit(14, 2));
+	std::cout << "overlapping words without case: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	hits.clear();
+	words.add("ushers");
+	words.Search("ushers", hits);
+	testpassed = (hits.size() == 4 && hits[2] == irc::multisearch::hit(6, 5) && hits[3] == irc::multisearch::hit(6, 3));
+	std::cout << "words added after searching: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	hits.clear();
+	irc::multisearch exact(rfc_case_sensitive_map);
+	exact.add("Spam");
+	exact.Search("spam SPAM Spam", hits);
+	testpassed = (hits.size() == 1 && hits[0] == irc::multisearch::hit(14, 0));
+	std::cout << "words with case: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	// Random words over a small alphabet, so that they overlap a lot, compared with a naive search
+	testpassed = true;
+	unsigned long seed = 1;
+	for (unsigned int round = 0; round < 50 && testpassed; round++)
+	{
+		irc::multisearch set(ascii_case_insensitive_map);
+		std::vector<std::string> list;
+		for (unsigned int w = 0; w < 1 + round * 4; w++)
+		{
+			std::string word;
+			seed = seed * 1103515245 + 12345;
+			unsigned int len = 1 + (seed >> 16) % 6;
+			for (unsigned int c = 0; c < len; c++)
+			{
+				seed = seed * 1103515245 + 12345;
+				word.push_back("abcAB"[(seed >> 16) % 5]);
+			}
+			list.push_back(word);
+			set.add(word);
+		}
+		std::string text;
+		for (unsigned int c = 0; c < 500; c++)
+		{
+			seed = seed * 1103515245 + 12345;
+			text.push_back("abcdAB"[(seed >> 16) % 6]);
+		}
+		std::vector<irc::multisearch::hit> got, expected;
+		set.Search(text, got);
+		NaiveSearch(list, text, ascii_case_insensitive_map, expected);
+		std::sort(got.begin(), got.end());
+		std::sort(expected.begin(), expected.end());
+		testpassed = (got == expected);
+	}
+	std::cout << "random words against a naive search: " << (testpassed ? "SUCCESS" : "FAILURE") << std::endl;
+	failed = !testpassed || failed;
+
+	std::cout << std::endl << "Result of multiple word search tests:";
+	COUTFAILED();
+	return !failed;
+}
+
+#ifndef WIN32
+/** A socket which tokenizes every line it receives, as the server does
+ * with pipelined commands.
+ */
+class BurstSocket : public StreamSocket
+{
+ public:
+	unsigned long lines;
+	unsigned long tokens;
+
+	BurstSocket(int newfd) : lines(0), tokens(0)
+	{
+		SetFd(newfd);
+	}
+
+	void OnDataReady()
+	{
+		std::string line, token;
+		while (GetNextLine(line))
+		{
+			irc::tokenstream ts(line.data(), line.length());
+			while (ts.GetToken(token))
+				tokens++;
+			lines++;
+		}
+	}
+
+	void OnError(BufferedSocketError) { }
+};
+
+static double Elapsed(const timeval& start)
+{
+	timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+/** Push bursts of pipelined lines through a socket pair and the real read path */
+static bool DoRecvQBenchmark()
+{
+	std::cout << "Receive queue benchmark" << std::endl << std::endl;
+	bool failed = false;
+
+	static const unsigned int bursts[] = { 1, 10, 100, 500, 5000, 0 };
+	static const unsigned long total = 50000;
+	const std::string msg = "PRIVMSG #channel :The quick brown fox jumps over the lazy dog\r\n";
+
+	for (unsigned int b = 0; bursts[b]; b++)
+	{
+		std::string burst;
+		for (unsigned int i = 0; i < bursts[b]; i++)
+			burst.append(msg);
+
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		{
+			std::cout << "FAILURE: socketpair: " << strerror(errno) << std::endl;
+			return false;
+		}
+		ServerInstance->SE->NonBlocking(fds[0]);
+		ServerInstance->SE->NonBlocking(fds[1]);
+		BurstSocket* sock = new BurstSocket(fds[0]);
+		ServerInstance->SE->AddFd(sock, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+
+		// The socket read path, with the recvq consumed by offset
+		unsigned long repeats = total / bursts[b];
+		unsigned long expected = repeats * bursts[b];
+		timeval start;
+		gettimeofday(&start, NULL);
+		for (unsigned long r = 0; r < repeats; r++)
+		{
+			size_t written = 0;
+			while (written < burst.length())
+			{
+				int n = send(fds[1], burst.data() + written, burst.length() - written, 0);
+				if (n > 0)
+					written += n;
+				sock->DoRead();
+			}
+		}
+		while (sock->lines < expected && sock->getError().empty())
+			sock->DoRead();
+		double fast = Elapsed(start);
+		bool ok = (sock->lines == expected && sock->tokens == expected * 3);
+
+		// The same data split the old way, copying the rest of the queue for every line
+		gettimeofday(&start, NULL);
+		unsigned long copied_lines = 0;
+		for (unsigned long r = 0; r < repeats; r++)
+		{
+			std::string queue;
+			for (size_t pos = 0; pos < burst.length(); pos += ServerInstance->Config->NetBufferSize)
+			{
+				queue.append(burst, pos, ServerInstance->Config->NetBufferSize);
+				std::string::size_type i;
+				while ((i = queue.find('\n')) != std::string::npos)
+				{
+					std::string line = queue.substr(0, i);
+					queue = queue.substr(i + 1);
+					irc::tokenstream ts(line);
+					std::string token;
+					while (ts.GetToken(token))
+						;
+					copied_lines++;
+				}
+			}
+		}
+		double slow = Elapsed(start);
+
+		std::cout << "burst of " << bursts[b] << " lines: " << (ok ? "SUCCESS" : "FAILURE")
+			<< ", " << (unsigned long)(expected / fast) << " lines/sec read and tokenized"
+			<< " (" << (unsigned long)(copied_lines / slow) << " lines/sec splitting by copy)" << std::endl;
+		failed = !ok || failed;
+
+		ServerInstance->SE->DelFd(sock);
+		sock->Close();
+		close(fds[1]);
+		delete sock;
+	}
+
+	std::cout << std::endl << "Result of receive queue benchmark:";
+	COUTFAILED();
+	return !failed;
+}
+
+/** Make a name for the hash table benchmark; nicks and channels in mixed case, UUIDs in upper case */
+static std::string MakeKey(char type, unsigned long n)
+{
+	static const char nickchars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ[]\\`_^{|}";
+	static const char uidchars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	std::string key;
+	if (type == 'u')
+	{
+		key = "0AB";
+		for (int i = 0; i < 6; i++, n /= 36)
+			key.push_back(uidchars[n % 36]);
+		return key;
+	}
+	if (type == 'c')
+		key = "#";
+	// Distinct for each n, with a pseudo-random spread of lengths and characters
+	unsigned long x = n * 2654435761UL + 12345;
+	for (unsigned int len = 5 + (x >> 7) % 8; len; len--, x = x * 1103515245 + 12345)
+		key.push_back(nickchars[(x >> 16) % (sizeof(nickchars) - 1)]);
+	key.push_back('-');
+	for (; n; n /= 26)
+		key.push_back('a' + n % 26);
+	return key;
+}
+
+/** Swap the case of a key, so that lookups have to fold it */
+static std::string SwapCase(const std::string& in)
+{
+	std::string out(in);
+	for (std::string::iterator c = out.begin(); c != out.end(); ++c)
+		*c = isupper(*c) ? tolower(*c) : toupper(*c);
+	return out;
+}
+
+template<typename Map>
+static double TimeLookups(Map& map, const std::vector<std::string>& keys, unsigned long& found)
+{
+	timeval start;
+	gettimeofday(&start, NULL);
+	found = 0;
+	for (std::vector<std::string>::const_iterator i = keys.begin(); i != keys.end(); ++i)
+		if (map.find(*i) != map.end())
+			found++;
+	return Elapsed(start);
+}
+
+/** Compare irc::hash_map with the tr1 unordered_map it replaced, hashing and comparing the same way */
+static bool DoHashBenchmark()
+{
+	std::cout << "Hash table benchmark" << std::endl << std::endl;
+	bool failed = false;
+
+	typedef std::tr1::unordered_map<std::string, User*, irc::insensitive, irc::StrHashComp> old_hash;
+	static const unsigned long sizes[] = { 100000, 1000000, 0 };
+	static const char types[] = "ncu";
+
+	for (unsigned int sz = 0; sizes[sz]; sz++)
+	{
+		for (const char* type = types; *type; type++)
+		{
+			const unsigned long count = sizes[sz];
+			user_hash newmap;
+			old_hash oldmap;
+			std::vector<std::string> hits, misses;
+			hits.reserve(count);
+			misses.reserve(count);
+			for (unsigned long i = 0; i < count; i++)
+			{
+				std::string key = MakeKey(*type, i);
+				newmap[key] = NULL;
+				oldmap[key] = NULL;
+				misses.push_back(MakeKey(*type, i + count));
+			}
+			// Look the keys up in a different order (and case) to the one they went in
+			for (unsigned long i = 0; i < count; i++)
+			{
+				std::string key = MakeKey(*type, (i * 7919) % count);
+				hits.push_back(*type == 'u' ? key : SwapCase(key));
+			}
+
+			unsigned long newhit, newmiss, oldhit, oldmiss;
+			double newhittime = TimeLookups(newmap, hits, newhit);
+			double newmisstime = TimeLookups(newmap, misses, newmiss);
+			double oldhittime = TimeLookups(oldmap, hits, oldhit);
+			double oldmisstime = TimeLookups(oldmap, misses, oldmiss);
+			bool ok = (newmap.size() == count && newhit == count && !newmiss && oldhit == count && !oldmiss);
+
+			std::cout << (*type == 'n' ? "nick" : *type == 'c' ? "channel" : "UUID") << " lookups, " << count << " entries: "
+				<< (ok ? "SUCCESS" : "FAILURE") << ", hits " << (unsigned long)(newhittime * 1000000000 / count) << "ns"
+				<< " (tr1 " << (unsigned long)(oldhittime * 1000000000 / count) << "ns), misses "
+				<< (unsigned long)(newmisstime * 1000000000 / count) << "ns (tr1 " << (unsigned long)(oldmisstime * 1000000000 / count) << "ns)" << std::endl;
+			failed = !ok || failed;
+		}
+	}
+
+	std::cout << std::endl << "Result of hash table benchmark:";
+	COUTFAILED();
+	return !failed;
+}
+
+/** Compare the CIDR tree with the std::map the clone counts were kept in, and with checking ranges one by one */
+static bool DoCIDRBenchmark()
+{
+	std::cout << "CIDR tree benchmark" << std::endl << std::endl;
+	bool failed = false;
+
+	const unsigned long count = 1000000;
+	unsigned long seed = 1;
+	std::vector<irc::sockets::sockaddrs> addrs;
+	addrs.reserve(count);
+	for (unsigned long i = 0; i < count; i++)
+		addrs.push_back(RandomAddress(seed, false, false));
+
+	// Clone counting: add every address, read its count for its /24, then remove it
+	timeval start;
+	gettimeofday(&start, NULL);
+	std::map<irc::sockets::cidr_mask, unsigned int> oldmap;
+	for (unsigned long i = 0; i < count; i++)
+		oldmap[irc::sockets::cidr_mask(addrs[i], 24)]++;
+	unsigned long oldsum = 0;
+	for (unsigned long i = 0; i < count; i++)
+		oldsum += oldmap.find(irc::sockets::cidr_mask(addrs[i], 24))->second;
+	for (unsigned long i = 0; i < count; i++)
+	{
+		std::map<irc::sockets::cidr_mask, unsigned int>::iterator x = oldmap.find(irc::sockets::cidr_mask(addrs[i], 24));
+		if (!--x->second)
+			oldmap.erase(x);
+	}
+	double oldtime = Elapsed(start);
+
+	gettimeofday(&start, NULL);
+	irc::sockets::cidr_tree_base counts;
+	for (unsigned long i = 0; i < count; i++)
+		counts.AddCount(irc::sockets::cidr_mask(addrs[i], 128), 1);
+	unsigned long newsum = 0;
+	for (unsigned long i = 0; i < count; i++)
+		newsum += counts.GetCount(irc::sockets::cidr_mask(addrs[i], 24));
+	for (unsigned long i = 0; i < count; i++)
+		counts.AddCount(irc::sockets::cidr_mask(addrs[i], 128), -1);
+	double newtime = Elapsed(start);
+
+	std::vector<std::pair<irc::sockets::cidr_mask, unsigned long> > left;
+	counts.GetCounts(AF_INET, 0, left);
+	bool ok = (oldsum == newsum && oldmap.empty() && left.empty());
+	std::cout << "clone counting, " << count << " addresses: " << (ok ? "SUCCESS" : "FAILURE") << ", "
+		<< (unsigned long)(newtime * 1000000000 / count) << "ns per user (std::map by /24 "
+		<< (unsigned long)(oldtime * 1000000000 / count) << "ns)" << std::endl;
+	failed = !ok || failed;
+
+	// Range matching, as for connect classes and Z-lines
+	static const unsigned int sizes[] = { 10, 100, 1000, 0 };
+	for (unsigned int sz = 0; sizes[sz]; sz++)
+	{
+		std::vector<irc::sockets::cidr_mask> ranges;
+		irc::sockets::cidr_tree<unsigned int> tree;
+		for (unsigned int i = 0; i < sizes[sz]; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			irc::sockets::cidr_mask range(RandomAddress(seed, false, false), 8 + (seed >> 16) % 25);
+			ranges.push_back(range);
+			tree[range]++;
+		}
+
+		gettimeofday(&start, NULL);
+		unsigned long newfound = 0;
+		for (unsigned long i = 0; i < count; i++)
+		{
+			unsigned int* found[129];
+			unsigned int n = tree.match(addrs[i], found);
+			while (n)
+				newfound += *found[--n];
+		}
+		newtime = Elapsed(start);
+
+		gettimeofday(&start, NULL);
+		unsigned long oldfound = 0;
+		for (unsigned long i = 0; i < count; i++)
+			for (std::vector<irc::sockets::cidr_mask>::iterator r = ranges.begin(); r != ranges.end(); ++r)
+				if (r->match(addrs[i]))
+					oldfound++;
+		oldtime = Elapsed(start);
+
+		ok = (newfound == oldfound);
+		std::cout << "range lookups, " << sizes[sz] << " ranges: " << (ok ? "SUCCESS" : "FAILURE") << ", "
+			<< (unsigned long)(newtime * 1000000000 / count) << "ns per address (one by one "
+			<< (unsigned long)(oldtime * 1000000000 / count) << "ns)" << std::endl;
+		failed = !ok || failed;
+	}
+
+	std::cout << std::endl << "Result of CIDR tree benchmark:";
+	COUTFAILED();
+	return !failed;
+}
+#endif
+
 TestSuite::TestSuite()
 {
 	std::cout << std::endl << "*** STARTING TESTSUITE ***" << std::endl;
@@ -214,6 +811,11 @@ TestSuite::TestSuite()
 		std::cout << "(4) Run comma sepstream tests" << std::endl;
 		std::cout << "(5) Run space sepstream tests" << std::endl;
 		std::cout << "(6) Run token stream tests" << std::endl;
+#ifndef WIN32
+		std::cout << "(7) Run receive queue benchmark" << std::endl;
+		std::cout << "(8) Run hash table benchmark" << std::endl;
+		std::cout << "(9) Run CIDR tree benchmark" << std::endl;
+#endif
 
 		std::cout << std::endl << "(L) Load a module" << std::endl;
 		std::cout << "(U) Unload a module" << std::endl;
@@ -244,6 +846,8 @@ TestSuite::TestSuite()
 			case '2':
 				failed = false;
 				failed = !DoWildTests() || failed;
+				failed = !DoCIDRTreeTests() || failed;
+				failed = !DoMultiSearchTests() || failed;
 				failed = !DoCommaSepStreamTests() || failed;
 				failed = !DoSpaceSepStreamTests() || failed;
 				failed = !DoTokenStreamTests() || failed;
@@ -253,6 +857,7 @@ TestSuite::TestSuite()
 
 			case '3':
 				DoWildTests();
+				DoCIDRTreeTests();
 				break;
 
 			case '4':
@@ -267,6 +872,20 @@ TestSuite::TestSuite()
 				DoTokenStreamTests();
 				break;
 
+#ifndef WIN32
+			case '7':
+				DoRecvQBenchmark();
+				break;
+
+			case '8':
+				DoHashBenchmark();
+				break;
+
+			case '9':
+				DoCIDRBenchmark();
+				break;
+#endif
+
 			case 'L':
 				std::cout << "Enter module filename to load: ";
 				std::cin >> modname;
@@ -17,6 +17,8 @@
 #include <pthread.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 
 #ifdef HAS_EVENTFD
 #include <sys/eventfd.h>
@@ -42,21 +44,18 @@ class ThreadSignalSocket : public EventHandler
 		eventfd_write(fd, 1);
 	}
 
+	void Clear()
+	{
+		eventfd_t dummy;
+		eventfd_read(fd, &dummy);
+	}
+
 	void HandleEvent(EventType et, int errornum)
 	{
 		if (et == EVENT_READ)
-		{
-			eventfd_t dummy;
-			eventfd_read(fd, &dummy);
 			ServerInstance->Threads->result_loop();
-		}
 		else
-		{
-			ServerInstance->Threads->job_lock.lock();
-			ServerInstance->Threads->result_ss = NULL;
-			ServerInstance->Threads->job_lock.unlock();
-			ServerInstance->GlobalCulls->AddItem(this);
-		}
+			ServerInstance->Logs->Log("THREAD", DEFAULT, "Error on thread signal eventfd: %s", strerror(errornum));
 	}
 };
 
@@ -90,31 +89,321 @@ class ThreadSignalSocket : public EventHandler
 		write(send_fd, &dummy, 1);
 	}
 
+	void Clear()
+	{
+		char dummy[128];
+		read(fd, dummy, 128);
+	}
+
 	void HandleEvent(EventType et, int errornum)
 	{
 		if (et == EVENT_READ)
-		{
-			char dummy[128];
-			read(fd, dummy, 128);
 			ServerInstance->Threads->result_loop();
-		}
 		else
+			ServerInstance->Logs->Log("THREAD", DEFAULT, "Error on thread signal pipe: %s", strerror(errornum));
+	}
+};
+#endif
+
+/** Job queues hold this many jobs; more are kept on the pool's backlog by the main thread */
+static const size_t QUEUE_SIZE = 1024;
+/** Most threads a pool may have, including those which have been told to exit */
+static const size_t MAX_THREADS = 64;
+/** Most jobs a pool may have queued, running or waiting to be collected; the size of its result queue, a power of two */
+static const size_t RESULT_QUEUE_SIZE = 2048;
+
+static uint64_t Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** A bounded queue of jobs, which any number of threads may push to and pop
+ * from at once without locking (Dmitry Vyukov's bounded MPMC queue).
+ *
+ * Each cell has a sequence number which says whose turn it is: a producer
+ * may fill the cell at position pos when its sequence is pos, and a consumer
+ * may empty it when its sequence is pos + 1. Threads claim a position by
+ * advancing enqueue_pos or dequeue_pos with compare and swap, and then hand
+ * the cell over by storing the next sequence number.
+ */
+class JobQueue
+{
+	struct Cell
+	{
+		volatile size_t sequence;
+		Job* job;
+	};
+
+	Cell* const cells;
+	const size_t mask;
+	/* Producers and consumers each have their own cache line */
+	char pad0[64];
+	volatile size_t enqueue_pos;
+	char pad1[64];
+	volatile size_t dequeue_pos;
+	char pad2[64];
+
+ public:
+	/** @param size The capacity of the queue, a power of two */
+	JobQueue(size_t size) : cells(new Cell[size]), mask(size - 1), enqueue_pos(0), dequeue_pos(0)
+	{
+		for (size_t i = 0; i < size; i++)
+			cells[i].sequence = i;
+	}
+
+	~JobQueue()
+	{
+		delete[] cells;
+	}
+
+	/** Add a job to the queue
+	 * @return False if the queue is full
+	 */
+	bool push(Job* job)
+	{
+		Cell* cell;
+		size_t pos = enqueue_pos;
+		while (true)
+		{
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence;
+			__sync_synchronize();
+			long dif = (long)(seq - pos);
+			if (dif == 0)
+			{
+				if (__sync_bool_compare_and_swap(&enqueue_pos, pos, pos + 1))
+					break;
+				pos = enqueue_pos;
+			}
+			else if (dif < 0)
+				return false;
+			else
+				pos = enqueue_pos;
+		}
+		cell->job = job;
+		// Publish the job before handing the cell to the consumers
+		__sync_synchronize();
+		cell->sequence = pos + 1;
+		return true;
+	}
+
+	/** Take the oldest job off the queue
+	 * @return False if the queue is empty
+	 */
+	bool pop(Job*& job)
+	{
+		Cell* cell;
+		size_t pos = dequeue_pos;
+		while (true)
 		{
-			ServerInstance->Threads->job_lock.lock();
-			ServerInstance->Threads->result_ss = NULL;
-			ServerInstance->Threads->job_lock.unlock();
-			ServerInstance->GlobalCulls->AddItem(this);
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence;
+			__sync_synchronize();
+			long dif = (long)(seq - (pos + 1));
+			if (dif == 0)
+			{
+				if (__sync_bool_compare_and_swap(&dequeue_pos, pos, pos + 1))
+					break;
+				pos = dequeue_pos;
+			}
+			else if (dif < 0)
+				return false;
+			else
+				pos = dequeue_pos;
 		}
+		job = cell->job;
+		// Finish reading the cell before handing it back to the producers
+		__sync_synchronize();
+		cell->sequence = pos + mask + 1;
+		return true;
+	}
+
+	/** Get the number of jobs in the queue; only exact if nothing is pushing or popping */
+	size_t size() const
+	{
+		return enqueue_pos - dequeue_pos;
 	}
 };
-#endif
 
-ThreadEngine::ThreadEngine() : result_ss(NULL)
+/** A pool of threads running one kind of job.
+ *
+ * The main thread is the only one to submit jobs and to collect results, so
+ * the job queue has one producer and the result queue one consumer. Jobs
+ * are only handed to the threads while fewer than RESULT_QUEUE_SIZE of them
+ * are in flight, from being pushed until their results are collected, so the
+ * result queue cannot fill up however long the main thread takes to collect.
+ *
+ * A NULL job tells the thread which takes it to exit; the thread passes it
+ * on to the result queue so that the main thread can join it.
+ */
+class ThreadEngine::Pool
+{
+ public:
+	ThreadEngine* const te;
+	const std::string name;
+	JobQueue jobs;
+	JobQueue results;
+	/** Jobs which did not fit into the job queue; only used by the main thread */
+	std::deque<Job*> backlog;
+	/** Jobs (and exit requests) pushed to the job queue whose results have not been collected; only used by the main thread */
+	size_t inflight;
+	/** All threads, including those which have been told to exit */
+	std::vector<Runner*> threads;
+	/** Number of threads which have not been told to exit */
+	unsigned int active;
+
+	/** Threads with nothing to do sleep on this; sleepers is the number doing so */
+	Mutex sleep_lock;
+	pthread_cond_var sleep_cond;
+	volatile int sleepers;
+
+	PoolStats stats;
+
+	Pool(ThreadEngine* t, const std::string& Name)
+		: te(t), name(Name), jobs(QUEUE_SIZE), results(RESULT_QUEUE_SIZE), inflight(0), active(0), sleepers(0)
+	{
+		stats.name = name;
+		stats.threads = 0;
+		stats.submitted = stats.finished = stats.queued = stats.max_queued = 0;
+		stats.wait_total = stats.wait_max = stats.run_total = stats.run_max = 0;
+	}
+
+	/** Hand a job (or an exit request) to the threads */
+	void Push(Job* job)
+	{
+		if (!backlog.empty() || inflight >= RESULT_QUEUE_SIZE || !jobs.push(job))
+		{
+			backlog.push_back(job);
+			return;
+		}
+		inflight++;
+		Wake();
+	}
+
+	/** Move jobs from the backlog into the queue, as far as there is room */
+	void Refill()
+	{
+		bool pushed = false;
+		while (!backlog.empty() && inflight < RESULT_QUEUE_SIZE && jobs.push(backlog.front()))
+		{
+			backlog.pop_front();
+			inflight++;
+			pushed = true;
+		}
+		if (pushed)
+			Wake();
+	}
+
+	/** Wake a sleeping thread, if there is one */
+	void Wake()
+	{
+		// The job must be visible before sleepers is read; a thread going to sleep counts itself
+		// in sleepers before looking at the queue, so it either sees the job or is counted here
+		__sync_synchronize();
+		if (sleepers)
+		{
+			Mutex::Lock lock(sleep_lock);
+			sleep_cond.signal_one();
+		}
+	}
+
+	/** Take a job off the queue, sleeping until there is one */
+	Job* Take()
+	{
+		Job* job;
+		if (jobs.pop(job))
+			return job;
+		Mutex::Lock lock(sleep_lock);
+		__sync_fetch_and_add(&sleepers, 1);
+		while (!jobs.pop(job))
+			sleep_cond.wait(sleep_lock);
+		__sync_fetch_and_sub(&sleepers, 1);
+		return job;
+	}
+
+	/** Start or stop threads to get the given number of them */
+	void Resize(unsigned int count)
+	{
+		if (count > MAX_THREADS)
+			count = MAX_THREADS;
+		while (active < count && threads.size() < MAX_THREADS)
+		{
+			threads.push_back(new Runner(this));
+			active++;
+		}
+		while (active > count)
+		{
+			Push(NULL);
+			active--;
+		}
+		stats.threads = active;
+	}
+
+	/** Take a result off the result queue
+	 * @return False if there are none
+	 */
+	bool Collect(Job*& job)
+	{
+		if (!results.pop(job))
+			return false;
+		inflight--;
+		return true;
+	}
+
+	/** Join a thread which has exited */
+	void Reap()
+	{
+		for (std::vector<Runner*>::iterator i = threads.begin(); i != threads.end(); ++i)
+		{
+			Runner* r = *i;
+			if (r->done)
+			{
+				threads.erase(i);
+				delete r;
+				return;
+			}
+		}
+	}
+};
+
+ThreadEngine::ThreadEngine() : signalled(0), result_ss(NULL)
 {
 }
 
 ThreadEngine::~ThreadEngine()
 {
+	for (std::set<Job*>::iterator i = pending.begin(); i != pending.end(); ++i)
+		(*i)->cancel();
+
+	// Let the threads run what they hold (cancelled jobs are skipped), then join them
+	for (std::map<std::string, Pool*>::iterator i = pools.begin(); i != pools.end(); ++i)
+	{
+		Pool* pool = i->second;
+		pool->Resize(0);
+		while (!pool->threads.empty())
+		{
+			Job* job;
+			bool any = false;
+			while (pool->Collect(job))
+			{
+				any = true;
+				if (!job)
+				{
+					pool->Reap();
+					continue;
+				}
+				// Too late to finish(), which may need what has already been torn down
+				pending.erase(job);
+				delete job;
+			}
+			pool->Refill();
+			if (!any)
+				usleep(1000);
+		}
+		delete pool;
+	}
 	delete result_ss;
 }
 
@@ -131,8 +420,8 @@ void* ThreadEngine::Runner::entry_point(void* parameter)
 	return parameter;
 }
 
-ThreadEngine::Runner::Runner(ThreadEngine* t)
-	: te(t), current(NULL)
+ThreadEngine::Runner::Runner(Pool* p)
+	: pool(p), done(false)
 {
 	if (pthread_create(&id, NULL, entry_point, this) != 0)
 		throw CoreException("Unable to create new thread: " + std::string(strerror(errno)));
@@ -145,82 +434,118 @@ ThreadEngine::Runner::~Runner()
 
 void ThreadEngine::Submit(Job* job)
 {
-	Mutex::Lock lock(job_lock);
-	// TODO launch more threads if we have a queue and more are allowed
-	// TODO clean up threads at garbage collection time (all but one)
-	if (threads.empty())
-		threads.push_back(new Runner(this));
 	if (result_ss == NULL)
 		result_ss = new ThreadSignalSocket();
-	submit_q.push_back(job);
-	submit_s.signal_one();
+
+	std::map<std::string, Pool*>::iterator p = pools.find(job->pool);
+	if (p == pools.end())
+		p = pools.insert(std::make_pair(job->pool, new Pool(this, job->pool))).first;
+	Pool* pool = p->second;
+
+	// Pick up changes to <threadpool>
+	std::map<std::string, unsigned int>::const_iterator size = ServerInstance->Config->ThreadPools.find(job->pool);
+	unsigned int wanted = (size == ServerInstance->Config->ThreadPools.end()) ? 1 : size->second;
+	if (wanted != pool->active)
+		pool->Resize(wanted);
+
+	job->submit_time = Now();
+	pending.insert(job);
+	pool->Push(job);
+
+	pool->stats.submitted++;
+	unsigned long queued = pool->jobs.size() + pool->backlog.size();
+	if (queued > pool->stats.max_queued)
+		pool->stats.max_queued = queued;
 }
 
-static class TerminateJob : public Job
+void ThreadEngine::Notify()
 {
- public:
-	TerminateJob() : Job(NULL) { cancel(); }
-	void run() {}
-	void finish() {}
-} terminator;
+	if (__sync_bool_compare_and_swap(&signalled, 0, 1))
+		result_ss->Notify();
+}
 
 void ThreadEngine::Runner::main_loop()
 {
-	te->job_lock.lock();
-	while (1)
+	while (true)
 	{
-		while (te->submit_q.empty())
-			te->submit_s.wait(te->job_lock);
-
-		current = te->submit_q.front();
-		te->submit_q.pop_front();
-
-		if (!current->IsCancelled())
+		Job* job = pool->Take();
+		if (job)
 		{
-			te->job_lock.unlock();
-			try
-			{
-				current->run();
-			}
-			catch (...)
+			job->start_time = Now();
+			if (!job->IsCancelled())
 			{
+				try
+				{
+					job->run();
+				}
+				catch (...)
+				{
+				}
 			}
-			te->job_lock.lock();
+			job->end_time = Now();
 		}
-		te->result_q.push_back(current);
-		if (current == &terminator)
-			break;
-		current = NULL;
+		else
+		{
+			// Told to exit; the main thread joins us when it sees the NULL
+			done = true;
+		}
+
+		// Never full, see Pool
+		while (!pool->results.push(job))
+			sched_yield();
+		pool->te->Notify();
 
-		te->result_sc.signal_one();
-		if (te->result_ss)
-			te->result_ss->Notify();
+		if (!job)
+			break;
 	}
-	te->job_lock.unlock();
-	// current == terminator, we die
 }
 
 void ThreadEngine::result_loop()
 {
-	job_lock.lock();
-	while (!result_q.empty())
+	// Clear the wakeup before collecting, so that results pushed from now on wake us again
+	if (result_ss)
+		result_ss->Clear();
+	__sync_fetch_and_and(&signalled, 0);
+
+	for (std::map<std::string, Pool*>::iterator i = pools.begin(); i != pools.end(); ++i)
 	{
-		Job* job = result_q.front();
-		result_q.pop_front();
-		job_lock.unlock();
-		job->finish();
-		job_lock.lock();
+		Pool* pool = i->second;
+		Job* job;
+		while (pool->Collect(job))
+		{
+			if (!job)
+			{
+				pool->Reap();
+				continue;
+			}
+
+			uint64_t wait = job->start_time - job->submit_time;
+			uint64_t run = job->end_time - job->start_time;
+			pool->stats.finished++;
+			pool->stats.wait_total += wait;
+			pool->stats.run_total += run;
+			if (wait > pool->stats.wait_max)
+				pool->stats.wait_max = wait;
+			if (run > pool->stats.run_max)
+				pool->stats.run_max = run;
+
+			pending.erase(job);
+			job->finish();
+		}
+		pool->Refill();
 	}
-	job_lock.unlock();
 }
 
 void ThreadEngine::BlockForUnload(Module* mod)
 {
-	job_lock.lock();
 	while (1)
 	{
+		// clean up any references remaining in the result loop
+		// (that's where any we were waiting for are sitting)
+		result_loop();
+
 		bool found = false;
-		for(std::list<Job*>::iterator i = submit_q.begin(); i != submit_q.end(); i++)
+		for (std::set<Job*>::iterator i = pending.begin(); i != pending.end(); ++i)
 		{
 			Job* j = *i;
 			if (j->BlocksUnload(mod))
@@ -229,22 +554,23 @@ void ThreadEngine::BlockForUnload(Module* mod)
 				j->cancel();
 			}
 		}
-		for(std::vector<Runner*>::iterator i = threads.begin(); i != threads.end(); i++)
-		{
-			Runner* r = *i;
-			if (r->current && r->current->BlocksUnload(mod))
-			{
-				found = true;
-				r->current->cancel();
-			}
-		}
 		if (!found)
 			break;
+
 		// wait for an item to finish so we can check again
-		result_sc.wait(job_lock);
+		struct pollfd pfd;
+		pfd.fd = result_ss->GetFd();
+		pfd.events = POLLIN;
+		poll(&pfd, 1, -1);
+	}
+}
+
+void ThreadEngine::GetStats(std::vector<PoolStats>& out) const
+{
+	for (std::map<std::string, Pool*>::const_iterator i = pools.begin(); i != pools.end(); ++i)
+	{
+		Pool* pool = i->second;
+		out.push_back(pool->stats);
+		out.back().queued = pool->jobs.size() + pool->backlog.size();
 	}
-	job_lock.unlock();
-	// clean up any references remaining in the result loop
-	// (that's where any we were waiting for are sitting)
-	result_loop();
 }
@@ -14,57 +14,216 @@
 #include "inspircd.h"
 #include "timer.h"
 
-TimerManager::TimerManager()
+/** Index of the lowest set bit of a non-zero word */
+static inline unsigned int LowestBit(uint64_t bits)
 {
+#ifdef __GNUC__
+	return __builtin_ctzll(bits);
+#else
+	unsigned int n = 0;
+	while (!(bits & 1))
+	{
+		bits >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+Timer::Timer(long secs_from_now, time_t now, bool repeating)
+	: interval(secs_from_now * 1000), repeat(repeating), next(NULL), prev(NULL)
+{
+	// Keep the fraction of the current second, so that the timer runs a whole number of seconds from now
+	uint64_t start = (ServerInstance && now == ServerInstance->Time()) ? ServerInstance->Time_ms() : (uint64_t)now * 1000;
+	trigger = start + interval;
+}
+
+TimerManager::TimerManager() : overflow(NULL), current(ServerInstance->Time_ms())
+{
+	for (unsigned int level = 0; level < LEVELS; level++)
+	{
+		for (unsigned int slot = 0; slot < SLOTS; slot++)
+			wheel[level][slot] = NULL;
+		occupied[level] = 0;
+	}
 }
 
 TimerManager::~TimerManager()
 {
-	for(std::multimap<time_t, Timer *>::iterator i = Timers.begin(); i != Timers.end(); i++)
-		delete i->second;
+	for (unsigned int level = 0; level < LEVELS; level++)
+	{
+		for (unsigned int slot = 0; slot < SLOTS; slot++)
+		{
+			while (wheel[level][slot])
+			{
+				Timer* t = wheel[level][slot];
+				wheel[level][slot] = t->next;
+				delete t;
+			}
+		}
+	}
+	while (overflow)
+	{
+		Timer* t = overflow;
+		overflow = t->next;
+		delete t;
+	}
+}
+
+void TimerManager::Schedule(Timer* T, uint64_t earliest)
+{
+	uint64_t when = std::max(T->trigger, earliest);
+	// The lowest level on which the timer is in the same cycle as the wheel
+	uint64_t diff = when ^ current;
+	unsigned int level = 0;
+	while (level < LEVELS && (diff >> (LEVEL_BITS * (level + 1))))
+		level++;
+
+	Timer** head = &overflow;
+	if (level < LEVELS)
+	{
+		unsigned int slot = (when >> (LEVEL_BITS * level)) & (SLOTS - 1);
+		head = &wheel[level][slot];
+		occupied[level] |= (uint64_t)1 << slot;
+	}
+
+	T->next = *head;
+	if (T->next)
+		T->next->prev = &T->next;
+	T->prev = head;
+	*head = T;
 }
 
-void TimerManager::TickTimers(time_t TIME)
+void TimerManager::Unlink(Timer* T)
 {
-	while (!Timers.empty())
+	*T->prev = T->next;
+	if (T->next)
+		T->next->prev = T->prev;
+
+	// If this emptied a slot of the wheel, clear its bit
+	Timer** first = &wheel[0][0];
+	if (!T->next && T->prev >= first && T->prev < first + LEVELS * SLOTS)
 	{
-		std::multimap<time_t, Timer*>::iterator i = Timers.begin();
-		Timer* t = i->second;
-		if (t->GetTimer() > TIME)
-			return;
-		Timers.erase(i);
+		unsigned int index = T->prev - first;
+		occupied[index / SLOTS] &= ~((uint64_t)1 << (index % SLOTS));
+	}
 
-		t->Tick(TIME);
+	T->next = NULL;
+	T->prev = NULL;
+}
 
-		if (t->GetRepeat())
+void TimerManager::Reschedule(Timer*& list)
+{
+	Timer* pending = list;
+	list = NULL;
+	while (pending)
+	{
+		Timer* t = pending;
+		pending = t->next;
+		Schedule(t, current);
+	}
+}
+
+uint64_t TimerManager::NextEvent() const
+{
+	for (unsigned int level = 0; level < LEVELS; level++)
+	{
+		unsigned int shift = LEVEL_BITS * level;
+		unsigned int index = (current >> shift) & (SLOTS - 1);
+		// Slots up to the wheel's own one are empty, see Schedule()
+		uint64_t later = (index == SLOTS - 1) ? 0 : occupied[level] & (~(uint64_t)0 << (index + 1));
+		if (later)
 		{
-			t->SetTimer(TIME + t->GetSecs());
-			AddTimer(t);
+			uint64_t cycle = (current >> (shift + LEVEL_BITS)) << (shift + LEVEL_BITS);
+			return cycle | ((uint64_t)LowestBit(later) << shift);
 		}
-		else
-			delete t;
+		// Nothing left on this level until the level above moves on
 	}
+
+	if (overflow)
+		return ((current >> (LEVEL_BITS * LEVELS)) + 1) << (LEVEL_BITS * LEVELS);
+	return ~(uint64_t)0;
 }
 
-void TimerManager::DelTimer(Timer* T)
+void TimerManager::TickTimers(uint64_t now)
 {
-	std::multimap<time_t, Timer*>::iterator i = Timers.find(T->GetTimer());
-	while (1)
+	while (true)
 	{
-		if (i == Timers.end())
-			return;
-		if (i->second == T)
+		uint64_t next = NextEvent();
+		if (next > now)
 			break;
-		if (i->second->GetTimer() != T->GetTimer())
-			return;
-		i++;
+		current = next;
+
+		// Cascade every level which started a new slot, from the top down
+		if (!(current & (((uint64_t)1 << (LEVEL_BITS * LEVELS)) - 1)))
+			Reschedule(overflow);
+		for (unsigned int level = LEVELS - 1; level > 0; level--)
+		{
+			unsigned int shift = LEVEL_BITS * level;
+			if (current & (((uint64_t)1 << shift) - 1))
+				continue;
+			unsigned int slot = (current >> shift) & (SLOTS - 1);
+			occupied[level] &= ~((uint64_t)1 << slot);
+			Reschedule(wheel[level][slot]);
+		}
+
+		// Take the due timers off the wheel, so that Tick() can add and delete timers freely
+		unsigned int slot = current & (SLOTS - 1);
+		Timer* due = wheel[0][slot];
+		if (!due)
+			continue;
+		wheel[0][slot] = NULL;
+		occupied[0] &= ~((uint64_t)1 << slot);
+		due->prev = &due;
+
+		while (due)
+		{
+			Timer* t = due;
+			Unlink(t);
+
+			t->Tick(now / 1000);
+
+			// Tick() added the timer again itself, with a new trigger time
+			if (t->prev)
+				continue;
+
+			if (t->GetRepeat())
+			{
+				// Keep to the original schedule, unless we have fallen a whole interval behind
+				t->trigger += t->interval;
+				if (t->trigger <= now)
+					t->trigger = now + t->interval;
+				Schedule(t, current + 1);
+			}
+			else
+				delete t;
+		}
 	}
+}
+
+int TimerManager::GetMaxWait() const
+{
+	uint64_t now = ServerInstance->Time_ms();
+	uint64_t next = NextEvent();
+	int wait = 1000 - (now % 1000);
+	if (next <= now)
+		return 0;
+	if (next - now < (uint64_t)wait)
+		return next - now;
+	return wait;
+}
 
-	Timers.erase(i);
+void TimerManager::DelTimer(Timer* T)
+{
+	// A timer which is not in the wheel (including one which is ticking right now) is left alone
+	if (!T->prev)
+		return;
+	Unlink(T);
 	delete T;
 }
 
 void TimerManager::AddTimer(Timer* T)
 {
-	Timers.insert(std::make_pair(T->GetTimer(), T));
+	// A timer which is already due triggers on the next tick
+	Schedule(T, current + 1);
 }
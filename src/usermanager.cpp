@@ -41,8 +41,9 @@ void UserManager::AddUser(LocalUser* New, ListenSocket* via)
 	ServerInstance->Users->AddLocalClone(New);
 	ServerInstance->Users->AddGlobalClone(New);
 
-	clientlist->insert(std::make_pair(New->nick, New));
+	clientlist->insert(std::make_pair(New->nickkey, New));
 	local_users.push_back(New);
+	New->StartCheckTimer();
 
 	if ((this->local_users.size() > ServerInstance->Config->SoftLimit) || (this->local_users.size() >= (unsigned int)ServerInstance->SE->GetMaxFds()))
 	{
@@ -202,9 +203,10 @@ void UserManager::QuitUser(User *user, const std::string &quitreason, const char
 			whowas->AddToWhoWas(user);
 	}
 
-	user_hash::iterator iter = this->clientlist->find(user->nick);
+	user_hash::iterator iter = this->clientlist->find(user->nickkey);
 
-	if (iter != this->clientlist->end())
+	/* A user whose nick collided in a casemapping change is not indexed by nick until InspIRCd::UpdateCaseMapping renames it */
+	if (iter != this->clientlist->end() && iter->second == user)
 		this->clientlist->erase(iter);
 	else
 		ServerInstance->Logs->Log("USERS", DEBUG, "iter == clientlist->end, can't remove them from hash... problematic..");
@@ -215,67 +217,30 @@ void UserManager::QuitUser(User *user, const std::string &quitreason, const char
 
 void UserManager::AddLocalClone(User *user)
 {
-	clonemap::iterator x;
-	x = local_clones.find(user->GetCIDRMask());
-	if (x != local_clones.end())
-		x->second++;
-	else
-		local_clones[user->GetCIDRMask()] = 1;
+	local_clones.AddCount(irc::sockets::cidr_mask(user->client_sa, 128), 1);
 }
 
 void UserManager::AddGlobalClone(User *user)
 {
-	clonemap::iterator x;
-
-	x = global_clones.find(user->GetCIDRMask());
-	if (x != global_clones.end())
-		x->second++;
-	else
-		global_clones[user->GetCIDRMask()] = 1;
+	global_clones.AddCount(irc::sockets::cidr_mask(user->client_sa, 128), 1);
 }
 
 void UserManager::RemoveCloneCounts(User *user)
 {
+	irc::sockets::cidr_mask addr(user->client_sa, 128);
 	if (IS_LOCAL(user))
-	{
-		clonemap::iterator x = local_clones.find(user->GetCIDRMask());
-		if (x != local_clones.end())
-		{
-			x->second--;
-			if (!x->second)
-			{
-				local_clones.erase(x);
-			}
-		}
-	}
-
-	clonemap::iterator y = global_clones.find(user->GetCIDRMask());
-	if (y != global_clones.end())
-	{
-		y->second--;
-		if (!y->second)
-		{
-			global_clones.erase(y);
-		}
-	}
+		local_clones.AddCount(addr, -1);
+	global_clones.AddCount(addr, -1);
 }
 
 unsigned long UserManager::GlobalCloneCount(User *user)
 {
-	clonemap::iterator x = global_clones.find(user->GetCIDRMask());
-	if (x != global_clones.end())
-		return x->second;
-	else
-		return 0;
+	return global_clones.GetCount(user->GetCIDRMask());
 }
 
 unsigned long UserManager::LocalCloneCount(User *user)
 {
-	clonemap::iterator x = local_clones.find(user->GetCIDRMask());
-	if (x != local_clones.end())
-		return x->second;
-	else
-		return 0;
+	return local_clones.GetCount(user->GetCIDRMask());
 }
 
 /* this function counts all users connected, wether they are registered or NOT. */
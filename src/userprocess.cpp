@@ -14,59 +14,70 @@
 #include "inspircd.h"
 #include "inspsocket.h"
 #include "xline.h"
+#include "timer.h"
 
-/**
- * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the user structs, e.g.
- * stuff like ping checks, registration timeouts, etc.
+/** Runs the ping checks and registration timeout of one local user.
+ *
+ * Rather than visiting every user once a second, each user has a timer
+ * which is due when something can happen to them: once a second until
+ * they are registered (modules may hold up registration, see OnCheckReady),
+ * then when their ping time runs out. Activity only moves User::nping
+ * forward; the timer notices that when it is due, and waits again.
  */
-void InspIRCd::DoBackgroundUserStuff()
+class UserCheckTimer : public Timer
 {
-	/*
-	 * loop over all local users..
-	 */
-	std::vector<LocalUser*>::reverse_iterator count2 = this->Users->local_users.rbegin();
-	while (count2 != this->Users->local_users.rend())
-	{
-		LocalUser *curr = *count2;
-		CrashState trace_handler(HERE_STR, curr);
-		count2++;
+	LocalUser* const user;
 
-		if (curr->quitting)
-			continue;
+ public:
+	UserCheckTimer(LocalUser* u) : Timer(1, ServerInstance->Time()), user(u) { }
 
-		if (curr->CommandFloodPenalty || curr->eh->getSendQSize())
+	void Tick(time_t)
+	{
+		LocalUser* curr = user;
+		CrashState trace_handler(HERE_STR, curr);
+		if (Check(curr))
 		{
-			unsigned int rate = curr->MyClass->commandrate;
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh->OnDataReady();
+			// Check the user again once they need a new PING, or in a second while unregistered
+			SetTimer(curr->registered == REG_ALL ? curr->nping + 1 : ServerInstance->Time() + 1);
+			ServerInstance->Timers->AddTimer(this);
+		}
+		else
+		{
+			// The TimerManager deletes this timer once Tick() returns
+			curr->check_timer = NULL;
 		}
+	}
+
+	/** Do the checks which are due
+	 * @return False if the user is quitting
+	 */
+	bool Check(LocalUser* curr)
+	{
+		if (curr->quitting)
+			return false;
 
 		switch (curr->registered)
 		{
 			case REG_ALL:
-				if (Time() > curr->nping)
+				if (ServerInstance->Time() > curr->nping)
 				{
 					// This user didn't answer the last ping, remove them
 					if (!curr->lastping)
 					{
-						time_t time = this->Time() - (curr->nping - curr->MyClass->pingtime);
+						time_t time = ServerInstance->Time() - (curr->nping - curr->MyClass->pingtime);
 						char message[MAXBUF];
 						snprintf(message, MAXBUF, "Ping timeout: %ld second%s", (long)time, time > 1 ? "s" : "");
 						curr->lastping = 1;
-						curr->nping = Time() + curr->MyClass->pingtime;
-						this->Users->QuitUser(curr, message);
-						continue;
+						curr->nping = ServerInstance->Time() + curr->MyClass->pingtime;
+						ServerInstance->Users->QuitUser(curr, message);
+						return false;
 					}
 
-					curr->Write("PING :%s",this->Config->ServerName.c_str());
+					curr->Write("PING :%s",ServerInstance->Config->ServerName.c_str());
 					curr->lastping = 0;
-					curr->nping = Time()  +curr->MyClass->pingtime;
+					curr->nping = ServerInstance->Time() + curr->MyClass->pingtime;
 				}
-				break;
+				return true;
 			case REG_NICKUSER:
 				if (curr->dns_done)
 				{
@@ -75,21 +86,69 @@ void InspIRCd::DoBackgroundUserStuff()
 					if (res != MOD_RES_DENY) {
 						/* User has sent NICK/USER, modules are okay, DNS finished. */
 						curr->FullConnect();
-						continue;
+						return !curr->quitting;
 					}
 				}
 				break;
 		}
 
-		if (curr->registered != REG_ALL && (Time() > (time_t)(curr->age + curr->MyClass->registration_timeout)))
+		if (ServerInstance->Time() > (time_t)(curr->age + curr->MyClass->registration_timeout))
 		{
 			/*
 			 * registration timeout -- didnt send USER/NICK/HOST
 			 * in the time specified in their connection class.
 			 */
-			this->Users->QuitUser(curr, "Registration timeout");
-			continue;
+			ServerInstance->Users->QuitUser(curr, "Registration timeout");
+			return false;
+		}
+		return true;
+	}
+};
+
+/** Lets the flood penalty of one local user decay once a second, while the
+ * user has a penalty or a sendq, and processes any lines which were held
+ * back by either of them.
+ */
+class FloodTimer : public Timer
+{
+	LocalUser* const user;
+
+ public:
+	FloodTimer(LocalUser* u) : Timer(1, ServerInstance->Time(), true), user(u) { }
+
+	void Tick(time_t)
+	{
+		LocalUser* curr = user;
+		CrashState trace_handler(HERE_STR, curr);
+		if (!curr->quitting)
+		{
+			unsigned int rate = curr->MyClass->commandrate;
+			if (curr->CommandFloodPenalty > rate)
+				curr->CommandFloodPenalty -= rate;
+			else
+				curr->CommandFloodPenalty = 0;
+			curr->eh->OnDataReady();
+		}
+
+		if (curr->quitting || (!curr->CommandFloodPenalty && !curr->eh->getSendQSize()))
+		{
+			// Nothing left to do; the TimerManager deletes this timer once Tick() returns
+			CancelRepeat();
+			curr->flood_timer = NULL;
 		}
 	}
+};
+
+void LocalUser::StartCheckTimer()
+{
+	check_timer = new UserCheckTimer(this);
+	ServerInstance->Timers->AddTimer(check_timer);
 }
 
+void LocalUser::CheckFloodTimer()
+{
+	if (flood_timer || (!CommandFloodPenalty && !eh->getSendQSize()))
+		return;
+	flood_timer = new FloodTimer(this);
+	ServerInstance->Timers->AddTimer(flood_timer);
+}
@@ -20,6 +20,12 @@
 #include <stdarg.h>
 #include "xline.h"
 #include "bancache.h"
+#include "slab.h"
+#include "timer.h"
+
+/* Leave room in the User pool for RemoteUser and FakeUser, which only add a pointer or two */
+static SlabPool UserPool("User", sizeof(User) + 4 * sizeof(void*));
+static SlabPool LocalUserPool("LocalUser", sizeof(LocalUser));
 
 already_sent_t LocalUser::already_sent_id = 0;
 
@@ -191,7 +197,7 @@ const char* User::FormatModes(bool showparameters)
 
 User::User(const std::string &uid, const std::string& sid, int type)
 	: Extensible(EXTENSIBLE_USER), age(ServerInstance->Time()), signon(0),
-	idle_lastmsg(0), nick(uid), uuid(uid), server(sid), registered(0),
+	idle_lastmsg(0), nick(uid), nickkey(uid), uuid(uid), server(sid), registered(0),
 	dns_done(0), quietquit(0), quitting(0), quitting_sendq(0), exempt(0), lastping(0),
 	usertype(type), frozen(0)
 {
@@ -206,10 +212,30 @@ User::User(const std::string &uid, const std::string& sid, int type)
 		throw CoreException("Duplicate UUID "+std::string(uuid)+" in User constructor");
 }
 
+void* User::operator new(size_t size)
+{
+	return UserPool.Allocate(size);
+}
+
+void User::operator delete(void* ptr, size_t size)
+{
+	UserPool.Deallocate(ptr, size);
+}
+
+void* LocalUser::operator new(size_t size)
+{
+	return LocalUserPool.Allocate(size);
+}
+
+void LocalUser::operator delete(void* ptr, size_t size)
+{
+	LocalUserPool.Deallocate(ptr, size);
+}
+
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
 	: User(ServerInstance->GetUID(), ServerInstance->Config->ServerName, USERTYPE_LOCAL), eh(new UserIOHandler(this)),
 	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0),
-	overrun_start(0), CommandFloodPenalty(0), already_sent(0)
+	overrun_start(0), CommandFloodPenalty(0), check_timer(NULL), flood_timer(NULL), already_sent(0)
 {
 	eh->SetFd(myfd);
 	memcpy(&client_sa, client, sizeof(irc::sockets::sockaddrs));
@@ -477,7 +503,7 @@ void UserIOHandler::OnDataReady()
 	if (user->quitting)
 		return;
 
-	if (recvq.length() > user->MyClass->recvqmax)
+	if (getRecvQSize() > user->MyClass->recvqmax)
 	{
 		ServerInstance->Users->QuitUser(user, "RecvQ exceeded");
 		ServerInstance->SNO->WriteToSnoMask('a', "User %s RecvQ exceeds maximum of %lu (class %s)",
@@ -486,14 +512,20 @@ void UserIOHandler::OnDataReady()
 	unsigned long sendqmax = user->MyClass->softsendqmax;
 	unsigned long penaltymax = user->MyClass->penaltythreshold * 1000;
 
+	std::string line;
+	line.reserve(MAXBUF);
 	while (!user->frozen && user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
-		std::string line;
-		line.reserve(MAXBUF);
-		std::string::size_type qpos = 0;
-		while (qpos < recvq.length())
+		const char* start = recvq.data() + recvq_pos;
+		const char* eol = static_cast<const char*>(memchr(start, '\n', recvq.length() - recvq_pos));
+		// if there is no newline, the rest of the line has not arrived yet
+		if (!eol)
+			return;
+
+		line.clear();
+		for (const char* p = start; p != eol; p++)
 		{
-			char c = recvq[qpos++];
+			char c = *p;
 			switch (c)
 			{
 			case '\0':
@@ -501,17 +533,14 @@ void UserIOHandler::OnDataReady()
 				break;
 			case '\r':
 				continue;
-			case '\n':
-				goto eol_found;
 			}
 			if (line.length() < MAXBUF - 2)
 				line.push_back(c);
 		}
-		// if we got here, the recvq ran out before we found a newline
-		return;
-eol_found:
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq = recvq.substr(qpos);
+
+		// Mark the line as consumed; the recvq itself is only trimmed on the next read
+		std::string::size_type qpos = eol + 1 - start;
+		recvq_pos += qpos;
 
 		ServerInstance->stats->statsRecv += qpos;
 		user->bytes_in += qpos;
@@ -520,21 +549,23 @@ eol_found:
 		ServerInstance->Parser->ProcessBuffer(line, user);
 		if (user->quitting)
 			return;
+		user->CheckFloodTimer();
 	}
+	user->CheckFloodTimer();
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+bool UserIOHandler::CheckSendQ(size_t datalen)
 {
 	if (user->quitting_sendq)
-		return;
-	size_t len = getSendQSize() + data.length();
+		return false;
+	size_t len = getSendQSize() + datalen;
 	if (!user->quitting && len > user->MyClass->hardsendqmax)
 	{
 		user->quitting_sendq = true;
 		ServerInstance->GlobalCulls->AddSQItem(user);
-		return;
+		return false;
 	}
 
 	if (!user->quitting && len > user->MyClass->softsendqmax)
@@ -546,7 +577,7 @@ void UserIOHandler::AddWriteBuf(const std::string &data)
 			ServerInstance->Users->QuitUser(user, "SendQ exceeded");
 			ServerInstance->SNO->WriteToSnoMask('a', "User %s SendQ exceeded maximum of %lu for 30s (class %s)",
 				user->nick.c_str(), user->MyClass->softsendqmax, user->MyClass->name.c_str());
-			return;
+			return false;
 		}
 	}
 	else
@@ -554,8 +585,19 @@ void UserIOHandler::AddWriteBuf(const std::string &data)
 
 	// We still want to append data to the sendq of a quitting user,
 	// e.g. their ERROR message that says 'closing link'
+	return true;
+}
 
-	WriteData(data);
+void UserIOHandler::AddWriteBuf(const std::string &data)
+{
+	if (CheckSendQ(data.length()))
+		WriteData(data);
+}
+
+void UserIOHandler::AddWriteBuf(SharedLine* line)
+{
+	if (CheckSendQ(line->data.length()))
+		WriteData(line);
 }
 
 void UserIOHandler::OnError(BufferedSocketError)
@@ -585,6 +627,12 @@ CullResult LocalUser::cull()
 	else
 		ServerInstance->Logs->Log("USERS", DEBUG, "Failed to remove user from vector");
 
+	if (check_timer)
+		ServerInstance->Timers->DelTimer(check_timer);
+	if (flood_timer)
+		ServerInstance->Timers->DelTimer(flood_timer);
+	check_timer = flood_timer = NULL;
+
 	eh->cull();
 	return User::cull();
 }
@@ -593,7 +641,7 @@ CullResult FakeUser::cull()
 {
 	// Fake users don't quit, they just get culled.
 	quitting = true;
-	ServerInstance->Users->clientlist->erase(nick);
+	ServerInstance->Users->clientlist->erase(nickkey);
 	ServerInstance->Users->uuidlist->erase(uuid);
 	return User::cull();
 }
@@ -894,7 +942,8 @@ bool User::ChangeNick(const std::string& newnick, bool force)
 		return false;
 	}
 
-	if (irc::string(newnick) == irc::string(nick))
+	irc::namekey newkey(newnick);
+	if (newkey == nickkey)
 	{
 		// case change, don't need to check Q:lines and such
 		// and, if it's identical including case, we can leave right now
@@ -947,7 +996,8 @@ bool User::ChangeNick(const std::string& newnick, bool force)
 		 * If the guy using the nick is already using it, tell the incoming nick change to gtfo,
 		 * because the nick is already (rightfully) in use. -- w00t
 		 */
-		User* InUse = ServerInstance->FindNickOnly(newnick);
+		user_hash::iterator found = ServerInstance->Users->clientlist->find(newkey);
+		User* InUse = (found == ServerInstance->Users->clientlist->end()) ? NULL : found->second;
 		if (InUse && (InUse != this))
 		{
 			if (InUse->registered != REG_ALL)
@@ -956,10 +1006,10 @@ bool User::ChangeNick(const std::string& newnick, bool force)
 				InUse->WriteTo(InUse, "NICK %s", InUse->uuid.c_str());
 				InUse->WriteNumeric(433, "%s %s :Nickname overruled.", InUse->nick.c_str(), InUse->nick.c_str());
 
-				ServerInstance->Users->clientlist->erase(InUse->nick);
-				(*(ServerInstance->Users->clientlist))[InUse->uuid] = InUse;
-
+				ServerInstance->Users->clientlist->erase(InUse->nickkey);
 				InUse->nick = InUse->uuid;
+				InUse->nickkey = InUse->nick;
+				(*(ServerInstance->Users->clientlist))[InUse->nickkey] = InUse;
 				InUse->InvalidateCache();
 				InUse->registered &= ~REG_NICK;
 			}
@@ -975,11 +1025,14 @@ bool User::ChangeNick(const std::string& newnick, bool force)
 	if (this->registered == REG_ALL)
 		this->WriteCommon("NICK %s",newnick.c_str());
 	std::string oldnick = nick;
+	user_hash::iterator old = ServerInstance->Users->clientlist->find(nickkey);
+	if (old != ServerInstance->Users->clientlist->end() && old->second == this)
+		ServerInstance->Users->clientlist->erase(old);
 	nick = newnick;
+	nickkey = newkey;
 
 	InvalidateCache();
-	ServerInstance->Users->clientlist->erase(oldnick);
-	(*(ServerInstance->Users->clientlist))[newnick] = this;
+	(*(ServerInstance->Users->clientlist))[nickkey] = this;
 
 	if (registered == REG_ALL)
 		FOREACH_MOD(I_OnUserPostNick,OnUserPostNick(this,oldnick));
@@ -1066,6 +1119,29 @@ void LocalUser::Write(const std::string& text)
 	this->cmds_out++;
 }
 
+SharedLine* LocalUser::MakeSharedLine(const std::string& text)
+{
+	// Crop the same way Write() does
+	if (text.length() > MAXBUF - 2)
+		return new SharedLine(text.substr(0, MAXBUF - 2) + wide_newline);
+	return new SharedLine(text + wide_newline);
+}
+
+void LocalUser::Write(SharedLine* line)
+{
+	if (!ServerInstance->SE->BoundsCheckFd(eh))
+		return;
+
+	size_t len = line->data.length();
+	ServerInstance->Logs->Log("USEROUTPUT", RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)len - 2, line->data.c_str());
+
+	eh->AddWriteBuf(line);
+
+	ServerInstance->stats->statsSent += len;
+	this->bytes_out += len;
+	this->cmds_out++;
+}
+
 /** Write()
  */
 void LocalUser::Write(const char *text, ...)
@@ -1204,6 +1280,7 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 		return;
 
 	LocalUser::already_sent_id++;
+	reference<SharedLine> out = LocalUser::MakeSharedLine(line);
 
 	std::vector<Channel*> include_c;
 	include_c.reserve(chans.size());
@@ -1222,7 +1299,7 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 		{
 			u->already_sent = LocalUser::already_sent_id;
 			if (i->second)
-				u->Write(line);
+				u->Write(out);
 		}
 	}
 	for (std::vector<Channel*>::iterator v = include_c.begin(); v != include_c.end(); ++v)
@@ -1231,11 +1308,11 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 		const UserMembList* ulist = c->GetUsers();
 		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
+			LocalUser* u = i->local;
 			if (u && !u->quitting && u->already_sent != LocalUser::already_sent_id)
 			{
 				u->already_sent = LocalUser::already_sent_id;
-				u->Write(line);
+				u->Write(out);
 			}
 		}
 	}
@@ -1253,8 +1330,8 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 
 	snprintf(tb1,MAXBUF,":%s QUIT :%s",this->GetFullHost().c_str(),normal_text.c_str());
 	snprintf(tb2,MAXBUF,":%s QUIT :%s",this->GetFullHost().c_str(),oper_text.c_str());
-	std::string out1 = tb1;
-	std::string out2 = tb2;
+	reference<SharedLine> out1 = LocalUser::MakeSharedLine(tb1);
+	reference<SharedLine> out2 = LocalUser::MakeSharedLine(tb2);
 
 	std::vector<Channel*> include_c;
 	include_c.reserve(chans.size());
@@ -1279,7 +1356,7 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 		const UserMembList* ulist = (**v).GetUsers();
 		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
+			LocalUser* u = i->local;
 			if (u && !u->quitting && (u->already_sent != uniq_id))
 			{
 				u->already_sent = uniq_id;
@@ -1356,10 +1433,8 @@ void User::SendServerNotice(const char* format, ...)
  * the first users channels then the second users channels within the outer loop,
  * therefore it was a maximum of x*y iterations (upon returning 0 and checking
  * all possible iterations). However this new function instead checks against the
- * channel's userlist in the inner loop which is a std::map<User*,User*>
- * and saves us time as we already know what pointer value we are after.
- * Don't quote me on the maths as i am not a mathematician or computer scientist,
- * but i believe this algorithm is now x+(log y) maximum iterations instead.
+ * channel's userlist in the inner loop, which is indexed by User* once the
+ * channel is big enough, so this is now about x lookups at worst.
  */
 bool User::SharesChannelWith(User *other)
 {
@@ -1370,7 +1445,7 @@ bool User::SharesChannelWith(User *other)
 	for (UCListIter i = this->chans.begin(); i != this->chans.end(); i++)
 	{
 		/* Eliminate the inner loop (which used to be ~equal in size to the outer loop)
-		 * by replacing it with a map::find which *should* be more efficient
+		 * by replacing it with a lookup in the channel's member index
 		 */
 		if (i->chan->HasUser(other))
 			return true;
@@ -1443,7 +1518,7 @@ void User::DoHostCycle(const std::string &quitline)
 		const UserMembList *ulist = c->GetUsers();
 		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
+			LocalUser* u = i->local;
 			if (u == NULL || u == this)
 				continue;
 			if (u->already_sent == silent_id)
@@ -1598,9 +1673,18 @@ void LocalUser::SetClass(const std::string &explicit_name)
 	}
 	else
 	{
+		// Find every class with a CIDR range matching our IP at once
+		std::vector<bool> inrange(ServerInstance->Config->Classes.size());
+		std::vector<unsigned int>* ranges[129];
+		unsigned int found = ServerInstance->Config->ClassRanges.match(client_sa, ranges);
+		for (unsigned int r = 0; r < found; r++)
+			for (std::vector<unsigned int>::iterator idx = ranges[r]->begin(); idx != ranges[r]->end(); ++idx)
+				inrange[*idx] = true;
+
 		for (ClassVector::iterator i = ServerInstance->Config->Classes.begin(); i != ServerInstance->Config->Classes.end(); i++)
 		{
 			ConnectClass* c = *i;
+			unsigned int index = i - ServerInstance->Config->Classes.begin();
 
 			ModResult MOD_RESULT;
 			FIRST_MOD_RESULT(OnSetConnectClass, MOD_RESULT, (this,c));
@@ -1621,17 +1705,20 @@ void LocalUser::SetClass(const std::string &explicit_name)
 				continue;
 
 			/* check if host matches.. */
-			irc::spacesepstream HostList(c->host);
-			std::string h;
-			while (HostList.GetToken(h))
+			if (!inrange[index])
 			{
-				if (InspIRCd::MatchCIDR(this->GetIPString(), h, NULL))
-					goto host_found;
-				if (InspIRCd::Match(this->host, h, NULL))
-					goto host_found;
+				const std::vector<irc::wildmask>& masks = ServerInstance->Config->ClassMasks[index];
+				std::vector<irc::wildmask>::const_iterator m = masks.begin();
+				for (; m != masks.end(); ++m)
+				{
+					if (InspIRCd::MatchCIDR(this->GetIPString(), *m))
+						break;
+					if (InspIRCd::Match(this->host, *m))
+						break;
+				}
+				if (m == masks.end())
+					continue;
 			}
-			continue;
-host_found:
 
 			/*
 			 * deny change if change will take class over the limit check it HERE, not after we found a matching class,
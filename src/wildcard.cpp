@@ -17,6 +17,10 @@
 #include "hashcomp.h"
 #include "inspstring.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
 static bool match_internal(const unsigned char *string, const unsigned char *wild, unsigned const char *map)
 {
 	const unsigned char *cp = NULL, *mp = NULL;
@@ -64,6 +68,191 @@ static bool match_internal(const unsigned char *string, const unsigned char *wil
 	return !*wild;
 }
 
+irc::wildmask::wildmask() : national(true), map(NULL), generation(0), star(false), minlen(0)
+{
+}
+
+irc::wildmask::wildmask(const std::string& Mask, const unsigned char* Map)
+	: mask(Mask), national(!Map), map(Map), generation(0), star(false), minlen(0)
+{
+	Compile();
+}
+
+void irc::wildmask::assign(const std::string& Mask, const unsigned char* Map)
+{
+	mask = Mask;
+	national = !Map;
+	map = Map;
+	Compile();
+}
+
+void irc::wildmask::MakeSegment(segment& seg, const char* start, size_t len) const
+{
+	seg.text.assign(start, len);
+	seg.lead = std::string::npos;
+	seg.nalts = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		unsigned char c = seg.text[i];
+		if (c == '?')
+			continue;
+		seg.text[i] = map[c];
+		if (seg.lead == std::string::npos)
+			seg.lead = i;
+	}
+	if (seg.lead == std::string::npos)
+		return;
+
+	unsigned char folded = seg.text[seg.lead];
+	unsigned int count = 0;
+	for (unsigned int c = 0; c < 256; c++)
+	{
+		if (map[c] != folded)
+			continue;
+		if (count < 2)
+			seg.alts[count] = c;
+		count++;
+	}
+	seg.nalts = (count > 2) ? 0 : count;
+	if (count == 1)
+		seg.alts[1] = seg.alts[0];
+}
+
+void irc::wildmask::Compile() const
+{
+	if (national)
+	{
+		map = national_case_insensitive_map;
+		generation = national_case_generation;
+	}
+
+	middle.clear();
+	std::string::size_type first = mask.find('*');
+	star = (first != std::string::npos);
+	if (!star)
+	{
+		MakeSegment(head, mask.data(), mask.length());
+		MakeSegment(tail, "", 0);
+		minlen = mask.length();
+		return;
+	}
+
+	std::string::size_type last = mask.rfind('*');
+	MakeSegment(head, mask.data(), first);
+	MakeSegment(tail, mask.data() + last + 1, mask.length() - last - 1);
+	minlen = head.text.length() + tail.text.length();
+
+	std::string::size_type pos = first + 1;
+	while (pos < last)
+	{
+		std::string::size_type next = mask.find('*', pos);
+		if (next > pos)
+		{
+			middle.push_back(segment());
+			MakeSegment(middle.back(), mask.data() + pos, next - pos);
+			minlen += next - pos;
+		}
+		pos = next + 1;
+	}
+}
+
+bool irc::wildmask::SegmentAt(const segment& seg, const unsigned char* str) const
+{
+	const unsigned char* text = reinterpret_cast<const unsigned char*>(seg.text.data());
+	for (size_t i = 0; i < seg.text.length(); i++)
+	{
+		if (text[i] != map[str[i]] && text[i] != '?')
+			return false;
+	}
+	return true;
+}
+
+/** Find the first position in [str, end) at which seg matches in full, or NULL */
+const unsigned char* irc::wildmask::Find(const segment& seg, const unsigned char* str, const unsigned char* end) const
+{
+	size_t len = seg.text.length();
+	if ((size_t)(end - str) < len)
+		return NULL;
+	// Last position the segment can start at
+	const unsigned char* last = end - len;
+
+	if (seg.lead == std::string::npos)
+		return str;
+
+	/* Scan for the first character of the segment which is not a '?', and
+	 * only compare the whole segment where it appears.
+	 */
+	size_t lead = seg.lead;
+	const unsigned char* p = str + lead;
+	const unsigned char* stop = last + lead;
+
+	if (!seg.nalts)
+	{
+		unsigned char folded = seg.text[lead];
+		for (; p <= stop; p++)
+			if (map[*p] == folded && SegmentAt(seg, p - lead))
+				return p - lead;
+		return NULL;
+	}
+
+#if defined(__SSE2__) && defined(__GNUC__)
+	const __m128i a = _mm_set1_epi8(seg.alts[0]);
+	const __m128i b = _mm_set1_epi8(seg.alts[1]);
+	for (; p + 16 <= stop + 1; p += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		unsigned int bits = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)));
+		while (bits)
+		{
+			const unsigned char* hit = p + __builtin_ctz(bits);
+			if (SegmentAt(seg, hit - lead))
+				return hit - lead;
+			bits &= bits - 1;
+		}
+	}
+#endif
+
+	for (; p <= stop; p++)
+		if ((*p == seg.alts[0] || *p == seg.alts[1]) && SegmentAt(seg, p - lead))
+			return p - lead;
+	return NULL;
+}
+
+bool irc::wildmask::Match(const char* s, size_t len) const
+{
+	if (national && (map != national_case_insensitive_map || generation != national_case_generation))
+		Compile();
+
+	if (len < minlen)
+		return false;
+
+	const unsigned char* str = reinterpret_cast<const unsigned char*>(s);
+	if (!star)
+		return (len == minlen) && SegmentAt(head, str);
+
+	const unsigned char* end = str + len - tail.text.length();
+	if (!SegmentAt(head, str) || !SegmentAt(tail, end))
+		return false;
+
+	/* Taking the leftmost match of each run in turn is always right, as
+	 * it leaves the most room for the runs after it.
+	 */
+	const unsigned char* pos = str + head.text.length();
+	for (std::vector<segment>::const_iterator i = middle.begin(); i != middle.end(); ++i)
+	{
+		pos = Find(*i, pos, end);
+		if (!pos)
+			return false;
+		pos += i->text.length();
+	}
+	return true;
+}
+
+bool irc::wildmask::Match(const std::string& str) const
+{
+	return Match(str.data(), str.length());
+}
+
 /********************************************************************
  * Below here is all wrappers around match_internal
  ********************************************************************/
@@ -107,3 +296,16 @@ CoreExport bool InspIRCd::MatchCIDR(const  char *str, const char *mask, unsigned
 	return InspIRCd::Match(str, mask, map);
 }
 
+
+CoreExport bool InspIRCd::Match(const std::string &str, const irc::wildmask &mask)
+{
+	return mask.Match(str);
+}
+
+CoreExport bool InspIRCd::MatchCIDR(const std::string &str, const irc::wildmask &mask)
+{
+	if (irc::sockets::MatchCIDR(str, mask.str(), true))
+		return true;
+
+	return mask.Match(str);
+}
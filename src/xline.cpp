@@ -238,12 +238,35 @@ IdentHostPair XLineManager::IdentSplit(const std::string &ident_and_host)
 	return n;
 }
 
+/** Drop the ban cache entries which adding or removing a line may have made wrong.
+ * A negative hit only lets a connecting user skip the Z-line check, so it can only
+ * be made wrong by adding a Z-line or removing an E-line; a positive hit only by
+ * removing the line which caused it.
+ */
+static void InvalidateBanCache(XLine* line, bool added)
+{
+	const std::string* mask = line->GetIndexMask();
+	bool ipmask = (line->type == "Z");
+	if (added ? (line->type == "Z") : (line->type == "E"))
+	{
+		if (mask)
+			ServerInstance->BanCache->RemoveEntries(line->type, false, *mask, ipmask);
+		else
+			ServerInstance->BanCache->RemoveEntries(line->type, false);
+	}
+	if (!added)
+	{
+		if (mask)
+			ServerInstance->BanCache->RemoveEntries(line->type, true, *mask, ipmask);
+		else
+			ServerInstance->BanCache->RemoveEntries(line->type, true);
+	}
+}
+
 // adds a line
 
 bool XLineManager::AddLine(XLine* line, User* user)
 {
-	ServerInstance->BanCache->RemoveEntries(line->type, false); // XXX perhaps remove ELines here?
-
 	if (line->duration && ServerInstance->Time() > line->expiry)
 		return false; // Don't apply expired XLines.
 
@@ -254,7 +277,12 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		LookupIter i = x->second.find(line->Displayable());
 		if (i != x->second.end())
 		{
-			return false;
+			/* Expired lines are only removed when they are next looked at,
+			 * so one may still be here; it must not block its replacement.
+			 */
+			if (!i->second->duration || ServerInstance->Time() <= i->second->expiry)
+				return false;
+			ExpireLine(x, i);
 		}
 	}
 
@@ -267,7 +295,12 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable()] = line;
+	XLineIndex*& index = line_index[line->type];
+	if (!index)
+		index = new XLineIndex;
+	index->Add(line);
 	line->OnAdd();
+	InvalidateBanCache(line, true);
 
 	FOREACH_MOD(I_OnAddLine,OnAddLine(user, line));
 
@@ -291,7 +324,7 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 	if (simulate)
 		return true;
 
-	ServerInstance->BanCache->RemoveEntries(y->second->type, true);
+	InvalidateBanCache(y->second, false);
 
 	FOREACH_MOD(I_OnDelLine,OnDelLine(user, y->second));
 
@@ -301,6 +334,7 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
+	line_index[type]->Remove(y->second);
 	delete y->second;
 	x->second.erase(y);
 
@@ -331,29 +365,43 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 
 	const time_t current = ServerInstance->Time();
 
-	LookupIter safei;
+	/* Only check the lines the index says can match; a line may come up
+	 * more than once, so expired ones are only removed at the end.
+	 */
+	std::vector<XLine*> candidates;
+	std::vector<XLine*> expired;
+	line_index[type]->GetCandidates(user, candidates);
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	XLine* found = NULL;
+	for (std::vector<XLine*>::iterator i = candidates.begin(); i != candidates.end(); ++i)
 	{
-		safei = i;
-		safei++;
-
-		if (i->second->duration && current > i->second->expiry)
+		XLine* line = *i;
+		if (line->duration && current > line->expiry)
 		{
-			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
+			expired.push_back(line);
 			continue;
 		}
 
-		if (i->second->Matches(user))
+		if (line->Matches(user))
 		{
-			return i->second;
+			found = line;
+			break;
 		}
+	}
 
-		i = safei;
+	if (!expired.empty())
+	{
+		std::sort(expired.begin(), expired.end());
+		expired.erase(std::unique(expired.begin(), expired.end()), expired.end());
+		for (std::vector<XLine*>::iterator i = expired.begin(); i != expired.end(); ++i)
+		{
+			LookupIter item = x->second.find((*i)->Displayable());
+			if (item != x->second.end() && item->second == *i)
+				ExpireLine(x, item);
+		}
 	}
-	return NULL;
+
+	return found;
 }
 
 XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pattern)
@@ -398,6 +446,7 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 
 	item->second->DisplayExpiry();
 	item->second->Unset();
+	InvalidateBanCache(item->second, false);
 
 	/* TODO: Can we skip this loop by having a 'pending' field in the XLine class, which is set when a line
 	 * is pending, cleared when it is no longer pending, so we skip over this loop if its not pending?
@@ -407,6 +456,7 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
+	line_index[container->first]->Remove(item->second);
 	delete item->second;
 	container->second.erase(item);
 }
@@ -466,6 +516,255 @@ void XLineManager::InvokeStats(const std::string &type, int numeric, User* user,
 }
 
 
+/** A node of a radix trie over strings. The key of a node is the
+ * concatenation of the labels from the root down to it.
+ */
+struct XLineIndex::TextNode
+{
+	std::string label;
+	std::vector<TextNode*> children;
+	std::vector<XLine*> lines;
+
+	TextNode* GetChild(char c)
+	{
+		for (std::vector<TextNode*>::iterator i = children.begin(); i != children.end(); ++i)
+			if ((*i)->label[0] == c)
+				return *i;
+		return NULL;
+	}
+
+	~TextNode()
+	{
+		for (std::vector<TextNode*>::iterator i = children.begin(); i != children.end(); ++i)
+			delete *i;
+	}
+};
+
+static void RemoveLine(std::vector<XLine*>& lines, XLine* line)
+{
+	std::vector<XLine*>::iterator i = std::find(lines.begin(), lines.end(), line);
+	if (i != lines.end())
+		lines.erase(i);
+}
+
+static std::string FoldHost(const std::string& host)
+{
+	std::string folded(host);
+	for (std::string::iterator i = folded.begin(); i != folded.end(); ++i)
+		*i = ascii_case_insensitive_map[(unsigned char)*i];
+	return folded;
+}
+
+XLineIndex::XLineIndex() : prefixes(new TextNode), suffixes(new TextNode)
+{
+}
+
+XLineIndex::~XLineIndex()
+{
+	delete prefixes;
+	delete suffixes;
+}
+
+/** Check that a CIDR mask is one which irc::sockets::MatchCIDR will match
+ * addresses against sensibly, i.e. a valid address and a numeric length.
+ */
+static bool ValidRange(const std::string& mask, const irc::sockets::cidr_mask& range)
+{
+	if (range.type != AF_INET && range.type != AF_INET6)
+		return false;
+	std::string::size_type slash = mask.rfind('/');
+	if (slash + 1 == mask.length())
+		return false;
+	for (std::string::size_type i = slash + 1; i < mask.length(); i++)
+		if (!isdigit(mask[i]))
+			return false;
+	return true;
+}
+
+static void TextFile(XLineIndex::TextNode* root, const std::string& key, XLine* line, bool add)
+{
+	if (add)
+	{
+		XLineIndex::TextNode* n = root;
+		std::string::size_type pos = 0;
+		while (pos < key.length())
+		{
+			XLineIndex::TextNode* c = n->GetChild(key[pos]);
+			if (!c)
+			{
+				c = new XLineIndex::TextNode;
+				c->label = key.substr(pos);
+				n->children.push_back(c);
+				n = c;
+				break;
+			}
+
+			std::string::size_type common = 1;
+			while (common < c->label.length() && pos + common < key.length() && c->label[common] == key[pos + common])
+				common++;
+			if (common < c->label.length())
+			{
+				// The key ends or branches off inside this label, so split it
+				XLineIndex::TextNode* mid = new XLineIndex::TextNode;
+				mid->label = c->label.substr(0, common);
+				c->label.erase(0, common);
+				mid->children.push_back(c);
+				*std::find(n->children.begin(), n->children.end(), c) = mid;
+				c = mid;
+			}
+			n = c;
+			pos += common;
+		}
+		n->lines.push_back(line);
+		return;
+	}
+
+	std::vector<XLineIndex::TextNode*> path(1, root);
+	std::string::size_type pos = 0;
+	while (pos < key.length())
+	{
+		XLineIndex::TextNode* c = path.back()->GetChild(key[pos]);
+		if (!c || key.compare(pos, c->label.length(), c->label))
+			return;
+		path.push_back(c);
+		pos += c->label.length();
+	}
+	RemoveLine(path.back()->lines, line);
+
+	// Drop nodes which no longer lead anywhere
+	while (path.size() > 1 && path.back()->lines.empty() && path.back()->children.empty())
+	{
+		XLineIndex::TextNode* dead = path.back();
+		path.pop_back();
+		path.back()->children.erase(std::find(path.back()->children.begin(), path.back()->children.end(), dead));
+		delete dead;
+	}
+}
+
+/** Collect the lines of every node whose key is a prefix of str */
+static void TextLookup(XLineIndex::TextNode* n, const std::string& str, std::vector<XLine*>& out)
+{
+	std::string::size_type pos = 0;
+	while (pos < str.length())
+	{
+		n = n->GetChild(str[pos]);
+		if (!n || str.compare(pos, n->label.length(), n->label))
+			break;
+		pos += n->label.length();
+		out.insert(out.end(), n->lines.begin(), n->lines.end());
+	}
+}
+
+void XLineIndex::Add(XLine* line)
+{
+	if (!File(line, true))
+		residue.push_back(line);
+}
+
+void XLineIndex::Remove(XLine* line)
+{
+	if (!File(line, false))
+		RemoveLine(residue, line);
+}
+
+bool XLineIndex::File(XLine* line, bool add)
+{
+	const std::string* maskptr = line->GetIndexMask();
+	if (!maskptr)
+		return false;
+	const std::string& mask = *maskptr;
+	if (mask.empty() || mask.find('@') != std::string::npos)
+		return false;
+
+	std::string::size_type wild = mask.find_first_of("*?");
+	bool slash = (mask.find('/') != std::string::npos);
+	if (wild == std::string::npos)
+	{
+		if (slash)
+		{
+			irc::sockets::cidr_mask range(mask);
+			if (!ValidRange(mask, range))
+				return false;
+			if (add)
+			{
+				ranges[range].push_back(line);
+			}
+			else if (std::vector<XLine*>* lines = ranges.find(range))
+			{
+				RemoveLine(*lines, line);
+				if (lines->empty())
+					ranges.erase(range);
+			}
+		}
+
+		// A mask without wildcards also matches a host which is literally the same
+		std::string key = FoldHost(mask);
+		if (add)
+		{
+			exact[key].push_back(line);
+		}
+		else
+		{
+			ExactMap::iterator i = exact.find(key);
+			if (i != exact.end())
+			{
+				RemoveLine(i->second, line);
+				if (i->second.empty())
+					exact.erase(i);
+			}
+		}
+		return true;
+	}
+
+	if (slash)
+		return false;
+
+	// *literal goes into the suffix trie, literal* into the prefix trie
+	std::string::size_type last = mask.length() - 1;
+	if (wild == 0 && last && mask[0] == '*' && mask.find_first_of("*?", 1) == std::string::npos)
+		TextFile(suffixes, FoldHost(std::string(mask.rbegin(), mask.rend() - 1)), line, add);
+	else if (wild == last && last && mask[last] == '*')
+		TextFile(prefixes, FoldHost(mask.substr(0, last)), line, add);
+	else
+		return false;
+	return true;
+}
+
+void XLineIndex::LookupHost(const std::string& host, std::vector<XLine*>& out)
+{
+	std::string folded = FoldHost(host);
+
+	ExactMap::iterator e = exact.find(folded);
+	if (e != exact.end())
+		out.insert(out.end(), e->second.begin(), e->second.end());
+
+	if (ranges.size() && host.find('/') == std::string::npos)
+	{
+		irc::sockets::sockaddrs sa;
+		if (irc::sockets::aptosa(host, 0, sa))
+		{
+			std::vector<XLine*>* found[129];
+			unsigned int count = ranges.match(sa, found);
+			for (unsigned int i = 0; i < count; i++)
+				out.insert(out.end(), found[i]->begin(), found[i]->end());
+		}
+	}
+
+	if (!prefixes->children.empty())
+		TextLookup(prefixes, folded, out);
+	if (!suffixes->children.empty())
+		TextLookup(suffixes, std::string(folded.rbegin(), folded.rend()), out);
+}
+
+void XLineIndex::GetCandidates(User* user, std::vector<XLine*>& out)
+{
+	out.insert(out.end(), residue.begin(), residue.end());
+	LookupHost(user->host, out);
+	const std::string& ip = user->GetIPString();
+	if (ip != user->host)
+		LookupHost(ip, out);
+}
+
 XLineManager::XLineManager()
 {
 	GLineFactory* GFact;
@@ -510,6 +809,8 @@ XLineManager::~XLineManager()
 	}
 	lookup_lines.clear();
 
+	for (std::map<std::string, XLineIndex*>::iterator i = line_index.begin(); i != line_index.end(); ++i)
+		delete i->second;
 }
 
 void XLine::Apply(User* u)
@@ -549,10 +850,10 @@ bool KLine::Matches(User *u)
 	if (u->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (InspIRCd::Match(u->ident, this->identmatch))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (InspIRCd::MatchCIDR(u->host, this->hostmatch) ||
+		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmatch))
 		{
 			return true;
 		}
@@ -571,10 +872,10 @@ bool GLine::Matches(User *u)
 	if (u->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (InspIRCd::Match(u->ident, this->identmatch))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (InspIRCd::MatchCIDR(u->host, this->hostmatch) ||
+		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmatch))
 		{
 			return true;
 		}
@@ -593,10 +894,10 @@ bool ELine::Matches(User *u)
 	if (u->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (InspIRCd::Match(u->ident, this->identmatch))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (InspIRCd::MatchCIDR(u->host, this->hostmatch) ||
+		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmatch))
 		{
 			return true;
 		}
@@ -610,7 +911,7 @@ bool ZLine::Matches(User *u)
 	if (u->exempt)
 		return false;
 
-	if (InspIRCd::MatchCIDR(u->GetIPString(), this->ipaddr))
+	if (InspIRCd::MatchCIDR(u->GetIPString(), this->ipmatch))
 		return true;
 	else
 		return false;
@@ -624,7 +925,7 @@ void ZLine::Apply(User* u)
 
 bool QLine::Matches(User *u)
 {
-	if (InspIRCd::Match(u->nick, this->nick))
+	if (InspIRCd::Match(u->nick, this->nickmatch))
 		return true;
 
 	return false;
@@ -639,7 +940,7 @@ void QLine::Apply(User* u)
 
 bool ZLine::Matches(const std::string &str)
 {
-	if (InspIRCd::MatchCIDR(str, this->ipaddr))
+	if (InspIRCd::MatchCIDR(str, this->ipmatch))
 		return true;
 	else
 		return false;
@@ -647,7 +948,7 @@ bool ZLine::Matches(const std::string &str)
 
 bool QLine::Matches(const std::string &str)
 {
-	if (InspIRCd::Match(str, this->nick))
+	if (InspIRCd::Match(str, this->nickmatch))
 		return true;
 
 	return false;